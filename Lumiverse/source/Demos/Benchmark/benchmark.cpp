@@ -0,0 +1,323 @@
+/*
+  Micro-benchmarks for parts of Lumiverse that run in the update loop or are
+  hit repeatedly by show control.
+
+  Usage: Benchmark [name ...]
+  Runs all benchmarks if no names are given. Rigs are generated in code so
+  no data files are needed.
+*/
+
+#include <string>
+#include "LumiverseCoreConfig.h"
+#include "LumiverseCore.h"
+#include "LumiverseShowControl.h"
+
+#ifdef USE_ARNOLD_CACHING
+#include "Simulation/Compositor.h"
+#include "Simulation/LayerCache.h"
+#endif
+
+using namespace std;
+using namespace Lumiverse;
+using namespace Lumiverse::ShowControl;
+
+// Creates a rig with the given number of devices. Each device has an intensity and
+// a color parameter, and is spread across a handful of metadata values.
+Rig* makeRig(int numDevices) {
+  Rig* rig = new Rig();
+
+  for (int i = 0; i < numDevices; i++) {
+    stringstream id;
+    id << "dev" << i;
+
+    Device* d = new Device(id.str(), i + 1, "Benchmark Device");
+    d->setParam("intensity", new LumiverseFloat(0, 0, 1, 0));
+    d->setParam("color", new LumiverseColor(BASIC_RGB));
+
+    stringstream area;
+    area << (i % 10);
+    d->setMetadata("area", area.str());
+    d->setMetadata("angle", (i % 2 == 0) ? "front" : "back");
+
+    rig->addDevice(d);
+  }
+
+  return rig;
+}
+
+// Runs a function the given number of times and reports the average time per call.
+void timeIt(string name, int iterations, function<void()> f) {
+  auto start = chrono::high_resolution_clock::now();
+
+  for (int i = 0; i < iterations; i++) {
+    f();
+  }
+
+  auto end = chrono::high_resolution_clock::now();
+  double us = chrono::duration_cast<chrono::microseconds>(end - start).count() / (double)iterations;
+
+  cout << "  " << name << ": " << us << " us/iter (" << iterations << " iterations)\n";
+}
+
+void dynamicGroups() {
+  cout << "Dynamic groups (10000 devices)\n";
+  Rig* rig = makeRig(10000);
+
+  DynamicDeviceSet byMeta(rig, "$area=3[$angle=back]");
+  DynamicDeviceSet byChannel(rig, "#100-2000");
+  DynamicDeviceSet byParam(rig, "@intensity>0.5f");
+
+  timeIt("select", 50, [&]() { rig->select("$area=3[$angle=back]"); });
+  timeIt("metadata group contains", 10000, [&]() { byMeta.contains("dev23"); });
+  timeIt("metadata group setParam", 1000, [&]() { byMeta.setParam("intensity", 0.75f); });
+  timeIt("channel group size", 10000, [&]() { byChannel.size(); });
+  timeIt("channel group getIds", 1000, [&]() { byChannel.getIds(); });
+  timeIt("parameter group contains, invalidated every iteration", 50, [&]() {
+    byParam.contains("dev23");
+    rig->getDevice("dev23")->setParam("intensity", 0.25f);
+  });
+
+  delete rig;
+}
+
+void selectors() {
+  cout << "Selectors (25000 devices)\n";
+  Rig* rig = makeRig(25000);
+
+  // First call builds the rig indexes.
+  rig->select("*");
+
+  timeIt("id", 10000, [&]() { rig->select("dev1234"); });
+  timeIt("channel range (100 devices)", 10000, [&]() { rig->select("#100-199"); });
+  timeIt("metadata equals + filter", 1000, [&]() { rig->select("$area=3[$angle=back]"); });
+  timeIt("metadata starts with", 1000, [&]() { rig->select("$angle^=fr[#1-50]"); });
+  timeIt("or + negation", 1000, [&]() { rig->select("#1-10|#500-510[!$area=2]"); });
+  timeIt("parameter", 100, [&]() { rig->select("@intensity>0.5f[#1-100]"); });
+  timeIt("metadata after metadata change", 100, [&]() {
+    rig->getDevice("dev10")->setMetadata("area", "2");
+    rig->select("$area=2[#1-20]");
+  });
+
+  delete rig;
+}
+
+void cueStart() {
+  cout << "Cue start (25000 devices)\n";
+  Rig* rig = makeRig(25000);
+  shared_ptr<Cue> cue(new Cue(rig, 3.0f, 5.0f, 1.0f));
+
+  // Layer state, same layout the Layer passes to the cue on play.
+  map<string, map<string, LumiverseType*> > state;
+  for (auto d : rig->getAllDevices().getDeviceList()) {
+    for (auto p : d->getRawParameters()) {
+      state[d->getId()][p.first] = LumiverseTypeUtils::copy(p.second);
+    }
+  }
+
+  map<string, shared_ptr<Timeline> > tls;
+  TimelineContext ctx(tls);
+
+  timeIt("setCurrentState, first run", 1, [&]() { cue->setCurrentState(state, nullptr, 0); });
+  timeIt("setCurrentState", 20, [&]() { cue->setCurrentState(state, nullptr, 0); });
+  timeIt("setCurrentState from active cue", 20, [&]() { cue->setCurrentState(state, cue, 2000); });
+  timeIt("getValueAtTime (all parameters)", 5, [&]() {
+    for (auto& d : state) {
+      for (auto& p : d.second) {
+        cue->getValueAtTime(d.first, p.first, p.second, 2500, ctx);
+      }
+    }
+  });
+
+  for (auto& d : state) {
+    for (auto& p : d.second) {
+      delete p.second;
+    }
+  }
+
+  delete rig;
+}
+
+void effects() {
+  cout << "Effects (25000 devices)\n";
+  Rig* rig = makeRig(25000);
+
+  map<string, map<string, LumiverseType*> > state;
+  for (auto d : rig->getAllDevices().getDeviceList()) {
+    state[d->getId()]["intensity"] = LumiverseTypeUtils::copy(d->getParam("intensity"));
+  }
+
+  map<string, shared_ptr<Timeline> > tls;
+  TimelineContext ctx(tls);
+
+  shared_ptr<Effect> effect(new Effect(Effect::SINE, 2));
+  effect->setDevices(rig->getAllDevices(), Effect::ORDER, 1);
+  effect->setLoops(-1);
+
+  // Each iteration is one update at a new time, like a Layer would make.
+  size_t time = 0;
+  timeIt("sine fan, all devices", 20, [&]() {
+    time += 25;
+    for (auto& d : state) {
+      shared_ptr<LumiverseType> val = effect->getValueAtTime(d.first, "intensity", d.second["intensity"], time, ctx);
+      LumiverseTypeUtils::copyByVal(val.get(), d.second["intensity"]);
+    }
+  });
+
+  effect->setWaveform(Effect::RANDOM);
+  timeIt("random fan, all devices", 20, [&]() {
+    time += 25;
+    for (auto& d : state) {
+      shared_ptr<LumiverseType> val = effect->getValueAtTime(d.first, "intensity", d.second["intensity"], time, ctx);
+      LumiverseTypeUtils::copyByVal(val.get(), d.second["intensity"]);
+    }
+  });
+
+  shared_ptr<SineWave> sine(new SineWave(2));
+  sine->setLoops(-1);
+  timeIt("SineWave, all devices", 20, [&]() {
+    time += 25;
+    for (auto& d : state) {
+      shared_ptr<LumiverseType> val = sine->getValueAtTime(d.first, "intensity", d.second["intensity"], time, ctx);
+      LumiverseTypeUtils::copyByVal(val.get(), d.second["intensity"]);
+    }
+  });
+
+  for (auto& d : state) {
+    delete d.second["intensity"];
+  }
+
+  delete rig;
+}
+
+#ifdef USE_ARNOLD_CACHING
+void compositor() {
+  const int width = 1920;
+  const int height = 1080;
+
+  for (int numLights : { 100, 250, 500 }) {
+    cout << "Compositor (" << numLights << " cached lights at " << width << "x" << height << ")\n";
+
+    // Layers are created at full size before being compacted, so this needs ~33MB per layer while loading.
+    Compositor* comp = new Compositor();
+    set<Device*> devices;
+
+    try {
+      for (int i = 0; i < numLights; i++) {
+        stringstream name;
+        name << "light" << i;
+
+        // Each light is a spot that covers a small part of the frame.
+        EXRLayer* layer = new EXRLayer(width, height, name.str().c_str());
+        Pixel4* pixels = layer->get_pixels();
+        int cx = (i * 397) % width;
+        int cy = (i * 211) % height;
+        for (int y = 0; y < height; y++) {
+          for (int x = 0; x < width; x++) {
+            bool lit = (x - cx) * (x - cx) + (y - cy) * (y - cy) < 200 * 200;
+            pixels[y * width + x] = lit ? Pixel4((x % 255) / 255.0f, (i % 10) / 10.0f, 0.5f, 1) : Pixel4(0, 0, 0, 0);
+          }
+        }
+        layer->compact();
+        comp->add_layer(layer);
+
+        Device* d = new Device(name.str(), i + 1, "Benchmark Light");
+        d->setParam("intensity", new LumiverseFloat(0.5f, 0, 1, 0));
+        d->setParam("color", new LumiverseColor(BASIC_RGB));
+        d->getColor()->setRGBRaw(1, 0.5, 0.25);
+        d->setMetadata("Arnold Node Name", name.str());
+        devices.insert(d);
+      }
+
+      const char* formatNames[] = { "float", "half", "rgb9e5" };
+      for (PixelFormat format : { PIXEL_FLOAT, PIXEL_HALF, PIXEL_RGB9E5 }) {
+        size_t bytes = 0;
+        for (auto& l : comp->get_layers()) {
+          l.second->set_format(format);
+          bytes += l.second->get_memory_usage();
+        }
+        cout << "  " << formatNames[format] << " layer memory: " << bytes / (1024 * 1024) << " MB\n";
+
+        timeIt("render, 1 thread", 3, [&]() { comp->set_num_threads(1); comp->render(devices); });
+        timeIt("render, all threads", 3, [&]() { comp->set_num_threads(0); comp->render(devices); });
+      }
+
+      // Tone mapping after compositing vs. in the same pass, with the stages of the fused render.
+      ToneMapper tm;
+      vector<float> output(width * height * 4);
+      vector<unsigned char> bytes(width * height * 4);
+      comp->set_num_threads(0);
+      timeIt("render + tone map, separate passes", 3, [&]() {
+        comp->render(devices);
+        tm.apply_hdr_inplace(comp->get_compose_buffer(), output.data(), width, height);
+      });
+      timeIt("render + tone map + RGBA8, fused", 3, [&]() { comp->render(devices, tm, output.data(), bytes.data()); });
+
+      const Compositor::RenderTimings& t = comp->get_timings();
+      cout << "  fused stages: gather " << t.gather << " ms, composite " << t.composite << " ms, tone map "
+        << t.tonemap << " ms (summed over threads), total " << t.total << " ms\n";
+
+      // Smaller frames are composited at a mip level and resampled, so resizing doesn't stall.
+      for (auto size : { make_pair(1280, 720), make_pair(800, 450), make_pair(320, 180) }) {
+        comp->update_dims(size.first, size.second);
+        stringstream label;
+        label << "render at " << size.first << "x" << size.second;
+        timeIt(label.str() + ", first frame", 1, [&]() { comp->render(devices); });
+        timeIt(label.str(), 3, [&]() { comp->render(devices); });
+      }
+      comp->update_dims(width, height);
+
+      // Opening a packed cache only reads the layer index, the tiles are paged in on use.
+      map<string, EXRLayer*> layers(comp->get_layers().begin(), comp->get_layers().end());
+      string cacheFile = "benchmark.lvcache";
+      if (LayerCacheFile::write(cacheFile, layers)) {
+        timeIt("open packed cache", 3, [&]() {
+          LayerCacheFile file;
+          file.open(cacheFile);
+          for (auto& l : layers) {
+            delete file.createLayer(l.first);
+          }
+        });
+        remove(cacheFile.c_str());
+      }
+    }
+    catch (bad_alloc&) {
+      cout << "  Not enough memory, skipped\n";
+    }
+
+    for (auto d : devices) {
+      delete d;
+    }
+    delete comp;
+  }
+}
+#endif
+
+int main(int argc, char**argv) {
+  Logger::setLogLevel(ERR);
+
+  map<string, function<void()> > benchmarks;
+  benchmarks["dynamicGroups"] = dynamicGroups;
+  benchmarks["selectors"] = selectors;
+  benchmarks["cueStart"] = cueStart;
+  benchmarks["effects"] = effects;
+#ifdef USE_ARNOLD_CACHING
+  benchmarks["compositor"] = compositor;
+#endif
+
+  if (argc <= 1) {
+    for (auto& b : benchmarks) {
+      b.second();
+    }
+  }
+  else {
+    for (int i = 1; i < argc; i++) {
+      if (benchmarks.count(argv[i]) == 0) {
+        cout << "Unknown benchmark " << argv[i] << "\n";
+        continue;
+      }
+      benchmarks[argv[i]]();
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,4 @@
+// Configruation file for LumiverseDemo project
+
+#define LumiverseDemo_VERSION_MAJOR 1
+#define LumiverseDemo_VERSION_MINOR 0
@@ -15,6 +15,7 @@ using namespace std;
 %template(UCharVector) std::vector<unsigned char>;
 %template(StringVector) std::vector<string>;
 %shared_ptr(Lumiverse::ShowControl::Timeline)
+%shared_ptr(Lumiverse::ShowControl::Effect)
 %shared_ptr(Lumiverse::ShowControl::SineWave)
 %shared_ptr(Lumiverse::ShowControl::Layer)
 %shared_ptr(Lumiverse::ShowControl::Event)
@@ -51,6 +52,8 @@ using namespace Lumiverse::ShowControl;
 %include "types/LumiverseTypeUtils.h"
 %include "DMX/KiNetInterface.h"
 %include "DMX/DMXDevicePatch.h"
+%include "DMX/DMXCapture.h"
+%include "DMX/DMXCapturePlayer.h"
 %include "DMX/ArtNetInterface.h"
 %include "Device.h"
 %include "Patch.h"
@@ -0,0 +1,403 @@
+#include "DMXCapture.h"
+#include "../Logger.h"
+
+#include <cstring>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Lumiverse {
+
+  // Bytes in each universe of a capture.
+  static const uint32_t CaptureUniverseSize = 512;
+
+  // Unchanged gaps this short are folded into the surrounding run. A new run costs 8 bytes of
+  // header plus padding, so splitting over a short gap doesn't save anything.
+  static const size_t CaptureRunGap = 8;
+
+  static inline size_t padded(size_t size) {
+    return (size + 7) & ~(size_t)7;
+  }
+
+  DMXCaptureWriter::DMXCaptureWriter() : m_file(nullptr), m_offset(0), m_sinceKey(0), m_error(false) {
+    memset(&m_header, 0, sizeof(m_header));
+  }
+
+  DMXCaptureWriter::~DMXCaptureWriter() {
+    if (m_file != nullptr)
+      close();
+  }
+
+  bool DMXCaptureWriter::open(string filename, unsigned int rate, const vector<DMXCaptureSource>& universes, unsigned int keyInterval) {
+    if (m_file != nullptr)
+      close();
+
+    m_file = fopen(filename.c_str(), "wb");
+    if (m_file == nullptr) {
+      Logger::log(ERR, "Unable to create DMX capture file " + filename);
+      return false;
+    }
+
+    m_offset = 0;
+    m_error = false;
+    m_sinceKey = 0;
+    m_index.clear();
+    m_prev.assign(universes.size() * CaptureUniverseSize, 0);
+
+    memset(&m_header, 0, sizeof(m_header));
+    memcpy(m_header.magic, "LVDMXCAP", 8);
+    m_header.version = 1;
+    m_header.rate = rate;
+    m_header.numUniverses = (uint32_t)universes.size();
+    m_header.keyInterval = (keyInterval == 0) ? 1 : keyInterval;
+
+    // Frame count and index offset are filled in by close().
+    write(&m_header, sizeof(m_header));
+
+    for (const auto& u : universes) {
+      DMXCaptureUniverse record;
+      memset(&record, 0, sizeof(record));
+      strncpy(record.patch, u.patch.c_str(), sizeof(record.patch) - 1);
+      record.universe = u.universe;
+      record.size = CaptureUniverseSize;
+      write(&record, sizeof(record));
+    }
+
+    return !m_error;
+  }
+
+  bool DMXCaptureWriter::writeFrame(const unsigned char* data) {
+    if (m_file == nullptr)
+      return false;
+
+    const size_t size = m_prev.size();
+    const unsigned char* prev = m_prev.data();
+
+    // Find the runs that changed since the last frame.
+    m_runs.clear();
+    size_t deltaSize = 0;
+    bool key = m_index.empty() || m_sinceKey >= m_header.keyInterval;
+
+    if (!key) {
+      size_t i = 0;
+      while (i < size) {
+        if (data[i] == prev[i]) {
+          i++;
+          continue;
+        }
+
+        size_t start = i;
+        size_t end = i + 1;
+        while (end < size) {
+          if (data[end] != prev[end]) {
+            end++;
+            continue;
+          }
+
+          // Look past short unchanged gaps.
+          size_t next = end;
+          while (next < size && next - end < CaptureRunGap && data[next] == prev[next])
+            next++;
+
+          if (next < size && next - end < CaptureRunGap)
+            end = next + 1;
+          else
+            break;
+        }
+
+        DMXCaptureRun run;
+        run.offset = (uint32_t)start;
+        run.length = (uint32_t)(end - start);
+        m_runs.push_back(run);
+        deltaSize += sizeof(DMXCaptureRun) + padded(run.length);
+
+        i = end;
+      }
+
+      // Big changes are smaller as a key frame.
+      if (deltaSize >= size)
+        key = true;
+    }
+
+    DMXCaptureFrame frame;
+    frame.frame = m_index.size();
+    frame.type = key ? DMX_CAPTURE_KEY : DMX_CAPTURE_DELTA;
+    frame.size = (uint32_t)(key ? padded(size) : deltaSize);
+
+    m_index.push_back(m_offset);
+    write(&frame, sizeof(frame));
+
+    if (key) {
+      write(data, size);
+      pad();
+      m_sinceKey = 1;
+    }
+    else {
+      for (const auto& run : m_runs) {
+        write(&run, sizeof(run));
+        write(data + run.offset, run.length);
+        pad();
+      }
+      m_sinceKey++;
+    }
+
+    memcpy(m_prev.data(), data, size);
+
+    return !m_error;
+  }
+
+  bool DMXCaptureWriter::close() {
+    if (m_file == nullptr)
+      return false;
+
+    m_header.frameCount = m_index.size();
+    m_header.indexOffset = m_offset;
+
+    if (!m_index.empty())
+      write(m_index.data(), m_index.size() * sizeof(uint64_t));
+
+    // Patch the header now that the counts are known.
+    if (fseek(m_file, 0, SEEK_SET) != 0 || fwrite(&m_header, sizeof(m_header), 1, m_file) != 1)
+      m_error = true;
+
+    if (fclose(m_file) != 0)
+      m_error = true;
+    m_file = nullptr;
+
+    if (m_error)
+      Logger::log(ERR, "Failed to write DMX capture file");
+
+    return !m_error;
+  }
+
+  void DMXCaptureWriter::write(const void* data, size_t size) {
+    if (size == 0)
+      return;
+
+    if (fwrite(data, 1, size, m_file) != size)
+      m_error = true;
+
+    m_offset += size;
+  }
+
+  void DMXCaptureWriter::pad() {
+    static const unsigned char zeros[8] = { 0 };
+    size_t extra = padded((size_t)m_offset) - (size_t)m_offset;
+    write(zeros, extra);
+  }
+
+  DMXCaptureReader::DMXCaptureReader() : m_data(nullptr), m_size(0),
+#ifdef _WIN32
+    m_fileHandle(nullptr), m_mapHandle(nullptr),
+#endif
+    m_universes(nullptr), m_index(nullptr), m_current(nullptr), m_currentFrame(0), m_hasCurrent(false)
+  {
+  }
+
+  DMXCaptureReader::~DMXCaptureReader() {
+    close();
+  }
+
+  bool DMXCaptureReader::open(string filename) {
+    close();
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+      Logger::log(ERR, "Unable to open DMX capture file " + filename);
+      return false;
+    }
+
+    LARGE_INTEGER size;
+    HANDLE mapping = NULL;
+    if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+      mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+
+    const void* data = (mapping != NULL) ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+    if (data == NULL) {
+      if (mapping != NULL)
+        CloseHandle(mapping);
+      CloseHandle(file);
+      Logger::log(ERR, "Unable to map DMX capture file " + filename);
+      return false;
+    }
+
+    m_fileHandle = file;
+    m_mapHandle = mapping;
+    m_size = (size_t)size.QuadPart;
+#else
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+      Logger::log(ERR, "Unable to open DMX capture file " + filename);
+      return false;
+    }
+
+    struct stat st;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+      data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    // The mapping stays valid after the descriptor is closed.
+    ::close(fd);
+
+    if (data == MAP_FAILED) {
+      Logger::log(ERR, "Unable to map DMX capture file " + filename);
+      return false;
+    }
+
+    m_size = (size_t)st.st_size;
+#endif
+
+    m_data = (const unsigned char*)data;
+
+    // Check everything the frames depend on once here.
+    const DMXCaptureHeader* header = (const DMXCaptureHeader*)m_data;
+    size_t tableEnd = sizeof(DMXCaptureHeader) + (m_size >= sizeof(DMXCaptureHeader) ? header->numUniverses : 0) * sizeof(DMXCaptureUniverse);
+    bool valid = m_size >= sizeof(DMXCaptureHeader) &&
+      memcmp(header->magic, "LVDMXCAP", 8) == 0 &&
+      header->version == 1 &&
+      header->rate > 0 &&
+      tableEnd <= m_size &&
+      header->indexOffset % 8 == 0 &&
+      header->indexOffset >= tableEnd &&
+      header->indexOffset <= m_size &&
+      header->frameCount <= (m_size - header->indexOffset) / sizeof(uint64_t);
+
+    if (!valid) {
+      Logger::log(ERR, filename + " is not a valid DMX capture file");
+      close();
+      return false;
+    }
+
+    m_universes = (const DMXCaptureUniverse*)(m_data + sizeof(DMXCaptureHeader));
+    m_index = (const uint64_t*)(m_data + header->indexOffset);
+    m_work.assign(header->numUniverses * CaptureUniverseSize, 0);
+
+    return true;
+  }
+
+  void DMXCaptureReader::close() {
+    if (m_data != nullptr) {
+#ifdef _WIN32
+      UnmapViewOfFile(m_data);
+      CloseHandle(m_mapHandle);
+      CloseHandle(m_fileHandle);
+      m_mapHandle = nullptr;
+      m_fileHandle = nullptr;
+#else
+      munmap((void*)m_data, m_size);
+#endif
+    }
+
+    m_data = nullptr;
+    m_size = 0;
+    m_universes = nullptr;
+    m_index = nullptr;
+    m_current = nullptr;
+    m_hasCurrent = false;
+    m_work.clear();
+  }
+
+  const unsigned char* DMXCaptureReader::getFrame(uint64_t frame) {
+    if (m_data == nullptr || frame >= getFrameCount())
+      return nullptr;
+
+    if (m_hasCurrent && m_currentFrame == frame)
+      return m_current;
+
+    // Find the key frame to start from, unless the current frame is already past it.
+    uint64_t key = frame;
+    while (true) {
+      const DMXCaptureFrame* f = frameHeader(key);
+      if (f == nullptr)
+        return nullptr;
+      if (f->type == DMX_CAPTURE_KEY || (m_hasCurrent && m_currentFrame + 1 == key))
+        break;
+      if (key == 0) {
+        Logger::log(ERR, "DMX capture file doesn't start with a key frame");
+        return nullptr;
+      }
+      key--;
+    }
+
+    uint64_t from = key;
+    if (m_hasCurrent && m_currentFrame >= key && m_currentFrame < frame)
+      from = m_currentFrame + 1;
+
+    for (uint64_t i = from; i <= frame; i++) {
+      if (!applyFrame(i)) {
+        m_hasCurrent = false;
+        Logger::log(ERR, "DMX capture frame " + to_string(i) + " is corrupt");
+        return nullptr;
+      }
+    }
+
+    m_currentFrame = frame;
+    m_hasCurrent = true;
+
+    return m_current;
+  }
+
+  const DMXCaptureFrame* DMXCaptureReader::frameHeader(uint64_t frame) {
+    uint64_t offset = m_index[frame];
+    if (offset % 8 != 0 || offset > m_size || m_size - offset < sizeof(DMXCaptureFrame))
+      return nullptr;
+
+    const DMXCaptureFrame* f = (const DMXCaptureFrame*)(m_data + offset);
+    if (f->size > m_size - offset - sizeof(DMXCaptureFrame))
+      return nullptr;
+
+    return f;
+  }
+
+  bool DMXCaptureReader::applyFrame(uint64_t frame) {
+    const DMXCaptureFrame* f = frameHeader(frame);
+    if (f == nullptr)
+      return false;
+
+    const unsigned char* payload = (const unsigned char*)(f + 1);
+    const size_t frameSize = m_work.size();
+
+    if (f->type == DMX_CAPTURE_KEY) {
+      if (f->size < frameSize)
+        return false;
+
+      // Read key frames in place.
+      m_current = payload;
+      return true;
+    }
+
+    if (f->type != DMX_CAPTURE_DELTA || m_current == nullptr)
+      return false;
+
+    // Deltas go on top of the previous frame, which might still be in the mapping.
+    if (m_current != m_work.data()) {
+      memcpy(m_work.data(), m_current, frameSize);
+      m_current = m_work.data();
+    }
+
+    size_t pos = 0;
+    while (pos < f->size) {
+      if (f->size - pos < sizeof(DMXCaptureRun))
+        return false;
+
+      const DMXCaptureRun* run = (const DMXCaptureRun*)(payload + pos);
+      pos += sizeof(DMXCaptureRun);
+
+      if (run->offset > frameSize || run->length > frameSize - run->offset || padded(run->length) > f->size - pos)
+        return false;
+
+      memcpy(m_work.data() + run->offset, payload + pos, run->length);
+      pos += padded(run->length);
+    }
+
+    return true;
+  }
+}
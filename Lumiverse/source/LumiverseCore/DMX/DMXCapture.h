@@ -0,0 +1,258 @@
+/*! \file DMXCapture.h
+* \brief Binary file format for recorded DMX output.
+*/
+#ifndef _DMXCAPTURE_H_
+#define _DMXCAPTURE_H_
+
+#pragma once
+
+#include "LumiverseCoreConfig.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace Lumiverse {
+  using namespace std;
+
+  /*!
+  * \brief Header at the start of a DMX capture file.
+  *
+  * A capture file records the output of one or more DMX universes at a fixed frame rate.
+  * The layout is:
+  *
+  * 1. DMXCaptureHeader
+  * 2. numUniverses DMXCaptureUniverse records, in the order universes appear in each frame.
+  * 3. frameCount frames. Each frame is a DMXCaptureFrame followed by its payload, padded to
+  *    a multiple of 8 bytes.
+  * 4. The frame index: frameCount uint64_t file offsets, one per frame, at indexOffset.
+  *
+  * All universes of a frame are treated as one buffer of numUniverses * 512 bytes. Key frames
+  * store the whole buffer. Delta frames store the runs of bytes that changed since the
+  * previous frame as DMXCaptureRun records, each followed by its bytes and padded to 8 bytes.
+  * A key frame is written at least every keyInterval frames, so any frame can be rebuilt from
+  * the key frame before it.
+  *
+  * Every record is 8 byte aligned so the file can be memory mapped and read in place. Values
+  * are stored in the byte order of the machine that wrote the file (little endian on every
+  * platform Lumiverse currently supports).
+  */
+  struct DMXCaptureHeader {
+    /*! \brief "LVDMXCAP" */
+    char magic[8];
+    uint32_t version;
+    /*! \brief Frames per second. */
+    uint32_t rate;
+    uint32_t numUniverses;
+    uint32_t keyInterval;
+    uint64_t frameCount;
+    /*! \brief Offset of the frame index from the start of the file. */
+    uint64_t indexOffset;
+  };
+
+  /*! \brief Describes one universe stored in each frame. */
+  struct DMXCaptureUniverse {
+    /*! \brief Id of the Patch the universe came from, null terminated. */
+    char patch[56];
+    /*! \brief Universe number within the patch. */
+    uint32_t universe;
+    /*! \brief Bytes per universe, currently always 512. */
+    uint32_t size;
+  };
+
+  /*! \brief Frame types in a capture file. */
+  enum DMXCaptureFrameType {
+    DMX_CAPTURE_KEY = 0,
+    DMX_CAPTURE_DELTA = 1
+  };
+
+  /*! \brief Header for a single frame. */
+  struct DMXCaptureFrame {
+    /*! \brief Frame number, starting at 0. */
+    uint64_t frame;
+    /*! \brief DMXCaptureFrameType */
+    uint32_t type;
+    /*! \brief Size of the payload following this header, including padding. */
+    uint32_t size;
+  };
+
+  /*! \brief A run of changed bytes in a delta frame. The bytes follow the record. */
+  struct DMXCaptureRun {
+    /*! \brief Offset into the frame buffer. */
+    uint32_t offset;
+    uint32_t length;
+  };
+
+  static_assert(sizeof(DMXCaptureHeader) == 40, "DMXCaptureHeader must match the file layout");
+  static_assert(sizeof(DMXCaptureUniverse) == 64, "DMXCaptureUniverse must match the file layout");
+  static_assert(sizeof(DMXCaptureFrame) == 16, "DMXCaptureFrame must match the file layout");
+  static_assert(sizeof(DMXCaptureRun) == 8, "DMXCaptureRun must match the file layout");
+
+  /*! \brief Identifies a universe to record. */
+  struct DMXCaptureSource {
+    string patch;
+    unsigned int universe;
+  };
+
+  /*!
+  * \brief Writes DMX frames to a capture file.
+  *
+  * Frames are delta compressed against the previous frame as they're written. Unchanged
+  * frames take 16 bytes.
+  * \sa DMXCaptureHeader
+  */
+  class DMXCaptureWriter
+  {
+  public:
+    DMXCaptureWriter();
+
+    /*! \brief Closes the file if it's still open. */
+    ~DMXCaptureWriter();
+
+    /*!
+    * \brief Creates a capture file and writes the header.
+    *
+    * \param filename File to write. Overwritten if it exists.
+    * \param rate Frame rate of the capture.
+    * \param universes Universes in each frame, in buffer order.
+    * \param keyInterval Maximum number of frames between key frames.
+    * \return false if the file couldn't be created.
+    */
+    bool open(string filename, unsigned int rate, const vector<DMXCaptureSource>& universes, unsigned int keyInterval = 40);
+
+    /*!
+    * \brief Appends a frame.
+    *
+    * \param data Values for every universe, getFrameSize() bytes.
+    * \return false if the file isn't open or the write failed.
+    */
+    bool writeFrame(const unsigned char* data);
+
+    /*!
+    * \brief Writes the frame index, finishes the header and closes the file.
+    * \return false if any write failed.
+    */
+    bool close();
+
+    bool isOpen() { return m_file != nullptr; }
+
+    /*! \brief Size in bytes of the data passed to writeFrame(). */
+    size_t getFrameSize() { return m_prev.size(); }
+
+    /*! \brief Number of frames written so far. */
+    uint64_t getFrameCount() { return m_index.size(); }
+
+    /*! \brief Number of bytes written so far. */
+    uint64_t getBytesWritten() { return m_offset; }
+
+  private:
+    /*! \brief Writes bytes and advances m_offset. Sets m_error on failure. */
+    void write(const void* data, size_t size);
+
+    /*! \brief Writes zeros up to the next multiple of 8 bytes. */
+    void pad();
+
+    FILE* m_file;
+
+    /*! \brief Current write position. */
+    uint64_t m_offset;
+
+    DMXCaptureHeader m_header;
+
+    /*! \brief Previous frame, for delta compression. */
+    vector<unsigned char> m_prev;
+
+    /*! \brief Scratch space for the runs of the current frame. Reused between frames. */
+    vector<DMXCaptureRun> m_runs;
+
+    /*! \brief Offset of every frame written. */
+    vector<uint64_t> m_index;
+
+    /*! \brief Frames since the last key frame. */
+    unsigned int m_sinceKey;
+
+    bool m_error;
+  };
+
+  /*!
+  * \brief Reads frames from a capture file.
+  *
+  * The file is memory mapped, so it's paged in by the OS as frames are read and nothing is
+  * loaded up front. Key frames are returned as pointers straight into the mapping. Delta
+  * frames are applied to a single working buffer. Reading frames in order only applies
+  * one delta per frame. Seeking goes back to the nearest key frame.
+  *
+  * Not thread safe. Pointers returned by getFrame() are valid until the next call.
+  * \sa DMXCaptureHeader
+  */
+  class DMXCaptureReader
+  {
+  public:
+    DMXCaptureReader();
+
+    /*! \brief Unmaps the file if it's open. */
+    ~DMXCaptureReader();
+
+    /*!
+    * \brief Maps a capture file and checks its header and frame index.
+    * \return false if the file can't be mapped or isn't a valid capture.
+    */
+    bool open(string filename);
+
+    void close();
+
+    bool isOpen() { return m_data != nullptr; }
+
+    /*! \brief Header of the open file. */
+    const DMXCaptureHeader& getHeader() { return *(const DMXCaptureHeader*)m_data; }
+
+    /*! \brief Description of universe i in each frame. */
+    const DMXCaptureUniverse& getUniverse(unsigned int i) { return m_universes[i]; }
+
+    unsigned int getNumUniverses() { return getHeader().numUniverses; }
+
+    uint64_t getFrameCount() { return getHeader().frameCount; }
+
+    unsigned int getRate() { return getHeader().rate; }
+
+    /*! \brief Size in bytes of a decoded frame. */
+    size_t getFrameSize() { return m_work.size(); }
+
+    /*!
+    * \brief Returns the values of every universe at a frame.
+    * \param frame Frame number.
+    * \return getFrameSize() bytes, or nullptr if the frame doesn't exist or is corrupt.
+    */
+    const unsigned char* getFrame(uint64_t frame);
+
+  private:
+    /*! \brief Applies a frame on top of m_current. Returns false if it's corrupt. */
+    bool applyFrame(uint64_t frame);
+
+    /*! \brief Returns the frame header, or nullptr if it's outside the file. */
+    const DMXCaptureFrame* frameHeader(uint64_t frame);
+
+    /*! \brief Start of the mapped file. */
+    const unsigned char* m_data;
+    size_t m_size;
+
+#ifdef _WIN32
+    void* m_fileHandle;
+    void* m_mapHandle;
+#endif
+
+    const DMXCaptureUniverse* m_universes;
+    const uint64_t* m_index;
+
+    /*! \brief Buffer delta frames are applied to. */
+    vector<unsigned char> m_work;
+
+    /*! \brief Most recently decoded frame. Points into the mapping or at m_work. */
+    const unsigned char* m_current;
+    uint64_t m_currentFrame;
+    bool m_hasCurrent;
+  };
+}
+
+#endif
@@ -0,0 +1,228 @@
+#include "DMXCapturePlayer.h"
+#include "DMXPatch.h"
+#include "../Logger.h"
+
+#include <cstring>
+
+namespace Lumiverse {
+
+  DMXCapturePlayer::DMXCapturePlayer() : m_playing(false), m_loop(true), m_startFrame(0),
+    m_fadeFrom(0), m_fadeTo(0), m_fadeTime(0)
+  {
+  }
+
+  DMXCapturePlayer::~DMXCapturePlayer() {
+    detachAll();
+  }
+
+  bool DMXCapturePlayer::open(string filename) {
+    lock_guard<mutex> lock(m_mutex);
+
+    m_playing = false;
+    m_startFrame = 0;
+
+    // Universe mappings belong to the old file.
+    detachAll();
+
+    return m_reader.open(filename);
+  }
+
+  void DMXCapturePlayer::close() {
+    lock_guard<mutex> lock(m_mutex);
+
+    m_playing = false;
+    m_startFrame = 0;
+    detachAll();
+
+    m_reader.close();
+  }
+
+  bool DMXCapturePlayer::attach(DMXPatch* patch, string id) {
+    lock_guard<mutex> lock(m_mutex);
+
+    if (!m_reader.isOpen()) {
+      Logger::log(ERR, "Can't attach a DMX capture player without an open capture");
+      return false;
+    }
+
+    vector<pair<unsigned int, unsigned int> > universes;
+    for (unsigned int i = 0; i < m_reader.getNumUniverses(); i++) {
+      const DMXCaptureUniverse& u = m_reader.getUniverse(i);
+      if (strncmp(u.patch, id.c_str(), sizeof(u.patch)) == 0)
+        universes.push_back(make_pair(i, u.universe));
+    }
+
+    if (universes.empty()) {
+      Logger::log(ERR, "DMX capture has no universes for patch " + id);
+      return false;
+    }
+
+    m_targets[patch] = universes;
+    patch->setCapturePlayer(this);
+
+    return true;
+  }
+
+  void DMXCapturePlayer::detach(DMXPatch* patch) {
+    lock_guard<mutex> lock(m_mutex);
+
+    if (m_targets.erase(patch) > 0 && patch->getCapturePlayer() == this)
+      patch->setCapturePlayer(nullptr);
+  }
+
+  void DMXCapturePlayer::play(bool loop) {
+    lock_guard<mutex> lock(m_mutex);
+
+    if (!m_reader.isOpen())
+      return;
+
+    m_loop = loop;
+    if (!m_playing) {
+      m_start = Clock::now();
+      m_playing = true;
+    }
+  }
+
+  void DMXCapturePlayer::stop() {
+    lock_guard<mutex> lock(m_mutex);
+
+    // Hold the current position.
+    m_startFrame = frameAt(Clock::now());
+    m_playing = false;
+  }
+
+  bool DMXCapturePlayer::isPlaying() {
+    lock_guard<mutex> lock(m_mutex);
+    return m_playing;
+  }
+
+  bool DMXCapturePlayer::isDone() {
+    lock_guard<mutex> lock(m_mutex);
+    return m_reader.isOpen() && !m_loop && frameAt(Clock::now()) + 1 >= m_reader.getFrameCount();
+  }
+
+  void DMXCapturePlayer::seek(size_t time) {
+    lock_guard<mutex> lock(m_mutex);
+
+    if (!m_reader.isOpen())
+      return;
+
+    m_startFrame = (uint64_t)time * m_reader.getRate() / 1000;
+    m_start = Clock::now();
+  }
+
+  uint64_t DMXCapturePlayer::getCurrentFrame() {
+    lock_guard<mutex> lock(m_mutex);
+    return frameAt(Clock::now());
+  }
+
+  void DMXCapturePlayer::fadeToLive(float seconds) {
+    fadeTo(1, seconds);
+  }
+
+  void DMXCapturePlayer::fadeToCapture(float seconds) {
+    fadeTo(0, seconds);
+  }
+
+  float DMXCapturePlayer::getLiveLevel() {
+    lock_guard<mutex> lock(m_mutex);
+    return liveLevelAt(Clock::now());
+  }
+
+  void DMXCapturePlayer::fadeTo(float level, float seconds) {
+    lock_guard<mutex> lock(m_mutex);
+
+    // Start from wherever the current fade is.
+    auto now = Clock::now();
+    m_fadeFrom = liveLevelAt(now);
+    m_fadeTo = level;
+    m_fadeStart = now;
+    m_fadeTime = (seconds > 0) ? seconds : 0;
+  }
+
+  bool DMXCapturePlayer::apply(DMXPatch* patch, const set<Device *>& devices) {
+    lock_guard<mutex> lock(m_mutex);
+
+    if (!m_playing)
+      return false;
+
+    auto target = m_targets.find(patch);
+    if (target == m_targets.end())
+      return false;
+
+    auto now = Clock::now();
+    float live = liveLevelAt(now);
+
+    // Fully live, no need to touch the capture.
+    if (live >= 1) {
+      patch->updateUniverses(devices);
+      return true;
+    }
+
+    const unsigned char* frame = m_reader.getFrame(frameAt(now));
+    if (frame == nullptr)
+      return false;
+
+    if (live > 0)
+      patch->updateUniverses(devices);
+
+    // Cross-fade in 8 bit fixed point.
+    const int weight = (int)(live * 256);
+    vector<vector<unsigned char> >& universes = patch->m_universes;
+
+    for (const auto& u : target->second) {
+      if (u.second >= universes.size())
+        continue;
+
+      const unsigned char* src = frame + u.first * 512;
+      unsigned char* dst = universes[u.second].data();
+      size_t size = universes[u.second].size() < 512 ? universes[u.second].size() : 512;
+
+      if (weight == 0) {
+        memcpy(dst, src, size);
+      }
+      else {
+        for (size_t i = 0; i < size; i++)
+          dst[i] = (unsigned char)(src[i] + (((dst[i] - src[i]) * weight) >> 8));
+      }
+    }
+
+    return true;
+  }
+
+  void DMXCapturePlayer::detachAll() {
+    for (auto& t : m_targets) {
+      if (t.first->getCapturePlayer() == this)
+        t.first->setCapturePlayer(nullptr);
+    }
+    m_targets.clear();
+  }
+
+  uint64_t DMXCapturePlayer::frameAt(Clock::time_point now) {
+    if (!m_reader.isOpen() || m_reader.getFrameCount() == 0)
+      return 0;
+
+    uint64_t frame = m_startFrame;
+    if (m_playing) {
+      long long ns = chrono::duration_cast<chrono::nanoseconds>(now - m_start).count();
+      frame += (uint64_t)ns * m_reader.getRate() / 1000000000ULL;
+    }
+
+    uint64_t count = m_reader.getFrameCount();
+    if (m_loop)
+      return frame % count;
+
+    return (frame < count) ? frame : count - 1;
+  }
+
+  float DMXCapturePlayer::liveLevelAt(Clock::time_point now) {
+    if (m_fadeTime <= 0)
+      return m_fadeTo;
+
+    float t = chrono::duration<float>(now - m_fadeStart).count() / m_fadeTime;
+    if (t >= 1)
+      return m_fadeTo;
+
+    return m_fadeFrom + (m_fadeTo - m_fadeFrom) * t;
+  }
+}
@@ -0,0 +1,156 @@
+/*! \file DMXCapturePlayer.h
+* \brief Plays DMX capture files out of DMXPatches.
+*/
+#ifndef _DMXCAPTUREPLAYER_H_
+#define _DMXCAPTUREPLAYER_H_
+
+#pragma once
+
+#include "LumiverseCoreConfig.h"
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <set>
+
+#include "DMXCapture.h"
+
+namespace Lumiverse {
+  class DMXPatch;
+  class Device;
+
+  /*!
+  * \brief Streams pre-rendered frames from a capture file to the interfaces of DMXPatches.
+  *
+  * Once attached to a DMXPatch, the player takes over the patch's output while it's playing.
+  * Each time the patch updates, the frame for the current time is read from the memory mapped
+  * capture and sent as is, without converting any devices. The frame comes from a monotonic
+  * clock, so playback stays frame accurate no matter how often the patch updates.
+  *
+  * The output can be cross-faded between the capture and the live output of the patch
+  * (whatever the Rig's devices, and so the Playback, are set to). Devices are only converted
+  * while some of the live output is showing.
+  *
+  * Patches don't own their player. Detach it, or stop the Rig, before deleting it.
+  * \sa DMXCaptureReader, OfflineRenderer
+  */
+  class DMXCapturePlayer
+  {
+  public:
+    DMXCapturePlayer();
+
+    /*! \brief Detaches from every patch. */
+    ~DMXCapturePlayer();
+
+    /*!
+    * \brief Opens a capture file. Stops playback and detaches from every patch.
+    * \return false if the file isn't a valid capture.
+    */
+    bool open(string filename);
+
+    /*! \brief Stops playback, detaches from every patch and closes the capture file. */
+    void close();
+
+    /*!
+    * \brief Sends the universes recorded from a patch to a DMXPatch.
+    *
+    * \param patch Patch to output through.
+    * \param id Patch id the universes were recorded from. Usually the same patch.
+    * \return false if no capture is open or it has no universes for the id.
+    */
+    bool attach(DMXPatch* patch, string id);
+
+    /*! \brief Gives the patch's output back to its devices. */
+    void detach(DMXPatch* patch);
+
+    /*!
+    * \brief Starts playing from the current position.
+    * \param loop If true, starts over at the end. Otherwise holds the last frame.
+    */
+    void play(bool loop = true);
+
+    /*! \brief Stops playing. Attached patches go back to their live output. */
+    void stop();
+
+    bool isPlaying();
+
+    /*! \brief Returns true if playback isn't looping and has reached the last frame. */
+    bool isDone();
+
+    /*!
+    * \brief Jumps to a time in the capture.
+    * \param time Time in ms.
+    */
+    void seek(size_t time);
+
+    /*! \brief Returns the frame that's currently playing. */
+    uint64_t getCurrentFrame();
+
+    /*!
+    * \brief Cross-fades the output to the live values of the patches.
+    * \param seconds Length of the fade. 0 cuts.
+    */
+    void fadeToLive(float seconds);
+
+    /*!
+    * \brief Cross-fades the output back to the capture.
+    * \param seconds Length of the fade. 0 cuts.
+    */
+    void fadeToCapture(float seconds);
+
+    /*! \brief Portion of the output that comes from the live values, [0, 1]. */
+    float getLiveLevel();
+
+    /*!
+    * \brief Writes the current frame into a patch's universes.
+    *
+    * Called by DMXPatch::update().
+    * \param patch Patch being updated.
+    * \param devices Devices to convert if live values are needed.
+    * \return false if the player isn't playing. The patch should convert its devices itself.
+    */
+    bool apply(DMXPatch* patch, const set<Device *>& devices);
+
+  private:
+    typedef chrono::steady_clock Clock;
+
+    /*! \brief Frame at the given time. Assumes m_mutex is held. */
+    uint64_t frameAt(Clock::time_point now);
+
+    /*! \brief Live level at the given time. Assumes m_mutex is held. */
+    float liveLevelAt(Clock::time_point now);
+
+    /*! \brief Gives every attached patch its output back. Assumes m_mutex is held. */
+    void detachAll();
+
+    /*! \brief Starts a fade to the given live level. */
+    void fadeTo(float level, float seconds);
+
+    /*!
+    * \brief Guards everything below.
+    *
+    * Patches update from the Rig's update loop while playback is controlled from elsewhere.
+    */
+    mutex m_mutex;
+
+    DMXCaptureReader m_reader;
+
+    /*! \brief Patch -> (capture universe, patch universe) pairs to output. */
+    map<DMXPatch*, vector<pair<unsigned int, unsigned int> > > m_targets;
+
+    bool m_playing;
+    bool m_loop;
+
+    /*! \brief Clock time m_startFrame was at. */
+    Clock::time_point m_start;
+    uint64_t m_startFrame;
+
+    /*! \brief Current cross-fade. */
+    float m_fadeFrom;
+    float m_fadeTo;
+    Clock::time_point m_fadeStart;
+    float m_fadeTime;
+  };
+}
+
+#endif
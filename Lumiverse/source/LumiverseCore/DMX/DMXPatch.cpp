@@ -23,11 +23,10 @@
 
 namespace Lumiverse {
 
-DMXPatch::DMXPatch() {
-  // Empty for now
+DMXPatch::DMXPatch() : m_capturePlayer(nullptr) {
 }
 
-DMXPatch::DMXPatch(const JSONNode data) {
+DMXPatch::DMXPatch(const JSONNode data) : m_capturePlayer(nullptr) {
   loadJSON(data);
 }
 
@@ -205,6 +204,9 @@ void DMXPatch::loadDeviceMaps(const JSONNode data) {
 }
 
 DMXPatch::~DMXPatch() {
+  if (m_capturePlayer != nullptr)
+    m_capturePlayer->detach(this);
+
   // Deallocate all interfaces after closing them.
   for (auto& interfaces : m_interfaces) {
     interfaces.second->closeInt();
@@ -218,6 +220,17 @@ DMXPatch::~DMXPatch() {
 }
 
 void DMXPatch::update(set<Device *> devices) {
+  // A playing capture replaces the device values.
+  if (m_capturePlayer == nullptr || !m_capturePlayer->apply(this, devices))
+    updateUniverses(devices);
+
+  // Send updated data to interfaces
+  for (auto& i : m_ifacePatch) {
+    m_interfaces[i.first]->sendDMX(&m_universes[i.second].front(), i.second);
+  }
+}
+
+void DMXPatch::updateUniverses(const set<Device *>& devices) {
   for (Device* d : devices) {
     // Skip if there is no DMX patch for the device stored
     try {
@@ -237,10 +250,19 @@ void DMXPatch::update(set<Device *> devices) {
       continue;
     }
   }
+}
 
-  // Send updated data to interfaces
-  for (auto& i : m_ifacePatch) {
-    m_interfaces[i.first]->sendDMX(&m_universes[i.second].front(), i.second);
+void DMXPatch::allocatePatchedUniverses() {
+  size_t size = m_universes.size();
+  for (auto& p : m_patch) {
+    if (p.second->getUniverse() + 1 > size)
+      size = p.second->getUniverse() + 1;
+  }
+
+  if (size > m_universes.size()) {
+    m_universes.resize(size);
+    for (auto& uni : m_universes)
+      uni.resize(512);
   }
 }
 
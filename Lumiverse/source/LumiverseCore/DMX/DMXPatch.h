@@ -11,6 +11,7 @@
 #include "../Patch.h"
 #include "DMXDevicePatch.h"
 #include "DMXInterface.h"
+#include "DMXCapturePlayer.h"
 #include "../lib/libjson/libjson.h"
 
 #include <iostream>
@@ -67,6 +68,38 @@ namespace Lumiverse {
     */
     virtual void update(set<Device *> devices);
 
+    /*!
+    * \brief Converts the devices to DMX values without sending anything to the interfaces.
+    *
+    * update() is this followed by sending every universe to its interfaces.
+    * \sa getUniverses()
+    */
+    void updateUniverses(const set<Device *>& devices);
+
+    /*!
+    * \brief Makes sure every universe that has patched devices has a buffer.
+    *
+    * Normally universes are only allocated when an interface is assigned to them.
+    * Call this to get DMX values for patched universes that have no interface,
+    * e.g. when rendering without hardware.
+    */
+    void allocatePatchedUniverses();
+
+    /*!
+    * \brief Returns the current DMX data for every universe. Universe 1 is index 0.
+    */
+    const vector<vector<unsigned char> >& getUniverses() { return m_universes; }
+
+    /*!
+    * \brief Sets the capture player that takes over output while it's playing.
+    *
+    * Use DMXCapturePlayer::attach() instead of calling this directly.
+    */
+    void setCapturePlayer(DMXCapturePlayer* player) { m_capturePlayer = player; }
+
+    /*! \brief Returns the attached capture player, or nullptr. */
+    DMXCapturePlayer* getCapturePlayer() { return m_capturePlayer; }
+
     /*!
     * \brief Initializes connections and other network settings for the patch.
     *
@@ -309,6 +342,13 @@ namespace Lumiverse {
     * devices. Key is the device map name.
     */
     map<string, map<string, patchData> > m_deviceMaps;
+
+    /*!
+    * \brief Player whose frames replace the device values while it's playing. Not owned.
+    */
+    DMXCapturePlayer* m_capturePlayer;
+
+    friend class DMXCapturePlayer;
   };
 }
 
@@ -1,10 +1,18 @@
 #include "Device.h"
+#include <atomic>
+
 namespace Lumiverse {
 
+// Source of Device instance ids. Starts at 1 so 0 never matches a device.
+static atomic<size_t> nextInstanceId(1);
+
 Device::Device(string id, unsigned int channel, string type) {
   this->m_id = id;
   this->m_channel = channel;
   this->m_type = type;
+  m_paramStructureVersion = 0;
+  m_instanceId = nextInstanceId++;
+  m_revision = 0;
 
   // Might auto-load parameters from device type file at some point.
   // Right now we just leave the maps empty and stuff.
@@ -12,6 +20,9 @@ Device::Device(string id, unsigned int channel, string type) {
 
 Device::Device(string id, const JSONNode data) {
   m_id = id;
+  m_paramStructureVersion = 0;
+  m_instanceId = nextInstanceId++;
+  m_revision = 0;
   loadJSON(data);
 }
 
@@ -27,6 +38,9 @@ Device::Device(const Device& other) {
 
   m_metadata = other.m_metadata;
   m_fp = other.m_fp;
+  m_paramStructureVersion = 0;
+  m_instanceId = nextInstanceId++;
+  m_revision = 0;
 }
 
 Device::Device(Device* other) {
@@ -41,6 +55,9 @@ Device::Device(Device* other) {
 
   m_metadata = other->m_metadata;
   m_fp = other->m_fp;
+  m_paramStructureVersion = 0;
+  m_instanceId = nextInstanceId++;
+  m_revision = 0;
 }
 
 Device::Device(string id, Device* other) {
@@ -55,6 +72,9 @@ Device::Device(string id, Device* other) {
 
   m_metadata = other->m_metadata;
   m_fp = other->m_fp;
+  m_paramStructureVersion = 0;
+  m_instanceId = nextInstanceId++;
+  m_revision = 0;
 }
 
 Device::~Device() {
@@ -156,6 +176,7 @@ bool Device::setParam(string param, LumiverseType* val) {
   }
 
   m_parameters[param] = val;
+  m_paramStructureVersion++;
 
   // callback
   onParameterChanged();
@@ -364,30 +385,40 @@ bool Device::setColorChannel(string param, string channel, double val) {
   return true;
 }
     
-void Device::copyParamByValue(string param, LumiverseType* source) {
+bool Device::copyParamByValue(string param, LumiverseType* source) {
   LumiverseType *target = m_parameters[param];
     
 	// Skips this copy if types don't match.
   if (!LumiverseTypeUtils::areSameType(source, target))
-    return;
+    return false;
     
+  bool changed;
   if (source->getTypeName() == "float") {
+    changed = !(*((LumiverseFloat*)target) == *((LumiverseFloat*)source));
     *((LumiverseFloat*)target) = *((LumiverseFloat*)source);
   }
   else if (source->getTypeName() == "enum") {
+    changed = !(*((LumiverseEnum*)target) == *((LumiverseEnum*)source));
     *((LumiverseEnum*)target) = *((LumiverseEnum*)source);
   }
   else if (source->getTypeName() == "color") {
+    changed = !(*((LumiverseColor*)target) == *((LumiverseColor*)source));
     *((LumiverseColor*)target) = *((LumiverseColor*)source);
   }
 	else if (source->getTypeName() == "orientation") {
+		changed = !(*((LumiverseOrientation*)target) == *((LumiverseOrientation*)source));
 		*((LumiverseOrientation*)target) = *((LumiverseOrientation*)source);
 	}
   else {
-      return;
+      return false;
   }
     
+  // Callbacks aren't run for this, but caches should still see the change.
+  if (changed)
+    m_revision++;
 //  onParameterChanged();
+
+  return changed;
 }
     
 bool Device::paramExists(string param) {
@@ -398,6 +429,7 @@ bool Device::paramExists(string param) {
     else {
       // remove parameter to be safe if it's null
       m_parameters.erase(param);
+      m_paramStructureVersion++;
       return false;
     }
   }
@@ -466,6 +498,7 @@ void Device::deleteParameter(string key) {
   if (m_parameters.count(key) != 0) {
     delete m_parameters[key];
     m_parameters.erase(key);
+    m_paramStructureVersion++;
 
     onParameterChanged();
   }
@@ -558,14 +591,15 @@ JSONNode Device::toJSON() {
 }
 
 int Device::addParameterChangedCallback(DeviceCallbackFunction func) {
-    int id = (int)m_onParameterChangedFunctions.size();
+    // Ids are never reused, even if earlier callbacks were deleted.
+    int id = (m_onParameterChangedFunctions.size() == 0) ? 0 : m_onParameterChangedFunctions.rbegin()->first + 1;
     m_onParameterChangedFunctions[id] = func;
 
     return id;
 }
 
 int Device::addMetadataChangedCallback(DeviceCallbackFunction func) {
-  int id = (int)m_onMetadataChangedFunctions.size();
+  int id = (m_onMetadataChangedFunctions.size() == 0) ? 0 : m_onMetadataChangedFunctions.rbegin()->first + 1;
   m_onMetadataChangedFunctions[id] = func;
 
   return (int)id;
@@ -642,6 +676,7 @@ Eigen::Vector3d Device::getGelColor() {
 void Device::addFocusPalette(FocusPalette fp)
 {
   m_fp[fp._name] = fp;
+  m_revision++;
 }
 
 FocusPalette * Device::getFocusPalette(string name)
@@ -655,8 +690,10 @@ FocusPalette * Device::getFocusPalette(string name)
 
 void Device::deleteFocusPalette(string name)
 {
-  if (m_fp.count(name) > 0)
+  if (m_fp.count(name) > 0) {
     m_fp.erase(name);
+    m_revision++;
+  }
 }
 
 void Device::setFocusPalette(string name)
@@ -823,12 +860,16 @@ void Device::loadParams(const JSONNode data) {
 }
     
 void Device::onParameterChanged() {
+    m_revision++;
+
     for (const auto& kvp : m_onParameterChangedFunctions) {
         kvp.second(this);
     }
 }
     
 void Device::onMetadataChanged(){
+    m_revision++;
+
     for (const auto& kvp : m_onMetadataChangedFunctions) {
         kvp.second(this);
     }
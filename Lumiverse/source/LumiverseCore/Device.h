@@ -395,8 +395,9 @@ namespace Lumiverse {
     *
     * \param param Id of the target parameter
     * \param source Pointer to the data source
+    * \return True if the value of the parameter changed.
     */
-    void copyParamByValue(string param, LumiverseType* source);
+    bool copyParamByValue(string param, LumiverseType* source);
       
     /*! 
     * \brief Checks for the existance of a parameter
@@ -419,6 +420,32 @@ namespace Lumiverse {
     */
     vector<string> getParamNames();
 
+    /*!
+    * \brief Changes whenever a parameter is added, removed or replaced with a new object.
+    *
+    * Setting the value of an existing parameter doesn't change this. Lets indexes that hold
+    * on to parameter pointers know when they need to be rebuilt.
+    */
+    size_t getParamStructureVersion() { return m_paramStructureVersion; }
+
+    /*!
+    * \brief Number that identifies this Device object. Never reused, even by copies or
+    * by a Device later allocated at the same address.
+    */
+    size_t getInstanceId() { return m_instanceId; }
+
+    /*!
+    * \brief Changes whenever a parameter value, metadata or a focus palette of the device changes.
+    *
+    * Together with getInstanceId() this lets a cache tell that a device is unchanged
+    * without comparing it against a copy. Changes made by writing directly to a LumiverseType
+    * returned by getParam() aren't tracked, call markChanged() after those.
+    */
+    size_t getRevision() { return m_revision; }
+
+    /*! \brief Changes the revision after parameters were written directly. */
+    void markChanged() { m_revision++; }
+
     /*!
     \brief Returns true if a specified metadata key exists for this device.
     */
@@ -709,6 +736,15 @@ namespace Lumiverse {
     * assuming it can be serialized to a string.
     */
     map<string, string> m_metadata;
+
+    /*! \brief Incremented when the parameter map changes shape. \sa getParamStructureVersion() */
+    size_t m_paramStructureVersion;
+
+    /*! \brief \sa getInstanceId() */
+    size_t m_instanceId;
+
+    /*! \brief Incremented when the device changes. \sa getRevision() */
+    size_t m_revision;
     
     /*!
     * \brief List of functions to run when a parameter is changed. Each function has an int id.
@@ -0,0 +1,444 @@
+#include "DeviceBitmap.h"
+
+#include <algorithm>
+#include <iterator>
+
+namespace Lumiverse {
+
+DeviceBitmap::const_iterator::const_iterator(const vector<Container>* containers, size_t container) :
+  m_containers(containers), m_container(container), m_pos(0), m_value(0)
+{
+  settle();
+}
+
+DeviceBitmap::const_iterator& DeviceBitmap::const_iterator::operator++() {
+  m_pos++;
+  settle();
+  return *this;
+}
+
+void DeviceBitmap::const_iterator::settle() {
+  while (m_containers != nullptr && m_container < m_containers->size()) {
+    const Container& c = (*m_containers)[m_container];
+    uint32_t high = (uint32_t)c.key << 16;
+
+    if (!c.isBitmap()) {
+      if (m_pos < c.array.size()) {
+        m_value = high | c.array[m_pos];
+        return;
+      }
+    }
+    else if (m_pos < 65536) {
+      size_t w = m_pos >> 6;
+      uint64_t word = c.bitmap[w] & (~(uint64_t)0 << (m_pos & 63));
+
+      while (word == 0 && ++w < c.bitmap.size())
+        word = c.bitmap[w];
+
+      if (word != 0) {
+        m_pos = (w << 6) + lowestBit(word);
+        m_value = high | (uint32_t)m_pos;
+        return;
+      }
+    }
+
+    m_container++;
+    m_pos = 0;
+  }
+}
+
+bool DeviceBitmap::add(uint32_t i) {
+  uint16_t key = i >> 16;
+  uint16_t low = i & 0xFFFF;
+
+  bool found;
+  size_t idx = findContainer(key, found);
+
+  if (found && contains(i))
+    return false;
+
+  auto& containers = mutate();
+
+  if (!found) {
+    Container c;
+    c.key = key;
+    c.cardinality = 0;
+    containers.insert(containers.begin() + idx, c);
+  }
+
+  Container& c = containers[idx];
+  if (c.isBitmap()) {
+    c.bitmap[low >> 6] |= (uint64_t)1 << (low & 63);
+  }
+  else {
+    c.array.insert(lower_bound(c.array.begin(), c.array.end(), low), low);
+  }
+
+  c.cardinality++;
+  normalize(c);
+  return true;
+}
+
+bool DeviceBitmap::remove(uint32_t i) {
+  if (!contains(i))
+    return false;
+
+  uint16_t low = i & 0xFFFF;
+  bool found;
+  size_t idx = findContainer(i >> 16, found);
+
+  auto& containers = mutate();
+  Container& c = containers[idx];
+
+  if (c.isBitmap()) {
+    c.bitmap[low >> 6] &= ~((uint64_t)1 << (low & 63));
+  }
+  else {
+    c.array.erase(lower_bound(c.array.begin(), c.array.end(), low));
+  }
+
+  c.cardinality--;
+
+  if (c.cardinality == 0)
+    containers.erase(containers.begin() + idx);
+  else
+    normalize(c);
+
+  if (containers.empty())
+    clear();
+
+  return true;
+}
+
+bool DeviceBitmap::contains(uint32_t i) const {
+  bool found;
+  size_t idx = findContainer(i >> 16, found);
+
+  if (!found)
+    return false;
+
+  const Container& c = (*m_containers)[idx];
+  uint16_t low = i & 0xFFFF;
+
+  if (c.isBitmap())
+    return (c.bitmap[low >> 6] >> (low & 63)) & 1;
+
+  return binary_search(c.array.begin(), c.array.end(), low);
+}
+
+size_t DeviceBitmap::size() const {
+  if (m_containers == nullptr)
+    return 0;
+
+  size_t total = 0;
+  for (const auto& c : *m_containers)
+    total += c.cardinality;
+
+  return total;
+}
+
+DeviceBitmap& DeviceBitmap::operator|=(const DeviceBitmap& other) {
+  if (other.empty() || m_containers == other.m_containers)
+    return *this;
+
+  if (empty()) {
+    m_containers = other.m_containers;
+    return *this;
+  }
+
+  vector<Container> result;
+  const auto& a = *m_containers;
+  const auto& b = *other.m_containers;
+  size_t i = 0, j = 0;
+
+  while (i < a.size() || j < b.size()) {
+    if (j == b.size() || (i < a.size() && a[i].key < b[j].key)) {
+      result.push_back(a[i++]);
+    }
+    else if (i == a.size() || b[j].key < a[i].key) {
+      result.push_back(b[j++]);
+    }
+    else {
+      result.push_back(combine(a[i++], b[j++], OR));
+    }
+  }
+
+  m_containers = make_shared<vector<Container> >(move(result));
+  return *this;
+}
+
+DeviceBitmap& DeviceBitmap::operator&=(const DeviceBitmap& other) {
+  if (empty() || m_containers == other.m_containers)
+    return *this;
+
+  if (other.empty()) {
+    clear();
+    return *this;
+  }
+
+  vector<Container> result;
+  const auto& a = *m_containers;
+  const auto& b = *other.m_containers;
+  size_t i = 0, j = 0;
+
+  while (i < a.size() && j < b.size()) {
+    if (a[i].key < b[j].key) {
+      i++;
+    }
+    else if (b[j].key < a[i].key) {
+      j++;
+    }
+    else {
+      Container c = combine(a[i++], b[j++], AND);
+      if (c.cardinality > 0)
+        result.push_back(move(c));
+    }
+  }
+
+  if (result.empty())
+    clear();
+  else
+    m_containers = make_shared<vector<Container> >(move(result));
+
+  return *this;
+}
+
+DeviceBitmap& DeviceBitmap::subtract(const DeviceBitmap& other) {
+  if (empty() || other.empty())
+    return *this;
+
+  if (m_containers == other.m_containers) {
+    clear();
+    return *this;
+  }
+
+  vector<Container> result;
+  const auto& a = *m_containers;
+  const auto& b = *other.m_containers;
+  size_t j = 0;
+
+  for (size_t i = 0; i < a.size(); i++) {
+    while (j < b.size() && b[j].key < a[i].key)
+      j++;
+
+    if (j < b.size() && b[j].key == a[i].key) {
+      Container c = combine(a[i], b[j], ANDNOT);
+      if (c.cardinality > 0)
+        result.push_back(move(c));
+    }
+    else {
+      result.push_back(a[i]);
+    }
+  }
+
+  if (result.empty())
+    clear();
+  else
+    m_containers = make_shared<vector<Container> >(move(result));
+
+  return *this;
+}
+
+bool DeviceBitmap::operator==(const DeviceBitmap& other) const {
+  if (m_containers == other.m_containers)
+    return true;
+
+  if (empty() || other.empty())
+    return empty() && other.empty();
+
+  if (size() != other.size())
+    return false;
+
+  // Containers are normalized so equal sets have equal storage.
+  const auto& a = *m_containers;
+  const auto& b = *other.m_containers;
+
+  if (a.size() != b.size())
+    return false;
+
+  for (size_t i = 0; i < a.size(); i++) {
+    if (a[i].key != b[i].key || a[i].array != b[i].array || a[i].bitmap != b[i].bitmap)
+      return false;
+  }
+
+  return true;
+}
+
+DeviceBitset DeviceBitmap::toBitset(size_t size) const {
+  DeviceBitset out(size);
+  if (m_containers == nullptr)
+    return out;
+
+  auto& words = out.getWords();
+
+  for (const auto& c : *m_containers) {
+    size_t base = (size_t)c.key << 10;
+    if (base >= words.size())
+      break;
+
+    if (c.isBitmap()) {
+      size_t n = min((size_t)1024, words.size() - base);
+      copy(c.bitmap.begin(), c.bitmap.begin() + n, words.begin() + base);
+    }
+    else {
+      for (auto low : c.array) {
+        size_t i = ((size_t)c.key << 16) | low;
+        if (i < size)
+          out.set(i);
+      }
+    }
+  }
+
+  // Clear anything a bitmap chunk put past the end.
+  out.resize(size);
+  return out;
+}
+
+DeviceBitmap DeviceBitmap::fromBitset(const DeviceBitset& bits) {
+  DeviceBitmap out;
+  vector<Container> containers;
+  const auto& words = bits.getWords();
+
+  // 1024 words per chunk
+  for (size_t base = 0; base < words.size(); base += 1024) {
+    Container c;
+    c.key = (uint16_t)(base >> 10);
+    c.cardinality = 0;
+
+    size_t end = min(words.size(), base + 1024);
+    for (size_t w = base; w < end; w++) {
+#ifdef _MSC_VER
+      c.cardinality += (uint32_t)__popcnt64(words[w]);
+#else
+      c.cardinality += (uint32_t)__builtin_popcountll(words[w]);
+#endif
+    }
+
+    if (c.cardinality == 0)
+      continue;
+
+    c.bitmap.assign(1024, 0);
+    copy(words.begin() + base, words.begin() + end, c.bitmap.begin());
+    normalize(c);
+    containers.push_back(move(c));
+  }
+
+  if (!containers.empty())
+    out.m_containers = make_shared<vector<Container> >(move(containers));
+
+  return out;
+}
+
+DeviceBitmap::const_iterator DeviceBitmap::begin() const {
+  return const_iterator(m_containers.get(), 0);
+}
+
+DeviceBitmap::const_iterator DeviceBitmap::end() const {
+  return const_iterator(m_containers.get(), (m_containers == nullptr) ? 0 : m_containers->size());
+}
+
+vector<DeviceBitmap::Container>& DeviceBitmap::mutate() {
+  if (m_containers == nullptr)
+    m_containers = make_shared<vector<Container> >();
+  else if (m_containers.use_count() > 1)
+    m_containers = make_shared<vector<Container> >(*m_containers);
+
+  return *m_containers;
+}
+
+size_t DeviceBitmap::findContainer(uint16_t key, bool& found) const {
+  found = false;
+  if (m_containers == nullptr)
+    return 0;
+
+  const auto& containers = *m_containers;
+  size_t lo = 0, hi = containers.size();
+
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (containers[mid].key < key)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  found = (lo < containers.size() && containers[lo].key == key);
+  return lo;
+}
+
+void DeviceBitmap::normalize(Container& c) {
+  if (c.isBitmap() && c.cardinality <= ArrayLimit) {
+    vector<uint16_t> arr;
+    arr.reserve(c.cardinality);
+
+    for (size_t w = 0; w < c.bitmap.size(); w++) {
+      uint64_t word = c.bitmap[w];
+      while (word != 0) {
+        arr.push_back((uint16_t)((w << 6) + lowestBit(word)));
+        word &= word - 1;
+      }
+    }
+
+    c.array = move(arr);
+    c.bitmap.clear();
+  }
+  else if (!c.isBitmap() && c.cardinality > ArrayLimit) {
+    c.bitmap = bits(c);
+    c.array.clear();
+  }
+}
+
+vector<uint64_t> DeviceBitmap::bits(const Container& c) {
+  if (c.isBitmap())
+    return c.bitmap;
+
+  vector<uint64_t> out(1024, 0);
+  for (auto low : c.array)
+    out[low >> 6] |= (uint64_t)1 << (low & 63);
+
+  return out;
+}
+
+DeviceBitmap::Container DeviceBitmap::combine(const Container& a, const Container& b, Op op) {
+  Container c;
+  c.key = a.key;
+
+  // Two arrays merge directly, anything involving a bitmap goes word by word.
+  if (!a.isBitmap() && !b.isBitmap()) {
+    auto out = back_inserter(c.array);
+
+    if (op == OR)
+      set_union(a.array.begin(), a.array.end(), b.array.begin(), b.array.end(), out);
+    else if (op == AND)
+      set_intersection(a.array.begin(), a.array.end(), b.array.begin(), b.array.end(), out);
+    else
+      set_difference(a.array.begin(), a.array.end(), b.array.begin(), b.array.end(), out);
+
+    c.cardinality = (uint32_t)c.array.size();
+  }
+  else {
+    c.bitmap = bits(a);
+    vector<uint64_t> other = bits(b);
+    c.cardinality = 0;
+
+    for (size_t w = 0; w < c.bitmap.size(); w++) {
+      if (op == OR)
+        c.bitmap[w] |= other[w];
+      else if (op == AND)
+        c.bitmap[w] &= other[w];
+      else
+        c.bitmap[w] &= ~other[w];
+
+#ifdef _MSC_VER
+      c.cardinality += (uint32_t)__popcnt64(c.bitmap[w]);
+#else
+      c.cardinality += (uint32_t)__builtin_popcountll(c.bitmap[w]);
+#endif
+    }
+  }
+
+  normalize(c);
+  return c;
+}
+
+}
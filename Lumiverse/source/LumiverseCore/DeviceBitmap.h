@@ -0,0 +1,172 @@
+/*! \file DeviceBitmap.h
+* \brief Compressed set of dense device indices.
+*/
+#ifndef _DEVICEBITMAP_H_
+#define _DEVICEBITMAP_H_
+
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+#include "DeviceBitset.h"
+
+namespace Lumiverse {
+  using namespace std;
+
+  /*!
+  * \brief A compressed bitmap of device indices.
+  *
+  * Indices are split into chunks of 65536 by their high 16 bits, in the style of
+  * roaring bitmaps. A chunk with few entries is stored as a sorted array of its low
+  * 16 bits, a dense chunk is stored as a 1024 word bitmap. Small selections on a large
+  * Rig stay small, and large selections get word-parallel set operations.
+  *
+  * Copies share storage until one of them is modified, so passing a DeviceBitmap
+  * around by value is cheap.
+  */
+  class DeviceBitmap
+  {
+  private:
+    /*! \brief One 65536 index chunk. */
+    struct Container {
+      /*! \brief High 16 bits of every index in the chunk. */
+      uint16_t key;
+
+      /*! \brief Number of indices in the chunk. */
+      uint32_t cardinality;
+
+      /*! \brief Sorted low 16 bits. Used when bitmap is empty. */
+      vector<uint16_t> array;
+
+      /*! \brief 1024 words of bits for dense chunks. Empty for array chunks. */
+      vector<uint64_t> bitmap;
+
+      bool isBitmap() const { return !bitmap.empty(); }
+    };
+
+  public:
+    /*! \brief Iterates over indices in increasing order. */
+    class const_iterator {
+    public:
+      const_iterator() : m_containers(nullptr), m_container(0), m_pos(0), m_value(0) { }
+      const_iterator(const vector<Container>* containers, size_t container);
+
+      uint32_t operator*() const { return m_value; }
+      const_iterator& operator++();
+      bool operator==(const const_iterator& other) const { return m_container == other.m_container && m_pos == other.m_pos; }
+      bool operator!=(const const_iterator& other) const { return !(*this == other); }
+
+    private:
+      /*! \brief Moves to the first index at or after the current position. */
+      void settle();
+
+      const vector<Container>* m_containers;
+      size_t m_container;
+      size_t m_pos;
+      uint32_t m_value;
+    };
+
+    DeviceBitmap() { }
+
+    /*! \brief Adds an index. Returns false if it was already in the set. */
+    bool add(uint32_t i);
+
+    /*! \brief Removes an index. Returns false if it wasn't in the set. */
+    bool remove(uint32_t i);
+
+    /*! \brief Returns true if the index is in the set. */
+    bool contains(uint32_t i) const;
+
+    /*! \brief Number of indices in the set. */
+    size_t size() const;
+
+    /*! \brief Returns true if the set is empty. */
+    bool empty() const { return m_containers == nullptr || m_containers->empty(); }
+
+    /*! \brief Removes every index. */
+    void clear() { m_containers.reset(); }
+
+    /*! \brief Union */
+    DeviceBitmap& operator|=(const DeviceBitmap& other);
+
+    /*! \brief Intersection */
+    DeviceBitmap& operator&=(const DeviceBitmap& other);
+
+    /*! \brief Difference. Removes every index in other from this set. */
+    DeviceBitmap& subtract(const DeviceBitmap& other);
+
+    bool operator==(const DeviceBitmap& other) const;
+    bool operator!=(const DeviceBitmap& other) const { return !(*this == other); }
+
+    /*! \brief Expands the set into a DeviceBitset of the given size. Indices past size are dropped. */
+    DeviceBitset toBitset(size_t size) const;
+
+    /*! \brief Compresses a DeviceBitset. */
+    static DeviceBitmap fromBitset(const DeviceBitset& bits);
+
+    const_iterator begin() const;
+    const_iterator end() const;
+
+    /*! \brief Calls f(index) for every index in increasing order. */
+    template <typename F>
+    void forEach(F f) const {
+      if (m_containers == nullptr)
+        return;
+
+      for (const auto& c : *m_containers) {
+        uint32_t high = (uint32_t)c.key << 16;
+
+        if (c.isBitmap()) {
+          for (size_t w = 0; w < c.bitmap.size(); w++) {
+            uint64_t word = c.bitmap[w];
+            while (word != 0) {
+              f(high | (uint32_t)((w << 6) + lowestBit(word)));
+              word &= word - 1;
+            }
+          }
+        }
+        else {
+          for (auto low : c.array)
+            f(high | low);
+        }
+      }
+    }
+
+  private:
+    /*! \brief Chunks with more entries than this are stored as bitmaps. */
+    static const uint32_t ArrayLimit = 4096;
+
+    static inline size_t lowestBit(uint64_t word) {
+#ifdef _MSC_VER
+      unsigned long idx;
+      _BitScanForward64(&idx, word);
+      return idx;
+#else
+      return __builtin_ctzll(word);
+#endif
+    }
+
+    /*! \brief Returns storage that's safe to modify, copying it if it's shared. */
+    vector<Container>& mutate();
+
+    /*! \brief Finds the container for a key, or the position it would be inserted at. */
+    size_t findContainer(uint16_t key, bool& found) const;
+
+    /*! \brief Converts a container between array and bitmap storage based on its cardinality. */
+    static void normalize(Container& c);
+
+    /*! \brief Returns the container's contents as a bitmap. */
+    static vector<uint64_t> bits(const Container& c);
+
+    /*! \brief Operations shared by the binary set operators. */
+    enum Op { OR, AND, ANDNOT };
+    static Container combine(const Container& a, const Container& b, Op op);
+
+    /*! \brief Containers sorted by key. nullptr when empty. */
+    shared_ptr<vector<Container> > m_containers;
+  };
+}
+
+#endif
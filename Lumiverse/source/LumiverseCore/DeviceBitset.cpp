@@ -0,0 +1,88 @@
+#include "DeviceBitset.h"
+
+namespace Lumiverse {
+
+void DeviceBitset::resize(size_t size) {
+  m_size = size;
+  m_words.resize((size + 63) / 64, 0);
+  trim();
+}
+
+void DeviceBitset::setRange(size_t begin, size_t end) {
+  if (end > m_size)
+    end = m_size;
+
+  for (size_t i = begin; i < end; ) {
+    // Whole words at a time when aligned.
+    if ((i & 63) == 0 && i + 64 <= end) {
+      m_words[i >> 6] = ~(uint64_t)0;
+      i += 64;
+    }
+    else {
+      set(i);
+      i++;
+    }
+  }
+}
+
+void DeviceBitset::setAll() {
+  for (auto& w : m_words)
+    w = ~(uint64_t)0;
+  trim();
+}
+
+void DeviceBitset::clear() {
+  for (auto& w : m_words)
+    w = 0;
+}
+
+void DeviceBitset::flip() {
+  for (auto& w : m_words)
+    w = ~w;
+  trim();
+}
+
+size_t DeviceBitset::count() const {
+  size_t total = 0;
+  for (auto w : m_words) {
+#ifdef _MSC_VER
+    total += __popcnt64(w);
+#else
+    total += __builtin_popcountll(w);
+#endif
+  }
+  return total;
+}
+
+bool DeviceBitset::none() const {
+  for (auto w : m_words) {
+    if (w != 0)
+      return false;
+  }
+  return true;
+}
+
+DeviceBitset& DeviceBitset::operator|=(const DeviceBitset& other) {
+  for (size_t i = 0; i < m_words.size() && i < other.m_words.size(); i++)
+    m_words[i] |= other.m_words[i];
+  return *this;
+}
+
+DeviceBitset& DeviceBitset::operator&=(const DeviceBitset& other) {
+  for (size_t i = 0; i < m_words.size(); i++)
+    m_words[i] &= (i < other.m_words.size()) ? other.m_words[i] : 0;
+  return *this;
+}
+
+DeviceBitset& DeviceBitset::subtract(const DeviceBitset& other) {
+  for (size_t i = 0; i < m_words.size() && i < other.m_words.size(); i++)
+    m_words[i] &= ~other.m_words[i];
+  return *this;
+}
+
+void DeviceBitset::trim() {
+  if (m_size % 64 != 0 && !m_words.empty())
+    m_words.back() &= ((uint64_t)1 << (m_size % 64)) - 1;
+}
+
+}
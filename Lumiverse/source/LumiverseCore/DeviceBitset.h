@@ -0,0 +1,125 @@
+/*! \file DeviceBitset.h
+* \brief Fixed size bitset over dense Rig device indices.
+*/
+#ifndef _DEVICEBITSET_H_
+#define _DEVICEBITSET_H_
+
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace Lumiverse {
+  using namespace std;
+
+  /*!
+  * \brief A set of device indices stored one bit per device.
+  *
+  * Used by the selector engine to do set algebra on query results. Operations
+  * work a word at a time, so union, intersection and difference on a 25k device
+  * Rig touch a few hundred integers instead of walking pointer sets.
+  * All bitsets combined with each other must have the same size.
+  */
+  class DeviceBitset
+  {
+  public:
+    /*! \brief Creates an empty bitset with no capacity. */
+    DeviceBitset() : m_size(0) { }
+
+    /*! \brief Creates an empty bitset that can hold indices in [0, size). */
+    DeviceBitset(size_t size) : m_size(size), m_words((size + 63) / 64, 0) { }
+
+    /*! \brief Changes the capacity of the bitset. Existing bits below the new size are kept. */
+    void resize(size_t size);
+
+    /*! \brief Number of indices the bitset can hold. */
+    size_t size() const { return m_size; }
+
+    /*! \brief Adds an index to the set. */
+    void set(size_t i) { m_words[i >> 6] |= (uint64_t)1 << (i & 63); }
+
+    /*! \brief Removes an index from the set. */
+    void reset(size_t i) { m_words[i >> 6] &= ~((uint64_t)1 << (i & 63)); }
+
+    /*! \brief Returns true if the index is in the set. */
+    bool test(size_t i) const { return (m_words[i >> 6] >> (i & 63)) & 1; }
+
+    /*! \brief Adds every index in [begin, end) to the set. */
+    void setRange(size_t begin, size_t end);
+
+    /*! \brief Adds every index to the set. */
+    void setAll();
+
+    /*! \brief Removes every index from the set. */
+    void clear();
+
+    /*! \brief Replaces the set with its complement. */
+    void flip();
+
+    /*! \brief Number of indices in the set. */
+    size_t count() const;
+
+    /*! \brief Returns true if no index is set. */
+    bool none() const;
+
+    /*! \brief Union */
+    DeviceBitset& operator|=(const DeviceBitset& other);
+
+    /*! \brief Intersection */
+    DeviceBitset& operator&=(const DeviceBitset& other);
+
+    /*! \brief Difference. Removes every index in other from this set. */
+    DeviceBitset& subtract(const DeviceBitset& other);
+
+    bool operator==(const DeviceBitset& other) const { return m_size == other.m_size && m_words == other.m_words; }
+    bool operator!=(const DeviceBitset& other) const { return !(*this == other); }
+
+    /*! \brief Raw storage, 64 indices per word starting from index 0. */
+    const vector<uint64_t>& getWords() const { return m_words; }
+
+    /*! \brief Writable raw storage. Bits at or past size() must be left clear. */
+    vector<uint64_t>& getWords() { return m_words; }
+
+    /*!
+    * \brief Calls f(index) for every index in the set, in increasing order.
+    */
+    template <typename F>
+    void forEach(F f) const {
+      for (size_t w = 0; w < m_words.size(); w++) {
+        uint64_t word = m_words[w];
+        while (word != 0) {
+          f((w << 6) + lowestBit(word));
+          word &= word - 1;
+        }
+      }
+    }
+
+  private:
+    /*! \brief Index of the lowest set bit in a non-zero word. */
+    static inline size_t lowestBit(uint64_t word) {
+#ifdef _MSC_VER
+      unsigned long idx;
+      _BitScanForward64(&idx, word);
+      return idx;
+#else
+      return __builtin_ctzll(word);
+#endif
+    }
+
+    /*! \brief Clears the unused bits past m_size in the last word. */
+    void trim();
+
+    /*! \brief Number of valid bits. */
+    size_t m_size;
+
+    /*! \brief Bit storage, 64 devices per word. */
+    vector<uint64_t> m_words;
+  };
+}
+
+#endif
@@ -1,12 +1,23 @@
 #include "DeviceSet.h"
 namespace Lumiverse {
 
+size_t DeviceList::count(Device* d) const {
+  if (m_table == nullptr)
+    return 0;
+
+  auto it = m_table->m_indices.find(d);
+  return (it != m_table->m_indices.end() && m_devices.contains((uint32_t)it->second)) ? 1 : 0;
+}
+
 DeviceSet::DeviceSet(Rig* rig) : m_rig(rig) {
   // look it's empty
 }
 
 DeviceSet::DeviceSet(Rig* rig, set<Device *> devices) : m_rig(rig) {
-  m_workingSet = set<Device *>(devices);
+  sync();
+  for (auto d : devices) {
+    insertDevice(d);
+  }
 }
 
 DeviceSet::DeviceSet(Rig* rig, JSONNode node) : m_rig(rig) {
@@ -20,7 +31,9 @@ DeviceSet::DeviceSet(Rig* rig, JSONNode node) : m_rig(rig) {
 }
 
 DeviceSet::DeviceSet(const DeviceSet& dc) {
-  m_workingSet = set<Device *>(dc.m_workingSet);
+  // Storage is shared until one of the sets changes.
+  m_workingSet = dc.m_workingSet;
+  m_table = dc.m_table;
   m_rig = dc.m_rig;
 }
 
@@ -29,292 +42,12 @@ DeviceSet::~DeviceSet() {
 }
 
 DeviceSet DeviceSet::select(string selector) {
-  // First step is to split the entire string into groups.
-  vector<string> groups;
-
-  size_t lbracket = selector.find('[', 0);
-  size_t rbracket;
-
-  // If we're not starting with a bracket, that's ok just treat everything before a bracket as a group.
-  if (lbracket != 0) {
-    groups.push_back(selector.substr(0, lbracket));
-  }
-
-  while (lbracket != string::npos) {
-    rbracket = selector.find(']', lbracket);
-
-    if (rbracket == string::npos) {
-      stringstream ss;
-      ss << "Selector parse error: no matching ] for [ in " << selector << " (" << lbracket << ")";
-      Logger::log(LOG_LEVEL::ERR, ss.str());
-    }
-
-    groups.push_back(selector.substr(lbracket + 1, rbracket - lbracket - 1));
-    lbracket = selector.find('[', rbracket);
-  }
-
-  // The first selector is always an add.
-  bool filter = false;
-
-  // Group by group, add devices to the DeviceSet according to the selectors
-  for (string& s : groups) {
-    size_t start = 0;
-    size_t end = 0;
-    vector<DeviceSet> queryResults;
-
-    while (start != string::npos) {
-      // Flag indicating the end of an or section.
-      bool consolidate = true;
-
-      // Skip whitespace
-      while (s[start] == ' ' || s[start] == '\n' || s[start] == '\t') {
-        start++;
-      }
-
-      // Time to handle |
-      end = s.find(',', start);
-
-        size_t bar = s.find('|', start);
-        if (bar < end) {
-          end = bar;
-          consolidate = false;
-        }
-
-      string sel = s.substr(start, end - start);
-      DeviceSet temp = parseSelector(sel, filter);
-
-      // Consolidation step. Either wait until all the or ops have finished
-      // and then consolidate results into one set, or just replace selector result with current
-      // working set.
-      if (!consolidate) {
-        queryResults.push_back(temp);
-      }
-      else {
-        m_workingSet = set<Device*>(temp.m_workingSet);
-
-        for (auto& res : queryResults) {
-          m_workingSet.insert(res.m_workingSet.begin(), res.m_workingSet.end());
-        }
-      }
-
-      start = (end == string::npos) ? end : end + 1;
-    }
-
-    filter = true;
-  }
+  // Selectors are parsed once per Rig and run against the Rig's indexes.
+  m_rig->runSelector(*m_rig->compileSelector(selector), m_table, m_workingSet);
 
   return *this;
 }
 
-DeviceSet DeviceSet::parseSelector(string selector, bool filter) {
-  char type;
-  // first check for !
-  type = (selector[0] == '!') ? selector[1] : selector[0];
-
-  // First check for #, @ or $
-  switch (type) {
-    // Channel selector
-    case '#':
-      return parseChannelSelector(selector, filter);
-      break;
-    // Parameter selector
-    case '@':
-      return parseParameterSelector(selector, filter);
-      break;
-    // Metadata seletor
-    case '$': 
-      return parseMetadataSelector(selector, filter);
-    case '*':
-    {
-      // special add everything selector.
-      DeviceSet a(*this);
-      for (const auto& d : m_rig->getDeviceRaw()) {
-        a = (filter) ? a.remove(d) : a.add(d);
-      }
-      return a;
-    }
-    // Everything else is an ID
-    default:
-      return (filter) ? remove(m_rig->m_devicesById[selector]) : add(m_rig->m_devicesById[selector]);
-  }
-}
-
-DeviceSet DeviceSet::parseMetadataSelector(string selector, bool filter) {
-  regex metadataRegex("(!\?)\\$([\\w\\d\\-]+)([\\!\\*~\\$\\^]?[=])(.+)");
-  smatch matches;
-  regex_match(selector, matches, metadataRegex);
-
-  // Matches size is 5 since entire string is the first match
-  if (matches.size() != 5) {
-    stringstream ss;
-    ss << "Selector parse error: invalid metadata selector format: " << selector;
-    Logger::log(LOG_LEVEL::ERR, ss.str());
-  }
-
-  string invert = matches[1];
-  bool eq = (invert.size() > 0) ? false : true;
-
-  string metadataKey = matches[2];
-  string op = matches[3];
-  string arg = matches[4];
-  regex testArg;
-
-  switch (op[0]) {
-    // Contains
-    case '*':
-      testArg = regex(".*" + arg + ".*");
-      break;
-    // Ends with
-    case '$':
-      testArg = regex(".*" + arg + "$");
-      break;
-    // Starts with
-    case '^':
-      testArg = regex("^" + arg + ".*");
-      break;
-    // Not equal to
-    case '!':
-      eq = !eq;
-      testArg = regex(arg);
-      break;
-    // Exactly equal to
-    case '=':
-      // Anything else is same as =
-    default:
-      testArg = regex("^" + arg + "$");
-      break;
-  }
-
-  return (filter) ? remove(metadataKey, testArg, !eq) : add(metadataKey, testArg, eq);
-}
-
-DeviceSet DeviceSet::parseChannelSelector(string selector, bool filter) {
-  regex metadataRegex("(!\?)#(\\d+)-\?(\\d*)");
-  smatch matches;
-  regex_match(selector, matches, metadataRegex);
-
-  // Matches size is 4 since entire string is the first match
-  if (matches.size() != 4) {
-    stringstream ss;
-    ss << "Selector parse error: invalid channel selector format: " << selector;
-    Logger::log(LOG_LEVEL::ERR, ss.str());
-  }
-
-  string invert = matches[1];
-  bool eq = (invert.size() > 0) ? false : true;
-
-  unsigned int first, second;
-  stringstream(matches[2]) >> first;
-
-  string secondStr = matches[3];
-  if (secondStr.size() > 0) {
-    stringstream(matches[3]) >> second;
-
-    if (first > second) {
-      // Flip channel ranges if the first value is greater than the second value
-      unsigned int tmp = first;
-      first = second;
-      second = tmp;
-    }
-  }
-
-  // Non-inverted range
-  if (eq) {
-    if (secondStr.size() == 0) {
-      return (filter) ? this->remove(first) : this->add(first);
-    }
-    else {
-      return (filter) ? this->remove(first, second) : this->add(first, second);
-    }
-  }
-  // Inverted range
-  else {
-    if (secondStr.size() == 0) {
-      unsigned int lowerEnd = first - 1;
-      unsigned int upperStart = first + 1;
-      unsigned int maxChan = m_rig->m_devicesByChannel.rbegin()->first;
-
-      return (filter) ? this->remove(0, lowerEnd).remove(upperStart, maxChan) : this->add(0, lowerEnd).add(upperStart, maxChan);
-    }
-    else
-    {
-      unsigned int lowerEnd = first - 1;
-      unsigned int upperStart = second + 1;
-      unsigned int maxChan = m_rig->m_devicesByChannel.rbegin()->first;
-
-      return (filter) ? this->remove(0, lowerEnd).remove(upperStart, maxChan) : this->add(0, lowerEnd).add(upperStart, maxChan);
-    }
-  }
-}
-
-DeviceSet DeviceSet::parseParameterSelector(string selector, bool filter) {
-  // Paramters are special in that we need to know the type of parameter we're filtering
-  // before we can construct the actual query in C++
-
-  // Supported Types: LumiverseFloat
-  regex paramRegex("(!\?)@(\\w+)([><!]\?[><=])(\\d*\\.\?\\d*)([f])");
-  smatch matches;
-  regex_match(selector, matches, paramRegex);
-  
-  // Matches size is 6 since entire string is the first match
-  if (matches.size() != 6) {
-    stringstream ss;
-    ss << "Selector parse error: invalid parameter selector format: " << selector;
-    Logger::log(LOG_LEVEL::ERR, ss.str());
-  }
-
-  string type = matches[5];
-  string invert = matches[1];
-  bool eq = (invert.size() > 0) ? false : true;
-
-  switch (type[0]) {
-    // LumiverseFloat
-    case 'f':
-      float val;
-      stringstream(matches[4]) >> val;
-      return parseFloatParameter(matches[2], matches[3], val, filter, eq);
-    // Error
-    default:
-      stringstream ss;
-      ss << "Selector parse error: invalid parameter selector type: " << type << " in " << selector;
-      Logger::log(LOG_LEVEL::ERR, ss.str());
-      return DeviceSet(*this);
-  }
-}
-
-DeviceSet DeviceSet::parseFloatParameter(string param, string op, float val, bool filter, bool eq) {
-  LumiverseFloat oVal(val);
-  LumiverseType* gVal = (LumiverseType *)(&oVal);
-
-  // There is some serious boxing and unboxing here to make this thing work with multiple types.
-  // Not sure if worth.
-  if (op == "<") {
-    function<bool(LumiverseType* a, LumiverseType* b)> ltFunc = [](LumiverseType* a, LumiverseType* b){ return (*(LumiverseFloat *)a) < (*(LumiverseFloat *)b); };
-    return (filter) ? remove(param, gVal, ltFunc, eq) : add(param, gVal, ltFunc, eq);
-  }
-  if (op == ">") {
-    function<bool(LumiverseType* a, LumiverseType* b)> gtFunc = [](LumiverseType* a, LumiverseType* b){ return (*(LumiverseFloat *)a) > (*(LumiverseFloat *)b); };
-    return (filter) ? remove(param, gVal, gtFunc, eq) : add(param, gVal, gtFunc, eq);
-  }
-  if (op == "<=") {
-    function<bool(LumiverseType* a, LumiverseType* b)> leqFunc = [](LumiverseType* a, LumiverseType* b){ return (*(LumiverseFloat *)a) <= (*(LumiverseFloat *)b); };
-    return (filter) ? remove(param, gVal, leqFunc, eq) : add(param, gVal, leqFunc, eq);
-  }
-  if (op == ">=") {
-    function<bool(LumiverseType* a, LumiverseType* b)> geqFunc = [](LumiverseType* a, LumiverseType* b){ return (*(LumiverseFloat *)a) >= (*(LumiverseFloat *)b); };
-    return (filter) ? remove(param, gVal, geqFunc, eq) : add(param, gVal, geqFunc, eq);
-  }
-  if (op == "!=") {
-    function<bool(LumiverseType* a, LumiverseType* b)> neqFunc = [](LumiverseType* a, LumiverseType* b){ return (*(LumiverseFloat *)a) != (*(LumiverseFloat *)b); };
-    return (filter) ? remove(param, gVal, neqFunc, eq) : add(param, gVal, neqFunc, eq);
-  }
-  // Defaults to =
-  else {
-    function<bool(LumiverseType* a, LumiverseType* b)> eqFunc = [](LumiverseType* a, LumiverseType* b){ return (*(LumiverseFloat *)a) == (*(LumiverseFloat *)b); };
-    return (filter) ? remove(param, gVal, eqFunc, eq) : add(param, gVal, eqFunc, eq);
-  }
-}
-
 DeviceSet DeviceSet::add(Device* device) {
   DeviceSet newSet(*this);
   newSet.addDevice(device);
@@ -330,25 +63,12 @@ DeviceSet DeviceSet::add(string query) {
 }
 
 DeviceSet DeviceSet::add(unsigned int channel) {
-  DeviceSet newSet(*this);
-
-  auto range = m_rig->m_devicesByChannel.equal_range(channel);
-  for (auto it = range.first; it != range.second; it++) {
-    newSet.addDevice(it->second);
-  }
-
-  return newSet;
+  return add(channel, channel);
 }
 
 DeviceSet DeviceSet::add(unsigned int lower, unsigned int upper) {
   DeviceSet newSet(*this);
-  
-  for (unsigned int i = lower; i <= upper; i++) {
-    auto range = m_rig->m_devicesByChannel.equal_range(i);
-    for (auto it = range.first; it != range.second; it++) {
-      newSet.addDevice(it->second);
-    }
-  }
+  newSet.m_workingSet |= newSet.channelIndices(lower, upper);
 
   return newSet;
 }
@@ -359,12 +79,13 @@ DeviceSet DeviceSet::add(string key, string val, bool isEqual) {
 
 DeviceSet DeviceSet::add(string key, regex val, bool isEqual) {
   DeviceSet newSet(*this);
+  newSet.sync();
 
   for (auto& d : m_rig->m_devices) {
     string data;
     if (d->getMetadata(key, data)) {
       if (regex_match(data, val) == isEqual) {
-        newSet.addDevice(d);
+        newSet.insertDevice(d);
       }
     }
   }
@@ -374,12 +95,13 @@ DeviceSet DeviceSet::add(string key, regex val, bool isEqual) {
 
 DeviceSet DeviceSet::add(string key, LumiverseType* val, function<bool(LumiverseType* a, LumiverseType* b)> cmp, bool isEqual) {
   DeviceSet newSet(*this);
+  newSet.sync();
 
   for (auto& d : m_rig->m_devices) {
     LumiverseType* data = d->getParam(key);
     if (data != nullptr) {
       if (cmp(data, val) == isEqual) {
-        newSet.addDevice(d);
+        newSet.insertDevice(d);
       }
     }
   }
@@ -409,25 +131,12 @@ DeviceSet DeviceSet::remove(string query) {
 }
 
 DeviceSet DeviceSet::remove(unsigned int channel) {
-  DeviceSet newSet(*this);
-
-  auto range = m_rig->m_devicesByChannel.equal_range(channel);
-  for (auto it = range.first; it != range.second; it++) {
-    newSet.removeDevice(it->second);
-  }
-
-  return newSet;
+  return remove(channel, channel);
 }
 
 DeviceSet DeviceSet::remove(unsigned int lower, unsigned int upper) {
   DeviceSet newSet(*this);
-
-  for (unsigned int i = lower; i <= upper; i++) {
-    auto range = m_rig->m_devicesByChannel.equal_range(i);
-    for (auto it = range.first; it != range.second; it++) {
-      newSet.removeDevice(it->second);
-    }
-  }
+  newSet.m_workingSet.subtract(newSet.channelIndices(lower, upper));
 
   return newSet;
 }
@@ -439,7 +148,7 @@ DeviceSet DeviceSet::remove(string key, string val, bool isEqual) {
 DeviceSet DeviceSet::remove(string key, regex val, bool isEqual) {
   DeviceSet newSet(*this);
 
-  for (auto& d : m_workingSet) {
+  for (auto& d : getDeviceList()) {
     string data;
     if (d->getMetadata(key, data)) {
       if (regex_match(data, val) == isEqual) {
@@ -458,7 +167,7 @@ DeviceSet DeviceSet::remove(string key, regex val, bool isEqual) {
 DeviceSet DeviceSet::remove(string key, LumiverseType* val, function<bool(LumiverseType* a, LumiverseType* b)> cmp, bool isEqual) {
   DeviceSet newSet(*this);
 
-  for (auto& d : m_workingSet) {
+  for (auto& d : getDeviceList()) {
     LumiverseType* data = d->getParam(key);
     if (data != nullptr) {
       if (cmp(data, val) == isEqual) {
@@ -483,33 +192,118 @@ DeviceSet DeviceSet::remove(DeviceSet set) {
 }
 
 void DeviceSet::reset() {
-  for (auto& d : m_workingSet) {
+  for (auto& d : getDeviceList()) {
     d->reset();
   }
 }
 
 void DeviceSet::addDevice(Device* device) {
   if (device != nullptr) {
-    m_workingSet.insert(device);
+    sync();
+    insertDevice(device);
   }
 }
 
+void DeviceSet::insertDevice(Device* device) {
+  if (device == nullptr)
+    return;
+
+  if (m_table != nullptr) {
+    auto it = m_table->m_indices.find(device);
+    if (it != m_table->m_indices.end()) {
+      m_workingSet.add((uint32_t)it->second);
+      return;
+    }
+  }
+
+  // Not a Rig device. Give it an index in a private copy of the table. A private table
+  // nothing else holds on to can be extended in place.
+  if (m_table != nullptr && m_table.use_count() == 1 && (m_table->m_base != nullptr || m_rig == nullptr)) {
+    m_workingSet.add((uint32_t)m_table->m_devices.size());
+    const_cast<DeviceTable*>(m_table.get())->append(device);
+    return;
+  }
+
+  shared_ptr<DeviceTable> extended((m_table != nullptr) ? new DeviceTable(*m_table) : new DeviceTable());
+  if (extended->m_base == nullptr && m_rig != nullptr)
+    extended->m_base = m_table;
+
+  m_workingSet.add((uint32_t)extended->m_devices.size());
+  extended->append(device);
+  m_table = extended;
+}
+
+const set<Device *>& DeviceSet::getDevices() {
+  if (m_devicesTable != m_table || !(m_devicesBitmap == m_workingSet)) {
+    m_devices = getDeviceList();
+    m_devicesTable = m_table;
+    m_devicesBitmap = m_workingSet;
+  }
+
+  return m_devices;
+}
+
 void DeviceSet::removeDevice(Device* device) {
-  m_workingSet.erase(device);
+  if (m_table == nullptr)
+    return;
+
+  auto it = m_table->m_indices.find(device);
+  if (it != m_table->m_indices.end())
+    m_workingSet.remove((uint32_t)it->second);
 }
 
 void DeviceSet::addSet(DeviceSet otherSet) {
-  m_workingSet.insert(otherSet.m_workingSet.begin(), otherSet.m_workingSet.end());
+  sync();
+  otherSet.sync();
+
+  if (m_table == otherSet.m_table) {
+    m_workingSet |= otherSet.m_workingSet;
+  }
+  else {
+    for (auto d : otherSet.getDeviceList())
+      insertDevice(d);
+  }
 }
 
 void DeviceSet::removeSet(DeviceSet otherSet) {
-  for (auto& d : otherSet.m_workingSet) {
-    removeDevice(d);
+  sync();
+  otherSet.sync();
+
+  if (m_table == otherSet.m_table) {
+    m_workingSet.subtract(otherSet.m_workingSet);
+  }
+  else {
+    for (auto d : otherSet.getDeviceList())
+      removeDevice(d);
   }
 }
 
+void DeviceSet::sync() {
+  if (m_rig != nullptr)
+    DeviceTable::remap(m_table, m_workingSet, m_rig->getDeviceTable());
+}
+
+DeviceBitmap DeviceSet::channelIndices(unsigned int lower, unsigned int upper) {
+  DeviceBitmap indices;
+  sync();
+
+  if (m_table == nullptr)
+    return indices;
+
+  // Rig devices are in channel order, so the channel range is an index range.
+  auto begin = m_table->m_channels.begin();
+  auto end = begin + m_table->m_rigDevices;
+  size_t first = lower_bound(begin, end, lower) - begin;
+  size_t last = upper_bound(begin, end, upper) - begin;
+
+  for (size_t i = first; i < last; i++)
+    indices.add((uint32_t)i);
+
+  return indices;
+}
+
 void DeviceSet::setParam(string param, float val) {
-  for (auto& d : m_workingSet) {
+  for (auto& d : getDeviceList()) {
     if (d->paramExists(param)) {
       d->setParam(param, val);
     }
@@ -517,7 +311,7 @@ void DeviceSet::setParam(string param, float val) {
 }
 
 void DeviceSet::setParam(string param, string val, float val2) {
-  for (auto& d : m_workingSet) {
+  for (auto& d : getDeviceList()) {
     if (d->paramExists(param)) {
       d->setParam(param, val, val2);
     }
@@ -525,7 +319,7 @@ void DeviceSet::setParam(string param, string val, float val2) {
 }
 
 void DeviceSet::setParam(string param, string val, float val2, LumiverseEnum::Mode mode, LumiverseEnum::InterpolationMode interpMode) {
-  for (auto& d : m_workingSet) {
+  for (auto& d : getDeviceList()) {
     if (d->paramExists(param)) {
       d->setParam(param, val, val2, mode, interpMode);
     }
@@ -533,7 +327,7 @@ void DeviceSet::setParam(string param, string val, float val2, LumiverseEnum::Mo
 }
 
 void DeviceSet::setParam(string param, string channel, double val) {
-  for (auto& d : m_workingSet) {
+  for (auto& d : getDeviceList()) {
     if (d->paramExists(param)) {
       d->setParam(param, channel, val);
     }
@@ -541,7 +335,7 @@ void DeviceSet::setParam(string param, string channel, double val) {
 }
 
 void DeviceSet::setParam(string param, double x, double y, double weight) {
-  for (auto& d : m_workingSet) {
+  for (auto& d : getDeviceList()) {
     if (d->paramExists(param)) {
       d->setParam(param, x, y, weight);
     }
@@ -549,7 +343,7 @@ void DeviceSet::setParam(string param, double x, double y, double weight) {
 }
 
 void DeviceSet::setColorRGBRaw(string param, double r, double g, double b, double weight) {
-  for (auto& d : m_workingSet) {
+  for (auto& d : getDeviceList()) {
     if (d->paramExists(param)) {
       d->setColorRGBRaw(param, r, g, b, weight);
     }
@@ -557,13 +351,13 @@ void DeviceSet::setColorRGBRaw(string param, double r, double g, double b, doubl
 }
 
 void DeviceSet::setRGBRaw(double r, double g, double b, double weight) {
-  for (auto& d : m_workingSet) {
+  for (auto& d : getDeviceList()) {
     d->setColorRGBRaw("color", r, g, b, weight);
   }
 }
 
 void DeviceSet::setColorRGB(string param, double r, double g, double b, double weight, RGBColorSpace cs) {
-  for (auto& d : m_workingSet) {
+  for (auto& d : getDeviceList()) {
     if (d->paramExists(param)) {
       d->setColorRGB(param, r, g, b, weight, cs);
     }
@@ -572,20 +366,20 @@ void DeviceSet::setColorRGB(string param, double r, double g, double b, double w
 
 void DeviceSet::setColorHSV(string param, double H, double S, double V, double weight)
 {
-  for (auto &d : m_workingSet) {
+  for (auto &d : getDeviceList()) {
     d->setColorHSV(param, H, S, V, weight);
   }
 }
 
 void DeviceSet::setColorWeight(string param, double weight)
 {
-  for (auto &d : m_workingSet) {
+  for (auto &d : getDeviceList()) {
     d->setColorWeight(param, weight);
   }
 }
 
 void DeviceSet::setMetadata(string key, string val) {
-  for (auto &d : m_workingSet) {
+  for (auto &d : getDeviceList()) {
     d->setMetadata(key, val);
   }
 }
@@ -593,7 +387,7 @@ void DeviceSet::setMetadata(string key, string val) {
 vector<string> DeviceSet::getIds() {
   vector<string> ids;
   
-  for (auto& d : m_workingSet) {
+  for (auto& d : getDeviceList()) {
     ids.push_back(d->getId());
   }
 
@@ -603,7 +397,7 @@ vector<string> DeviceSet::getIds() {
 set<string> DeviceSet::getAllParams() {
   set<string> params;
 
-  for (auto& d : m_workingSet) {
+  for (auto& d : getDeviceList()) {
     for (auto& s : d->getParamNames()) {
       params.insert(s);
     }
@@ -615,7 +409,7 @@ set<string> DeviceSet::getAllParams() {
 set<string> DeviceSet::getAllMetadata() {
   set<string> params;
 
-  for (auto& d : m_workingSet) {
+  for (auto& d : getDeviceList()) {
     for (auto& s : d->getMetadataKeyNames()) {
       params.insert(s);
     }
@@ -627,7 +421,7 @@ set<string> DeviceSet::getAllMetadata() {
 set<string> DeviceSet::getAllMetadataForKey(string key) {
   set<string> vals;
 
-  for (auto& d : m_workingSet) {
+  for (auto& d : getDeviceList()) {
     string val;
     if (d->getMetadata(key, val)) {
       vals.insert(val);
@@ -644,7 +438,7 @@ string DeviceSet::info() {
   ss << "IDs: ";
 
   bool first = true;
-  for (auto& d : m_workingSet) {
+  for (auto& d : getDeviceList()) {
     ss << ((first) ? "" : ", ") << d->getId();
     first = false;
   }
@@ -657,7 +451,7 @@ bool DeviceSet::hasSameIds(DeviceSet& devices) {
     return false;
 
   auto ids = devices.getIds();
-  for (auto d : m_workingSet) {
+  for (auto d : getDeviceList()) {
     if (find(ids.begin(), ids.end(), d->getId()) == ids.end())
       return false;
   }
@@ -669,8 +463,11 @@ bool DeviceSet::hasSameDevices(DeviceSet& devices) {
   if (devices.size() != size())
     return false;
 
-  for (auto d : m_workingSet) {
-    if (devices.m_workingSet.count(d) == 0)
+  if (m_table == devices.m_table)
+    return m_workingSet == devices.m_workingSet;
+
+  for (auto d : getDeviceList()) {
+    if (!devices.contains(d))
       return false;
   }
 
@@ -678,11 +475,15 @@ bool DeviceSet::hasSameDevices(DeviceSet& devices) {
 }
 
 bool DeviceSet::contains(Device* d) {
-  return m_workingSet.count(d) > 0;
+  if (m_table == nullptr)
+    return false;
+
+  auto it = m_table->m_indices.find(d);
+  return it != m_table->m_indices.end() && m_workingSet.contains((uint32_t)it->second);
 }
 
 bool DeviceSet::contains(string id) {
-  for (const auto& d : m_workingSet) {
+  for (const auto& d : getDeviceList()) {
     if (d->getId() == id)
       return true;
   }
@@ -694,7 +495,7 @@ JSONNode DeviceSet::toJSON(string name) {
   JSONNode arr;
   arr.set_name(name);
 
-  for (const auto& d : m_workingSet) {
+  for (const auto& d : getDeviceList()) {
     JSONNode newNode(d->getId(), d->getId());
     arr.push_back(newNode);
   }
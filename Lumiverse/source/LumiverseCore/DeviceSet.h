@@ -13,12 +13,80 @@
 
 #include "Logger.h"
 #include "Device.h"
+#include "SelectorQuery.h"
 #include "Rig.h"
 
 namespace Lumiverse {
   class Rig;
   class LumiverseType;
 
+  /*!
+  * \brief Read-only list of the Devices in a DeviceSet.
+  *
+  * Returned by DeviceSet::getDeviceList(). Iterates in channel order without
+  * building a `set<Device*>`, so it's the cheaper choice for loops over a set.
+  * Copies are cheap and stay valid after the DeviceSet they came from changes.
+  */
+  class DeviceList
+  {
+  public:
+#ifndef SWIG
+    /*! \brief Iterates over Device pointers in channel order. */
+    class const_iterator {
+    public:
+      typedef forward_iterator_tag iterator_category;
+      typedef Device* value_type;
+      typedef ptrdiff_t difference_type;
+      typedef Device* const* pointer;
+      typedef Device* const& reference;
+
+      const_iterator() : m_table(nullptr), m_current(nullptr) { }
+      const_iterator(const DeviceTable* table, DeviceBitmap::const_iterator it, DeviceBitmap::const_iterator end) :
+        m_table(table), m_it(it), m_end(end), m_current(nullptr) { load(); }
+
+      reference operator*() const { return m_current; }
+      pointer operator->() const { return &m_current; }
+      const_iterator& operator++() { ++m_it; load(); return *this; }
+      const_iterator operator++(int) { const_iterator old(*this); ++(*this); return old; }
+      bool operator==(const const_iterator& other) const { return m_it == other.m_it; }
+      bool operator!=(const const_iterator& other) const { return m_it != other.m_it; }
+
+    private:
+      void load() { m_current = (m_it != m_end) ? m_table->m_devices[*m_it] : nullptr; }
+
+      const DeviceTable* m_table;
+      DeviceBitmap::const_iterator m_it;
+      DeviceBitmap::const_iterator m_end;
+      Device* m_current;
+    };
+
+    typedef const_iterator iterator;
+
+    const_iterator begin() const { return const_iterator(m_table.get(), m_devices.begin(), m_devices.end()); }
+    const_iterator end() const { return const_iterator(m_table.get(), m_devices.end(), m_devices.end()); }
+
+    /*! \brief Copies the devices into a set. */
+    operator set<Device*>() const { return set<Device*>(begin(), end()); }
+
+    DeviceList(shared_ptr<const DeviceTable> table, DeviceBitmap devices) : m_table(table), m_devices(devices) { }
+#endif
+
+    DeviceList() { }
+
+    /*! \brief Number of devices in the list. */
+    size_t size() const { return m_devices.size(); }
+
+    /*! \brief Returns true if the list is empty. */
+    bool empty() const { return m_devices.empty(); }
+
+    /*! \brief Returns 1 if the device is in the list, 0 otherwise. Same as set<Device*>::count. */
+    size_t count(Device* d) const;
+
+  private:
+    shared_ptr<const DeviceTable> m_table;
+    DeviceBitmap m_devices;
+  };
+
   /*!
   * \brief A DeviceSet is a set of devices.
   *
@@ -49,7 +117,7 @@ namespace Lumiverse {
     * it can store an arbitrary list of deivces.
     * \sa DeviceSet(Rig*), DeviceSet(const DeviceSet&)
     */
-    DeviceSet() { };
+    DeviceSet() : m_rig(nullptr) { };
 
     /*!
     * \brief Constructs an empty set
@@ -108,80 +176,6 @@ namespace Lumiverse {
     */
     DeviceSet select(string selector);
 
-  private:
-    // Grouped here for convenience
-    
-    /*!
-    * \brief Parses a single selector.
-    *
-    * Redirects to appropriate functions. See implementation for details.
-    * Boolean flag determines if selected Devices are added or subtracted from
-    * the current DeviceSet.
-    * \param selector Query string
-    * \param filter If true, indicates that devices will be filtered out of the current device set
-    * based on the result of the selector. If false, devices will be added based on the selector result.
-    * \return DeviceSet containing the result of applying the selector to the current set.
-    * \sa parseMetadataSelector(string, bool), parseChannelSelector(string, bool), parseParameterSelector(string, bool),
-    * parseFloatParameter(string, string, float, bool, bool)
-    */
-    DeviceSet parseSelector(string selector, bool filter);
-
-    /*!
-    * \brief Processes a metadata selector
-    * 
-    * Helper for parseSelector.
-    * \param selector Query string
-    * \param filter If true, indicates that devices will be filtered out of the current device set
-    * based on the result of the selector. If false, devices will be added based on the selector result.
-    * \return DeviceSet containing the result of applying the metadata selector to the current set.
-    * \sa parseSelector(string, bool)
-    */
-    DeviceSet parseMetadataSelector(string selector, bool filter);
-
-    /*!
-    * \brief Processes a channel selector
-    *
-    * Helper for parseSelector.
-    * \param selector Query string
-    * \param filter If true, indicates that devices will be filtered out of the current device set
-    * based on the result of the selector. If false, devices will be added based on the selector result.
-    * \return DeviceSet containing the result of applying the channel selector to the current set.
-    * \sa parseSelector(string, bool)
-    */
-    DeviceSet parseChannelSelector(string selector, bool filter);
-
-    /*!
-    * \brief Processes a parameter selector
-    *
-    * Helper for parseSelector. This part of the query is a bit difficult to parse
-    * due to LumiverseType objects actually being different types (enum, float, etc.).
-    * \param selector Query string
-    * \param filter If true, indicates that devices will be filtered out of the current device set
-    * based on the result of the selector. If false, devices will be added based on the selector result.
-    * \return DeviceSet containing the result of applying the parameter selector to the current set.
-    * \sa parseSelector(string, bool), parseFloatParameter(string, string, float, bool, bool)
-    */
-    DeviceSet parseParameterSelector(string selector, bool filter);
-
-    /*!
-    * \brief Processes a float parameter selector
-    *
-    * Helper for parseParameterSelector.
-    * \param param Parameter name
-    * \param op Equality operation. One of "<", "<=", ">", ">=, "!=". Defaults to "==" if nothing specified
-    * or if invalid option is specified.
-    * \param val The value we're testing against
-    * \param filter If true, indicates that devices will be filtered out of the current device set
-    * based on the result of the selector. If false, devices will be added based on the selector result.
-    * \param eq If set to false, this function will add everything that does not satisfy the selector.
-    * It essentially inverts the query. For example, if you have `@intensity < .50` as the query with `eq = false`,
-    * the returned set will contain `@intensity >= .5`. This parameter is intended for internal use only.
-    * \return DeviceSet containing the result of applying the channel selector to the current set.
-    * \sa parseParameterSelector(string, bool)
-    */
-    DeviceSet parseFloatParameter(string param, string op, float val, bool filter, bool eq);
-
-  public:
     /*!
     * \brief Adds a Device to the set.
     * \param device Pointer to the Device to add.
@@ -468,9 +462,18 @@ namespace Lumiverse {
     /*!
     * \brief Gets the devices managed by this set.
     * 
+    * The set is cached and only rebuilt after the DeviceSet changes.
     * \return Set of Device* contained by the DeviceSet
+    * \sa getDeviceList()
+    */
+    const set<Device *>& getDevices();
+
+    /*!
+    * \brief Gets the devices managed by this set without copying them into a set.
+    *
+    * \return List of Device* contained by the DeviceSet, in channel order.
     */
-    inline const set<Device *>& getDevices() { return m_workingSet; }
+    inline DeviceList getDeviceList() { return DeviceList(m_table, m_workingSet); }
 
     /*!
     * \brief Gets a copy of the list of the IDs contained by this DeviceSet
@@ -591,9 +594,43 @@ namespace Lumiverse {
     void removeSet(DeviceSet otherSet);
 
     /*!
-    * \brief Set of devices currently contained in the Deviceset
+    * \brief Moves the set onto the Rig's current device table if devices were added or removed.
+    */
+    void sync();
+
+    /*!
+    * \brief Adds a device without syncing first. Used by loops that sync once up front.
+    */
+    void insertDevice(Device* device);
+
+    /*!
+    * \brief Returns the indices of the Rig devices with channels in [lower, upper].
+    */
+    DeviceBitmap channelIndices(unsigned int lower, unsigned int upper);
+
+    /*!
+    * \brief Indices of the devices currently contained in the DeviceSet
+    *
+    * Indices refer to m_table.
+    */
+    DeviceBitmap m_workingSet;
+
+    /*!
+    * \brief Maps m_workingSet indices to Devices.
+    *
+    * Usually the Rig's device table. Shared between all sets made from the same Rig
+    * until the Rig's devices change.
+    */
+    shared_ptr<const DeviceTable> m_table;
+
+    /*!
+    * \brief Devices returned by getDevices().
+    *
+    * Valid while m_table and m_workingSet match m_devicesTable and m_devicesBitmap.
     */
-    set<Device *> m_workingSet;
+    set<Device *> m_devices;
+    shared_ptr<const DeviceTable> m_devicesTable;
+    DeviceBitmap m_devicesBitmap;
 
     /*!
     * \brief Pointer to the rig for accessing indexes and devices
@@ -1,17 +1,38 @@
 #include "DynamicDeviceSet.h"
 namespace Lumiverse {
 
-DynamicDeviceSet::DynamicDeviceSet(Rig* rig, string query) : m_rig(rig), m_query(query) {
-  // look it's empty
+DynamicDeviceSet::DynamicDeviceSet(Rig* rig, string query) : m_query(query), m_rig(rig) {
+  invalidate();
 }
 
 DynamicDeviceSet::DynamicDeviceSet(Rig* rig, JSONNode data) : m_rig(rig) {
   m_query = data.as_string();
+  invalidate();
 }
 
 DynamicDeviceSet::DynamicDeviceSet(const DynamicDeviceSet& dc) {
+  lock_guard<mutex> lock(dc.m_cacheLock);
   m_rig = dc.m_rig;
   m_query = dc.m_query;
+  invalidate();
+}
+
+void DynamicDeviceSet::operator=(const DynamicDeviceSet& dc) {
+  if (this == &dc)
+    return;
+
+  Rig* rig;
+  string query;
+  {
+    lock_guard<mutex> lock(dc.m_cacheLock);
+    rig = dc.m_rig;
+    query = dc.m_query;
+  }
+
+  lock_guard<mutex> lock(m_cacheLock);
+  m_rig = rig;
+  m_query = query;
+  invalidate();
 }
 
 DynamicDeviceSet::~DynamicDeviceSet() {
@@ -19,66 +40,104 @@ DynamicDeviceSet::~DynamicDeviceSet() {
 }
 
 DeviceSet DynamicDeviceSet::getDeviceSet() {
-  return m_rig->select(m_query);
+  return *resolve();
+}
+
+void DynamicDeviceSet::invalidate() {
+  m_cacheValid = false;
+  m_usesMetadata = m_query.find('$') != string::npos;
+  m_usesParams = m_query.find('@') != string::npos;
+}
+
+shared_ptr<DeviceSet> DynamicDeviceSet::resolve() {
+  // The rig thread and UI threads can both resolve the same set. Callers get their own
+  // reference to the result, so replacing the cache doesn't change a set in use.
+  lock_guard<mutex> lock(m_cacheLock);
+
+  if (m_rig == nullptr) {
+    if (!m_cacheValid) {
+      m_cache = make_shared<DeviceSet>(nullptr);
+      m_cacheValid = true;
+    }
+    return m_cache;
+  }
+
+  if (m_cacheValid &&
+      m_deviceGen == m_rig->getDeviceGeneration() &&
+      (!m_usesMetadata || m_metadataGen == m_rig->getMetadataGeneration()) &&
+      (!m_usesParams || m_paramGen == m_rig->getParameterGeneration())) {
+    return m_cache;
+  }
+
+  // Grab the counters before selecting so changes made during the select
+  // cause another update next time.
+  m_deviceGen = m_rig->getDeviceGeneration();
+  m_metadataGen = m_rig->getMetadataGeneration();
+  m_paramGen = m_rig->getParameterGeneration();
+
+  m_cache = make_shared<DeviceSet>(m_rig->select(m_query));
+  m_cacheValid = true;
+
+  return m_cache;
 }
 
 void DynamicDeviceSet::reset() {
-  getDeviceSet().reset();
+  resolve()->reset();
 }
 
 void DynamicDeviceSet::setParam(string param, float val) {
-  getDeviceSet().setParam(param, val);
+  resolve()->setParam(param, val);
 }
 
 void DynamicDeviceSet::setParam(string param, string val, float val2) {
-  getDeviceSet().setParam(param, val, val2);
+  resolve()->setParam(param, val, val2);
 }
 
 void DynamicDeviceSet::setParam(string param, string val, float val2, LumiverseEnum::Mode mode, LumiverseEnum::InterpolationMode interpMode) {
-  getDeviceSet().setParam(param, val, val2, mode, interpMode);
+  resolve()->setParam(param, val, val2, mode, interpMode);
 }
 
 void DynamicDeviceSet::setParam(string param, string channel, double val) {
-  getDeviceSet().setParam(param, channel, val);
+  resolve()->setParam(param, channel, val);
 }
 
 void DynamicDeviceSet::setParam(string param, double x, double y, double weight) {
-  getDeviceSet().setParam(param, x, y, weight);
+  resolve()->setParam(param, x, y, weight);
 }
 
 void DynamicDeviceSet::setColorRGBRaw(string param, double r, double g, double b, double weight) {
-  getDeviceSet().setColorRGBRaw(param, r, g, b, weight);
+  resolve()->setColorRGBRaw(param, r, g, b, weight);
 }
 
 void DynamicDeviceSet::setColorRGB(string param, double r, double g, double b, double weight, RGBColorSpace cs) {
-  getDeviceSet().setColorRGB(param, r, g, b, weight, cs);
+  resolve()->setColorRGB(param, r, g, b, weight, cs);
 }
 
 vector<string> DynamicDeviceSet::getIds() {
-  return getDeviceSet().getIds();
+  return resolve()->getIds();
 }
 
 set<string> DynamicDeviceSet::getAllParams() {
-  return getDeviceSet().getAllParams();
+  return resolve()->getAllParams();
 }
 
 set<string> DynamicDeviceSet::getAllMetadata() {
-  return getDeviceSet().getAllMetadata();
+  return resolve()->getAllMetadata();
 }
 
 set<string> DynamicDeviceSet::getAllMetadataForKey(string key) {
-  return getDeviceSet().getAllMetadataForKey(key);
+  return resolve()->getAllMetadataForKey(key);
 }
 
 string DynamicDeviceSet::info() {
   stringstream ss;
 
   ss << "Device set contains " << size() << " devices.\n";
-  ss << "Query string: " << m_query << "\n";
+  ss << "Query string: " << getQuery() << "\n";
   ss << "IDs: ";
 
   bool first = true;
-  for (auto& id : getDeviceSet().getIds()) {
+  for (auto& id : resolve()->getIds()) {
     ss << ((first) ? "" : ", ") << id;
     first = false;
   }
@@ -87,40 +146,42 @@ string DynamicDeviceSet::info() {
 }
 
 bool DynamicDeviceSet::hasSameIds(DynamicDeviceSet& devices) {
-  DeviceSet other = devices.getDeviceSet();
-  return getDeviceSet().hasSameIds(other);
+  return resolve()->hasSameIds(*devices.resolve());
 }
 
 bool DynamicDeviceSet::hasSameDevices(DynamicDeviceSet& devices) {
-  DeviceSet other = devices.getDeviceSet();
-  return getDeviceSet().hasSameDevices(other);
+  return resolve()->hasSameDevices(*devices.resolve());
 }
 
 bool DynamicDeviceSet::contains(Device* d) {
-  return getDeviceSet().contains(d);
+  return resolve()->contains(d);
 }
 
 bool DynamicDeviceSet::contains(string id) {
-  return getDeviceSet().contains(id);
+  return resolve()->contains(id);
 }
 
 JSONNode DynamicDeviceSet::toJSON(string name) {
   JSONNode str;
   str.set_name(name);
-  str = m_query;
+  str = getQuery();
 
   return str;
 }
 
 void DynamicDeviceSet::setQuery(string query) {
+  lock_guard<mutex> lock(m_cacheLock);
   m_query = query;
+  invalidate();
 }
 
 string DynamicDeviceSet::getQuery() {
+  lock_guard<mutex> lock(m_cacheLock);
   return m_query;
 }
 
 bool DynamicDeviceSet::isQueryNull() {
+  lock_guard<mutex> lock(m_cacheLock);
   return m_query == "";
 }
 }
\ No newline at end of file
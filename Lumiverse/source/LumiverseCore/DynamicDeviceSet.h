@@ -10,6 +10,8 @@
 #include <set>
 #include <regex>
 #include <functional>
+#include <memory>
+#include <mutex>
 
 #include "Logger.h"
 #include "Device.h"
@@ -27,9 +29,11 @@ namespace Lumiverse {
   * (https://github.com/ebshimizu/Lumiverse/wiki/Query-Syntax-Notes) and
   * each time they're accessed, the set of devices matching the query will be
   * selected for use.
-  * Note that this class is really a wrapper around DeviceSets and may be slow for
-  * repeated use of large queries.
-  * \sa Device, DeviceSet
+  * The result of the query is cached and only re-evaluated when the Rig reports
+  * a change that could affect the result: devices being added or removed, metadata
+  * changes if the query selects on metadata, and parameter changes if the query
+  * selects on parameters.
+  * \sa Device, DeviceSet, Rig::getDeviceGeneration()
   */
   class DynamicDeviceSet
   {
@@ -39,7 +43,7 @@ namespace Lumiverse {
     
     Like the default constructor for DeviceSet, this isn't particularly useful.
     */
-    DynamicDeviceSet() : m_query("") { };
+    DynamicDeviceSet() : m_query(""), m_rig(nullptr) { invalidate(); };
 
     /*!
     * \brief Constructs a DynamicDeviceSet
@@ -65,6 +69,11 @@ namespace Lumiverse {
     */
     DynamicDeviceSet(const DynamicDeviceSet& dc);
 
+    /*!
+    \brief Assigns the query and rig of another DynamicDeviceSet to this one.
+    */
+    void operator=(const DynamicDeviceSet& dc);
+
     /*!
     * \brief Destructor for the DeviceSet
     */
@@ -189,8 +198,16 @@ namespace Lumiverse {
     * \brief Gets the devices managed by this set.
     * 
     * \return Set of Device* contained by the DynamicDeviceSet
+    * \sa getDeviceList()
     */
-    inline const set<Device *>& getDevices() { return m_rig->select(m_query).getDevices(); }
+    inline set<Device *> getDevices() { return resolve()->getDevices(); }
+
+    /*!
+    * \brief Gets the devices managed by this set without copying them into a set.
+    *
+    * \return List of Device* contained by the DynamicDeviceSet, in channel order.
+    */
+    inline DeviceList getDeviceList() { return resolve()->getDeviceList(); }
 
     /*!
     * \brief Gets a copy of the list of the IDs contained by this DynamicDeviceSet
@@ -226,7 +243,7 @@ namespace Lumiverse {
     * \brief Returns the number of devices in the DynamicDeviceSet
     * \return Number of devices in the set.
     */
-    inline size_t size() { return m_rig->select(m_query).size(); }
+    inline size_t size() { return resolve()->size(); }
 
     /*!
     \brief Returns true if the device sets have the same number of devices
@@ -282,6 +299,34 @@ namespace Lumiverse {
     * \brief Pointer to the rig for accessing indexes and devices
     */
     Rig* m_rig;
+
+    /*! \brief Result of the query the last time it was evaluated. Replaced, never modified. */
+    shared_ptr<DeviceSet> m_cache;
+
+    /*! \brief Guards the query and the cache. */
+    mutable mutex m_cacheLock;
+
+    /*! \brief Indicates if m_cache has been filled in. */
+    bool m_cacheValid;
+
+    /*! \brief Rig generation counters at the time m_cache was filled in. */
+    size_t m_deviceGen;
+    size_t m_metadataGen;
+    size_t m_paramGen;
+
+    /*! \brief True if the query contains a metadata selector. */
+    bool m_usesMetadata;
+
+    /*! \brief True if the query contains a parameter selector. */
+    bool m_usesParams;
+
+    /*! \brief Marks the cache as stale and determines what the query depends on. Call with m_cacheLock held. */
+    void invalidate();
+
+    /*!
+    \brief Returns the devices matching the query, re-evaluating the query only if needed.
+    */
+    shared_ptr<DeviceSet> resolve();
   };
 }
 
@@ -60,6 +60,7 @@
 #include "Rig.h"
 #include "DeviceSet.h"
 #include "DynamicDeviceSet.h"
+#include "SelectorQuery.h"
 #include "Patch.h"
 #include "LumiverseType.h"
 #include "types/LumiverseFloat.h"
@@ -70,6 +71,8 @@
 #include "DMX/DMXPatch.h"
 #include "DMX/DMXDevicePatch.h"
 #include "DMX/DMXInterface.h"
+#include "DMX/DMXCapture.h"
+#include "DMX/DMXCapturePlayer.h"
 #include "lib/libjson/libjson.h"
 
 #ifdef USE_DMXPRO2
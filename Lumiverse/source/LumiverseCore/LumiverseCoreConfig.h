@@ -0,0 +1,12 @@
+// Configruation file for Lumiverse Core library
+
+#define LumiverseCore_VERSION_MAJOR 2
+#define LumiverseCore_VERSION_MINOR 5
+
+
+#define USE_KINET
+
+
+
+
+
@@ -4,13 +4,18 @@ namespace Lumiverse {
 
 map<string, patchParseFunc> Rig::patchParsers = {};
 
-Rig::Rig() {
+// Source of Rig instance ids. Starts at 1 so 0 never matches a rig.
+static atomic<size_t> nextRigInstanceId(1);
+
+Rig::Rig() : m_deviceGeneration(0), m_metadataGeneration(0), m_paramGeneration(0), m_metadataRebuild(true) {
+  m_instanceId = nextRigInstanceId++;
   m_running = false;
   setRefreshRate(40);
   m_updateLoop = nullptr;
 }
 
-Rig::Rig(string filename) {
+Rig::Rig(string filename) : m_deviceGeneration(0), m_metadataGeneration(0), m_paramGeneration(0), m_metadataRebuild(true) {
+  m_instanceId = nextRigInstanceId++;
   m_running = false;
   setRefreshRate(40);
   m_updateLoop = nullptr;
@@ -251,6 +256,7 @@ void Rig::reset() {
   m_devicesById.clear();
   m_devicesByChannel.clear();
   m_updateFunctions.clear();
+  m_deviceGeneration++;
 }
 
 Rig::~Rig() {
@@ -354,6 +360,27 @@ void Rig::addDevice(Device* device) {
   m_devices.insert(device);
   m_devicesById[device->getId()] = device;
   m_devicesByChannel.insert(make_pair(device->getChannel(), device));
+
+  // Track changes to the device so cached queries know when to update.
+  // Adding, removing or replacing parameters changes the selector index, so it counts as a device change.
+  size_t paramStructure = device->getParamStructureVersion();
+  device->addParameterChangedCallback([this, paramStructure](Device* d) mutable {
+    m_paramGeneration++;
+    if (d->getParamStructureVersion() != paramStructure) {
+      paramStructure = d->getParamStructureVersion();
+      m_deviceGeneration++;
+    }
+  });
+  device->addMetadataChangedCallback([this](Device* d) {
+    m_metadataGeneration++;
+
+    lock_guard<mutex> lock(m_selectorMutex);
+    if (m_dirtyMetadata.size() < m_devices.size())
+      m_dirtyMetadata.push_back(d);
+    else
+      m_metadataRebuild = true;
+  });
+  m_deviceGeneration++;
 }
 
 Device* Rig::getDevice(string id) {
@@ -394,6 +421,7 @@ void Rig::deleteDevice(string id) {
   // Delete the memory used by the device using the id->device map
   delete m_devicesById[id];
   m_devicesById.erase(id);
+  m_deviceGeneration++;
 }
 
 void Rig::addPatch(string id, Patch* patch) {
@@ -470,6 +498,8 @@ void Rig::updateOnce() {
 }
 
 void Rig::setAllDevices(map<string, Device*> devices) {
+  bool changed = false;
+
   for (auto& kvp : devices) {
     try {
       auto d = m_devicesById.at(kvp.first);
@@ -478,7 +508,8 @@ void Rig::setAllDevices(map<string, Device*> devices) {
         // We want to copy instead of assign since we don't know where that LumiverseType data
         // is going to end up. Maybe it'd be better if devices did a copy instead...
         //LumiverseTypeUtils::copyByVal(param.second, m_devicesById[kvp.first]->getParam(param.first));
-        d->copyParamByValue(param.first, param.second);
+        if (d->copyParamByValue(param.first, param.second))
+          changed = true;
       }
     }
     catch (exception e) {
@@ -487,6 +518,11 @@ void Rig::setAllDevices(map<string, Device*> devices) {
       Logger::log(WARN, ss.str());
     }
   }
+
+  // copyParamByValue doesn't trigger device callbacks. Only count frames that changed
+  // something so parameter queries stay cached while nothing moves.
+  if (changed)
+    m_paramGeneration++;
 }
 
 Device* Rig::operator[](string id) {
@@ -498,12 +534,84 @@ DeviceSet Rig::select(string q) {
   return working.select(q);
 }
 
+shared_ptr<SelectorQuery> Rig::compileSelector(const string& selector) {
+  lock_guard<mutex> lock(m_selectorMutex);
+
+  auto it = m_selectorCache.find(selector);
+  if (it != m_selectorCache.end())
+    return it->second;
+
+  // Console input can produce an unbounded number of distinct queries, so keep the cache small.
+  if (m_selectorCache.size() >= 1024)
+    m_selectorCache.clear();
+
+  shared_ptr<SelectorQuery> query(new SelectorQuery(selector));
+  m_selectorCache[selector] = query;
+  return query;
+}
+
+void Rig::runSelector(const SelectorQuery& query, shared_ptr<const DeviceTable>& table, DeviceBitmap& devices) {
+  lock_guard<mutex> lock(m_selectorMutex);
+  refreshSelectorIndex();
+
+  DeviceTable::remap(table, devices, m_selectorIndex.m_table);
+  size_t n = m_selectorIndex.m_table->m_devices.size();
+
+  // Devices from outside the Rig can't be matched by a query, they're kept as is.
+  DeviceBitmap outside;
+  if (table->m_devices.size() > n) {
+    devices.forEach([&](uint32_t i) {
+      if (i >= n)
+        outside.add(i);
+    });
+  }
+
+  DeviceBitset working = devices.toBitset(n);
+  query.evaluate(m_selectorIndex, working);
+
+  devices = DeviceBitmap::fromBitset(working);
+  devices |= outside;
+}
+
+shared_ptr<const DeviceTable> Rig::getDeviceTable() {
+  lock_guard<mutex> lock(m_selectorMutex);
+  refreshDeviceTable();
+
+  return m_selectorIndex.m_table;
+}
+
+void Rig::refreshDeviceTable() {
+  size_t deviceGen = m_deviceGeneration;
+
+  if (!m_selectorIndex.m_valid || m_selectorIndex.m_deviceGeneration != deviceGen) {
+    m_selectorIndex.rebuildDevices(m_devicesByChannel);
+    m_selectorIndex.m_deviceGeneration = deviceGen;
+    m_metadataRebuild = true;
+  }
+}
+
+void Rig::refreshSelectorIndex() {
+  refreshDeviceTable();
+
+  if (m_metadataRebuild) {
+    m_selectorIndex.rebuildMetadata();
+  }
+  else {
+    for (auto d : m_dirtyMetadata)
+      m_selectorIndex.updateMetadata(d);
+  }
+
+  m_dirtyMetadata.clear();
+  m_metadataRebuild = false;
+}
+
 DeviceSet Rig::operator[](unsigned int channel) {
   return getChannel(channel);
 }
 
 DeviceSet Rig::getAllDevices() {
-  return DeviceSet(this, m_devices);
+  DeviceSet working(this);
+  return working.select("*");
 }
 
 DeviceSet Rig::getChannel(unsigned int channel) {
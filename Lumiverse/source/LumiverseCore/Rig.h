@@ -14,6 +14,10 @@
 #include <sstream>
 #include <set>
 #include <functional>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <unordered_map>
 
 #include "LumiverseCoreConfig.h"
 #include "Patch.h"
@@ -21,6 +25,7 @@
 #include "Device.h"
 #include "Logger.h"
 #include "DeviceSet.h"
+#include "SelectorQuery.h"
 #include "lib/libjson/libjson.h"
 
 #ifdef USE_ARNOLD
@@ -404,6 +409,42 @@ namespace Lumiverse {
     */
     set<string> getMetadataValues(string key);
 
+    /*!
+    \brief Returns a counter that changes whenever a Device is added to or removed from the Rig.
+
+    Used along with getMetadataGeneration() and getParameterGeneration() to cheaply
+    check if cached query results are still valid.
+    \sa DynamicDeviceSet
+    */
+    size_t getDeviceGeneration() { return m_deviceGeneration; }
+
+    /*!
+    \brief Number that identifies this Rig object. Never reused, even by a Rig later
+    allocated at the same address.
+    */
+    size_t getInstanceId() { return m_instanceId; }
+
+    /*!
+    \brief Returns a counter that changes whenever metadata changes on a Device in the Rig.
+    */
+    size_t getMetadataGeneration() { return m_metadataGeneration; }
+
+    /*!
+    \brief Returns a counter that changes whenever parameter values change in the Rig.
+
+    Changes made through the Device setParam functions and through setAllDevices() are tracked.
+    Changes made by writing directly to a LumiverseType returned by Device::getParam() are not.
+    */
+    size_t getParameterGeneration() { return m_paramGeneration; }
+
+    /*!
+    \brief Changes the parameter generation after parameters were written directly.
+
+    Call this after writing to LumiverseTypes returned by Device::getParam() so cached
+    queries see the new values.
+    */
+    void markParametersChanged() { m_paramGeneration++; }
+
   private:
     /*!
     * \brief Loads the rig info from the parsed JSON data.
@@ -431,6 +472,39 @@ namespace Lumiverse {
     */
     void reset();
 
+    /*!
+    * \brief Returns the compiled plan for a selector, compiling it on first use.
+    * \param selector Query string
+    */
+    shared_ptr<SelectorQuery> compileSelector(const string& selector);
+
+    /*!
+    * \brief Runs a compiled selector.
+    * \param query Compiled selector
+    * \param table Device table the starting set refers to. Updated to the table the result refers to.
+    * \param devices Starting set. Replaced by the result of the query.
+    */
+    void runSelector(const SelectorQuery& query, shared_ptr<const DeviceTable>& table, DeviceBitmap& devices);
+
+    /*!
+    * \brief Returns the current device table, rebuilding it if devices were added or removed.
+    */
+    shared_ptr<const DeviceTable> getDeviceTable();
+
+    /*!
+    * \brief Rebuilds the device part of m_selectorIndex if it's out of date.
+    *
+    * Must be called with m_selectorMutex held.
+    */
+    void refreshDeviceTable();
+
+    /*!
+    * \brief Rebuilds the parts of m_selectorIndex that are out of date.
+    *
+    * Must be called with m_selectorMutex held.
+    */
+    void refreshSelectorIndex();
+
     /*!
     * \brief Thread that runs the update loop.
     */
@@ -503,6 +577,33 @@ namespace Lumiverse {
     */
     bool m_slow;
 
+    /*! \brief \sa getInstanceId() */
+    size_t m_instanceId;
+
+    /*! \brief Incremented when Devices are added or removed. \sa getDeviceGeneration() */
+    atomic<size_t> m_deviceGeneration;
+
+    /*! \brief Incremented when Device metadata changes. \sa getMetadataGeneration() */
+    atomic<size_t> m_metadataGeneration;
+
+    /*! \brief Incremented when Device parameters change. \sa getParameterGeneration() */
+    atomic<size_t> m_paramGeneration;
+
+    /*! \brief Device, channel, parameter and metadata indexes used by select(). */
+    SelectorIndex m_selectorIndex;
+
+    /*! \brief Compiled selectors by query string. */
+    unordered_map<string, shared_ptr<SelectorQuery> > m_selectorCache;
+
+    /*! \brief Devices whose metadata changed since m_selectorIndex was last refreshed. */
+    vector<Device*> m_dirtyMetadata;
+
+    /*! \brief Set when too many devices changed for m_dirtyMetadata to be worth tracking. */
+    bool m_metadataRebuild;
+
+    /*! \brief Guards m_selectorIndex, m_selectorCache and m_dirtyMetadata. */
+    mutex m_selectorMutex;
+
     // May have more indicies in the future, like mapping by channel number.
   };
 }
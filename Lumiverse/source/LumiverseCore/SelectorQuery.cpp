@@ -0,0 +1,534 @@
+#include "SelectorQuery.h"
+
+namespace Lumiverse {
+
+void DeviceTable::append(Device* d) {
+  size_t i = m_devices.size();
+  m_devices.push_back(d);
+  m_channels.push_back(d->getChannel());
+  m_indices[d] = i;
+
+  if (m_ids.count(d->getId()) == 0)
+    m_ids[d->getId()] = i;
+}
+
+void DeviceTable::remap(shared_ptr<const DeviceTable>& table, DeviceBitmap& devices, const shared_ptr<const DeviceTable>& to) {
+  if (table == to || (table != nullptr && table->m_base == to))
+    return;
+
+  if (table == nullptr) {
+    table = to;
+    devices.clear();
+    return;
+  }
+
+  DeviceBitmap moved;
+  vector<Device*> outside;
+
+  devices.forEach([&](uint32_t i) {
+    Device* d = table->m_devices[i];
+    auto it = to->m_indices.find(d);
+
+    if (it != to->m_indices.end())
+      moved.add((uint32_t)it->second);
+    else if (i >= table->m_rigDevices)
+      outside.push_back(d);
+  });
+
+  if (outside.empty()) {
+    table = to;
+  }
+  else {
+    shared_ptr<DeviceTable> extended(new DeviceTable(*to));
+    extended->m_base = to;
+
+    for (auto d : outside) {
+      moved.add((uint32_t)extended->m_devices.size());
+      extended->append(d);
+    }
+
+    table = extended;
+  }
+
+  devices = moved;
+}
+
+void SelectorIndex::rebuildDevices(const multimap<unsigned int, Device*>& devicesByChannel) {
+  size_t n = devicesByChannel.size();
+  shared_ptr<DeviceTable> table(new DeviceTable());
+
+  table->m_devices.reserve(n);
+  table->m_channels.reserve(n);
+  m_params.clear();
+  m_paramValues.clear();
+
+  for (const auto& kvp : devicesByChannel) {
+    size_t i = table->m_devices.size();
+    table->m_devices.push_back(kvp.second);
+    table->m_channels.push_back(kvp.first);
+    table->m_indices[kvp.second] = i;
+    table->m_ids[kvp.second->getId()] = i;
+
+    for (const auto& p : kvp.second->getRawParameters()) {
+      if (p.second == nullptr)
+        continue;
+
+      auto it = m_params.find(p.first);
+      if (it == m_params.end())
+        it = m_params.insert(make_pair(p.first, DeviceBitset(n))).first;
+      it->second.set(i);
+
+      LumiverseFloat* val = (p.second->getTypeName() == "float") ? (LumiverseFloat*)p.second : nullptr;
+      m_paramValues[p.first].push_back(make_pair(i, val));
+    }
+  }
+
+  table->m_rigDevices = n;
+
+  // Parameter changes also land here. Keep the old table if the devices are the same.
+  if (m_table == nullptr || m_table->m_devices != table->m_devices || m_table->m_channels != table->m_channels)
+    m_table = table;
+
+  m_all = DeviceBitset(n);
+  m_all.setAll();
+  m_valid = true;
+}
+
+void SelectorIndex::rebuildMetadata() {
+  m_metadata.clear();
+  m_deviceMetadata.assign(m_table->m_devices.size(), map<string, string>());
+
+  for (auto d : m_table->m_devices) {
+    updateMetadata(d);
+  }
+}
+
+void SelectorIndex::updateMetadata(Device* d) {
+  auto idx = m_table->m_indices.find(d);
+  if (idx == m_table->m_indices.end())
+    return;
+
+  size_t i = idx->second;
+  size_t n = m_table->m_devices.size();
+
+  // Take the device out of the values it used to have
+  for (const auto& kvp : m_deviceMetadata[i]) {
+    auto& values = m_metadata[kvp.first];
+    auto it = values.find(kvp.second);
+    if (it == values.end())
+      continue;
+
+    it->second.reset(i);
+    if (it->second.none())
+      values.erase(it);
+  }
+
+  m_deviceMetadata[i].clear();
+
+  for (const auto& key : d->getMetadataKeyNames()) {
+    string val = d->getMetadata(key);
+    auto& values = m_metadata[key];
+
+    auto it = values.find(val);
+    if (it == values.end())
+      it = values.insert(make_pair(val, DeviceBitset(n))).first;
+    it->second.set(i);
+
+    m_deviceMetadata[i][key] = val;
+  }
+}
+
+SelectorQuery::SelectorQuery(string selector) : m_selector(selector), m_valid(true) {
+  // First step is to split the entire string into groups.
+  vector<string> groups;
+
+  size_t lbracket = selector.find('[', 0);
+  size_t rbracket;
+
+  // If we're not starting with a bracket, that's ok just treat everything before a bracket as a group.
+  if (lbracket != 0) {
+    groups.push_back(selector.substr(0, lbracket));
+  }
+
+  while (lbracket != string::npos) {
+    rbracket = selector.find(']', lbracket);
+
+    if (rbracket == string::npos) {
+      stringstream ss;
+      ss << "Selector parse error: no matching ] for [ in " << selector << " (" << lbracket << ")";
+      Logger::log(LOG_LEVEL::ERR, ss.str());
+      m_valid = false;
+    }
+
+    groups.push_back(selector.substr(lbracket + 1, rbracket - lbracket - 1));
+    lbracket = selector.find('[', rbracket);
+  }
+
+  // The first group is always an add.
+  bool filter = false;
+
+  for (string& s : groups) {
+    Group g;
+    g.filter = filter;
+
+    size_t start = 0;
+    size_t end = 0;
+
+    while (start != string::npos) {
+      // Skip whitespace
+      while (s[start] == ' ' || s[start] == '\n' || s[start] == '\t') {
+        start++;
+      }
+
+      // | ends an or section, which gets consolidated at the next , or the end of the group.
+      bool consolidate = true;
+      end = s.find(',', start);
+
+      size_t bar = s.find('|', start);
+      if (bar < end) {
+        end = bar;
+        consolidate = false;
+      }
+
+      Term t = compileTerm(s.substr(start, end - start));
+      t.consolidate = consolidate;
+      g.terms.push_back(t);
+
+      start = (end == string::npos) ? end : end + 1;
+    }
+
+    m_groups.push_back(g);
+    filter = true;
+  }
+}
+
+SelectorQuery::Term SelectorQuery::compileTerm(const string& selector) {
+  Term t;
+  t.type = NONE;
+  t.eq = true;
+  t.consolidate = true;
+  t.lower = 0;
+  t.upper = 0;
+  t.literal = true;
+  t.val = 0;
+  t.cmp = EQ;
+
+  // first check for !
+  char type = (selector[0] == '!') ? selector[1] : selector[0];
+
+  switch (type) {
+    // Channel selector
+    case '#':
+      compileChannel(selector, t);
+      break;
+    // Parameter selector
+    case '@':
+      compileParameter(selector, t);
+      break;
+    // Metadata selector
+    case '$':
+      compileMetadata(selector, t);
+      break;
+    // Special add everything selector.
+    case '*':
+      t.type = ALL;
+      break;
+    // Everything else is an ID. !id selects everything except id.
+    default:
+      t.type = ID;
+      if (selector[0] == '!') {
+        t.eq = false;
+        t.key = selector.substr(1);
+      }
+      else {
+        t.key = selector;
+      }
+      break;
+  }
+
+  return t;
+}
+
+void SelectorQuery::compileMetadata(const string& selector, Term& t) {
+  regex metadataRegex("(!\?)\\$([\\w\\d\\-]+)([\\!\\*~\\$\\^]?[=])(.+)");
+  smatch matches;
+  regex_match(selector, matches, metadataRegex);
+
+  // Matches size is 5 since entire string is the first match
+  if (matches.size() != 5) {
+    stringstream ss;
+    ss << "Selector parse error: invalid metadata selector format: " << selector;
+    Logger::log(LOG_LEVEL::ERR, ss.str());
+    m_valid = false;
+    return;
+  }
+
+  t.type = METADATA;
+  t.eq = (matches[1].length() > 0) ? false : true;
+  t.key = matches[2];
+  t.op = matches[3].str().substr(0, 1);
+  t.arg = matches[4];
+
+  // Not equal to is an inverted equals
+  if (t.op == "!")
+    t.eq = !t.eq;
+
+  // Plain strings are compared directly, everything else goes through a regex built once here.
+  t.literal = (t.arg.find_first_of("\\^$.|?*+()[]{}") == string::npos);
+  if (t.literal)
+    return;
+
+  switch (t.op[0]) {
+    // Contains
+    case '*':
+      t.pattern = regex(".*" + t.arg + ".*");
+      break;
+    // Ends with
+    case '$':
+      t.pattern = regex(".*" + t.arg + "$");
+      break;
+    // Starts with
+    case '^':
+      t.pattern = regex("^" + t.arg + ".*");
+      break;
+    // Not equal to
+    case '!':
+      t.pattern = regex(t.arg);
+      break;
+    // Exactly equal to. Anything else is same as =
+    default:
+      t.pattern = regex("^" + t.arg + "$");
+      break;
+  }
+}
+
+void SelectorQuery::compileChannel(const string& selector, Term& t) {
+  regex channelRegex("(!\?)#(\\d+)-\?(\\d*)");
+  smatch matches;
+  regex_match(selector, matches, channelRegex);
+
+  // Matches size is 4 since entire string is the first match
+  if (matches.size() != 4) {
+    stringstream ss;
+    ss << "Selector parse error: invalid channel selector format: " << selector;
+    Logger::log(LOG_LEVEL::ERR, ss.str());
+    m_valid = false;
+    return;
+  }
+
+  t.type = CHANNEL;
+  t.eq = (matches[1].length() > 0) ? false : true;
+
+  stringstream(matches[2]) >> t.lower;
+  t.upper = t.lower;
+
+  if (matches[3].length() > 0) {
+    stringstream(matches[3]) >> t.upper;
+
+    // Flip channel ranges if the first value is greater than the second value
+    if (t.lower > t.upper)
+      swap(t.lower, t.upper);
+  }
+}
+
+void SelectorQuery::compileParameter(const string& selector, Term& t) {
+  // Supported Types: LumiverseFloat
+  regex paramRegex("(!\?)@(\\w+)([><!]\?[><=])(\\d*\\.\?\\d*)([f])");
+  smatch matches;
+  regex_match(selector, matches, paramRegex);
+
+  // Matches size is 6 since entire string is the first match
+  if (matches.size() != 6) {
+    stringstream ss;
+    ss << "Selector parse error: invalid parameter selector format: " << selector;
+    Logger::log(LOG_LEVEL::ERR, ss.str());
+    m_valid = false;
+    return;
+  }
+
+  t.type = PARAMETER;
+  t.eq = (matches[1].length() > 0) ? false : true;
+  t.key = matches[2];
+  t.op = matches[3];
+  stringstream(matches[4]) >> t.val;
+
+  if (t.op == "<")
+    t.cmp = LT;
+  else if (t.op == ">")
+    t.cmp = GT;
+  else if (t.op == "<=")
+    t.cmp = LEQ;
+  else if (t.op == ">=")
+    t.cmp = GEQ;
+  else if (t.op == "!=")
+    t.cmp = NEQ;
+  // Defaults to =
+  else
+    t.cmp = EQ;
+}
+
+void SelectorQuery::evaluate(const SelectorIndex& index, DeviceBitset& working) const {
+  size_t n = index.m_table->m_devices.size();
+  working.resize(n);
+
+  DeviceBitset matched(n);
+  DeviceBitset temp(n);
+
+  for (const auto& g : m_groups) {
+    // Results of | sections, merged in when the section ends.
+    DeviceBitset orResults(n);
+
+    for (const auto& t : g.terms) {
+      matched.clear();
+      match(t, index, matched);
+      temp = working;
+
+      if (!g.filter) {
+        temp |= matched;
+      }
+      else {
+        switch (t.type) {
+          // Metadata filters keep devices that match.
+          case METADATA:
+            temp &= matched;
+            break;
+          // Parameter filters keep devices that have the parameter but don't match.
+          case PARAMETER:
+          {
+            auto has = index.m_params.find(t.key);
+            if (has == index.m_params.end()) {
+              temp.clear();
+            }
+            else {
+              DeviceBitset keep(has->second);
+              keep.subtract(matched);
+              temp &= keep;
+            }
+            break;
+          }
+          case NONE:
+            break;
+          // Ids, channels and * remove matching devices.
+          default:
+            temp.subtract(matched);
+            break;
+        }
+      }
+
+      if (!t.consolidate) {
+        orResults |= temp;
+      }
+      else {
+        working = temp;
+        working |= orResults;
+      }
+    }
+  }
+}
+
+void SelectorQuery::match(const Term& t, const SelectorIndex& index, DeviceBitset& out) const {
+  switch (t.type) {
+    case ID:
+    {
+      auto it = index.m_table->m_ids.find(t.key);
+      if (it != index.m_table->m_ids.end())
+        out.set(it->second);
+
+      if (!t.eq)
+        out.flip();
+      break;
+    }
+    case CHANNEL:
+    {
+      // Devices are indexed in channel order so a range of channels is a range of indices.
+      const auto& channels = index.m_table->m_channels;
+      auto first = lower_bound(channels.begin(), channels.end(), t.lower);
+      auto last = upper_bound(channels.begin(), channels.end(), t.upper);
+      out.setRange(first - channels.begin(), last - channels.begin());
+
+      if (!t.eq)
+        out.flip();
+      break;
+    }
+    case METADATA:
+    {
+      auto values = index.m_metadata.find(t.key);
+      if (values == index.m_metadata.end())
+        break;
+
+      // Exact matches are a single lookup
+      if (t.literal && t.eq && t.op == "=") {
+        auto it = values->second.find(t.arg);
+        if (it != values->second.end())
+          out |= it->second;
+        break;
+      }
+
+      // Everything else tests each distinct value once.
+      for (const auto& v : values->second) {
+        bool m = (t.literal) ? matchLiteral(t, v.first) : regex_match(v.first, t.pattern);
+        if (m == t.eq)
+          out |= v.second;
+      }
+      break;
+    }
+    case PARAMETER:
+    {
+      auto values = index.m_paramValues.find(t.key);
+      if (values == index.m_paramValues.end())
+        break;
+
+      for (const auto& v : values->second) {
+        if (matchParameter(t, v.second) == t.eq)
+          out.set(v.first);
+      }
+      break;
+    }
+    case ALL:
+      out = index.m_all;
+      break;
+    default:
+      break;
+  }
+}
+
+bool SelectorQuery::matchLiteral(const Term& t, const string& value) const {
+  switch (t.op[0]) {
+    // Contains
+    case '*':
+      return value.find(t.arg) != string::npos;
+    // Ends with
+    case '$':
+      return value.size() >= t.arg.size() && value.compare(value.size() - t.arg.size(), t.arg.size(), t.arg) == 0;
+    // Starts with
+    case '^':
+      return value.compare(0, t.arg.size(), t.arg) == 0;
+    // Equal and not equal both compare the whole string, eq handles the inversion.
+    default:
+      return value == t.arg;
+  }
+}
+
+bool SelectorQuery::matchParameter(const Term& t, LumiverseFloat* value) const {
+  // Same results as the LumiverseFloat comparison operators: non-float parameters
+  // never compare equal, less or greater.
+  bool isFloat = value != nullptr;
+  float v = isFloat ? value->getVal() : 0;
+
+  switch (t.cmp) {
+    case LT:
+      return isFloat && v < t.val;
+    case GT:
+      return isFloat && t.val < v;
+    case LEQ:
+      return !(isFloat && t.val < v);
+    case GEQ:
+      return !(isFloat && v < t.val);
+    case NEQ:
+      return !(isFloat && v == t.val);
+    default:
+      return isFloat && v == t.val;
+  }
+}
+
+}
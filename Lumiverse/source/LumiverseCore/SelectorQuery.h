@@ -0,0 +1,233 @@
+/*! \file SelectorQuery.h
+* \brief Compiled selector queries and the Rig indexes they run against.
+*/
+#ifndef _SELECTORQUERY_H_
+#define _SELECTORQUERY_H_
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <regex>
+#include <memory>
+#include <sstream>
+#include <algorithm>
+
+#include "Logger.h"
+#include "Device.h"
+#include "DeviceBitset.h"
+#include "DeviceBitmap.h"
+
+namespace Lumiverse {
+  /*!
+  * \brief Maps Devices to the dense indices used by DeviceSet and the selector engine.
+  *
+  * Rig devices are numbered in channel order. Tables don't change once the Rig publishes
+  * them. When devices are added or removed the Rig builds a new table, and sets built against
+  * an older table are moved over with remap().
+  */
+  struct DeviceTable
+  {
+    DeviceTable() : m_rigDevices(0) { }
+
+    /*! \brief Adds a Device that isn't part of the Rig to the end of the table. */
+    void append(Device* d);
+
+    /*!
+    * \brief Moves a set of indices from one table to another.
+    *
+    * Rig devices that aren't in the new table have been deleted and are dropped.
+    * Devices from outside the Rig are kept by extending a private copy of the new table.
+    * \param table Table the indices currently refer to. Updated to the table they refer to afterwards.
+    * \param devices Indices to move.
+    * \param to Current Rig table.
+    */
+    static void remap(shared_ptr<const DeviceTable>& table, DeviceBitmap& devices, const shared_ptr<const DeviceTable>& to);
+
+    /*! \brief Dense index -> Device. Rig devices are sorted by channel. */
+    vector<Device*> m_devices;
+
+    /*! \brief Dense index -> channel. Non-decreasing over the Rig devices, so channel ranges map to index ranges. */
+    vector<unsigned int> m_channels;
+
+    /*! \brief Device -> dense index */
+    unordered_map<Device*, size_t> m_indices;
+
+    /*! \brief Device id -> dense index */
+    unordered_map<string, size_t> m_ids;
+
+    /*! \brief Number of leading entries that belong to the Rig. */
+    size_t m_rigDevices;
+
+    /*! \brief For tables extended with outside devices, the Rig table that was extended. */
+    shared_ptr<const DeviceTable> m_base;
+  };
+
+  /*!
+  * \brief Secondary indexes over the Devices in a Rig.
+  *
+  * Query results are stored in DeviceBitsets over the indices in m_table. The Rig rebuilds
+  * the device tables when devices are added or removed and the metadata tables when metadata changes.
+  */
+  struct SelectorIndex
+  {
+    SelectorIndex() : m_deviceGeneration(0), m_valid(false) { }
+
+    /*!
+    * \brief Rebuilds the device table and parameter tables.
+    *
+    * The current table is kept if the Rig's devices didn't actually change, so DeviceSets
+    * don't need to be remapped.
+    * \param devicesByChannel The Rig's channel index. Device indices follow its order.
+    */
+    void rebuildDevices(const multimap<unsigned int, Device*>& devicesByChannel);
+
+    /*! \brief Rebuilds the metadata key -> value -> devices table. */
+    void rebuildMetadata();
+
+    /*!
+    * \brief Updates the metadata table for a single Device.
+    *
+    * Much cheaper than rebuildMetadata() when only a few devices changed.
+    */
+    void updateMetadata(Device* d);
+
+    /*! \brief Current Rig device table. */
+    shared_ptr<const DeviceTable> m_table;
+
+    /*! \brief Parameter name -> devices that have the parameter */
+    unordered_map<string, DeviceBitset> m_params;
+
+    /*!
+    * \brief Parameter name -> (dense index, value) for every device that has the parameter.
+    *
+    * The value is nullptr for parameters that aren't LumiverseFloats. Pointers stay valid until
+    * the next rebuildDevices(), since the Rig counts replacing a parameter object as a device change.
+    */
+    unordered_map<string, vector<pair<size_t, LumiverseFloat*> > > m_paramValues;
+
+    /*! \brief Dense index -> metadata the device had when it was last indexed. */
+    vector<map<string, string> > m_deviceMetadata;
+
+    /*! \brief Metadata key -> metadata value -> devices with that value */
+    unordered_map<string, unordered_map<string, DeviceBitset> > m_metadata;
+
+    /*! \brief Every device in the index. */
+    DeviceBitset m_all;
+
+    /*! \brief Rig device generation the device tables were built at. */
+    size_t m_deviceGeneration;
+
+    /*! \brief False until the first build. */
+    bool m_valid;
+  };
+
+  /*!
+  * \brief A selector string parsed into a reusable query plan.
+  *
+  * Parsing (including building any regular expressions) happens once in the constructor.
+  * evaluate() then runs the plan against a SelectorIndex using bitset set algebra.
+  * Semantics match the query syntax described at
+  * https://github.com/ebshimizu/Lumiverse/wiki/Query-Syntax-Notes : the first group adds devices
+  * to the working set and each bracketed group after it filters the working set. Within a group,
+  * `,` separates selectors applied in sequence and `|` unions selector results.
+  * \sa Rig::select(), DeviceSet::select()
+  */
+  class SelectorQuery
+  {
+  public:
+    /*!
+    * \brief Compiles a selector string.
+    *
+    * Parse errors are logged and the offending selector becomes a no-op.
+    * \param selector Query string.
+    */
+    SelectorQuery(string selector);
+
+    /*! \brief Returns the source query string. */
+    const string& getSelector() const { return m_selector; }
+
+    /*! \brief Returns false if any part of the selector failed to parse. */
+    bool isValid() const { return m_valid; }
+
+    /*!
+    * \brief Runs the query.
+    * \param index Index of the Rig to select from.
+    * \param working Starting set. Replaced by the result. Must be sized to the index's device table.
+    */
+    void evaluate(const SelectorIndex& index, DeviceBitset& working) const;
+
+  private:
+    /*! \brief Kinds of single selectors. */
+    enum TermType { ID, CHANNEL, METADATA, PARAMETER, ALL, NONE };
+
+    /*! \brief Parameter comparisons */
+    enum Comparison { LT, GT, LEQ, GEQ, NEQ, EQ };
+
+    /*! \brief A single selector, e.g. `#1-10` or `$area=2`. */
+    struct Term {
+      TermType type;
+
+      /*! \brief False if the selector was negated with ! */
+      bool eq;
+
+      /*! \brief False if this selector is followed by |, in which case its result is unioned later. */
+      bool consolidate;
+
+      /*! \brief Device id, metadata key or parameter name */
+      string key;
+
+      /*! \brief Channel range, inclusive. */
+      unsigned int lower;
+      unsigned int upper;
+
+      /*! \brief Metadata operator (=, *, $, ^, !) or parameter comparison (<, >, <=, >=, !=, =) */
+      string op;
+
+      /*! \brief Metadata argument */
+      string arg;
+
+      /*! \brief True if the metadata argument has no regex special characters. */
+      bool literal;
+
+      /*! \brief Compiled metadata pattern, only built when the argument isn't literal. */
+      regex pattern;
+
+      /*! \brief Parameter comparison, parsed from op */
+      Comparison cmp;
+
+      /*! \brief Parameter comparison value */
+      float val;
+    };
+
+    /*! \brief Selectors in one group. The first group adds, the others filter. */
+    struct Group {
+      bool filter;
+      vector<Term> terms;
+    };
+
+    /*! \brief Parses a single selector into a Term. */
+    Term compileTerm(const string& selector);
+
+    void compileMetadata(const string& selector, Term& t);
+    void compileChannel(const string& selector, Term& t);
+    void compileParameter(const string& selector, Term& t);
+
+    /*! \brief Computes the devices matched by a term. */
+    void match(const Term& t, const SelectorIndex& index, DeviceBitset& out) const;
+
+    /*! \brief Checks a metadata value against a term without a regex. */
+    bool matchLiteral(const Term& t, const string& value) const;
+
+    /*! \brief Checks a parameter against a term. value is nullptr for non-float parameters. */
+    bool matchParameter(const Term& t, LumiverseFloat* value) const;
+
+    string m_selector;
+    vector<Group> m_groups;
+    bool m_valid;
+  };
+}
+
+#endif
@@ -182,18 +182,18 @@ void ArnoldAnimationPatch::renderSingleFrame(const set<Device*>& devices, string
 
   bool success = false;
   float* bp = nullptr;
-  int cid;
+  CachingRenderContextHandle context;
   int w = getWidth();
   int h = getHeight();
 
   if (CachingArnoldInterface* ci = dynamic_cast<CachingArnoldInterface*>(m_interface)) {
 #ifdef USE_ARNOLD
-    success = ci->render(devices, w, h, cid) == AI_SUCCESS;
+    success = ci->render(devices, w, h, context) == AI_SUCCESS;
 #else
-    success = ci->render(devices, w, h, cid) == 0;
+    success = ci->render(devices, w, h, context) == 0;
 #endif
     // we need to pull the proper buffer from the right context
-    bp = ci->getBufferForContext(cid);
+    bp = context->_buffer;
     frame.clear();
   }
   else {
@@ -215,10 +215,6 @@ void ArnoldAnimationPatch::renderSingleFrame(const set<Device*>& devices, string
       Logger::log(ERR, err_ss.str());
     }
   }
-
-  if (CachingArnoldInterface* ci = dynamic_cast<CachingArnoldInterface*>(m_interface)) {
-    ci->closeContext(cid);
-  }
 }
 
 void ArnoldAnimationPatch::renderSingleFrameToBuffer(const set<Device*>& devices, unsigned char* buff, int w, int h) {
@@ -258,16 +254,16 @@ void ArnoldAnimationPatch::renderSingleFrameToBuffer(const set<Device*>& devices
 
   bool success = false;
   float* bp = nullptr;
-  int cid;
+  CachingRenderContextHandle context;
 
   if (CachingArnoldInterface* ci = dynamic_cast<CachingArnoldInterface*>(m_interface)) {
 #ifdef USE_ARNOLD
-    success = ci->render(devices, w, h, cid) == AI_SUCCESS;
+    success = ci->render(devices, w, h, context) == AI_SUCCESS;
 #else
-    success = ci->render(devices, w, h, cid) == 0;
+    success = ci->render(devices, w, h, context) == 0;
 #endif
     // we need to pull the proper buffer from the right context
-    bp = ci->getBufferForContext(cid);
+    bp = context->_buffer;
     frame.clear();
   }
   else {
@@ -290,10 +286,6 @@ void ArnoldAnimationPatch::renderSingleFrameToBuffer(const set<Device*>& devices
       }
     }
   }
-
-  if (CachingArnoldInterface* ci = dynamic_cast<CachingArnoldInterface*>(m_interface)) {
-    ci->closeContext(cid);
-  }
 }
 
 void ArnoldAnimationPatch::getPositionFromAss(const set<Device*>& devices)
@@ -364,6 +356,7 @@ void ArnoldAnimationPatch::getPositionFromAss(const set<Device*>& devices)
       d->getParam<LumiverseFloat>("lookAtX")->setVals((float)look(0), (float)look(0), (float)look(0), (float)look(0));
       d->getParam<LumiverseFloat>("lookAtY")->setVals((float)look(1), (float)look(1), (float)look(1), (float)look(1));
       d->getParam<LumiverseFloat>("lookAtZ")->setVals((float)look(2), (float)look(2), (float)look(2), (float)look(2));
+      d->markChanged();
     }
   }
 #endif
@@ -391,6 +384,7 @@ void ArnoldAnimationPatch::getBeamPropsFromAss(const set<Device*>& devices)
       d->getColor()->setRGB(color.r, color.g, color.b);
       d->setIntensity(intens);
       d->getParam<LumiverseFloat>("penumbraAngle")->setVal(pangle);
+      d->markChanged();
     }
   }
 #endif
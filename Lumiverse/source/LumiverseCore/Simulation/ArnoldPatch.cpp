@@ -85,6 +85,34 @@ void ArnoldPatch::loadJSON(const JSONNode data) {
       if (exposure != cacheSettings->end()) {
         cacheInterface->setExposure(exposure->as_float());
       }
+
+      auto format = cacheSettings->find("format");
+      if (format != cacheSettings->end()) {
+        string f = format->as_string();
+        if (f == "half")
+          cacheInterface->setCacheFormat(PIXEL_HALF);
+        else if (f == "rgb9e5")
+          cacheInterface->setCacheFormat(PIXEL_RGB9E5);
+        else if (f == "float")
+          cacheInterface->setCacheFormat(PIXEL_FLOAT);
+        else
+          Logger::log(WARN, "Unknown cache format " + f + ", using float");
+      }
+
+      auto threads = cacheSettings->find("load_threads");
+      if (threads != cacheSettings->end()) {
+        cacheInterface->setLoadThreads(threads->as_int());
+      }
+
+      auto lazy = cacheSettings->find("lazy_load");
+      if (lazy != cacheSettings->end()) {
+        cacheInterface->setLazyLoading(lazy->as_bool());
+      }
+
+      auto contexts = cacheSettings->find("contexts");
+      if (contexts != cacheSettings->end()) {
+        cacheInterface->setNumContexts(contexts->as_int());
+      }
     }
 
     m_interface = cacheInterface;
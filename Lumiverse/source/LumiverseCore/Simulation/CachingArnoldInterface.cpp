@@ -3,6 +3,7 @@
 #ifdef USE_ARNOLD_CACHING
 
 #include "types/LumiverseFloat.h"
+#include "types/LumiverseOrientation.h"
 #include "ImfTestFile.h"    // Header checks
 #include "ImfInputFile.h"   // Imf file IO
 #include "ImfOutputFile.h"  // Imf file IO
@@ -13,7 +14,7 @@
 
 namespace Lumiverse {
   CachingRenderContext::CachingRenderContext(Compositor * c, int w, int h) :
-    _compositor(c), _w(w), _h(h)
+    _compositor(c), _bytes(nullptr), _w(w), _h(h)
   {
     _buffer = new float[4 * _w * _h];
   }
@@ -25,11 +26,17 @@ namespace Lumiverse {
     delete _compositor;
     
     if (_buffer != nullptr)
-      delete _buffer;
+      delete[] _buffer;
+
+    if (_bytes != nullptr)
+      delete[] _bytes;
   }
 
   void CachingRenderContext::setSize(int w, int h)
   {
+    if (w == _w && h == _h && _compositor->get_width() == (size_t)w && _compositor->get_height() == (size_t)h)
+      return;
+
     _w = w;
     _h = h;
 
@@ -38,16 +45,306 @@ namespace Lumiverse {
       _buffer = new float[_w * _h * 4];
     }
 
+    if (_bytes != nullptr) {
+      delete[] _bytes;
+      _bytes = new unsigned char[_w * _h * 4];
+    }
+
     _compositor->update_dims(_w, _h);
   }
 
+  void CachingRenderContext::setByteOutput(bool enabled)
+  {
+    if (enabled && _bytes == nullptr) {
+      _bytes = new unsigned char[_w * _h * 4];
+    }
+    else if (!enabled && _bytes != nullptr) {
+      delete[] _bytes;
+      _bytes = nullptr;
+    }
+  }
+
   void CachingRenderContext::render(const set<Device*>& d)
   {
-    _compositor->render(d);
+    _compositor->render(d, _toneMapper, _buffer, _bytes);
+  }
+
+  CachingRenderContextHandle::CachingRenderContextHandle() : _pool(nullptr), _id(-1)
+  {
+  }
+
+  CachingRenderContextHandle::CachingRenderContextHandle(CachingRenderContextPool* pool, int id) :
+    _pool(pool), _id(id)
+  {
+  }
+
+  CachingRenderContextHandle::CachingRenderContextHandle(CachingRenderContextHandle&& other) :
+    _pool(other._pool), _id(other._id)
+  {
+    other._pool = nullptr;
+    other._id = -1;
+  }
+
+  CachingRenderContextHandle::~CachingRenderContextHandle()
+  {
+    release();
+  }
+
+  CachingRenderContextHandle& CachingRenderContextHandle::operator=(CachingRenderContextHandle&& other)
+  {
+    if (this != &other) {
+      release();
+      _pool = other._pool;
+      _id = other._id;
+      other._pool = nullptr;
+      other._id = -1;
+    }
+
+    return *this;
+  }
+
+  void CachingRenderContextHandle::release()
+  {
+    if (_pool != nullptr)
+      _pool->release(_id);
+
+    _pool = nullptr;
+    _id = -1;
+  }
+
+  int CachingRenderContextHandle::detach()
+  {
+    int id = _id;
+    _pool = nullptr;
+    _id = -1;
+    return id;
+  }
+
+  CachingRenderContext* CachingRenderContextHandle::get() const
+  {
+    return (_pool != nullptr) ? _pool->get(_id) : nullptr;
+  }
+
+  CachingRenderContextPool::CachingRenderContextPool() : _nextTicket(0), _nowServing(0)
+  {
+    resetStats();
+  }
+
+  CachingRenderContextPool::~CachingRenderContextPool()
+  {
+    clear();
+  }
+
+  void CachingRenderContextPool::add(CachingRenderContext* context)
+  {
+    lock_guard<mutex> lock(_lock);
+
+    _free.insert(_free.begin(), (int)_contexts.size());
+    _contexts.push_back(context);
+    _inUse.push_back(false);
+    _acquiredAt.push_back(Clock::time_point());
+
+    _changed.notify_all();
+  }
+
+  void CachingRenderContextPool::clear()
+  {
+    lock_guard<mutex> lock(_lock);
+
+    if (_free.size() != _contexts.size())
+      Logger::log(ERR, "Render contexts deleted while in use");
+
+    for (auto c : _contexts)
+      delete c;
+
+    _contexts.clear();
+    _free.clear();
+    _inUse.clear();
+    _acquiredAt.clear();
+  }
+
+  size_t CachingRenderContextPool::size()
+  {
+    lock_guard<mutex> lock(_lock);
+    return _contexts.size();
+  }
+
+  CachingRenderContextHandle CachingRenderContextPool::acquire()
+  {
+    unique_lock<mutex> lock(_lock);
+
+    wait(lock, [this]() { return !_free.empty(); });
+
+    return CachingRenderContextHandle(this, pop());
+  }
+
+  CachingRenderContextHandle CachingRenderContextPool::tryAcquire()
+  {
+    lock_guard<mutex> lock(_lock);
+
+    // Don't jump ahead of threads that are waiting.
+    if (_nextTicket != _nowServing || _free.empty())
+      return CachingRenderContextHandle();
+
+    return CachingRenderContextHandle(this, pop());
+  }
+
+  void CachingRenderContextPool::release(int id)
+  {
+    {
+      lock_guard<mutex> lock(_lock);
+
+      if (id < 0 || id >= (int)_contexts.size() || !_inUse[id]) {
+        stringstream ss;
+        ss << "Render context " << id << " released but it isn't in use";
+        Logger::log(ERR, ss.str());
+        return;
+      }
+
+      _inUse[id] = false;
+      _busy += Clock::now() - max(_acquiredAt[id], _statsStart);
+      _free.push_back(id);
+    }
+
+    _changed.notify_all();
+  }
+
+  CachingRenderContext* CachingRenderContextPool::get(int id)
+  {
+    lock_guard<mutex> lock(_lock);
+
+    if (id < 0 || id >= (int)_contexts.size())
+      return nullptr;
+
+    return _contexts[id];
+  }
+
+  void CachingRenderContextPool::forEach(const function<void(CachingRenderContext*)>& f)
+  {
+    unique_lock<mutex> lock(_lock);
+
+    wait(lock, [this]() { return _free.size() == _contexts.size(); });
+
+    for (auto c : _contexts)
+      f(c);
+  }
+
+  CachingRenderContextPool::Stats CachingRenderContextPool::getStats()
+  {
+    lock_guard<mutex> lock(_lock);
+
+    Clock::time_point now = Clock::now();
+    Clock::duration busy = _busy;
+    for (size_t i = 0; i < _contexts.size(); i++) {
+      if (_inUse[i])
+        busy += now - max(_acquiredAt[i], _statsStart);
+    }
+
+    Stats stats;
+    stats.size = _contexts.size();
+    stats.inUse = _contexts.size() - _free.size();
+    stats.waiting = (size_t)(_nextTicket - _nowServing);
+    stats.acquisitions = _acquisitions;
+    stats.waits = _waits;
+    stats.totalWait = chrono::duration<double, milli>(_totalWait).count();
+    stats.maxWait = chrono::duration<double, milli>(_maxWait).count();
+
+    double available = chrono::duration<double>(now - _statsStart).count() * _contexts.size();
+    stats.utilization = (available > 0) ? chrono::duration<double>(busy).count() / available : 0;
+
+    return stats;
+  }
+
+  void CachingRenderContextPool::resetStats()
+  {
+    lock_guard<mutex> lock(_lock);
+
+    _acquisitions = 0;
+    _waits = 0;
+    _totalWait = Clock::duration::zero();
+    _maxWait = Clock::duration::zero();
+    _busy = Clock::duration::zero();
+    _statsStart = Clock::now();
+  }
+
+  void CachingRenderContextPool::wait(unique_lock<mutex>& lock, const function<bool()>& ready)
+  {
+    unsigned long long ticket = _nextTicket++;
+
+    if (ticket == _nowServing && ready()) {
+      _nowServing++;
+      return;
+    }
+
+    Clock::time_point start = Clock::now();
+    _changed.wait(lock, [&]() { return ticket == _nowServing && ready(); });
+    Clock::duration waited = Clock::now() - start;
+
+    _waits++;
+    _totalWait += waited;
+    _maxWait = max(_maxWait, waited);
+
+    // The next thread in line may be able to go as well.
+    _nowServing++;
+    _changed.notify_all();
+  }
+
+  int CachingRenderContextPool::pop()
+  {
+    int id = _free.back();
+    _free.pop_back();
+
+    _inUse[id] = true;
+    _acquiredAt[id] = Clock::now();
+    _acquisitions++;
+
+    return id;
+  }
+
+  void CachingLayerLock::lock()
+  {
+    unique_lock<mutex> lock(_lock);
+
+    _writersWaiting++;
+    _changed.wait(lock, [this]() { return !_writing && _readers == 0; });
+    _writersWaiting--;
+    _writing = true;
+  }
+
+  void CachingLayerLock::unlock()
+  {
+    {
+      lock_guard<mutex> lock(_lock);
+      _writing = false;
+    }
+
+    _changed.notify_all();
+  }
+
+  void CachingLayerLock::lock_shared()
+  {
+    unique_lock<mutex> lock(_lock);
+
+    _changed.wait(lock, [this]() { return !_writing && _writersWaiting == 0; });
+    _readers++;
+  }
+
+  void CachingLayerLock::unlock_shared()
+  {
+    bool last;
+    {
+      lock_guard<mutex> lock(_lock);
+      last = (--_readers == 0);
+    }
+
+    if (last)
+      _changed.notify_all();
   }
 
   CachingArnoldInterface::CachingArnoldInterface() : ArnoldInterface(),
-    _cache_aa_samples(-1), _cache_width(1920), _cache_height(980), _cache_file_path(""), _exposure(1)
+    _cache_aa_samples(-1), _cache_width(1920), _cache_height(980), _cache_file_path(""), _exposure(1),
+    _byteOutput(false), _cache_format(PIXEL_FLOAT), _loadThreads(0), _lazyLoading(false), _loadTotal(0), _loadDone(0),
+    _numContexts(0)
   {
   }
 
@@ -133,6 +430,7 @@ namespace Lumiverse {
         // create new layer
         string name = AiNodeGetStr(light, "name");
         EXRLayer *layer = new EXRLayer(m_width, m_height, name.c_str());
+        layer->set_format(_cache_format);
 
         // Disable layer by default -- enable when we read light nodes from scene in render()
         layer->enable();
@@ -158,10 +456,15 @@ namespace Lumiverse {
 		*/
     
     // We also set up the data needed for running multiple threads in this caching renderer.
-    _maxThreads = thread::hardware_concurrency();
+    unsigned int numContexts = (_numContexts > 0) ? _numContexts : max(thread::hardware_concurrency(), 1u);
 
-    for (int i = 0; i < _maxThreads; i++) {
+    // Contexts render their tiles on the same threads, instead of each starting their own.
+    if (_tilePool == nullptr)
+      _tilePool = make_shared<TilePool>();
+
+    for (unsigned int i = 0; i < numContexts; i++) {
       Compositor* c = new Compositor();
+      c->set_tile_pool(_tilePool);
       for (const auto& l : _layers) {
         c->add_layer(l.second);
       }
@@ -175,7 +478,8 @@ namespace Lumiverse {
       c->_exposure = _exposure;
 
       CachingRenderContext* con = new CachingRenderContext(c, c->get_width(), c->get_height());
-      _contexts.push_back(con);
+      con->setByteOutput(_byteOutput);
+      _contexts.add(con);
     }
 
 
@@ -190,22 +494,26 @@ namespace Lumiverse {
     for (auto l : _layers)
       delete l.second;
 
-    for (auto c : _contexts)
-      delete c;
+    // Layers may have pointed into the mapping.
+    _packedCache.close();
 
-    for (auto& device : cached_devices) {
-      delete device.second;
-    }
+    _contexts.clear();
+
+    _layerKeys.clear();
+    _checkedDevices.clear();
 
 		ArnoldInterface::close();
 	}
 
   float CachingArnoldInterface::getPercentage()
   {
-    // here we don't actually do anything and I don't particularly want
-    // to deal with determining which context we're asking for,
-    // so just say we're done.
-    return 100;
+    // Compositing a frame is close to instant, so the only progress to report
+    // is loading the cache. Layers loaded on first use aren't counted.
+    size_t total = _loadTotal;
+    if (total == 0)
+      return 100;
+
+    return 100.f * _loadDone / total;
   }
 
 	bool CachingArnoldInterface::setDims(int w, int h)  {
@@ -240,23 +548,34 @@ namespace Lumiverse {
 		std::unordered_map<std::string, Device *> to_update;
 
 		for (Device *device : devices) {
+			// Instance ids aren't reused, so a new device at the address of a deleted one won't match.
+			DeviceRevision& checked = _checkedDevices[device];
+			if (!force_cache_reload && checked.instance == device->getInstanceId() && checked.revision == device->getRevision())
+				continue;
+
+			checked.instance = device->getInstanceId();
+			checked.revision = device->getRevision();
+
 			std::string device_name = device->getMetadata("Arnold Node Name");
-			if (!force_cache_reload && (cached_devices.count(device_name) > 0)) {
-				Device *cached = cached_devices.at(device_name);
-				if (!isValidCacheCopy(cached, device)) {
-          if (cached_devices[device_name] != nullptr)
-            delete cached_devices[device_name];
-
-					cached_devices[device_name] = new Device(device);
-					to_update[device_name] = device;
-				}
-			}
-			else {
-				cached_devices[device_name] = new Device(device);
+			size_t key = getCacheKey(device);
+
+			auto cached = _layerKeys.find(device_name);
+			if (force_cache_reload || cached == _layerKeys.end() || cached->second != key) {
+				_layerKeys[device_name] = key;
 				to_update[device_name] = device;
 			}
 		}
 
+		// Forget devices that are no longer passed in, like copies made for earlier frames.
+		if (_checkedDevices.size() > 2 * devices.size()) {
+			for (auto it = _checkedDevices.begin(); it != _checkedDevices.end(); ) {
+				if (devices.count(it->first) == 0)
+					it = _checkedDevices.erase(it);
+				else
+					it++;
+			}
+		}
+
 		return to_update;
 	}
 
@@ -273,10 +592,14 @@ namespace Lumiverse {
 			return;
 		}
 
+    // Renders on other contexts read the layers being replaced.
+    lock_guard<CachingLayerLock> layers(_layerLock);
+
 		memset(m_render_buffer, 0, _cache_width * _cache_height * 4 * sizeof(float));
 
 		// render each per-light layer
 		std::cout << "Rendering layers" << std::endl;
+    set<string> rendered;
 		AtNodeIterator *it = AiUniverseGetNodeIterator(AI_NODE_LIGHT);
 		while (!AiNodeIteratorFinished(it)) {
 			AtNode *light = AiNodeIteratorGetNext(it);
@@ -324,7 +647,11 @@ namespace Lumiverse {
 				layer_buffer[idx].a = !!m_render_buffer[buf_idx + 3];
 			}
 
+      // Only keep the part of the frame the light reaches.
+      layer->compact();
+
       layer->enable();
+      rendered.insert(name);
 
 			// disable light
 			AiNodeSetDisabled(light, true);
@@ -333,7 +660,7 @@ namespace Lumiverse {
 		AiNodeIteratorDestroy(it);
 
     // autosave to disk
-    dumpCache();
+    writeCache(rendered);
 #else
     // Logger::log(WARN, "Cannot rengenerate cache, compiled without Arnold support.");
 #endif
@@ -346,39 +673,36 @@ namespace Lumiverse {
 		ArnoldInterface::setSamples(_cache_aa_samples);
 	}
 
-	int CachingArnoldInterface::render(const std::set<Device *> &devices, int w, int h, int& cid) {
-    // pick a context to use
-    CachingRenderContext* selected = nullptr;
-
-    while (selected == nullptr) {
-      cid = 0;
-      for (auto& c : _contexts) {
-        if (c->_inUse.try_lock()) {
-          c->_compositor->_exposure = _exposure;
-          selected = c;
-          break;
-        }
-        cid++;
-      }
-      this_thread::sleep_for(chrono::microseconds(5));
-    }
+	int CachingArnoldInterface::render(const std::set<Device *> &devices, int w, int h, CachingRenderContextHandle& context) {
+    // wait for a free context
+    context = _contexts.acquire();
+    CachingRenderContext* selected = context.get();
+    selected->_compositor->_exposure = _exposure;
 
     // set up context
     selected->setSize(w, h);
     updateDevicesLayers(devices);
 		tone_mapper.set_gamma(m_gamma);
+    selected->_toneMapper.set_gamma(m_gamma);
 
-    // do the render
+    // do the render, tone mapping each tile as it's composited
+    _layerLock.lock_shared();
     selected->render(devices);
-    tone_mapper.apply_hdr_inplace(selected->_compositor->get_compose_buffer(), selected->_buffer, selected->_w, selected->_h);
-
-    // note that we don't unlock the context yet we wait for the patch to copy the
-    // proper buffer over and unlock it.
+    _layerLock.unlock_shared();
 
 		force_cache_reload = false;
 		return 0;
 	}
 
+	int CachingArnoldInterface::render(const std::set<Device *> &devices, int w, int h, int& cid) {
+    CachingRenderContextHandle context;
+    int result = render(devices, w, h, context);
+
+    // the context stays in use until the patch has copied the buffer over and closed it
+    cid = context.detach();
+    return result;
+	}
+
 	void CachingArnoldInterface::setHDROutputBuffer() {
 		tone_mapper.set_output_hdr(m_buffer);
 	}
@@ -395,7 +719,10 @@ namespace Lumiverse {
     header.channels().insert("G", OPENEXR_IMF_INTERNAL_NAMESPACE::Channel(OPENEXR_IMF_INTERNAL_NAMESPACE::FLOAT));
     header.channels().insert("B", OPENEXR_IMF_INTERNAL_NAMESPACE::Channel(OPENEXR_IMF_INTERNAL_NAMESPACE::FLOAT));
 
-    Pixel4* pixels = l->get_pixels();
+    // Leaves the layer as it is, it may point into the packed cache.
+    vector<Pixel4> buffer(l->get_size());
+    l->copy_pixels(buffer.data());
+    Pixel4* pixels = buffer.data();
 
     OPENEXR_IMF_INTERNAL_NAMESPACE::OutputFile out(file.c_str(), header);
     OPENEXR_IMF_INTERNAL_NAMESPACE::FrameBuffer fb;
@@ -440,57 +767,38 @@ namespace Lumiverse {
 	}
 #endif
 
-	bool CachingArnoldInterface::isValidCacheCopy(Device *cached_device, Device *other_device) {
-		if (cached_device->getId() != other_device->getId()) return false;
-		if (cached_device->getType() != other_device->getType()) return false;
-
-		// num parameter check
-		if (cached_device->getRawParameters().size() != other_device->getRawParameters().size()) {
-			return false;
-		}
-
-		// penumbra angle
-		if (cached_device->paramExists("penumbraAngle")) {
-			if (((LumiverseFloat *)(cached_device->getParam("penumbraAngle")))->getVal() != ((LumiverseFloat *)other_device->getParam("penumbraAngle"))->getVal()) {
-				return false;
-			}
-		}
+	size_t CachingArnoldInterface::getCacheKey(Device *device) {
+		static const string params[] = { "penumbraAngle", "lookAtX", "lookAtY", "lookAtZ", "polar", "azimuth", "distance" };
 
-		// position
-		if (cached_device->paramExists("lookAtX") && cached_device->paramExists("lookAtY") && cached_device->paramExists("lookAtZ")) {
-			LumiverseFloat *cachedX = (LumiverseFloat *)cached_device->getParam("lookAtX");
-			LumiverseFloat *cachedY = (LumiverseFloat *)cached_device->getParam("lookAtY");
-			LumiverseFloat *cachedZ = (LumiverseFloat *)cached_device->getParam("lookAtZ");
+		size_t key = 0;
+		auto combine = [&key](size_t h) { key ^= h + 0x9e3779b9 + (key << 6) + (key >> 2); };
 
-			LumiverseFloat *otherX = (LumiverseFloat *)other_device->getParam("lookAtX");
-			LumiverseFloat *otherY = (LumiverseFloat *)other_device->getParam("lookAtY");
-			LumiverseFloat *otherZ = (LumiverseFloat *)other_device->getParam("lookAtZ");
+		combine(hash<string>()(device->getId()));
+		combine(hash<string>()(device->getType()));
+		combine(device->getRawParameters().size());
 
-			if ((cachedX->getVal() != otherX->getVal()) || (cachedY->getVal() != otherY->getVal()) || (cachedZ->getVal() != otherZ->getVal())) {
-				return false;
+		for (const string& name : params) {
+			LumiverseType* param = device->getParam(name);
+			if (param == nullptr) {
+				combine(0);
 			}
-		}
-
-		// rotation
-		if (cached_device->paramExists("polar") && cached_device->paramExists("azimuth")) {
-			LumiverseFloat *cachedPolar = (LumiverseFloat *)cached_device->getParam("polar");
-			LumiverseFloat *cachedAzim = (LumiverseFloat *)cached_device->getParam("azimuth");
-
-			LumiverseFloat *otherPolar = (LumiverseFloat *)cached_device->getParam("polar");
-			LumiverseFloat *otherAzim = (LumiverseFloat *)cached_device->getParam("azimuth");
-
-			if ((cachedPolar->getVal() != otherPolar->getVal()) || (cachedAzim->getVal() != otherAzim->getVal())) {
-				return false;
+			else if (param->getTypeName() == "float") {
+				combine(hash<float>()(((LumiverseFloat*)param)->getVal()));
+			}
+			else if (param->getTypeName() == "orientation") {
+				combine(hash<float>()(((LumiverseOrientation*)param)->valAsUnit(RADIAN)));
+			}
+			else {
+				combine(hash<string>()(param->asString()));
 			}
 		}
 
-		// distance
-		if (cached_device->paramExists("distance")) {
-			return ((LumiverseFloat *)cached_device->getParam("distance"))->getVal() == 
-				((LumiverseFloat*)other_device->getParam("distance"))->getVal();
+		for (const string& name : device->getFocusPaletteNames()) {
+			combine(hash<string>()(name));
+			combine(hash<string>()(device->getFocusPalette(name)->_image));
 		}
 
-		return true;
+		return key;
 	}
 
 #ifdef USE_ARNOLD
@@ -504,37 +812,150 @@ namespace Lumiverse {
 #endif
 
   void CachingArnoldInterface::dumpCache()
+  {
+    lock_guard<mutex> lock(_updateLock);
+    lock_guard<CachingLayerLock> layers(_layerLock);
+
+    set<string> names;
+    for (auto& l : _layerKeys) {
+      names.insert(l.first);
+    }
+
+    writeCache(names);
+  }
+
+  void CachingArnoldInterface::writeCache(const set<string>& names)
   {
     if (_cache_file_path == "") {
       Logger::log(ERR, "Can't save cache when path is not set.");
       return;
     }
 
-    for (auto& d : cached_devices) {
-      string name = d.second->getMetadata("Arnold Node Name");
+    for (auto& name : names) {
+      auto layer = _layers.find(name);
+      if (layer != _layers.end())
+        saveLayer(layer->second);
+    }
+
+    if (!_layers.empty())
+      LayerCacheFile::write(getPackedCachePath(), _layers);
+  }
 
-      saveLayer(_layers[name.c_str()]);
+  bool CachingArnoldInterface::convertCache(const set<Device*>& devices)
+  {
+    if (_cache_file_path == "") {
+      Logger::log(ERR, "Can't convert cache when path is not set.");
+      return false;
     }
+
+    vector<string> names;
+    for (auto& d : devices) {
+      for (auto& name : getLayerNames(d)) {
+        // Replace anything already loaded with the exr copy.
+        auto existing = _layers.find(name);
+        if (existing != _layers.end()) {
+          delete existing->second;
+          _layers.erase(existing);
+        }
+
+        names.push_back(name);
+      }
+    }
+
+    readLayers(names);
+
+    if (_layers.empty()) {
+      Logger::log(ERR, "No exr layers found in " + _cache_file_path);
+      return false;
+    }
+
+    return LayerCacheFile::write(getPackedCachePath(), _layers);
   }
 
   void CachingArnoldInterface::loadCache(const set<Device*>& devices)
   {
+    // Only the layer index is read up front. Tiles are paged in as they're composited.
+    if (!_packedCache.isOpen() && _cache_file_path != "" && ifstream(getPackedCachePath()).good()) {
+      if (_packedCache.open(getPackedCachePath()))
+        Logger::log(INFO, "Using packed cache " + getPackedCachePath());
+    }
+
+    // Layers that aren't in the packed cache come from exr files. In lazy mode the
+    // layers of devices that are off are read the first time they're composited.
+    vector<string> packed;
+    vector<string> toRead;
+    vector<string> toDefer;
+
     for (auto& d : devices) {
-      vector<string> fp = d->getFocusPaletteNames();
-      if (fp.size() > 0) {
-        for (auto& id : fp) {
-          load_exr(d->getFocusPalette(id)->_image);
+      bool off = d->getIntensity() == nullptr || d->getIntensity()->asPercent() == 0;
+
+      for (auto& name : getLayerNames(d)) {
+        if (loadPackedLayer(name)) {
+          packed.push_back(name);
+          continue;
         }
 
-        cached_devices[d->getId()] = new Device(d);
+        if (!ifstream(getExrPath(name)).good())
+          continue;
+
+        if (_lazyLoading && off)
+          toDefer.push_back(name);
+        else
+          toRead.push_back(name);
       }
-      else {
-        if (load_exr(d->getMetadata("Arnold Node Name")) == 0) {
-          cached_devices[d->getId()] = new Device(d);
-        }
+    }
+
+    prepareLayers(packed);
+    readLayers(toRead);
+
+    // Deferred layers are the same size as the rest of the cache. If no layer was loaded
+    // to size it, the size comes from the header of a deferred file.
+    bool sized = !packed.empty();
+    for (auto& name : toRead) {
+      if (_layers.count(name) > 0)
+        sized = true;
+    }
+
+    if (!toDefer.empty() && !sized) {
+      int w, h;
+      if (readExrSize(getExrPath(toDefer[0]), w, h) == 0) {
+        _cache_width = w;
+        _cache_height = h;
       }
     }
 
+    for (auto& name : toDefer) {
+      string path = getExrPath(name);
+      int w = _cache_width;
+      int h = _cache_height;
+
+      EXRLayer* layer = new EXRLayer(w, h, name.c_str(), [path, w, h]() -> Pixel4* {
+        Pixel4* pixels;
+        int fw, fh;
+        if (readExr(path, pixels, fw, fh) != 0)
+          return nullptr;
+
+        if (fw != w || fh != h) {
+          Logger::log(ERR, path + " doesn't match the size of the cache");
+          delete[] pixels;
+          return nullptr;
+        }
+
+        return pixels;
+      });
+      layer->set_format(_cache_format);
+      _layers[name] = layer;
+    }
+
+    if (!toDefer.empty())
+      Logger::log(INFO, "Deferred loading " + to_string(toDefer.size()) + " cache layers until they're used");
+
+    for (auto& d : devices) {
+      string name = d->getMetadata("Arnold Node Name");
+      if (d->getFocusPaletteNames().size() > 0 || _layers.count(name) > 0)
+        _layerKeys[name] = getCacheKey(d);
+    }
+
 		if (_layers.size() > 0) {
 			m_width = _layers.begin()->second->get_width();
 			m_height = _layers.begin()->second->get_height();
@@ -542,6 +963,137 @@ namespace Lumiverse {
 		}
   }
 
+  bool CachingArnoldInterface::loadPackedLayer(string name)
+  {
+    EXRLayer* layer = _packedCache.createLayer(name);
+    if (layer == nullptr)
+      return false;
+
+    _cache_width = (int)layer->get_width();
+    _cache_height = (int)layer->get_height();
+    _layers[name] = layer;
+
+    return true;
+  }
+
+  void CachingArnoldInterface::readLayers(const vector<string>& names)
+  {
+    if (names.empty())
+      return;
+
+    vector<EXRLayer*> layers(names.size(), nullptr);
+    vector<int> widths(names.size());
+    vector<int> heights(names.size());
+
+    _loadDone = 0;
+    _loadTotal = names.size();
+
+    auto start = chrono::high_resolution_clock::now();
+
+    // Each thread only holds one full size buffer at a time, since layers are
+    // compacted as soon as they're read. Compacting also builds the mips.
+    PixelFormat format = _cache_format;
+    unsigned int threads = parallelFor(names.size(), [&](size_t i) {
+      Pixel4* pixels;
+      if (readExr(getExrPath(names[i]), pixels, widths[i], heights[i]) == 0) {
+        layers[i] = new EXRLayer(widths[i], heights[i], names[i].c_str(), nullptr);
+        layers[i]->set_format(format);
+        layers[i]->set_pixels(pixels);
+
+        // Only keep the part of the frame the light reaches.
+        layers[i]->compact();
+      }
+
+      _loadDone++;
+    });
+
+    size_t loaded = 0;
+    for (size_t i = 0; i < names.size(); i++) {
+      if (layers[i] == nullptr)
+        continue;
+
+      _cache_width = widths[i];
+      _cache_height = heights[i];
+      _layers[names[i]] = layers[i];
+      loaded++;
+    }
+
+    _loadTotal = 0;
+
+    double ms = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+    Logger::log(INFO, "Loaded " + to_string(loaded) + " of " + to_string(names.size()) + " cache layers in " +
+      to_string((int)ms) + "ms on " + to_string(threads) + " threads");
+  }
+
+  void CachingArnoldInterface::prepareLayers(const vector<string>& names)
+  {
+    if (names.empty())
+      return;
+
+    vector<EXRLayer*> layers;
+    for (auto& name : names) {
+      layers.push_back(_layers[name]);
+    }
+
+    auto start = chrono::high_resolution_clock::now();
+
+    // Both touch every tile, so it's faster to write the packed cache in the format used.
+    PixelFormat format = _cache_format;
+    unsigned int threads = parallelFor(layers.size(), [&](size_t i) {
+      layers[i]->set_format(format);
+      layers[i]->build_mips();
+    });
+
+    double ms = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+    Logger::log(INFO, "Built mips of " + to_string(layers.size()) + " packed cache layers in " +
+      to_string((int)ms) + "ms on " + to_string(threads) + " threads");
+  }
+
+  unsigned int CachingArnoldInterface::parallelFor(size_t count, const function<void(size_t)>& f)
+  {
+    unsigned int threads = _loadThreads;
+    if (threads == 0)
+      threads = max(thread::hardware_concurrency(), 1u);
+    if (threads > count)
+      threads = (unsigned int)count;
+
+    // Threads take the next item until they run out.
+    atomic<size_t> next(0);
+    auto worker = [&]() {
+      for (size_t i = next++; i < count; i = next++) {
+        f(i);
+      }
+    };
+
+    vector<thread> workers;
+    for (unsigned int i = 1; i < threads; i++) {
+      workers.push_back(thread(worker));
+    }
+
+    worker();
+
+    for (auto& t : workers) {
+      t.join();
+    }
+
+    return threads;
+  }
+
+  vector<string> CachingArnoldInterface::getLayerNames(Device* d)
+  {
+    vector<string> names;
+
+    vector<string> fp = d->getFocusPaletteNames();
+    for (auto& id : fp) {
+      names.push_back(d->getFocusPalette(id)->_image);
+    }
+
+    if (names.empty())
+      names.push_back(d->getMetadata("Arnold Node Name"));
+
+    return names;
+  }
+
   void CachingArnoldInterface::loadIfUsingCaching(const set<Device*>& devices)
   {
     loadCache(devices);
@@ -549,12 +1101,29 @@ namespace Lumiverse {
 
   float * CachingArnoldInterface::getBufferForContext(int contextId)
   {
-    return _contexts[contextId]->_buffer;
+    return _contexts.get(contextId)->_buffer;
+  }
+
+  unsigned char * CachingArnoldInterface::getBytesForContext(int contextId)
+  {
+    return _contexts.get(contextId)->_bytes;
+  }
+
+  Compositor::RenderTimings CachingArnoldInterface::getRenderTimings(int contextId)
+  {
+    return _contexts.get(contextId)->_compositor->get_timings();
+  }
+
+  void CachingArnoldInterface::setByteOutput(bool enabled)
+  {
+    _byteOutput = enabled;
+
+    _contexts.forEach([enabled](CachingRenderContext* c) { c->setByteOutput(enabled); });
   }
 
   void CachingArnoldInterface::closeContext(int contextId)
   {
-    _contexts[contextId]->_inUse.unlock();
+    _contexts.release(contextId);
   }
 
   JSONNode CachingArnoldInterface::toJSON()
@@ -567,6 +1136,17 @@ namespace Lumiverse {
     opts.push_back(JSONNode("path", _cache_file_path));
     opts.push_back(JSONNode("exposure", _exposure));
 
+    if (_cache_format == PIXEL_HALF)
+      opts.push_back(JSONNode("format", "half"));
+    else if (_cache_format == PIXEL_RGB9E5)
+      opts.push_back(JSONNode("format", "rgb9e5"));
+    else
+      opts.push_back(JSONNode("format", "float"));
+
+    opts.push_back(JSONNode("load_threads", (int)_loadThreads));
+    opts.push_back(JSONNode("lazy_load", _lazyLoading));
+    opts.push_back(JSONNode("contexts", (int)_numContexts));
+
     return opts;
   }
 
@@ -580,12 +1160,52 @@ namespace Lumiverse {
     _exposure = e;
   }
 
+  void CachingArnoldInterface::setCacheFormat(PixelFormat format)
+  {
+    lock_guard<mutex> lock(_updateLock);
+    lock_guard<CachingLayerLock> layers(_layerLock);
+
+    _cache_format = format;
+
+    size_t bytes = 0;
+    for (const auto& l : _layers) {
+      l.second->set_format(format);
+      bytes += l.second->get_memory_usage();
+    }
+
+    if (!_layers.empty())
+      Logger::log(INFO, "Cache uses " + to_string(bytes >> 20) + "MB after format change");
+  }
+
 	bool CachingArnoldInterface::optionRequiresCacheReload(const std::string &paramName) {
 		return paramName == "AA_samples";
 	}
 
   int CachingArnoldInterface::load_exr(string& filename) {
-    string file_path = _cache_file_path + "/" + filename + ".exr";
+    Pixel4 *pixels;
+    int width, height;
+
+    int result = readExr(getExrPath(filename), pixels, width, height);
+    if (result != 0)
+      return result;
+
+    _cache_width = width;
+    _cache_height = height;
+
+    // add layer
+    EXRLayer *layer = new EXRLayer(_cache_width, _cache_height, filename.c_str(), nullptr);
+    layer->set_format(_cache_format);
+    layer->set_pixels(pixels);
+    layer->enable();
+    _layers[filename] = layer;
+
+    // Only keep the part of the frame the light reaches.
+    layer->compact();
+
+    return 0;
+  }
+
+  int CachingArnoldInterface::readExrSize(const string& file_path, int& width, int& height) {
 
     // check for existence before loading
     ifstream fileCheck(file_path);
@@ -612,19 +1232,28 @@ namespace Lumiverse {
     // read dimensions
     OPENEXR_IMF_INTERNAL_NAMESPACE::InputFile file(file_path.c_str());
     IMATH_INTERNAL_NAMESPACE::Box2i dw = file.header().dataWindow();
-    _cache_width = dw.max.x - dw.min.x + 1;
-    _cache_height = dw.max.y - dw.min.y + 1;
+    width = dw.max.x - dw.min.x + 1;
+    height = dw.max.y - dw.min.y + 1;
+
+    return 0;
+  }
+
+  int CachingArnoldInterface::readExr(const string& file_path, Pixel4*& pixels, int& width, int& height) {
+    int result = readExrSize(file_path, width, height);
+    if (result != 0)
+      return result;
+
+    OPENEXR_IMF_INTERNAL_NAMESPACE::InputFile file(file_path.c_str());
+    IMATH_INTERNAL_NAMESPACE::Box2i dw = file.header().dataWindow();
 
     // Assuming the files were saved with Lumiverse, there will be 3 channels here.
 
-    // read layers
-    Pixel4 *pixels;
     // read pixels
     OPENEXR_IMF_INTERNAL_NAMESPACE::FrameBuffer frame_buffer;
     // each file is assumed to be one layer
 
     // allocate memory
-    pixels = new Pixel4[_cache_width * _cache_height]();
+    pixels = new Pixel4[width * height]();
     if (!pixels) {
       Logger::log(ERR, "Failed to allocate memory for new layer");
       return -4;
@@ -635,7 +1264,7 @@ namespace Lumiverse {
       OPENEXR_IMF_INTERNAL_NAMESPACE::Slice(OPENEXR_IMF_INTERNAL_NAMESPACE::FLOAT,
       (char *)&pixels[0].r,  // base
         sizeof(Pixel4) * 1,    // xstride
-        sizeof(Pixel4) * _cache_width,    // ystride
+        sizeof(Pixel4) * width,    // ystride
         1, 1,                  // sampling
         0.0));                 // fill value
                      // layer.R
@@ -643,7 +1272,7 @@ namespace Lumiverse {
       OPENEXR_IMF_INTERNAL_NAMESPACE::Slice(OPENEXR_IMF_INTERNAL_NAMESPACE::FLOAT,
       (char *)&pixels[0].g,  // base
         sizeof(Pixel4) * 1,    // xstride
-        sizeof(Pixel4) * _cache_width,    // ystride
+        sizeof(Pixel4) * width,    // ystride
         1, 1,                  // sampling
         0.0));                 // fill value
                      // layer.R
@@ -651,16 +1280,10 @@ namespace Lumiverse {
       OPENEXR_IMF_INTERNAL_NAMESPACE::Slice(OPENEXR_IMF_INTERNAL_NAMESPACE::FLOAT,
       (char *)&pixels[0].b,  // base
         sizeof(Pixel4) * 1,    // xstride
-        sizeof(Pixel4) * _cache_width,    // ystride
+        sizeof(Pixel4) * width,    // ystride
         1, 1,                  // sampling
         0.0));                 // fill value
 
-    // add layer
-    EXRLayer *layer = new EXRLayer(_cache_width, _cache_height, filename.c_str());
-    layer->set_pixels(pixels);
-    layer->enable();
-    _layers[filename] = layer;
-
     // read pixels
     file.setFrameBuffer(frame_buffer);
     file.readPixels(dw.min.y, dw.max.y);
@@ -22,12 +22,17 @@
 #include "Compositor.h"
 #include "ToneMapper.h"
 #include "EXRLayer.h"
+#include "LayerCache.h"
 #include <thread>
 #include <algorithm>
 #include <unordered_map>
 #include <set>
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+#include <chrono>
 
 namespace Lumiverse {
 
@@ -37,14 +42,204 @@ namespace Lumiverse {
     CachingRenderContext(Compositor* c, int w, int h);
     ~CachingRenderContext();
 
+    /*! \brief Resizes the buffers. Does nothing if the size hasn't changed. */
     void setSize(int w, int h);
+
+    /*! \brief Allocates or frees the RGBA8 output buffer. */
+    void setByteOutput(bool enabled);
+
+    /*! \brief Composites and tone maps the devices into the output buffers in one pass. */
     void render(const set<Device*>& d);
 
     Compositor* _compositor;
+    /*! \brief Tone mapper for this context, so contexts can render at the same time. */
+    ToneMapper _toneMapper;
+    /*! \brief Tone mapped RGBA floats. */
     float* _buffer;
+    /*! \brief Tone mapped RGBA8, or nullptr if byte output is off. */
+    unsigned char* _bytes;
     int _w;
     int _h;
-    mutex _inUse;
+  };
+
+  class CachingRenderContextPool;
+
+  /*!
+  \brief Holds a context acquired from a CachingRenderContextPool and returns it to the
+  pool when destroyed.
+
+  Handles can be moved but not copied. An empty handle holds no context.
+  */
+  class CachingRenderContextHandle
+  {
+  public:
+    CachingRenderContextHandle();
+    CachingRenderContextHandle(CachingRenderContextPool* pool, int id);
+    CachingRenderContextHandle(CachingRenderContextHandle&& other);
+    CachingRenderContextHandle(const CachingRenderContextHandle& other) = delete;
+    ~CachingRenderContextHandle();
+
+    CachingRenderContextHandle& operator=(CachingRenderContextHandle&& other);
+    CachingRenderContextHandle& operator=(const CachingRenderContextHandle& other) = delete;
+
+    /*! \brief Returns the context to the pool now. Does nothing if the handle is empty. */
+    void release();
+
+    /*!
+    \brief Empties the handle without returning the context to the pool.
+    \return Id of the context, to be passed to CachingRenderContextPool::release() later. -1 if empty.
+    */
+    int detach();
+
+    /*! \brief Id of the held context, -1 if empty. */
+    int getId() const { return _id; }
+
+    CachingRenderContext* get() const;
+    CachingRenderContext* operator->() const { return get(); }
+    explicit operator bool() const { return _pool != nullptr; }
+
+  private:
+    CachingRenderContextPool* _pool;
+    int _id;
+  };
+
+  /*!
+  \brief Fixed set of render contexts shared by the threads calling render.
+
+  Threads that find no free context sleep until one is released, and are served
+  in the order they arrived. The most recently released context is handed out first
+  so its buffers are more likely to still be in cache.
+  */
+  class CachingRenderContextPool
+  {
+  public:
+    /*! \brief Pool metrics. Times are in ms, counts are since the last resetStats(). */
+    struct Stats {
+      /*! \brief Contexts in the pool. */
+      size_t size;
+      /*! \brief Contexts currently acquired. */
+      size_t inUse;
+      /*! \brief Threads currently waiting for a context. */
+      size_t waiting;
+      size_t acquisitions;
+      /*! \brief Times a thread had to wait for its turn, in acquire() or forEach(). */
+      size_t waits;
+      double totalWait;
+      double maxWait;
+      /*! \brief Fraction of the available context time that contexts were held, 0 to 1. */
+      double utilization;
+    };
+
+    CachingRenderContextPool();
+
+    /*! \brief Deletes the contexts. */
+    ~CachingRenderContextPool();
+
+    /*! \brief Adds a context to the pool, which takes ownership of it. */
+    void add(CachingRenderContext* context);
+
+    /*! \brief Deletes all contexts. None may be in use. */
+    void clear();
+
+    size_t size();
+
+    /*! \brief Waits until a context is free and acquires it. */
+    CachingRenderContextHandle acquire();
+
+    /*! \brief Acquires a context without waiting. Returns an empty handle if none are free. */
+    CachingRenderContextHandle tryAcquire();
+
+    /*!
+    \brief Returns a context to the pool. Handles call this when destroyed.
+
+    Logs an error if the context isn't in use.
+    */
+    void release(int id);
+
+    /*!
+    \brief Context with the given id, or nullptr if there is none.
+
+    Contexts aren't locked by this, so the caller should hold the context.
+    */
+    CachingRenderContext* get(int id);
+
+    /*!
+    \brief Waits until every context is free, then calls f on each of them.
+
+    Waits in line with threads calling acquire(), and no context can be acquired
+    until f has returned for all of them.
+    */
+    void forEach(const function<void(CachingRenderContext*)>& f);
+
+    Stats getStats();
+    void resetStats();
+
+  private:
+    typedef chrono::steady_clock Clock;
+
+    /*!
+    \brief Waits for this thread's turn and for ready() to be true, recording the wait.
+    Must be called with _lock held.
+    */
+    void wait(unique_lock<mutex>& lock, const function<bool()>& ready);
+
+    /*! \brief Takes a context off the free list. Must be called with _lock held. */
+    int pop();
+
+    vector<CachingRenderContext*> _contexts;
+
+    /*! \brief Ids of the free contexts. The back is handed out next. */
+    vector<int> _free;
+
+    /*! \brief Whether each context is acquired, and when. */
+    vector<bool> _inUse;
+    vector<Clock::time_point> _acquiredAt;
+
+    mutex _lock;
+
+    /*! \brief Signalled when a context is released or a waiting thread is served. */
+    condition_variable _changed;
+
+    /*! \brief Waiting threads take a ticket and are served in ticket order. */
+    unsigned long long _nextTicket;
+    unsigned long long _nowServing;
+
+    size_t _acquisitions;
+    size_t _waits;
+    Clock::duration _totalWait;
+    Clock::duration _maxWait;
+
+    /*! \brief Time contexts were held for since _statsStart, not counting contexts still held. */
+    Clock::duration _busy;
+    Clock::time_point _statsStart;
+  };
+
+  /*!
+  \brief Lets any number of renders read the cache layers at once, or one thread change them.
+
+  Threads waiting to change the layers go ahead of renders that haven't started, so a
+  steady stream of renders can't hold them off. Uses the names of the standard mutex
+  functions so it works with lock_guard.
+  */
+  class CachingLayerLock
+  {
+  public:
+    CachingLayerLock() : _readers(0), _writersWaiting(0), _writing(false) { }
+
+    /*! \brief Waits until no render is reading the layers and keeps new ones from starting. */
+    void lock();
+    void unlock();
+
+    /*! \brief Waits until no thread is changing the layers and starts reading them. */
+    void lock_shared();
+    void unlock_shared();
+
+  private:
+    mutex _lock;
+    condition_variable _changed;
+    size_t _readers;
+    size_t _writersWaiting;
+    bool _writing;
   };
 
   /*!
@@ -71,11 +266,22 @@ namespace Lumiverse {
 		*/
 		void close() override;
 
+    /*!
+    \brief Progress of loading the cache from exr files. 100 when nothing is loading.
+    */
     virtual float getPercentage() override;
 
 		/*!
 		* \brief Now that all of the EXR layers have been rendered (i.e. the cache has been filled),
 		* render an image per the light node parameters.
+		*
+		* Waits for a free render context. The result is left in the context, which
+		* goes back to the pool when the handle is released or destroyed.
+		*/
+		int render(const std::set<Device *> &devices, int w, int h, CachingRenderContextHandle& context);
+
+		/*!
+		\brief Renders like the handle version, but the context is held until closeContext(cid).
 		*/
 		int render(const std::set<Device *> &devices, int w, int h, int& cid);
 
@@ -113,9 +319,24 @@ namespace Lumiverse {
 
     /*!
     \brief Saves cache layers to exr files for reuse.
+
+    Also writes the layers to a packed cache file, which is loaded instead of the exr
+    files when it exists. Layers re-rendered by render() are saved automatically.
     */
     void dumpCache();
 
+    /*!
+    \brief Converts a cache saved as exr files into a packed cache file.
+
+    Loads the layers of the given devices from the exr files in the cache path, ignoring
+    any packed cache file there, then writes them to the packed cache file. Call before init().
+    \return false if no layers could be loaded or the file couldn't be written.
+    */
+    bool convertCache(const set<Device*>& devices);
+
+    /*! \brief Location of the packed cache file in the cache path. */
+    string getPackedCachePath() { return _cache_file_path + "/layers.lvcache"; }
+
     /*!
     \brief If the interface is caching it should use this function to perform any
     preload operations it may be doing.
@@ -125,14 +346,67 @@ namespace Lumiverse {
     /*! \brief Returns the buffer associated with the given context. */
     float* getBufferForContext(int contextId);
 
+    /*! \brief Returns the RGBA8 buffer associated with the given context. nullptr if byte output is off. */
+    unsigned char* getBytesForContext(int contextId);
+
+    /*! \brief Returns the time spent in each stage of the last render of the given context. */
+    Compositor::RenderTimings getRenderTimings(int contextId);
+
     /*! \brief Releases the specified context back into the pool. */
     void closeContext(int contextId);
 
+    /*!
+    \brief Sets the number of render contexts, which is how many renders can run at once.
+    0 uses one per hardware thread. Takes effect on the next init().
+    */
+    void setNumContexts(unsigned int contexts) { _numContexts = contexts; }
+    unsigned int getNumContexts() { return _numContexts; }
+
+    /*! \brief Wait times and utilization of the render contexts. */
+    CachingRenderContextPool::Stats getContextStats() { return _contexts.getStats(); }
+    void resetContextStats() { _contexts.resetStats(); }
+
+    /*!
+    \brief If true, render() also writes the frame as RGBA8 in the same pass.
+
+    Saves a separate conversion pass for clients that display 8 bit images. Waits for
+    contexts that are in use to be closed.
+    \sa getBytesForContext()
+    */
+    void setByteOutput(bool enabled);
+    bool getByteOutput() { return _byteOutput; }
+
     virtual JSONNode toJSON() override;
 
     float getExposure();
     void setExposure(float e);
 
+    /*!
+    \brief Sets the format cached layers are kept in memory as.
+
+    PIXEL_HALF halves the memory used by the cache and PIXEL_RGB9E5 quarters it, in
+    exchange for a small error in the composite. See PixelFormat for the bounds.
+    Layers already in the cache are converted. Files on disk are always float.
+    */
+    void setCacheFormat(PixelFormat format);
+    PixelFormat getCacheFormat() { return _cache_format; }
+
+    /*!
+    \brief Sets the number of threads cache layers are loaded on. 0 uses one per hardware thread.
+    */
+    void setLoadThreads(unsigned int threads) { _loadThreads = threads; }
+    unsigned int getLoadThreads() { return _loadThreads; }
+
+    /*!
+    \brief If true, the exr files of devices that are off when the cache is loaded are only
+    read the first time the device is composited.
+
+    Shortens the time to the first frame of large shows, at the cost of a pause the first
+    time each of those devices is turned on.
+    */
+    void setLazyLoading(bool lazy) { _lazyLoading = lazy; }
+    bool isLazyLoading() { return _lazyLoading; }
+
 	protected:
 
 		const static int DEFAULT_WIDTH = 1920;
@@ -151,6 +425,25 @@ namespace Lumiverse {
 		*/
 		int load_exr(string& filename);
 
+    /*!
+    \brief Reads the RGB channels of an exr file into a new buffer.
+
+    Doesn't touch the interface, so it's safe to call from several threads.
+    \param file_path File to read.
+    \param pixels Set to a new buffer of width * height pixels on success.
+    \return 0 on success, or the same error codes as load_exr.
+    */
+    static int readExr(const string& file_path, Pixel4*& pixels, int& width, int& height);
+
+    /*!
+    \brief Reads the size of an exr file from its header without reading the pixels.
+    \return 0 on success, or the same error codes as load_exr.
+    */
+    static int readExrSize(const string& file_path, int& width, int& height);
+
+    /*! \brief Location of a layer's exr file in the cache path. */
+    string getExrPath(const string& name) { return _cache_file_path + "/" + name + ".exr"; }
+
 		/*!
 		\brief Update each lighting device's basis layer if necessary
 		*/
@@ -158,15 +451,33 @@ namespace Lumiverse {
 
 		/*!
 		\brief Get a list of devices that need to be updated / re-rendered
+
+		Only devices whose revision changed since the last call are looked at, so a render
+		where nothing moved doesn't read any parameters.
 		*/
 		const std::unordered_map<std::string, Device*> getDevicesToUpdate(const std::set<Device *> &devices);
 
 		/*!
-		* \brief A map from a device name to the device. This is used
-		* to determine when a device has changed and needs to be updated
+		* \brief Hash of the parameters that change a device's cache layer: id, type, position,
+		* rotation, beam and focus palettes. Intensity and color aren't included.
+		*/
+		size_t getCacheKey(Device* device);
+
+		/*!
+		* \brief Cache key of the device each layer was last rendered or loaded for, by Arnold
+		* node name. Used to determine when a device has changed and needs to be updated
 		* in the cache on a render call.
 		*/
-		std::unordered_map<std::string, Device*> cached_devices;
+		std::unordered_map<std::string, size_t> _layerKeys;
+
+		/*! \brief Instance id and revision of a device when getDevicesToUpdate() last checked it. */
+		struct DeviceRevision {
+			size_t instance;
+			size_t revision;
+		};
+
+		/*! \brief Devices passed to the last calls of getDevicesToUpdate(). */
+		std::unordered_map<Device*, DeviceRevision> _checkedDevices;
 		
 		/*!
 		\brief Should we force an update on the next render call?
@@ -198,6 +509,24 @@ namespace Lumiverse {
     */
     float _exposure;
 
+    /*! \brief Whether render contexts also output RGBA8. */
+    bool _byteOutput;
+
+    /*! \brief Format layers are stored in once compacted. */
+    PixelFormat _cache_format;
+
+    /*! \brief Threads exr files are read on. 0 uses one per hardware thread. */
+    unsigned int _loadThreads;
+
+    /*! \brief Read the exr files of devices that are off on first use. */
+    bool _lazyLoading;
+
+    /*! \brief Number of exr files being read. 0 when not loading. */
+    atomic<size_t> _loadTotal;
+
+    /*! \brief Number of exr files read so far. */
+    atomic<size_t> _loadDone;
+
 		/*!
 		* \brief Check if an option change requires a complete reloading of the cache
 		*
@@ -206,40 +535,85 @@ namespace Lumiverse {
 		*/
 		bool optionRequiresCacheReload(const std::string &paramName);
 
-		/*
-		* \brief Test whether a device parameter has changed such that its cache
-		* basis image should be re-rendered. This can happen on updates to params
-		* such as position, rotation, penumbra angle, and distance.
-		*/
-		bool isValidCacheCopy(Device *cached_device, Device *other_device);
-
 		/*!
 		* \brief Set the HDR output buffer
 		*/
 		virtual void setHDROutputBuffer();
 
+    /*!
+    \brief Saves the named layers to exr files and rewrites the packed cache file.
+
+    The caller holds _updateLock and _layerLock.
+    */
+    void writeCache(const set<string>& names);
+
     /*!
     \brief Saves a layer to a file
     */
     void saveLayer(EXRLayer* l);
 
     /*!
-    \brief Loads cache layers from exr files. Assumes cache is up to date after load.
+    \brief Loads cache layers from the packed cache file, or from exr files for layers
+    that aren't in it. Assumes cache is up to date after load.
     */
     void loadCache(const set<Device*>& devices);
 
+    /*!
+    \brief Loads a single layer from the packed cache file.
+    \return false if the packed cache file isn't open or has no layer with that name.
+    */
+    bool loadPackedLayer(string name);
+
+    /*!
+    \brief Reads the exr files of the named layers in parallel and adds them to the cache.
+
+    Updates the progress reported by getPercentage().
+    */
+    void readLayers(const vector<string>& names);
+
+    /*!
+    \brief Converts layers loaded from the packed cache file to the cache format and builds
+    their mips, in parallel.
+    */
+    void prepareLayers(const vector<string>& names);
+
+    /*!
+    \brief Calls f for 0 to count - 1 on the load threads.
+    \return Number of threads used.
+    */
+    unsigned int parallelFor(size_t count, const function<void(size_t)>& f);
+
+    /*! \brief Names of the layers a device uses: its focus palette images or its Arnold node. */
+    vector<string> getLayerNames(Device* d);
+
+    /*!
+    \brief Mapped packed cache file.
+
+    Layers loaded from it point into the mapping, so it's only closed after they're deleted.
+    */
+    LayerCacheFile _packedCache;
+
     // Variables for thread safety and parallel rendering of cached images
     /*! \brief Container for shared layer data */
     map<string, EXRLayer*> _layers;
 
-    /*! \brief Render context containing separate buffers to support threaded rendering from cache */
-    vector<CachingRenderContext*> _contexts;
+    /*! \brief Render contexts containing separate buffers to support threaded rendering from cache */
+    CachingRenderContextPool _contexts;
+
+    /*! \brief Tile rendering threads shared by the compositors of all contexts. */
+    shared_ptr<TilePool> _tilePool;
 
     /*! \brief lock for accessing workers, buffers, layers, and compositors. */
     mutex _updateLock;
 
-    /*! \brief Maximum number of threads allowed by the renderer. */
-    int _maxThreads;
+    /*!
+    \brief Held shared by renders while they composite, and exclusively while layer data is
+    changed. Taken after _updateLock.
+    */
+    CachingLayerLock _layerLock;
+
+    /*! \brief Number of render contexts. 0 uses one per hardware thread. */
+    unsigned int _numContexts;
 	};
 }
 
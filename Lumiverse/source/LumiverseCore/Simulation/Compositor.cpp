@@ -11,9 +11,197 @@
 #include <unordered_map>
 #include <set>
 #include <assert.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define LUMIVERSE_COMPOSITOR_SSE
+#include <immintrin.h>
+#endif
+
+// GCC and Clang can build an AVX2 kernel without compiling the rest of the
+// library for AVX2. It's only used if the CPU supports it.
+#if defined(LUMIVERSE_COMPOSITOR_SSE) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LUMIVERSE_COMPOSITOR_AVX2
+#endif
 
 namespace Lumiverse {
 
+// out += scale * basis for numPixels pixels. out is RGBA floats, basis is in the
+// kernel's pixel format.
+typedef void (*AccumulateKernel)(float *out, const unsigned char *basis, const float *scale, size_t numPixels);
+
+static void accumulate_scalar(float *out, const unsigned char *basis, const float *scale, size_t numPixels) {
+  const float *in = (const float *)basis;
+
+  for (size_t i = 0; i < numPixels * 4; i += 4) {
+    out[i] += scale[0] * in[i];
+    out[i + 1] += scale[1] * in[i + 1];
+    out[i + 2] += scale[2] * in[i + 2];
+    out[i + 3] += scale[3] * in[i + 3];
+  }
+}
+
+static void accumulate_half_scalar(float *out, const unsigned char *basis, const float *scale, size_t numPixels) {
+  const uint16_t *in = (const uint16_t *)basis;
+
+  for (size_t i = 0; i < numPixels * 4; i += 4) {
+    out[i] += scale[0] * half_to_float(in[i]);
+    out[i + 1] += scale[1] * half_to_float(in[i + 1]);
+    out[i + 2] += scale[2] * half_to_float(in[i + 2]);
+    out[i + 3] += scale[3] * half_to_float(in[i + 3]);
+  }
+}
+
+static void accumulate_rgb9e5_scalar(float *out, const unsigned char *basis, const float *scale, size_t numPixels) {
+  const uint32_t *in = (const uint32_t *)basis;
+
+  for (size_t i = 0; i < numPixels; i++) {
+    Pixel4 p = unpack_rgb9e5(in[i]);
+    out[i * 4] += scale[0] * p.r;
+    out[i * 4 + 1] += scale[1] * p.g;
+    out[i * 4 + 2] += scale[2] * p.b;
+  }
+}
+
+#ifdef LUMIVERSE_COMPOSITOR_SSE
+static void accumulate_sse(float *out, const unsigned char *basis, const float *scale, size_t numPixels) {
+  const float *in = (const float *)basis;
+  __m128 s = _mm_loadu_ps(scale);
+
+  for (size_t i = 0; i < numPixels * 4; i += 4) {
+    __m128 o = _mm_loadu_ps(out + i);
+    _mm_storeu_ps(out + i, _mm_add_ps(o, _mm_mul_ps(s, _mm_loadu_ps(in + i))));
+  }
+}
+
+static void accumulate_rgb9e5_sse(float *out, const unsigned char *basis, const float *scale, size_t numPixels) {
+  const uint32_t *in = (const uint32_t *)basis;
+  __m128 s = _mm_loadu_ps(scale);
+
+  for (size_t i = 0; i < numPixels; i++) {
+    uint32_t v = in[i];
+    __m128i m = _mm_setr_epi32(v & 0x1FF, (v >> 9) & 0x1FF, (v >> 18) & 0x1FF, 0);
+
+    // 2^(exp - 24) from the exponent bits, see unpack_rgb9e5
+    __m128 e = _mm_castsi128_ps(_mm_set1_epi32(((v >> 27) + 103) << 23));
+
+    __m128 o = _mm_loadu_ps(out + i * 4);
+    _mm_storeu_ps(out + i * 4, _mm_add_ps(o, _mm_mul_ps(_mm_mul_ps(s, e), _mm_cvtepi32_ps(m))));
+  }
+}
+#endif
+
+#ifdef LUMIVERSE_COMPOSITOR_AVX2
+__attribute__((target("avx2,fma")))
+static void accumulate_avx2(float *out, const unsigned char *basis, const float *scale, size_t numPixels) {
+  const float *in = (const float *)basis;
+  size_t numFloats = numPixels * 4;
+
+  // Two pixels per register.
+  __m256 s = _mm256_setr_ps(scale[0], scale[1], scale[2], scale[3], scale[0], scale[1], scale[2], scale[3]);
+
+  size_t i = 0;
+  for (; i + 16 <= numFloats; i += 16) {
+    __m256 o0 = _mm256_loadu_ps(out + i);
+    __m256 o1 = _mm256_loadu_ps(out + i + 8);
+    o0 = _mm256_fmadd_ps(s, _mm256_loadu_ps(in + i), o0);
+    o1 = _mm256_fmadd_ps(s, _mm256_loadu_ps(in + i + 8), o1);
+    _mm256_storeu_ps(out + i, o0);
+    _mm256_storeu_ps(out + i + 8, o1);
+  }
+
+  for (; i < numFloats; i += 4) {
+    __m128 o = _mm_loadu_ps(out + i);
+    _mm_storeu_ps(out + i, _mm_fmadd_ps(_mm256_castps256_ps128(s), _mm_loadu_ps(in + i), o));
+  }
+}
+
+// Same as accumulate_avx2, with F16C converting the halves as they're loaded.
+__attribute__((target("avx2,fma,f16c")))
+static void accumulate_half_f16c(float *out, const unsigned char *basis, const float *scale, size_t numPixels) {
+  const uint16_t *in = (const uint16_t *)basis;
+  size_t numFloats = numPixels * 4;
+
+  __m256 s = _mm256_setr_ps(scale[0], scale[1], scale[2], scale[3], scale[0], scale[1], scale[2], scale[3]);
+
+  size_t i = 0;
+  for (; i + 16 <= numFloats; i += 16) {
+    __m256 b0 = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(in + i)));
+    __m256 b1 = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(in + i + 8)));
+    _mm256_storeu_ps(out + i, _mm256_fmadd_ps(s, b0, _mm256_loadu_ps(out + i)));
+    _mm256_storeu_ps(out + i + 8, _mm256_fmadd_ps(s, b1, _mm256_loadu_ps(out + i + 8)));
+  }
+
+  for (; i < numFloats; i += 4) {
+    __m128 b = _mm_cvtph_ps(_mm_loadl_epi64((const __m128i *)(in + i)));
+    __m128 o = _mm_loadu_ps(out + i);
+    _mm_storeu_ps(out + i, _mm_fmadd_ps(_mm256_castps256_ps128(s), b, o));
+  }
+}
+
+// Unpacks two RGB9E5 pixels per register.
+__attribute__((target("avx2,fma")))
+static void accumulate_rgb9e5_avx2(float *out, const unsigned char *basis, const float *scale, size_t numPixels) {
+  const uint32_t *in = (const uint32_t *)basis;
+
+  __m256 s = _mm256_setr_ps(scale[0], scale[1], scale[2], scale[3], scale[0], scale[1], scale[2], scale[3]);
+  const __m256i spread = _mm256_setr_epi32(0, 0, 0, 0, 1, 1, 1, 1);
+  const __m256i shifts = _mm256_setr_epi32(0, 9, 18, 27, 0, 9, 18, 27);
+  const __m256i mask = _mm256_setr_epi32(0x1FF, 0x1FF, 0x1FF, 0, 0x1FF, 0x1FF, 0x1FF, 0);
+  const __m256i bias = _mm256_set1_epi32(103);
+
+  size_t i = 0;
+  for (; i + 2 <= numPixels; i += 2) {
+    __m256i v = _mm256_permutevar8x32_epi32(_mm256_castsi128_si256(_mm_loadl_epi64((const __m128i *)(in + i))), spread);
+    __m256i m = _mm256_and_si256(_mm256_srlv_epi32(v, shifts), mask);
+
+    // 2^(exp - 24) from the exponent bits, see unpack_rgb9e5
+    __m256 e = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(_mm256_srli_epi32(v, 27), bias), 23));
+
+    __m256 o = _mm256_loadu_ps(out + i * 4);
+    _mm256_storeu_ps(out + i * 4, _mm256_fmadd_ps(_mm256_mul_ps(s, e), _mm256_cvtepi32_ps(m), o));
+  }
+
+  if (i < numPixels)
+    accumulate_rgb9e5_scalar(out + i * 4, (const unsigned char *)(in + i), scale, numPixels - i);
+}
+#endif
+
+// Kernels for each PixelFormat, fastest the CPU supports.
+struct AccumulateKernels {
+  AccumulateKernel kernels[3];
+
+  AccumulateKernels() {
+    kernels[PIXEL_FLOAT] = accumulate_scalar;
+    kernels[PIXEL_HALF] = accumulate_half_scalar;
+    kernels[PIXEL_RGB9E5] = accumulate_rgb9e5_scalar;
+
+#ifdef LUMIVERSE_COMPOSITOR_SSE
+    kernels[PIXEL_FLOAT] = accumulate_sse;
+    kernels[PIXEL_RGB9E5] = accumulate_rgb9e5_sse;
+#endif
+
+#ifdef LUMIVERSE_COMPOSITOR_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+      kernels[PIXEL_FLOAT] = accumulate_avx2;
+      kernels[PIXEL_RGB9E5] = accumulate_rgb9e5_avx2;
+
+      if (__builtin_cpu_supports("f16c"))
+        kernels[PIXEL_HALF] = accumulate_half_f16c;
+    }
+#endif
+  }
+
+  AccumulateKernel operator[](PixelFormat format) const { return kernels[format]; }
+};
+
+static const AccumulateKernels accumulate;
+
 Compositor::Compositor() {
 
   // buffers
@@ -22,6 +210,17 @@ Compositor::Compositor() {
   w = 0;
   h = 0;
   _exposure = 1;
+  num_threads = 0;
+  timings = RenderTimings();
+
+  tone_mapper = nullptr;
+  tonemap_output = nullptr;
+  tonemap_bytes = nullptr;
+
+  mip_level = 0;
+  level_w = 0;
+  level_h = 0;
+  composite_buffer = NULL;
 }
 
 Compositor::~Compositor() {
@@ -107,12 +306,47 @@ void Compositor::update_dims(int width, int height) {
 }
 
 void Compositor::render(const std::set<Device*> &devices) {
+  tone_mapper = nullptr;
+  tonemap_output = nullptr;
+  tonemap_bytes = nullptr;
+
+  render_tiles(devices);
+}
+
+void Compositor::render(const std::set<Device*> &devices, const ToneMapper &tone_mapper, float *output, unsigned char *bytes) {
+  this->tone_mapper = &tone_mapper;
+  tonemap_output = output;
+  tonemap_bytes = bytes;
+
+  render_tiles(devices);
+}
+
+void Compositor::render_tiles(const std::set<Device*> &devices) {
+  timings = RenderTimings();
 
   if (layers.size() == 0)
     return;
 
-  // clear previous rendering
-  std::memset((void *)compose_buffer, 0, sizeof(Pixel4) * w * h);
+  auto start = std::chrono::high_resolution_clock::now();
+
+  // Frames smaller than the layers are composited at the closest mip level that's at
+  // least as large, then resampled. Compositing is linear, so resampling the composite
+  // once is the same as resampling every light.
+  EXRLayer *first = layers.begin()->second;
+  mip_level = EXRLayer::choose_mip(first->get_width(), first->get_height(), w, h);
+  EXRLayer::get_mip_size(first->get_width(), first->get_height(), mip_level, level_w, level_h);
+
+  bool resampled = (level_w != w || level_h != h);
+  if (resampled) {
+    level_buffer.resize(level_w * level_h);
+    composite_buffer = level_buffer.data();
+  }
+  else {
+    composite_buffer = compose_buffer;
+  }
+
+  // Gather the lights first. Mips are built here if they haven't been, since that isn't thread safe.
+  terms.clear();
 
   for (Device *device : devices) {
 	  std::string name = device->getMetadata("Arnold Node Name");
@@ -139,22 +373,217 @@ void Compositor::render(const std::set<Device*> &devices) {
     if (device->getColor() != nullptr && !device->metadataExists("fixed"))
 	    modulator = device->getColor()->getRGB();
 
-	  float r = modulator.x() * intensity_shift * _exposure;
-	  float g = modulator.y() * intensity_shift * _exposure;
-	  float b = modulator.z() * intensity_shift * _exposure;
+    // Alpha is scaled by 0 so every pixel is the same float4 multiply-add.
+    // Layers that load on first use are loaded here, so only once they're lit.
+    LightTerm term;
+    term.basis = layer->get_mip(mip_level);
+    if (term.basis == nullptr || term.basis->num_lit == 0)
+      continue;
+
+    term.scale[0] = (float)(modulator.x() * intensity_shift * _exposure);
+    term.scale[1] = (float)(modulator.y() * intensity_shift * _exposure);
+    term.scale[2] = (float)(modulator.z() * intensity_shift * _exposure);
+    term.scale[3] = 0;
+    terms.push_back(term);
+  }
+
+  auto gathered = std::chrono::high_resolution_clock::now();
 
-	  Pixel4 *pixels = layer->get_downsampled_pixels(w, h);
-    int numPixels = w * h;
+  // A 64x64 RGBA float tile is 64KB, which stays in L2 while every light is added to it.
+  // Lights stored as halves or RGB9E5 are converted as they're added.
+  TileTimes total = TileTimes();
+  run_tiles(tile_count(level_w, level_h), [&](size_t tile, TileTimes& times) {
+    render_tile(tile, !resampled, times);
+  }, total);
 
-    for (int i = 0; i < numPixels; i++) {
-      Pixel4* basis_pixel = &pixels[i];
-      //if (basis_pixel.a > 0) {
-      compose_buffer[i].r += (r * basis_pixel->r);
-      compose_buffer[i].g += (g * basis_pixel->g);
-      compose_buffer[i].b += (b * basis_pixel->b);
-      //}
+  if (resampled) {
+    run_tiles(tile_count(w, h), [&](size_t tile, TileTimes& times) {
+      resample_tile(tile, times);
+    }, total);
+  }
+
+  auto end = std::chrono::high_resolution_clock::now();
+  timings.gather = std::chrono::duration<double, std::milli>(gathered - start).count();
+  timings.composite = total.composite / 1e6;
+  timings.resample = total.resample / 1e6;
+  timings.tonemap = total.tonemap / 1e6;
+  timings.total = std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+size_t Compositor::tile_count(size_t width, size_t height) {
+  size_t tilesX = (width + EXRLayer::TILE_SIZE - 1) / EXRLayer::TILE_SIZE;
+  size_t tilesY = (height + EXRLayer::TILE_SIZE - 1) / EXRLayer::TILE_SIZE;
+  return tilesX * tilesY;
+}
+
+void Compositor::run_tiles(size_t numTiles, const std::function<void(size_t, TileTimes&)>& f, TileTimes& total) {
+  unsigned int maxThreads = num_threads;
+  if (maxThreads == 0)
+    maxThreads = std::max(std::thread::hardware_concurrency(), 1u);
+  unsigned int threads = maxThreads;
+  if (threads > numTiles)
+    threads = (unsigned int)numTiles;
+
+  // Threads take the next tile until they run out.
+  std::atomic<size_t> nextTile(0);
+  std::mutex totalLock;
+  std::function<void()> worker = [&]() {
+    TileTimes times = TileTimes();
+    for (size_t tile = nextTile++; tile < numTiles; tile = nextTile++) {
+      f(tile, times);
+    }
+
+    std::lock_guard<std::mutex> lock(totalLock);
+    total.composite += times.composite;
+    total.resample += times.resample;
+    total.tonemap += times.tonemap;
+  };
+
+  if (threads <= 1) {
+    worker();
+    return;
+  }
+
+  if (pool == nullptr)
+    pool = std::make_shared<TilePool>(maxThreads - 1);
+
+  pool->run(threads - 1, worker);
+}
+
+TilePool::TilePool(unsigned int count) : stopping(false) {
+  if (count == 0)
+    count = std::max(std::thread::hardware_concurrency(), 1u) - 1;
+
+  for (unsigned int i = 0; i < count; i++) {
+    threads.push_back(std::thread([this]() { worker(); }));
+  }
+}
+
+TilePool::~TilePool() {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stopping = true;
+  }
+  work_ready.notify_all();
+
+  for (auto& t : threads) {
+    t.join();
+  }
+}
+
+void TilePool::run(unsigned int helpers, const std::function<void()>& work) {
+  Job job;
+  job.work = &work;
+  job.slots = std::min(helpers, (unsigned int)threads.size());
+  job.active = 0;
+
+  if (job.slots > 0) {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      jobs.push_back(&job);
     }
+    work_ready.notify_all();
+  }
+
+  work();
+
+  std::unique_lock<std::mutex> guard(lock);
+
+  // Once this thread is done there's nothing left for threads that haven't joined.
+  if (job.slots > 0) {
+    jobs.erase(std::find(jobs.begin(), jobs.end(), &job));
+    job.slots = 0;
   }
+
+  work_done.wait(guard, [&]() { return job.active == 0; });
+}
+
+void TilePool::worker() {
+  std::unique_lock<std::mutex> guard(lock);
+
+  while (true) {
+    work_ready.wait(guard, [this]() { return stopping || !jobs.empty(); });
+    if (stopping)
+      return;
+
+    Job *job = jobs.front();
+    if (--job->slots == 0)
+      jobs.pop_front();
+    job->active++;
+
+    guard.unlock();
+    (*job->work)();
+    guard.lock();
+
+    if (--job->active == 0)
+      work_done.notify_all();
+  }
+}
+
+void Compositor::render_tile(size_t tile, bool tonemap, TileTimes &times) {
+  const size_t tileSize = EXRLayer::TILE_SIZE;
+  size_t tilesX = (level_w + tileSize - 1) / tileSize;
+  size_t x0 = (tile % tilesX) * tileSize;
+  size_t y0 = (tile / tilesX) * tileSize;
+  size_t tw = std::min(tileSize, level_w - x0);
+  size_t th = std::min(tileSize, level_h - y0);
+
+  auto start = std::chrono::high_resolution_clock::now();
+  Pixel4 *out = composite_buffer + y0 * level_w + x0;
+
+  // clear previous rendering
+  for (size_t y = 0; y < th; y++) {
+    std::fill_n(out + y * level_w, tw, Pixel4(0, 0, 0, 0));
+  }
+
+  for (const LightTerm& term : terms) {
+    const unsigned char *basis = term.basis->tiles[tile];
+
+    // Light doesn't reach this tile.
+    if (basis == nullptr)
+      continue;
+
+    AccumulateKernel kernel = accumulate[term.basis->format];
+    for (size_t y = 0; y < th; y++) {
+      kernel(as_floats(out + y * level_w), basis + y * term.basis->stride, term.scale, tw);
+    }
+  }
+
+  times.composite += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - start).count();
+
+  if (tonemap)
+    tonemap_tile(x0, y0, tw, th, times);
+}
+
+void Compositor::resample_tile(size_t tile, TileTimes &times) {
+  const size_t tileSize = EXRLayer::TILE_SIZE;
+  size_t tilesX = (w + tileSize - 1) / tileSize;
+  size_t x0 = (tile % tilesX) * tileSize;
+  size_t y0 = (tile / tilesX) * tileSize;
+  size_t tw = std::min(tileSize, w - x0);
+  size_t th = std::min(tileSize, h - y0);
+
+  auto start = std::chrono::high_resolution_clock::now();
+  EXRLayer::resample(level_buffer.data(), level_w, level_h, compose_buffer, w, w, h, x0, y0, x0 + tw, y0 + th);
+  times.resample += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - start).count();
+
+  tonemap_tile(x0, y0, tw, th, times);
+}
+
+void Compositor::tonemap_tile(size_t x0, size_t y0, size_t tw, size_t th, TileTimes &times) {
+  if (tone_mapper == nullptr)
+    return;
+
+  auto start = std::chrono::high_resolution_clock::now();
+
+  for (size_t y = 0; y < th; y++) {
+    size_t offset = (y0 + y) * w + x0;
+    tone_mapper->map_pixels(compose_buffer + offset,
+      tonemap_output ? tonemap_output + offset * 4 : nullptr,
+      tonemap_bytes ? tonemap_bytes + offset * 4 : nullptr, tw);
+  }
+
+  times.tonemap += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - start).count();
 }
 
 }; // namespace Lumiverse
@@ -6,12 +6,85 @@
 #include <unordered_map>
 #include <set>
 #include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #include "EXRLayer.h"
+#include "ToneMapper.h"
 #include "Device.h"
 
 namespace Lumiverse {
 
+/*!
+\brief Threads that render tiles for one or more Compositors.
+
+The threads are started once and wait for work between renders. Compositors sharing a
+pool share its threads, so rendering several frames at once doesn't start more threads
+than the pool has. The thread calling run() works too, so a render still finishes when
+every pool thread is busy with another one.
+*/
+class TilePool {
+public:
+  /*!
+  \brief Starts the pool threads.
+  \param count Number of threads. 0 starts one per hardware thread, less one for the
+  thread calling run().
+  */
+  TilePool(unsigned int count = 0);
+
+  /*!
+  \brief Stops the threads. Nothing may be running on the pool.
+  */
+  ~TilePool();
+
+  /*!
+  \brief Gets the number of pool threads.
+  */
+  unsigned int get_num_threads() { return (unsigned int)threads.size(); }
+
+  /*!
+  \brief Calls work on this thread and on up to helpers pool threads, and returns once
+  every call has returned.
+
+  Pool threads may join late or not at all, so work should take items from a shared
+  counter until there are none left.
+  */
+  void run(unsigned int helpers, const std::function<void()>& work);
+
+private:
+  /*!
+  \brief A run() call waiting for pool threads.
+  */
+  struct Job {
+    const std::function<void()> *work;
+    /*! \brief Pool threads that may still join. The job is queued while this is above 0. */
+    unsigned int slots;
+    /*! \brief Pool threads currently calling work. */
+    unsigned int active;
+  };
+
+  /*!
+  \brief Runs queued jobs until the pool is destroyed.
+  */
+  void worker();
+
+  std::vector<std::thread> threads;
+  std::deque<Job *> jobs;
+  bool stopping;
+
+  /*!
+  \brief Guards jobs and stopping.
+  */
+  std::mutex lock;
+  std::condition_variable work_ready;
+  std::condition_variable work_done;
+};
+
 /**
  * Composes layers and generates output images.
  * Also responsible of managing the layers. Note that layers in a
@@ -20,6 +93,17 @@ namespace Lumiverse {
  * first layer is added. Attempts to add layers of inconsistent
  * sizes will be ignored.
  *
+ * Rendering splits the frame into tiles that are composited on multiple
+ * threads. Each tile accumulates every light before moving on, so the tile
+ * stays in cache instead of the whole frame being streamed once per light.
+ * Tiles match the EXRLayer tiles, so tiles a light doesn't reach are skipped.
+ * Given a ToneMapper, each tile is also tone mapped while it's still in cache,
+ * so the frame is only written to memory once.
+ *
+ * Frames smaller than the layers are composited at the smallest layer mip level
+ * that covers them and bilinearly resampled to the frame size, so resizing the
+ * frame doesn't resample any layers.
+ *
  * Credit to Sky Gao for writing most of this code
  */
 class Compositor {
@@ -89,6 +173,63 @@ public:
    */
   void render(const std::set<Device*> &devices);
 
+  /*!
+  \brief Renders the scene and tone maps it in the same pass.
+
+  The compose buffer still holds the HDR composite afterwards.
+  \param devices Devices to composite.
+  \param tone_mapper Tone mapper to apply to each tile.
+  \param output Buffer of 4 * width * height floats for the tone mapped image, or null.
+  \param bytes Buffer of 4 * width * height bytes for the tone mapped image as RGBA8, or null.
+  */
+  void render(const std::set<Device*> &devices, const ToneMapper &tone_mapper, float *output, unsigned char *bytes);
+
+  /*!
+  \brief Time spent in each stage of the last render, in ms.
+
+  Composite and tone map times are summed over all threads, so with more than one
+  thread they can add up to more than the total.
+  */
+  struct RenderTimings {
+    /*! \brief Finding the lights to composite and loading their layers. */
+    double gather;
+    /*! \brief Adding lights into the tiles. */
+    double composite;
+    /*! \brief Resampling the composite to the frame size. 0 if the frame is the size of a mip level. */
+    double resample;
+    /*! \brief Tone mapping the tiles. 0 if the render wasn't tone mapped. */
+    double tonemap;
+    /*! \brief Wall time of the whole render. */
+    double total;
+  };
+
+  /*!
+  \brief Gets the time spent in each stage of the last render.
+  */
+  const RenderTimings& get_timings() { return timings; }
+
+  /*!
+  \brief Gets the layer mip level the last render was composited at.
+  */
+  size_t get_mip_level() { return mip_level; }
+
+  /*!
+  \brief Sets the number of threads used by render(), including the calling thread.
+  0 uses one per hardware thread. Limited to one more than the threads in the tile pool.
+  */
+  void set_num_threads(unsigned int threads) { num_threads = threads; }
+
+  /*!
+  \brief Gets the number of threads used by render(). 0 means one per hardware thread.
+  */
+  unsigned int get_num_threads() { return num_threads; }
+
+  /*!
+  \brief Sets the threads render() uses. Compositors rendering at the same time should share
+  one pool. Without one, the compositor starts its own pool on the first threaded render.
+  */
+  void set_tile_pool(std::shared_ptr<TilePool> tile_pool) { pool = tile_pool; }
+
   /*!
   \brief Get the buffer of composed pixels (i.e. the composition of
   all of the exr layers)
@@ -138,6 +279,103 @@ private:
    * is set, results are saved in the composition buffer.
    */
   Pixel4 *compose_buffer;
+
+  /*!
+  \brief A light's contribution to the composite.
+  */
+  struct LightTerm {
+    /*! \brief Lit tiles of the light at the compositor's size. */
+    const SparseBasis *basis;
+
+    /*! \brief Per channel multiplier. Alpha is always 0. */
+    float scale[4];
+  };
+
+  /*!
+  \brief Lights gathered by the current render. Reused between renders.
+  */
+  std::vector<LightTerm> terms;
+
+  /*!
+  \brief Number of threads to render with. 0 uses one per hardware thread.
+  */
+  unsigned int num_threads;
+
+  /*!
+  \brief Threads tiles are rendered on.
+  */
+  std::shared_ptr<TilePool> pool;
+
+  /*!
+  \brief Stage times of the last render.
+  */
+  RenderTimings timings;
+
+  /*!
+  \brief Tone mapping outputs of the current render. tone_mapper is null if not tone mapping.
+  */
+  const ToneMapper *tone_mapper;
+  float *tonemap_output;
+  unsigned char *tonemap_bytes;
+
+  /*!
+  \brief Mip level of the last render, and its size.
+  */
+  size_t mip_level;
+  size_t level_w;
+  size_t level_h;
+
+  /*!
+  \brief Composite at the mip level size, when it isn't the frame size.
+  */
+  std::vector<Pixel4> level_buffer;
+
+  /*!
+  \brief Buffer lights are added into. Either compose_buffer or level_buffer.
+  */
+  Pixel4 *composite_buffer;
+
+  /*!
+  \brief Nanoseconds a thread spent in each stage.
+  */
+  struct TileTimes {
+    long long composite;
+    long long resample;
+    long long tonemap;
+  };
+
+  /*!
+  \brief Gathers the lights and renders every tile with the current tone mapping outputs.
+  */
+  void render_tiles(const std::set<Device*> &devices);
+
+  /*!
+  \brief Number of tiles in an image of the given size.
+  */
+  static size_t tile_count(size_t width, size_t height);
+
+  /*!
+  \brief Calls f for every tile on this thread and the tile pool and adds their times to total.
+  */
+  void run_tiles(size_t numTiles, const std::function<void(size_t, TileTimes&)>& f, TileTimes& total);
+
+  /*!
+  \brief Composites every light term into a tile of the composite buffer.
+  \param tile Row major tile index at the mip level size.
+  \param tonemap Tone maps the tile too. Only when compositing at the frame size.
+  */
+  void render_tile(size_t tile, bool tonemap, TileTimes &times);
+
+  /*!
+  \brief Resamples the level composite into a tile of the compose buffer and tone maps it.
+  \param tile Row major tile index at the frame size.
+  */
+  void resample_tile(size_t tile, TileTimes &times);
+
+  /*!
+  \brief Tone maps a region of the compose buffer into the tone mapping outputs, if set.
+  */
+  void tonemap_tile(size_t x0, size_t y0, size_t tw, size_t th, TileTimes &times);
 };
 
 }; // namespace Lumiverse
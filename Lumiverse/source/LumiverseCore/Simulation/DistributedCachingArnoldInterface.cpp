@@ -76,6 +76,7 @@ namespace Lumiverse {
 			EXRLayer *layer = compositor.get_layer_by_name(device_name.c_str());
 			layer->clear_buffers();
 			layer->set_pixels(DistributedArnoldInterface::m_buffer);
+			layer->compact();
 
 			// Now that we have the buffer in the layer, set intensity back to 0 for next device
 			render_device->setIntensity(0);
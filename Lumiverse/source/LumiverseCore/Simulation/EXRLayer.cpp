@@ -1,15 +1,73 @@
 #include "LumiverseCoreConfig.h"
 #include "EXRLayer.h"
 
-#define STB_IMAGE_RESIZE_IMPLEMENTATION
-#include "../../lib/stb/stb_image_resize.h"
-
+#include <algorithm>
 #include <cstring>
+#include <cmath>
 
 #ifdef USE_ARNOLD_CACHING
 
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define LUMIVERSE_EXRLAYER_SSE
+#include <immintrin.h>
+#endif
+
 namespace Lumiverse {
 
+const size_t EXRLayer::TILE_SIZE;
+
+// Converts n float pixels to the given format.
+static void encode_row(const Pixel4 *src, unsigned char *dst, size_t n, PixelFormat format) {
+  switch (format) {
+  case PIXEL_HALF:
+  {
+    uint16_t *h = (uint16_t *)dst;
+    for (size_t i = 0; i < n; i++) {
+      h[i * 4] = float_to_half(src[i].r);
+      h[i * 4 + 1] = float_to_half(src[i].g);
+      h[i * 4 + 2] = float_to_half(src[i].b);
+      h[i * 4 + 3] = float_to_half(src[i].a);
+    }
+    break;
+  }
+  case PIXEL_RGB9E5:
+  {
+    uint32_t *v = (uint32_t *)dst;
+    for (size_t i = 0; i < n; i++) {
+      v[i] = pack_rgb9e5(src[i].r, src[i].g, src[i].b);
+    }
+    break;
+  }
+  default:
+    memcpy(dst, src, n * sizeof(Pixel4));
+  }
+}
+
+// Converts n pixels in the given format back to floats.
+static void decode_row(const unsigned char *src, Pixel4 *dst, size_t n, PixelFormat format) {
+  switch (format) {
+  case PIXEL_HALF:
+  {
+    const uint16_t *h = (const uint16_t *)src;
+    for (size_t i = 0; i < n; i++) {
+      dst[i] = Pixel4(half_to_float(h[i * 4]), half_to_float(h[i * 4 + 1]),
+        half_to_float(h[i * 4 + 2]), half_to_float(h[i * 4 + 3]));
+    }
+    break;
+  }
+  case PIXEL_RGB9E5:
+  {
+    const uint32_t *v = (const uint32_t *)src;
+    for (size_t i = 0; i < n; i++) {
+      dst[i] = unpack_rgb9e5(v[i]);
+    }
+    break;
+  }
+  default:
+    memcpy(dst, src, n * sizeof(Pixel4));
+  }
+}
+
 EXRLayer::EXRLayer(const char *file, const char *name) {
 
   if (name) {
@@ -20,6 +78,10 @@ EXRLayer::EXRLayer(const char *file, const char *name) {
   w = 0;
   h = 0;
   pixels = NULL;
+  sparse = NULL;
+  format = PIXEL_FLOAT;
+  loaded = true;
+  mips_built = false;
 
   active = true;
   modulator = Pixel3(1, 1, 1);
@@ -35,7 +97,48 @@ EXRLayer::EXRLayer(size_t width, size_t height,
   w = width;
   h = height;
   pixels = new Pixel4[w * h];
-  memset(pixels, 0, w * h * sizeof(Pixel4));
+  std::fill_n(pixels, w * h, Pixel4(0, 0, 0, 0));
+  sparse = NULL;
+  format = PIXEL_FLOAT;
+  loaded = true;
+  mips_built = false;
+
+  active = true;
+  modulator = Pixel3(1, 1, 1);
+}
+
+EXRLayer::EXRLayer(SparseBasis *basis, const char *name) {
+
+  if (name) {
+    this->name = name;
+  }
+
+  w = basis->width;
+  h = basis->height;
+  pixels = NULL;
+  sparse = basis;
+  format = basis->format;
+  loaded = true;
+  mips_built = false;
+
+  active = true;
+  modulator = Pixel3(1, 1, 1);
+}
+
+EXRLayer::EXRLayer(size_t width, size_t height, const char *name,
+  std::function<Pixel4 *()> loader) : loader(loader) {
+
+  if (name) {
+    this->name = name;
+  }
+
+  w = width;
+  h = height;
+  pixels = NULL;
+  sparse = NULL;
+  format = PIXEL_FLOAT;
+  loaded = false;
+  mips_built = false;
 
   active = true;
   modulator = Pixel3(1, 1, 1);
@@ -43,10 +146,9 @@ EXRLayer::EXRLayer(size_t width, size_t height,
 
 EXRLayer::~EXRLayer() {
   delete[] pixels;
+  delete sparse;
 
-  for (auto& base : pixel_size_bases) {
-    delete base.second;
-  }
+  clear_bases();
 }
 
 std::string EXRLayer::get_name() { return name; }
@@ -67,23 +169,533 @@ Pixel3 EXRLayer::get_modulator() { return modulator; }
 
 void EXRLayer::set_modulator(Pixel3 modulator) { this->modulator = modulator; }
 
-Pixel4 *EXRLayer::get_pixels() { return pixels; }
+Pixel4 *EXRLayer::get_pixels() {
+  ensure_loaded();
 
-void EXRLayer::clear_buffers() {
+  if (pixels == NULL && sparse != NULL) {
+    // Expand a compact layer.
+    pixels = new Pixel4[w * h];
+    expand_sparse(sparse, pixels);
+  }
+
+  // The caller may write to the pixels, so the tile index and mips are out of date.
+  delete sparse;
+  sparse = NULL;
+  clear_bases();
+
+  return pixels;
+}
+
+bool EXRLayer::ensure_loaded() {
+  if (!loaded) {
+    std::lock_guard<std::mutex> lock(load_lock);
+
+    // Another thread may have loaded it while this one waited.
+    if (!loaded) {
+      Pixel4 *buffer = loader ? loader() : NULL;
+      if (buffer != NULL) {
+        pixels = buffer;
+        compact();
+      }
+
+      // Set last, other threads read the layer without the lock once it's loaded.
+      loader = nullptr;
+      loaded = true;
+    }
+  }
+
+  return pixels != NULL || sparse != NULL;
+}
+
+void EXRLayer::cancel_load() {
+  loader = nullptr;
+  loaded = true;
+}
+
+void EXRLayer::compact() {
+  if (pixels == NULL)
+    return;
+
+  clear_bases();
+
+  delete sparse;
+  sparse = make_sparse(pixels, w, h, true, format);
+
+  delete[] pixels;
+  pixels = NULL;
+
+  make_mips();
+}
+
+bool EXRLayer::is_compact() { return pixels == NULL && sparse != NULL; }
+
+void EXRLayer::set_format(PixelFormat format) {
+  if (format == this->format)
+    return;
+
+  this->format = format;
+
+  // Downsampled tiles are in the old format.
+  clear_bases();
+
+  if (is_compact()) {
+    // Converting from a lossy format doesn't get the float values back, but
+    // it doesn't add more error than the new format has either.
+    pixels = new Pixel4[w * h];
+    expand_sparse(sparse, pixels);
+    compact();
+  }
+}
+
+PixelFormat EXRLayer::get_format() { return format; }
+
+void EXRLayer::copy_pixels(Pixel4 *dst) {
+  ensure_loaded();
+
+  if (pixels != NULL)
+    std::copy(pixels, pixels + w * h, dst);
+  else if (sparse != NULL)
+    expand_sparse(sparse, dst);
+  else
+    std::fill_n(dst, w * h, Pixel4(0, 0, 0, 0));
+}
+
+const SparseBasis *EXRLayer::get_sparse_pixels(int width, int height) {
+  ensure_loaded();
+
+  // Several render contexts can composite the same layer, so the lazily built
+  // bases are only touched under mip_lock.
+  if (((size_t)width == w) && ((size_t)height == h)) {
+    std::lock_guard<std::mutex> lock(mip_lock);
+    if (sparse == NULL && pixels != NULL)
+      sparse = make_sparse(pixels, w, h, false);
+
+    return sparse;
+  }
+
+  int key = get_size_key(width, height);
+  {
+    std::lock_guard<std::mutex> lock(mip_lock);
+    auto it = sparse_size_bases.find(key);
+    if (it != sparse_size_bases.end())
+      return it->second;
+  }
+
+  // Resampling reads the mips, which takes mip_lock itself.
+  Pixel4 *resampled = resample_from_mip(width, height);
+  if (resampled == NULL)
+    return NULL;
+
+  SparseBasis *basis = make_sparse(resampled, width, height, true, format);
+  delete[] resampled;
+
+  std::lock_guard<std::mutex> lock(mip_lock);
+  auto inserted = sparse_size_bases.insert(std::make_pair(key, basis));
+  if (!inserted.second)
+    delete basis;
+
+  return inserted.first->second;
+}
+
+const SparseBasis *EXRLayer::get_mip(size_t level) {
+  if (level == 0)
+    return get_sparse_pixels((int)w, (int)h);
+
+  build_mips();
+  return level <= mips.size() ? mips[level - 1] : NULL;
+}
+
+void EXRLayer::build_mips() {
+  // Loading compacts the layer, which builds the mips.
+  ensure_loaded();
+  make_mips();
+}
+
+void EXRLayer::make_mips() {
+  if (mips_built)
+    return;
+
+  std::lock_guard<std::mutex> lock(mip_lock);
+  if (mips_built)
+    return;
+
+  if (sparse == NULL && pixels != NULL)
+    sparse = make_sparse(pixels, w, h, false);
+
+  const SparseBasis *level = sparse;
+  size_t num_mips = get_num_mips(w, h);
+
+  for (size_t i = 1; level != NULL && i < num_mips; i++) {
+    SparseBasis *next = downsample_sparse(level, format);
+    mips.push_back(next);
+    level = next;
+  }
+
+  mips_built = true;
+}
+
+size_t EXRLayer::get_num_mips(size_t width, size_t height) {
+  size_t levels = 1;
+
+  // Levels stop before either side gets smaller than a tile.
+  while ((width + 1) / 2 >= TILE_SIZE && (height + 1) / 2 >= TILE_SIZE) {
+    width = (width + 1) / 2;
+    height = (height + 1) / 2;
+    levels++;
+  }
+
+  return levels;
+}
+
+void EXRLayer::get_mip_size(size_t width, size_t height, size_t level, size_t &mip_width, size_t &mip_height) {
+  mip_width = width;
+  mip_height = height;
+
+  for (size_t i = 0; i < level; i++) {
+    mip_width = (mip_width + 1) / 2;
+    mip_height = (mip_height + 1) / 2;
+  }
+}
+
+size_t EXRLayer::choose_mip(size_t width, size_t height, size_t target_width, size_t target_height) {
+  size_t num_mips = get_num_mips(width, height);
+  size_t level = 0;
+
+  for (size_t i = 1; i < num_mips; i++) {
+    size_t mw, mh;
+    get_mip_size(width, height, i, mw, mh);
+    if (mw < target_width || mh < target_height)
+      break;
+
+    level = i;
+  }
+
+  return level;
+}
+
+void EXRLayer::resample(const Pixel4 *src, size_t src_width, size_t src_height,
+  Pixel4 *dst, size_t dst_stride, size_t dst_width, size_t dst_height,
+  size_t x0, size_t y0, size_t x1, size_t y1) {
+  float scale_x = (float)src_width / dst_width;
+  float scale_y = (float)src_height / dst_height;
+
+  // Columns and weights are the same for every row.
+  std::vector<size_t> cols(2 * (x1 - x0));
+  std::vector<float> col_weights(x1 - x0);
+  for (size_t x = x0; x < x1; x++) {
+    float fx = std::max((x + 0.5f) * scale_x - 0.5f, 0.0f);
+    size_t ix = std::min((size_t)fx, src_width - 1);
+    cols[2 * (x - x0)] = ix;
+    cols[2 * (x - x0) + 1] = std::min(ix + 1, src_width - 1);
+    col_weights[x - x0] = std::min(fx - ix, 1.0f);
+  }
+
+  for (size_t y = y0; y < y1; y++) {
+    float fy = std::max((y + 0.5f) * scale_y - 0.5f, 0.0f);
+    size_t iy = std::min((size_t)fy, src_height - 1);
+    float wy = std::min(fy - iy, 1.0f);
+    const float *row0 = as_floats(src + iy * src_width);
+    const float *row1 = as_floats(src + std::min(iy + 1, src_height - 1) * src_width);
+    float *out = as_floats(dst + y * dst_stride);
+
+    for (size_t x = x0; x < x1; x++) {
+      size_t a = cols[2 * (x - x0)] * 4;
+      size_t b = cols[2 * (x - x0) + 1] * 4;
+      float wx = col_weights[x - x0];
+
+#ifdef LUMIVERSE_EXRLAYER_SSE
+      // One pixel per register.
+      __m128 vx = _mm_set1_ps(wx);
+      __m128 a0 = _mm_loadu_ps(row0 + a);
+      __m128 a1 = _mm_loadu_ps(row1 + a);
+      __m128 top = _mm_add_ps(a0, _mm_mul_ps(vx, _mm_sub_ps(_mm_loadu_ps(row0 + b), a0)));
+      __m128 bottom = _mm_add_ps(a1, _mm_mul_ps(vx, _mm_sub_ps(_mm_loadu_ps(row1 + b), a1)));
+      _mm_storeu_ps(out + x * 4, _mm_add_ps(top, _mm_mul_ps(_mm_set1_ps(wy), _mm_sub_ps(bottom, top))));
+#else
+      for (size_t c = 0; c < 4; c++) {
+        float top = row0[a + c] + wx * (row0[b + c] - row0[a + c]);
+        float bottom = row1[a + c] + wx * (row1[b + c] - row1[a + c]);
+        out[x * 4 + c] = top + wy * (bottom - top);
+      }
+#endif
+    }
+  }
+}
+
+Pixel4 *EXRLayer::resample_from_mip(int width, int height) {
+  const SparseBasis *basis = get_mip(choose_mip(w, h, width, height));
+  if (basis == NULL)
+    return NULL;
+
+  Pixel4 *source = new Pixel4[basis->width * basis->height];
+  expand_sparse(basis, source);
+
+  Pixel4 *resampled = new Pixel4[width * height];
+  resample(source, basis->width, basis->height, resampled, width, width, height, 0, 0, width, height);
+
+  delete[] source;
+  return resampled;
+}
+
+size_t EXRLayer::get_memory_usage() {
+  size_t bytes = 0;
+
+  if (pixels != NULL)
+    bytes += sizeof(Pixel4) * w * h;
+
+  if (sparse != NULL)
+    bytes += sparse->data.capacity() + sparse->tiles.capacity() * sizeof(unsigned char *);
+
+  for (const auto& base : sparse_size_bases) {
+    bytes += base.second->data.capacity() + base.second->tiles.capacity() * sizeof(unsigned char *);
+  }
+
+  for (const auto& mip : mips) {
+    bytes += mip->data.capacity() + mip->tiles.capacity() * sizeof(unsigned char *);
+  }
+
+  for (const auto& base : pixel_size_bases) {
+    // Key is (width << 16) + height
+    bytes += sizeof(Pixel4) * (base.first >> 16) * (base.first & 0xFFFF);
+  }
+
+  return bytes;
+}
+
+void EXRLayer::clear_bases() {
 	for (auto i = pixel_size_bases.begin(); i != pixel_size_bases.end(); i++) {
-		delete(i->second);
+		delete[] i->second;
 	}
 	pixel_size_bases.clear();
-	std::memset(pixels, 0, sizeof(Pixel4) * get_size());
+
+  for (auto& base : sparse_size_bases) {
+    delete base.second;
+  }
+  sparse_size_bases.clear();
+
+  for (auto mip : mips) {
+    delete mip;
+  }
+  mips.clear();
+  mips_built = false;
+}
+
+void EXRLayer::clear_buffers() {
+  cancel_load();
+  clear_bases();
+
+  delete sparse;
+  sparse = NULL;
+
+  if (pixels == NULL)
+    pixels = new Pixel4[w * h];
+
+	std::fill_n(pixels, get_size(), Pixel4(0, 0, 0, 0));
 }
 
 int inline EXRLayer::get_size_key(int width, int height) {
-	return width << 2 + height;
+	return (width << 16) + height;
+}
+
+SparseBasis *EXRLayer::new_sparse(size_t width, size_t height, bool pack, PixelFormat format) {
+  SparseBasis *basis = new SparseBasis();
+  basis->width = width;
+  basis->height = height;
+  basis->tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+  basis->tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+  basis->format = pack ? format : PIXEL_FLOAT;
+  basis->tiles.resize(basis->tiles_x * basis->tiles_y, NULL);
+  basis->stride = (pack ? TILE_SIZE : width) * pixel_format_size(basis->format);
+  basis->num_lit = 0;
+  basis->max_error = 0;
+
+  return basis;
+}
+
+void EXRLayer::pack_tile(const Pixel4 *src, size_t src_stride, size_t tw, size_t th,
+  unsigned char *dst, SparseBasis *basis) {
+  std::vector<Pixel4> decoded;
+  if (basis->format != PIXEL_FLOAT)
+    decoded.resize(tw);
+
+  for (size_t y = 0; y < th; y++) {
+    const Pixel4 *row = src + y * src_stride;
+    encode_row(row, dst + y * basis->stride, tw, basis->format);
+
+    if (basis->format == PIXEL_FLOAT)
+      continue;
+
+    // Measure what the format lost.
+    decode_row(dst + y * basis->stride, decoded.data(), tw, basis->format);
+    for (size_t x = 0; x < tw; x++) {
+      basis->max_error = std::max(basis->max_error, std::abs(decoded[x].r - row[x].r));
+      basis->max_error = std::max(basis->max_error, std::abs(decoded[x].g - row[x].g));
+      basis->max_error = std::max(basis->max_error, std::abs(decoded[x].b - row[x].b));
+    }
+  }
+}
+
+SparseBasis *EXRLayer::make_sparse(const Pixel4 *image, size_t width, size_t height, bool pack,
+  PixelFormat format) {
+  SparseBasis *basis = new_sparse(width, height, pack, format);
+
+  // Find the tiles with light in them. Alpha doesn't contribute to the composite.
+  for (size_t ty = 0; ty < basis->tiles_y; ty++) {
+    for (size_t tx = 0; tx < basis->tiles_x; tx++) {
+      size_t x0 = tx * TILE_SIZE;
+      size_t y0 = ty * TILE_SIZE;
+      size_t x1 = std::min(x0 + TILE_SIZE, width);
+      size_t y1 = std::min(y0 + TILE_SIZE, height);
+
+      bool lit = false;
+      for (size_t y = y0; y < y1 && !lit; y++) {
+        const Pixel4 *row = image + y * width;
+        for (size_t x = x0; x < x1; x++) {
+          if (row[x].r != 0 || row[x].g != 0 || row[x].b != 0) {
+            lit = true;
+            break;
+          }
+        }
+      }
+
+      if (lit) {
+        basis->tiles[ty * basis->tiles_x + tx] = (const unsigned char *)(image + y0 * width + x0);
+        basis->num_lit++;
+      }
+    }
+  }
+
+  if (!pack)
+    return basis;
+
+  // Copy the lit tiles, then point at the copies.
+  basis->data.resize(basis->num_lit * TILE_SIZE * basis->stride, 0);
+  unsigned char *dst = basis->data.data();
+
+  for (size_t t = 0; t < basis->tiles.size(); t++) {
+    if (basis->tiles[t] == NULL)
+      continue;
+
+    size_t tx = t % basis->tiles_x;
+    size_t ty = t / basis->tiles_x;
+    size_t tw = std::min(TILE_SIZE, width - tx * TILE_SIZE);
+    size_t th = std::min(TILE_SIZE, height - ty * TILE_SIZE);
+
+    pack_tile((const Pixel4 *)basis->tiles[t], width, tw, th, dst, basis);
+
+    basis->tiles[t] = dst;
+    dst += TILE_SIZE * basis->stride;
+  }
+
+  return basis;
+}
+
+SparseBasis *EXRLayer::downsample_sparse(const SparseBasis *src, PixelFormat format) {
+  SparseBasis *basis = new_sparse((src->width + 1) / 2, (src->height + 1) / 2, true, format);
+
+  // A tile is lit if any of the 2x2 source tiles under it are.
+  std::vector<bool> lit(basis->tiles.size(), false);
+  for (size_t t = 0; t < src->tiles.size(); t++) {
+    if (src->tiles[t] == NULL)
+      continue;
+
+    size_t tx = (t % src->tiles_x) / 2;
+    size_t ty = (t / src->tiles_x) / 2;
+    if (!lit[ty * basis->tiles_x + tx]) {
+      lit[ty * basis->tiles_x + tx] = true;
+      basis->num_lit++;
+    }
+  }
+
+  basis->data.resize(basis->num_lit * TILE_SIZE * basis->stride, 0);
+  unsigned char *dst = basis->data.data();
+
+  // The 2x2 source tiles, decoded, and the averaged tile.
+  const size_t region_size = 2 * TILE_SIZE;
+  std::vector<Pixel4> region(region_size * region_size);
+  std::vector<Pixel4> tile(TILE_SIZE * TILE_SIZE);
+
+  for (size_t t = 0; t < basis->tiles.size(); t++) {
+    if (!lit[t])
+      continue;
+
+    size_t tx = t % basis->tiles_x;
+    size_t ty = t / basis->tiles_x;
+    size_t tw = std::min(TILE_SIZE, basis->width - tx * TILE_SIZE);
+    size_t th = std::min(TILE_SIZE, basis->height - ty * TILE_SIZE);
+
+    // Source pixels under this tile, clamped to the source image.
+    size_t rw = std::min(region_size, src->width - 2 * tx * TILE_SIZE);
+    size_t rh = std::min(region_size, src->height - 2 * ty * TILE_SIZE);
+
+    std::fill(region.begin(), region.end(), Pixel4(0, 0, 0, 0));
+    for (size_t sy = 0; sy < 2; sy++) {
+      for (size_t sx = 0; sx < 2; sx++) {
+        size_t stx = 2 * tx + sx;
+        size_t sty = 2 * ty + sy;
+        if (stx >= src->tiles_x || sty >= src->tiles_y)
+          continue;
+
+        const unsigned char *src_tile = src->tiles[sty * src->tiles_x + stx];
+        if (src_tile == NULL)
+          continue;
+
+        size_t stw = std::min(TILE_SIZE, src->width - stx * TILE_SIZE);
+        size_t sth = std::min(TILE_SIZE, src->height - sty * TILE_SIZE);
+        for (size_t y = 0; y < sth; y++) {
+          decode_row(src_tile + y * src->stride, region.data() + (sy * TILE_SIZE + y) * region_size + sx * TILE_SIZE,
+            stw, src->format);
+        }
+      }
+    }
+
+    // Odd sized sources repeat their last row and column.
+    for (size_t y = 0; y < th; y++) {
+      const float *row0 = as_floats(region.data() + 2 * y * region_size);
+      const float *row1 = as_floats(region.data() + std::min(2 * y + 1, rh - 1) * region_size);
+      float *out = as_floats(tile.data() + y * TILE_SIZE);
+
+      for (size_t x = 0; x < tw; x++) {
+        size_t a = 2 * x * 4;
+        size_t b = std::min(2 * x + 1, rw - 1) * 4;
+        for (size_t c = 0; c < 4; c++) {
+          out[x * 4 + c] = 0.25f * (row0[a + c] + row0[b + c] + row1[a + c] + row1[b + c]);
+        }
+      }
+    }
+
+    pack_tile(tile.data(), TILE_SIZE, tw, th, dst, basis);
+    basis->tiles[t] = dst;
+    dst += TILE_SIZE * basis->stride;
+  }
+
+  return basis;
+}
+
+void EXRLayer::expand_sparse(const SparseBasis *basis, Pixel4 *image) {
+  std::fill_n(image, basis->width * basis->height, Pixel4(0, 0, 0, 0));
+
+  for (size_t t = 0; t < basis->tiles.size(); t++) {
+    if (basis->tiles[t] == NULL)
+      continue;
+
+    size_t tx = t % basis->tiles_x;
+    size_t ty = t / basis->tiles_x;
+    size_t tw = std::min(TILE_SIZE, basis->width - tx * TILE_SIZE);
+    size_t th = std::min(TILE_SIZE, basis->height - ty * TILE_SIZE);
+    Pixel4 *dst = image + ty * TILE_SIZE * basis->width + tx * TILE_SIZE;
+
+    for (size_t y = 0; y < th; y++) {
+      decode_row(basis->tiles[t] + y * basis->stride, dst + y * basis->width, tw, basis->format);
+    }
+  }
 }
 
 Pixel4 *EXRLayer::get_downsampled_pixels(int width, int height) {
+	ensure_loaded();
+
 	if ((width == w) && (height == h)) {
-		return pixels;
+		return get_pixels();
 	}
 
 	int key = get_size_key(width, height);
@@ -91,38 +703,9 @@ Pixel4 *EXRLayer::get_downsampled_pixels(int width, int height) {
 		return pixel_size_bases.at(key);
 	}
 
-	Pixel4 *downsampled_pixels = new Pixel4[width * height];
-
-	float *output_pixels = new float[width * height * 4];
-	float *input_pixels = new float[w * h * 4];
-	for (int i = 0; i < w * h; i++) {
-		int input_idx = 4 * i;
-		float r = pixels[i].r;
-		float g = pixels[i].g;
-		float b = pixels[i].b;
-		float a = pixels[i].a;
-		input_pixels[input_idx] = r;
-		input_pixels[input_idx + 1] = g;
-		input_pixels[input_idx + 2] = b;
-		input_pixels[input_idx + 3] = a;
-	}
-
-	stbir_resize_float(
-		input_pixels, w, h, 0,
-		output_pixels, width, height, 0,
-		4
-	);
-
-	for (int i = 0; i < width * height; i++) {
-		int output_idx = 4 * i;
-		downsampled_pixels[i].r = output_pixels[output_idx];
-		downsampled_pixels[i].g = output_pixels[output_idx + 1];
-		downsampled_pixels[i].b = output_pixels[output_idx + 2];
-		downsampled_pixels[i].a = output_pixels[output_idx + 3];
-	}
-
-	delete[] input_pixels;
-	delete[] output_pixels;
+	Pixel4 *downsampled_pixels = resample_from_mip(width, height);
+	if (downsampled_pixels == NULL)
+		return NULL;
 
 	// Add this buffer to the map for future use
 	pixel_size_bases[key] = downsampled_pixels;
@@ -131,25 +714,28 @@ Pixel4 *EXRLayer::get_downsampled_pixels(int width, int height) {
 }
 
 void EXRLayer::set_pixels(float *buffer) {
-	
+	cancel_load();
+	clear_bases();
+
 	if (pixels != NULL) {
 		delete[] pixels;
 	}
+	delete sparse;
+	sparse = NULL;
 	pixels = new Pixel4[w * h];
 
-	for (int i = 0; i < w * h; i++) {
-		int buf_idx = 4 * i;
-		pixels[i].r = buffer[buf_idx];
-		pixels[i].g = buffer[buf_idx + 1];
-		pixels[i].b = buffer[buf_idx + 2];
-		pixels[i].a = buffer[buf_idx + 3];
-	}
+	std::memcpy(as_floats(pixels), buffer, sizeof(Pixel4) * w * h);
 }
 
 void EXRLayer::set_pixels(Pixel4 * buffer)
 {
+  cancel_load();
+  clear_bases();
+
   if (pixels != NULL)
     delete[] pixels;
+  delete sparse;
+  sparse = NULL;
 
   pixels = buffer;
 }
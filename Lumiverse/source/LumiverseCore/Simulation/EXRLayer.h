@@ -6,17 +6,87 @@
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <atomic>
+#include <functional>
+#include <mutex>
 #include "Pixel.h"
 
 namespace Lumiverse {
 
+/*!
+\brief A layer image split into square tiles, where tiles that are entirely black are skipped.
+
+Most lights only illuminate part of the frame, so most of their tiles are empty.
+Tiles are EXRLayer::TILE_SIZE pixels square, except at the right and bottom edges.
+*/
+struct SparseBasis {
+  size_t width;
+  size_t height;
+
+  /*! \brief Number of tiles across. */
+  size_t tiles_x;
+
+  /*! \brief Number of tiles down. */
+  size_t tiles_y;
+
+  /*!
+  \brief Format of the pixels in the tiles.
+
+  Tiles that point into a dense buffer are always PIXEL_FLOAT.
+  */
+  PixelFormat format;
+
+  /*!
+  \brief First pixel of each tile, row major. nullptr if the tile is empty.
+  */
+  std::vector<const unsigned char *> tiles;
+
+  /*!
+  \brief Bytes between rows of a tile.
+
+  One tile row if the tiles are packed into data, or one image row if the tiles point into
+  a dense buffer.
+  */
+  size_t stride;
+
+  /*!
+  \brief Packed non-empty tiles.
+
+  Empty if the tiles point into a dense buffer or into a mapped LayerCacheFile.
+  */
+  std::vector<unsigned char> data;
+
+  /*! \brief Number of non-empty tiles. */
+  size_t num_lit;
+
+  /*!
+  \brief Largest difference between a stored color channel and the float it was made from.
+
+  Measured when the tiles are packed. 0 for PIXEL_FLOAT.
+  */
+  float max_error;
+};
+
 /**
  * Layers are defined as arrays of pixels with some modifiers.
  * Layers in lightman have RGB channels only since it does not make
  * sense for an alpha channel to exist in the illuminance space.
+ *
+ * A layer can be compacted, which keeps only the tiles that have light in
+ * them. Compacted layers use memory in proportion to their lit area, and the
+ * compositor skips the tiles they don't light. The lit tiles can also be
+ * stored as half floats or RGB9E5 to cut their size by 2 or 4 times.
+ *
+ * Layers also keep a mip pyramid of their lit tiles, so the compositor can
+ * render smaller frames from a level close to the frame size.
  */
 class EXRLayer {
 public:
+  /*!
+  \brief Width and height of a tile in pixels.
+  */
+  static const size_t TILE_SIZE = 64;
+
   /**
    * Constructor.
    * Creates a new layer from an OpenEXR file.
@@ -29,6 +99,24 @@ public:
    */
   EXRLayer(size_t w, size_t h, const char *name = NULL);
 
+  /*!
+  \brief Creates a compact layer from its lit tiles.
+
+  The layer takes ownership of the basis. If the tiles point into memory the basis
+  doesn't own, that memory has to stay valid until the layer is deleted or its
+  pixels change.
+  */
+  EXRLayer(SparseBasis *basis, const char *name = NULL);
+
+  /*!
+  \brief Creates an empty layer that loads its pixels the first time they're used.
+
+  The loader is called once, by the first call that needs the pixels, and returns a
+  buffer of w * h pixels the layer takes ownership of, or NULL if loading failed. The
+  loaded pixels are compacted. Setting or clearing the pixels first cancels the load.
+  */
+  EXRLayer(size_t w, size_t h, const char *name, std::function<Pixel4 *()> loader);
+
   /**
    * Destructor.
    */
@@ -81,9 +169,125 @@ public:
 
   /**
    * Get a pointer to the pixels.
+   *
+   * Compacted layers are expanded back to a full buffer. Call compact()
+   * again once done writing to it.
    */
   Pixel4 *get_pixels();
 
+  /*!
+  \brief Runs the loader of a layer that loads on first use.
+
+  Safe to call from several threads. Only the first call loads, the others wait for it.
+  \return false if the layer has no pixels because loading failed.
+  */
+  bool ensure_loaded();
+
+  /*!
+  \brief Returns false if the layer is still waiting to be loaded on first use.
+  */
+  bool is_loaded() { return loaded; }
+
+  /*!
+  \brief Replaces the full pixel buffer with only the tiles that have light in them.
+
+  Call after the pixels are loaded or rendered. Also builds the mip pyramid.
+  */
+  void compact();
+
+  /*!
+  \brief Returns true if the layer only stores its lit tiles.
+  */
+  bool is_compact();
+
+  /*!
+  \brief Sets the format lit tiles are stored in.
+
+  Applies the next time the layer is compacted, and converts the layer now if it
+  is already compact. Downsampled tiles are also stored in this format.
+  */
+  void set_format(PixelFormat format);
+
+  /*!
+  \brief Gets the format lit tiles are stored in.
+  */
+  PixelFormat get_format();
+
+  /*!
+  \brief Copies the full size image into a buffer of get_size() pixels.
+
+  Unlike get_pixels(), this doesn't change how the layer is stored, so compact layers
+  stay compact and layers loaded from a LayerCacheFile keep pointing into it.
+  */
+  void copy_pixels(Pixel4 *dst);
+
+  /*!
+  \brief Gets the lit tiles of the image at the given size.
+
+  Sizes other than the layer's size are resampled from the closest mip level. The
+  result is cached until the pixels change. Safe to call from several threads as long as
+  the pixels don't change.
+  */
+  const SparseBasis *get_sparse_pixels(int width, int height);
+
+  /*!
+  \brief Gets the lit tiles of a level of the layer's mip pyramid.
+
+  Level 0 is the full image. Each level after it is half the width and height of the one
+  before, rounded up, as long as both are at least TILE_SIZE. The levels after 0 are
+  built by compact(), or on first use for layers that aren't compact, and are stored in
+  the layer's format.
+
+  Every lit tile of a level comes from at least one lit tile of the level above, so a level
+  never has more lit tiles than level 0. All the levels together are also never more than a
+  third of the size of the full frame. Lights that cover most of the frame add about a third
+  to their size, small lights add more since their tiles are mostly empty.
+
+  Safe to call from several threads as long as the pixels don't change.
+  \return NULL if the level doesn't exist or the layer has no pixels.
+  */
+  const SparseBasis *get_mip(size_t level);
+
+  /*!
+  \brief Builds the mip pyramid if it hasn't been built since the pixels last changed.
+  */
+  void build_mips();
+
+  /*!
+  \brief Number of levels in the mip pyramid of an image, including the full size level.
+  */
+  static size_t get_num_mips(size_t width, size_t height);
+
+  /*!
+  \brief Size of a level of the mip pyramid of an image.
+  */
+  static void get_mip_size(size_t width, size_t height, size_t level, size_t &mip_width, size_t &mip_height);
+
+  /*!
+  \brief Finds the smallest mip level that is at least the target size in both directions.
+
+  Level 0 if the target is larger than the image.
+  */
+  static size_t choose_mip(size_t width, size_t height, size_t target_width, size_t target_height);
+
+  /*!
+  \brief Bilinearly resamples a region of an image to a new size.
+
+  Pixel centers of the two images are aligned, and samples outside the source are clamped
+  to its edges. Good for scaling up, and for scaling down by up to 2x.
+  \param src Source image.
+  \param dst Destination image. Only pixels in [x0, x1) x [y0, y1) are written.
+  \param dst_stride Pixels between rows of dst.
+  */
+  static void resample(const Pixel4 *src, size_t src_width, size_t src_height,
+    Pixel4 *dst, size_t dst_stride, size_t dst_width, size_t dst_height,
+    size_t x0, size_t y0, size_t x1, size_t y1);
+
+  /*!
+  \brief Approximate number of bytes used by the layer's pixels and cached bases.
+  */
+  size_t get_memory_usage();
+
   /*!
   \brief Set all bits of the buffer to 0
   */
@@ -91,6 +295,8 @@ public:
 
   /*!
   \brief Get a downsampled image basis
+
+  Resampled from the closest mip level and cached until the pixels change.
   */
   Pixel4 *get_downsampled_pixels(int width, int height);
 
@@ -135,13 +341,121 @@ private:
    */
   Pixel3 modulator;
 
+  /*!
+  \brief Format of compacted and downsampled tiles.
+  */
+  PixelFormat format;
+
   /**
    * Pixel buffer of the layer.
    * Do note that the pixels have RGB channels only since it does not
    * make sense for an alpha channel to exist in the illuminance space.
+   *
+   * NULL while the layer is compact.
    */
   Pixel4 *pixels;
 
+  /*!
+  \brief Loads the pixels of a layer created to load on first use.
+
+  Empty once it has been run or cancelled.
+  */
+  std::function<Pixel4 *()> loader;
+
+  /*!
+  \brief False until the loader has been run or cancelled.
+  */
+  std::atomic<bool> loaded;
+
+  /*!
+  \brief Held while the loader runs.
+  */
+  std::mutex load_lock;
+
+  /*!
+  \brief Cancels a pending load. Called when the pixels are replaced.
+  */
+  void cancel_load();
+
+  /*!
+  \brief Lit tiles at full size.
+
+  Owns the pixels while the layer is compact. Otherwise an index into the
+  pixel buffer, rebuilt when the pixels may have changed.
+  */
+  SparseBasis *sparse;
+
+  /*!
+  \brief Map from a size key to the lit tiles of a downsampled image.
+  */
+  std::unordered_map<int, SparseBasis *> sparse_size_bases;
+
+  /*!
+  \brief Levels 1 and up of the mip pyramid.
+  */
+  std::vector<SparseBasis *> mips;
+
+  /*!
+  \brief True once the mip pyramid has been built for the current pixels.
+  */
+  std::atomic<bool> mips_built;
+
+  /*!
+  \brief Held while the mip pyramid, sparse (for layers that aren't compact) or
+  sparse_size_bases are built.
+  */
+  std::mutex mip_lock;
+
+  /*!
+  \brief Deletes the cached bases and mip pyramid. Called when the pixels change.
+  */
+  void clear_bases();
+
+  /*!
+  \brief Builds the mip pyramid if it hasn't been built. Doesn't load the layer.
+  */
+  void make_mips();
+
+  /*!
+  \brief Expands a mip level and resamples it to the given size.
+  \return NULL if the layer has no pixels.
+  */
+  Pixel4 *resample_from_mip(int width, int height);
+
+  /*!
+  \brief Creates the next mip level from the lit tiles of a level.
+
+  Each pixel is the average of the 2x2 pixels above it. Only tiles under lit tiles of
+  the source are computed.
+  */
+  static SparseBasis *downsample_sparse(const SparseBasis *src, PixelFormat format);
+
+  /*!
+  \brief Creates a basis of the given size with no lit tiles.
+  */
+  static SparseBasis *new_sparse(size_t width, size_t height, bool pack, PixelFormat format);
+
+  /*!
+  \brief Encodes a tile into a basis' packed data and updates its max_error.
+  \param src First pixel of the tile.
+  \param src_stride Pixels between rows of src.
+  */
+  static void pack_tile(const Pixel4 *src, size_t src_stride, size_t tw, size_t th,
+    unsigned char *dst, SparseBasis *basis);
+
+  /*!
+  \brief Finds the lit tiles of an image.
+  \param pack If true, copies the lit tiles so the image can be deleted.
+  \param format Format to copy the tiles in. Only used when packing.
+  */
+  static SparseBasis *make_sparse(const Pixel4 *image, size_t width, size_t height, bool pack,
+    PixelFormat format = PIXEL_FLOAT);
+
+  /*!
+  \brief Expands lit tiles back into a full image.
+  */
+  static void expand_sparse(const SparseBasis *basis, Pixel4 *image);
+
   /*!
    * \brief Map from an integer (width << 2 + height) key to a basis image
    * of pixels for this EXR layer
@@ -0,0 +1,372 @@
+#include "LayerCache.h"
+
+#ifdef USE_ARNOLD_CACHING
+
+#include "../Logger.h"
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Lumiverse {
+
+  // Data blocks start on a page, so each layer only faults in its own pages.
+  static const uint64_t LayerCacheBlockAlignment = 4096;
+
+  static uint64_t alignBlock(uint64_t offset) {
+    return (offset + LayerCacheBlockAlignment - 1) / LayerCacheBlockAlignment * LayerCacheBlockAlignment;
+  }
+
+  // Writes size bytes, clearing ok if the write fails.
+  static void writeBytes(FILE* file, const void* data, size_t size, bool& ok) {
+    if (ok && size > 0 && fwrite(data, 1, size, file) != size)
+      ok = false;
+  }
+
+  // Writes zeros until the file is at offset.
+  static void padTo(FILE* file, uint64_t current, uint64_t offset, bool& ok) {
+    static const unsigned char zeros[LayerCacheBlockAlignment] = { 0 };
+    writeBytes(file, zeros, (size_t)(offset - current), ok);
+  }
+
+  LayerCacheFile::LayerCacheFile() : m_data(nullptr), m_size(0),
+#ifdef _WIN32
+    m_fileHandle(nullptr), m_mapHandle(nullptr),
+#endif
+    m_entries(nullptr)
+  {
+  }
+
+  LayerCacheFile::~LayerCacheFile() {
+    close();
+  }
+
+  bool LayerCacheFile::write(string filename, const map<string, EXRLayer*>& layers) {
+    const size_t tileSize = EXRLayer::TILE_SIZE;
+
+    // Gather the lit tiles of each layer. Layers that aren't compact are indexed in place.
+    vector<pair<string, const SparseBasis*> > bases;
+    size_t width = 0;
+    size_t height = 0;
+
+    for (const auto& l : layers) {
+      if (l.first.size() >= sizeof(LayerCacheEntry::name)) {
+        Logger::log(WARN, "Layer name " + l.first + " is too long for a layer cache, skipping");
+        continue;
+      }
+
+      if (bases.empty()) {
+        width = l.second->get_width();
+        height = l.second->get_height();
+      }
+      else if (l.second->get_width() != width || l.second->get_height() != height) {
+        Logger::log(WARN, "Layer " + l.first + " doesn't match the size of the other layers, skipping");
+        continue;
+      }
+
+      const SparseBasis* basis = l.second->get_sparse_pixels((int)width, (int)height);
+      if (basis != nullptr)
+        bases.push_back(make_pair(l.first, basis));
+    }
+
+    if (bases.empty()) {
+      Logger::log(ERR, "No layers to write to " + filename);
+      return false;
+    }
+
+    size_t numTiles = bases[0].second->tiles.size();
+
+    // Lay out the file.
+    LayerCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "LVLAYERS", 8);
+    header.version = 1;
+    header.numLayers = (uint32_t)bases.size();
+    header.width = (uint32_t)width;
+    header.height = (uint32_t)height;
+    header.tileSize = (uint32_t)tileSize;
+
+    vector<LayerCacheEntry> entries(bases.size());
+    uint64_t offset = sizeof(LayerCacheHeader) + entries.size() * sizeof(LayerCacheEntry);
+
+    for (size_t i = 0; i < bases.size(); i++) {
+      memset(&entries[i], 0, sizeof(LayerCacheEntry));
+      strncpy(entries[i].name, bases[i].first.c_str(), sizeof(entries[i].name) - 1);
+      entries[i].format = bases[i].second->format;
+      entries[i].numLit = (uint32_t)bases[i].second->num_lit;
+      entries[i].maxError = bases[i].second->max_error;
+      entries[i].tableOffset = offset;
+      offset += numTiles * sizeof(uint32_t);
+    }
+
+    for (size_t i = 0; i < bases.size(); i++) {
+      offset = alignBlock(offset);
+      entries[i].dataOffset = offset;
+      offset += entries[i].numLit * tileSize * tileSize * pixel_format_size(bases[i].second->format);
+    }
+
+    // Write next to the destination, so a mapping of the old file isn't truncated under it.
+    string temp = filename + ".tmp";
+    FILE* file = fopen(temp.c_str(), "wb");
+    if (file == nullptr) {
+      Logger::log(ERR, "Unable to create layer cache file " + temp);
+      return false;
+    }
+
+    bool ok = true;
+    writeBytes(file, &header, sizeof(header), ok);
+    writeBytes(file, entries.data(), entries.size() * sizeof(LayerCacheEntry), ok);
+
+    vector<uint32_t> table(numTiles);
+    for (const auto& b : bases) {
+      uint32_t next = 0;
+      for (size_t t = 0; t < numTiles; t++) {
+        table[t] = (b.second->tiles[t] != nullptr) ? next++ : LayerCacheEmptyTile;
+      }
+      writeBytes(file, table.data(), table.size() * sizeof(uint32_t), ok);
+    }
+
+    uint64_t current = entries[0].tableOffset + bases.size() * numTiles * sizeof(uint32_t);
+    vector<unsigned char> tile;
+
+    for (size_t i = 0; i < bases.size(); i++) {
+      const SparseBasis* basis = bases[i].second;
+      size_t pixelSize = pixel_format_size(basis->format);
+      size_t rowBytes = tileSize * pixelSize;
+
+      padTo(file, current, entries[i].dataOffset, ok);
+      current = entries[i].dataOffset;
+
+      tile.assign(tileSize * rowBytes, 0);
+
+      for (size_t t = 0; t < numTiles; t++) {
+        if (basis->tiles[t] == nullptr)
+          continue;
+
+        // Edge tiles are padded out to a full tile.
+        size_t tw = min(tileSize, width - (t % basis->tiles_x) * tileSize);
+        size_t th = min(tileSize, height - (t / basis->tiles_x) * tileSize);
+        if (tw < tileSize || th < tileSize)
+          fill(tile.begin(), tile.end(), 0);
+
+        for (size_t y = 0; y < th; y++) {
+          memcpy(tile.data() + y * rowBytes, basis->tiles[t] + y * basis->stride, tw * pixelSize);
+        }
+
+        writeBytes(file, tile.data(), tile.size(), ok);
+        current += tile.size();
+      }
+    }
+
+    if (fclose(file) != 0)
+      ok = false;
+
+    if (!ok) {
+      Logger::log(ERR, "Failed writing layer cache file " + temp);
+      remove(temp.c_str());
+      return false;
+    }
+
+#ifdef _WIN32
+    // Windows can't replace a file while it's mapped, which it is if layers were loaded
+    // from it. Keep the new file next to it, open() moves it into place.
+    string pending = filename + ".pending";
+    if (MoveFileExA(temp.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+      // An older write that couldn't replace the file is out of date now.
+      DeleteFileA(pending.c_str());
+    }
+    else {
+      if (!MoveFileExA(temp.c_str(), pending.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+        Logger::log(ERR, "Unable to replace layer cache file " + filename);
+        remove(temp.c_str());
+        return false;
+      }
+
+      Logger::log(INFO, filename + " is in use, wrote " + pending + " to replace it when it's next opened");
+      return true;
+    }
+#else
+    if (rename(temp.c_str(), filename.c_str()) != 0) {
+      Logger::log(ERR, "Unable to replace layer cache file " + filename);
+      remove(temp.c_str());
+      return false;
+    }
+#endif
+
+    Logger::log(INFO, "Wrote " + to_string(bases.size()) + " layers to " + filename);
+    return true;
+  }
+
+  bool LayerCacheFile::open(string filename) {
+    close();
+
+#ifdef _WIN32
+    // Finish a write that couldn't replace the file while it was mapped.
+    string pending = filename + ".pending";
+    if (GetFileAttributesA(pending.c_str()) != INVALID_FILE_ATTRIBUTES &&
+      !MoveFileExA(pending.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+      Logger::log(WARN, "Unable to replace " + filename + " with " + pending + ", it's still in use");
+    }
+
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+      Logger::log(ERR, "Unable to open layer cache file " + filename);
+      return false;
+    }
+
+    LARGE_INTEGER size;
+    HANDLE mapping = NULL;
+    if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+      mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+
+    const void* data = (mapping != NULL) ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+    if (data == NULL) {
+      if (mapping != NULL)
+        CloseHandle(mapping);
+      CloseHandle(file);
+      Logger::log(ERR, "Unable to map layer cache file " + filename);
+      return false;
+    }
+
+    m_fileHandle = file;
+    m_mapHandle = mapping;
+    m_size = (size_t)size.QuadPart;
+#else
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+      Logger::log(ERR, "Unable to open layer cache file " + filename);
+      return false;
+    }
+
+    struct stat st;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+      data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    // The mapping stays valid after the descriptor is closed.
+    ::close(fd);
+
+    if (data == MAP_FAILED) {
+      Logger::log(ERR, "Unable to map layer cache file " + filename);
+      return false;
+    }
+
+    m_size = (size_t)st.st_size;
+#endif
+
+    m_data = (const unsigned char*)data;
+
+    const LayerCacheHeader* header = (const LayerCacheHeader*)m_data;
+    bool valid = m_size >= sizeof(LayerCacheHeader) &&
+      memcmp(header->magic, "LVLAYERS", 8) == 0 &&
+      header->version == 1 &&
+      header->tileSize == EXRLayer::TILE_SIZE &&
+      header->width > 0 && header->height > 0 &&
+      header->numLayers <= (m_size - sizeof(LayerCacheHeader)) / sizeof(LayerCacheEntry);
+
+    if (!valid) {
+      Logger::log(ERR, filename + " is not a valid layer cache file");
+      close();
+      return false;
+    }
+
+    m_entries = (const LayerCacheEntry*)(m_data + sizeof(LayerCacheHeader));
+
+    // Check that every block is inside the file here, so createLayer only checks the tiles.
+    const uint64_t tileSize = EXRLayer::TILE_SIZE;
+    uint64_t numTiles = ((header->width + tileSize - 1) / tileSize) * ((header->height + tileSize - 1) / tileSize);
+
+    for (unsigned int i = 0; i < header->numLayers; i++) {
+      const LayerCacheEntry& e = m_entries[i];
+      uint64_t dataSize = (uint64_t)e.numLit * tileSize * tileSize *
+        ((e.format <= PIXEL_RGB9E5) ? pixel_format_size((PixelFormat)e.format) : 0);
+
+      if (e.format > PIXEL_RGB9E5 ||
+        memchr(e.name, 0, sizeof(e.name)) == nullptr ||
+        e.numLit > numTiles ||
+        e.tableOffset % sizeof(uint32_t) != 0 ||
+        e.tableOffset > m_size || numTiles * sizeof(uint32_t) > m_size - e.tableOffset ||
+        e.dataOffset % LayerCacheBlockAlignment != 0 ||
+        e.dataOffset > m_size || dataSize > m_size - e.dataOffset) {
+        Logger::log(ERR, filename + " is not a valid layer cache file");
+        close();
+        return false;
+      }
+
+      m_names[e.name] = i;
+    }
+
+    return true;
+  }
+
+  void LayerCacheFile::close() {
+    if (m_data != nullptr) {
+#ifdef _WIN32
+      UnmapViewOfFile(m_data);
+      CloseHandle(m_mapHandle);
+      CloseHandle(m_fileHandle);
+      m_mapHandle = nullptr;
+      m_fileHandle = nullptr;
+#else
+      munmap((void*)m_data, m_size);
+#endif
+    }
+
+    m_data = nullptr;
+    m_size = 0;
+    m_entries = nullptr;
+    m_names.clear();
+  }
+
+  EXRLayer* LayerCacheFile::createLayer(const string& name) {
+    auto it = m_names.find(name);
+    if (it == m_names.end())
+      return nullptr;
+
+    const LayerCacheEntry& e = m_entries[it->second];
+    const size_t tileSize = EXRLayer::TILE_SIZE;
+
+    SparseBasis* basis = new SparseBasis();
+    basis->width = getWidth();
+    basis->height = getHeight();
+    basis->tiles_x = (basis->width + tileSize - 1) / tileSize;
+    basis->tiles_y = (basis->height + tileSize - 1) / tileSize;
+    basis->format = (PixelFormat)e.format;
+    basis->stride = tileSize * pixel_format_size(basis->format);
+    basis->num_lit = 0;
+    basis->max_error = e.maxError;
+    basis->tiles.resize(basis->tiles_x * basis->tiles_y, nullptr);
+
+    // Only the table is read here. The tiles are paged in when they're used.
+    const uint32_t* table = (const uint32_t*)(m_data + e.tableOffset);
+    const unsigned char* tiles = m_data + e.dataOffset;
+
+    for (size_t t = 0; t < basis->tiles.size(); t++) {
+      if (table[t] == LayerCacheEmptyTile)
+        continue;
+
+      if (table[t] >= e.numLit) {
+        Logger::log(ERR, "Layer " + name + " has a corrupt tile table");
+        delete basis;
+        return nullptr;
+      }
+
+      basis->tiles[t] = tiles + table[t] * tileSize * basis->stride;
+      basis->num_lit++;
+    }
+
+    return new EXRLayer(basis, name.c_str());
+  }
+}
+
+#endif // USE_ARNOLD_CACHING
@@ -0,0 +1,154 @@
+/*! \file LayerCache.h
+* \brief Packed file format for cached light layers.
+*/
+#ifndef _LAYERCACHE_H_
+#define _LAYERCACHE_H_
+
+#pragma once
+
+#include "LumiverseCoreConfig.h"
+
+#ifdef USE_ARNOLD_CACHING
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "EXRLayer.h"
+
+namespace Lumiverse {
+  using namespace std;
+
+  /*!
+  * \brief Header at the start of a packed layer cache file.
+  *
+  * A layer cache file holds the lit tiles of every light layer of a cache in one file,
+  * in the same layout EXRLayer keeps them in memory. The layout is:
+  *
+  * 1. LayerCacheHeader
+  * 2. numLayers LayerCacheEntry records.
+  * 3. The tile table of each layer: one uint32_t per tile, row major. Either the index of
+  *    the tile in the layer's data block, or LayerCacheEmptyTile.
+  * 4. The data block of each layer: the lit tiles, each tileSize rows of tileSize pixels
+  *    in the layer's PixelFormat. Blocks start on a 4096 byte boundary.
+  *
+  * The file is memory mapped when it's read, and layers point straight into the mapping.
+  * Only the header and tile tables are read when the file is opened. Tiles are paged in
+  * by the OS the first time they're composited. Values are stored in the byte order of the
+  * machine that wrote the file (little endian on every platform Lumiverse currently supports).
+  */
+  struct LayerCacheHeader {
+    /*! \brief "LVLAYERS" */
+    char magic[8];
+    uint32_t version;
+    uint32_t numLayers;
+    /*! \brief Size of every layer in pixels. */
+    uint32_t width;
+    uint32_t height;
+    /*! \brief Width and height of a tile. Always EXRLayer::TILE_SIZE. */
+    uint32_t tileSize;
+    uint32_t reserved;
+  };
+
+  /*! \brief Describes one layer in the file. */
+  struct LayerCacheEntry {
+    /*! \brief Layer name, null terminated. */
+    char name[96];
+    /*! \brief PixelFormat of the tiles. */
+    uint32_t format;
+    /*! \brief Number of tiles in the data block. */
+    uint32_t numLit;
+    /*! \brief Offset of the tile table from the start of the file. */
+    uint64_t tableOffset;
+    /*! \brief Offset of the data block from the start of the file. */
+    uint64_t dataOffset;
+    /*! \brief SparseBasis::max_error when the layer was written. */
+    float maxError;
+    uint32_t reserved;
+  };
+
+  static_assert(sizeof(LayerCacheHeader) == 32, "LayerCacheHeader must match the file layout");
+  static_assert(sizeof(LayerCacheEntry) == 128, "LayerCacheEntry must match the file layout");
+
+  /*! \brief Tile table value for tiles with no light in them. */
+  static const uint32_t LayerCacheEmptyTile = 0xFFFFFFFF;
+
+  /*!
+  * \brief Reads and writes packed layer cache files.
+  *
+  * Layers created from an open file point into its mapping, so the file has to stay open
+  * until they're deleted or their pixels change.
+  * \sa LayerCacheHeader
+  */
+  class LayerCacheFile
+  {
+  public:
+    LayerCacheFile();
+
+    /*! \brief Unmaps the file if it's open. */
+    ~LayerCacheFile();
+
+    /*!
+    * \brief Writes layers to a packed cache file.
+    *
+    * Each layer is stored in its current format. The file is written next to the
+    * destination and moved over it when done, so a mapped copy of the old file stays valid.
+    * Windows can't replace a mapped file, so there the new file may be left as
+    * filename.pending until open() is next called for it.
+    * \param filename File to write. Replaced if it exists.
+    * \param layers Layers to write. They must all be the same size.
+    * \return false if the file couldn't be written.
+    */
+    static bool write(string filename, const map<string, EXRLayer*>& layers);
+
+    /*!
+    * \brief Maps a cache file and checks its header and layer index.
+    * \return false if the file can't be mapped or isn't a valid layer cache.
+    */
+    bool open(string filename);
+
+    void close();
+
+    bool isOpen() { return m_data != nullptr; }
+
+    unsigned int getWidth() { return getHeader().width; }
+
+    unsigned int getHeight() { return getHeader().height; }
+
+    unsigned int getNumLayers() { return getHeader().numLayers; }
+
+    /*! \brief Returns true if the file has a layer with the given name. */
+    bool contains(const string& name) { return m_names.count(name) > 0; }
+
+    /*!
+    * \brief Creates a compact layer whose tiles point into the file.
+    *
+    * The caller owns the layer.
+    * \return nullptr if there's no layer with that name or its tiles are corrupt.
+    */
+    EXRLayer* createLayer(const string& name);
+
+  private:
+    const LayerCacheHeader& getHeader() { return *(const LayerCacheHeader*)m_data; }
+
+    /*! \brief Start of the mapped file. */
+    const unsigned char* m_data;
+    size_t m_size;
+
+#ifdef _WIN32
+    void* m_fileHandle;
+    void* m_mapHandle;
+#endif
+
+    const LayerCacheEntry* m_entries;
+
+    /*! \brief Layer name -> index into m_entries. */
+    unordered_map<string, unsigned int> m_names;
+  };
+}
+
+#endif // USE_ARNOLD_CACHING
+
+#endif
@@ -4,28 +4,27 @@
 #ifdef USE_ARNOLD_CACHING
 
 #include <iostream>
+#include <type_traits>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
 
 namespace Lumiverse {
 
 /**
  * Pixels are defined as vectors of illuminance of the color channels.
- * Lightman uses GLM's single precision floating point vectors as a basis
- * for its pixel representation. Therefore they are compatible with all
- * the vector operations provided by GLM.
+ *
+ * Pixels are plain structs with no virtual functions, so a pixel buffer is
+ * just packed floats. A Pixel4 buffer can be treated as an array of float4
+ * (or of 4 * n floats) by the compositing kernels and by image libraries.
+ * Use the illum() free functions to get the illuminance of a pixel.
  */
-class Pixel {
-public:
-  /**
-   * Compute the illuminance value of the pixel.
-   */
-  virtual inline float illum() = 0;
-};
 
 /**
  * Pixel with RGB channels.
  * You may access individual channel through members r,g,b
  */
-class Pixel3 : public Pixel {
+class Pixel3 {
 public:
 	Pixel3() {
 		r = 1;
@@ -41,7 +40,7 @@ public:
 
 	float r, g, b;
 
-	Pixel3 operator *(float scalar) {
+	Pixel3 operator *(float scalar) const {
 		return Pixel3(r * scalar, g * scalar, b * scalar);
 	}
 
@@ -50,17 +49,17 @@ public:
 		g *= scalar;
 		b *= scalar;
 	}
-
-	inline float illum() {
-		return (float) (0.2126*r + 0.7152*g + 0.0722*b);
-	}
 };
 
 /**
  * Pixel with RGBA channels.
  * You may access individual channel through members r,g,b,a
+ *
+ * 16 bytes and 16 byte aligned, so each pixel fills exactly one SIMD register.
+ * Buffers allocated with new[] are 16 byte aligned on the 64 bit platforms
+ * Lumiverse builds on.
  */
-class Pixel4 : public Pixel {
+class alignas(16) Pixel4 {
 public:
 	Pixel4() {
 		r = 1;
@@ -78,11 +77,7 @@ public:
 
 	float r, g, b, a;
 
-  inline float illum() {
-	  return (float) (0.2126*r + 0.7152*g + 0.0722*b);
-  }
-
-  Pixel4 operator *(float scalar) {
+  Pixel4 operator *(float scalar) const {
 	  return Pixel4(r * scalar, g * scalar, b * scalar, a);
   }
 
@@ -94,6 +89,162 @@ public:
 
 };
 
+static_assert(sizeof(Pixel3) == 3 * sizeof(float), "Pixel3 must be packed RGB floats");
+static_assert(sizeof(Pixel4) == 4 * sizeof(float), "Pixel4 must be packed RGBA floats");
+static_assert(std::is_standard_layout<Pixel4>::value, "Pixel4 must be usable as a float array");
+
+/**
+ * Compute the illuminance value of a pixel.
+ */
+inline float illum(const Pixel3& p) {
+	return (float) (0.2126*p.r + 0.7152*p.g + 0.0722*p.b);
+}
+
+inline float illum(const Pixel4& p) {
+	return (float) (0.2126*p.r + 0.7152*p.g + 0.0722*p.b);
+}
+
+/**
+ * Get a pixel buffer as a flat array of floats, 4 per pixel.
+ */
+inline float *as_floats(Pixel4 *pixels) { return reinterpret_cast<float *>(pixels); }
+inline const float *as_floats(const Pixel4 *pixels) { return reinterpret_cast<const float *>(pixels); }
+
+/**
+ * Storage formats for cached light layers.
+ *
+ * PIXEL_FLOAT is Pixel4, 16 bytes per pixel.
+ * PIXEL_HALF is RGBA as IEEE half floats, 8 bytes per pixel. Each channel is
+ * within a relative error of 2^-11 of the float value, up to 65504.
+ * PIXEL_RGB9E5 is RGB with a shared 5 bit exponent and 9 bit mantissas,
+ * 4 bytes per pixel, and drops alpha. Each channel is within about
+ * 2^-9 * max(r, g, b) of the float value, up to 65408, or within 2^-24 when
+ * max(r, g, b) is below 2^-15. Negative values are stored as 0.
+ */
+enum PixelFormat {
+	PIXEL_FLOAT,
+	PIXEL_HALF,
+	PIXEL_RGB9E5
+};
+
+/**
+ * Bytes per pixel in the given format.
+ */
+inline size_t pixel_format_size(PixelFormat format) {
+	switch (format) {
+	case PIXEL_HALF: return 8;
+	case PIXEL_RGB9E5: return 4;
+	default: return sizeof(float) * 4;
+	}
+}
+
+/**
+ * Convert a float to a half float, rounding to nearest even.
+ * Values too large for a half are clamped to the largest half (65504)
+ * instead of becoming infinity.
+ */
+inline uint16_t float_to_half(float f) {
+	uint32_t x;
+	std::memcpy(&x, &f, sizeof(x));
+
+	uint32_t sign = (x >> 16) & 0x8000;
+	x &= 0x7FFFFFFF;
+
+	// Inf and NaN
+	if (x >= 0x7F800000)
+		return (uint16_t)(sign | 0x7C00 | (x > 0x7F800000 ? 0x200 : 0));
+
+	// Would round up to infinity
+	if (x >= 0x477FF000)
+		return (uint16_t)(sign | 0x7BFF);
+
+	// Denormal half. Adding 0.5 lines the mantissa up with the half's last bit
+	// and lets the FPU do the rounding.
+	if (x < 0x38800000) {
+		float a;
+		std::memcpy(&a, &x, sizeof(a));
+		a += 0.5f;
+		std::memcpy(&x, &a, sizeof(x));
+		return (uint16_t)(sign | (x - 0x3F000000));
+	}
+
+	// Rebias the exponent and round the 13 dropped bits to nearest even.
+	uint32_t odd = (x >> 13) & 1;
+	x += 0xC8000FFF + odd;
+	return (uint16_t)(sign | (x >> 13));
+}
+
+/**
+ * Convert a half float to a float. Exact.
+ */
+inline float half_to_float(uint16_t h) {
+	uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+	uint32_t exp = (h >> 10) & 0x1F;
+	uint32_t mant = h & 0x3FF;
+	uint32_t x;
+
+	if (exp == 0x1F) {
+		x = sign | 0x7F800000 | (mant << 13);
+	}
+	else if (exp == 0) {
+		// Zero or denormal, mant * 2^-24
+		float f = mant * (1.0f / 16777216.0f);
+		std::memcpy(&x, &f, sizeof(x));
+		x |= sign;
+	}
+	else {
+		x = sign | ((exp + 112) << 23) | (mant << 13);
+	}
+
+	float f;
+	std::memcpy(&f, &x, sizeof(f));
+	return f;
+}
+
+/**
+ * Pack RGB into the shared exponent format from EXT_texture_shared_exponent.
+ * Bits 0-8 are red, 9-17 green, 18-26 blue and 27-31 the exponent.
+ */
+inline uint32_t pack_rgb9e5(float r, float g, float b) {
+	const float max_value = 65408.0f; // (2^9 - 1) / 2^9 * 2^16
+
+	// Also maps NaN to 0
+	r = r > 0 ? (r < max_value ? r : max_value) : 0;
+	g = g > 0 ? (g < max_value ? g : max_value) : 0;
+	b = b > 0 ? (b < max_value ? b : max_value) : 0;
+
+	float max_c = r > g ? (r > b ? r : b) : (g > b ? g : b);
+	if (max_c == 0)
+		return 0;
+
+	// floor(log2(max_c)), limited to the smallest exponent
+	int e;
+	std::frexp(max_c, &e);
+	int exp = (e - 1 < -16 ? -16 : e - 1) + 16;
+
+	// Rounding can carry into the next exponent
+	if ((int)std::floor(std::ldexp(max_c, 24 - exp) + 0.5f) == 512)
+		exp++;
+
+	uint32_t rm = (uint32_t)std::floor(std::ldexp(r, 24 - exp) + 0.5f);
+	uint32_t gm = (uint32_t)std::floor(std::ldexp(g, 24 - exp) + 0.5f);
+	uint32_t bm = (uint32_t)std::floor(std::ldexp(b, 24 - exp) + 0.5f);
+
+	return rm | (gm << 9) | (bm << 18) | ((uint32_t)exp << 27);
+}
+
+/**
+ * Unpack a shared exponent pixel. Alpha is 0.
+ */
+inline Pixel4 unpack_rgb9e5(uint32_t v) {
+	// 2^(exp - 15 - 9), built directly from the exponent bits
+	uint32_t scale_bits = ((v >> 27) + 103) << 23;
+	float scale;
+	std::memcpy(&scale, &scale_bits, sizeof(scale));
+
+	return Pixel4((v & 0x1FF) * scale, ((v >> 9) & 0x1FF) * scale, ((v >> 18) & 0x1FF) * scale, 0);
+}
+
 /**
  * Clamp an illuminance value to 8 bit color
  */
@@ -12,9 +12,141 @@
 #include <cmath>
 #include <cstring>
 #include <fstream>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LUMIVERSE_TONEMAPPER_SSE
+#include <immintrin.h>
+#endif
+
+// Same as the compositor, the AVX2 kernel is only used if the CPU supports it.
+#if defined(LUMIVERSE_TONEMAPPER_SSE) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LUMIVERSE_TONEMAPPER_AVX2
+#endif
 
 namespace Lumiverse {
 
+  // Layout of the gamma table. See ToneMapper::lut.
+  static const int LUT_SHIFT = 23 - ToneMapper::LUT_MANTISSA_BITS;
+  static const uint32_t LUT_BASE = (127 + ToneMapper::LUT_MIN_EXPONENT) << ToneMapper::LUT_MANTISSA_BITS;
+  static const size_t LUT_SIZE = ((size_t)-ToneMapper::LUT_MIN_EXPONENT << ToneMapper::LUT_MANTISSA_BITS) + 1;
+  static const float LUT_FRAC_SCALE = 1.0f / (1 << LUT_SHIFT);
+
+  static inline float lut_lookup(const float *lut, float x) {
+    // Also catches NaN.
+    if (!(x >= std::ldexp(1.0f, ToneMapper::LUT_MIN_EXPONENT)))
+      return 0;
+    if (x >= 1)
+      return 1;
+
+    uint32_t bits;
+    std::memcpy(&bits, &x, sizeof(float));
+    uint32_t i = (bits >> LUT_SHIFT) - LUT_BASE;
+    float frac = (bits & ((1 << LUT_SHIFT) - 1)) * LUT_FRAC_SCALE;
+    return lut[i] + frac * (lut[i + 1] - lut[i]);
+  }
+
+  // Tone maps numPixels RGBA float pixels from in to out.
+  typedef void(*MapKernel)(const float *lut, const float *in, float *out, size_t numPixels);
+
+  // Converts numPixels RGBA float pixels in [0, 1] to RGBA8.
+  typedef void(*ByteKernel)(const float *in, unsigned char *out, size_t numPixels);
+
+  static void map_scalar(const float *lut, const float *in, float *out, size_t numPixels) {
+    for (size_t i = 0; i < numPixels * 4; i += 4) {
+      out[i] = lut_lookup(lut, in[i]);
+      out[i + 1] = lut_lookup(lut, in[i + 1]);
+      out[i + 2] = lut_lookup(lut, in[i + 2]);
+      out[i + 3] = 1.f;
+    }
+  }
+
+  static void bytes_scalar(const float *in, unsigned char *out, size_t numPixels) {
+    for (size_t i = 0; i < numPixels * 4; i++) {
+      out[i] = (unsigned char)std::lrint(in[i] * 255.f);
+    }
+  }
+
+#ifdef LUMIVERSE_TONEMAPPER_SSE
+  static void bytes_sse(const float *in, unsigned char *out, size_t numPixels) {
+    const __m128 s = _mm_set1_ps(255.f);
+
+    // Four pixels per store.
+    size_t i = 0;
+    for (; i + 4 <= numPixels; i += 4) {
+      __m128i p0 = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(in + i * 4), s));
+      __m128i p1 = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(in + i * 4 + 4), s));
+      __m128i p2 = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(in + i * 4 + 8), s));
+      __m128i p3 = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(in + i * 4 + 12), s));
+      __m128i b = _mm_packus_epi16(_mm_packs_epi32(p0, p1), _mm_packs_epi32(p2, p3));
+      _mm_storeu_si128((__m128i *)(out + i * 4), b);
+    }
+
+    if (i < numPixels)
+      bytes_scalar(in + i * 4, out + i * 4, numPixels - i);
+  }
+#endif
+
+#ifdef LUMIVERSE_TONEMAPPER_AVX2
+  // Two pixels per register, with the table entries on either side gathered.
+  __attribute__((target("avx2,fma")))
+  static void map_avx2(const float *lut, const float *in, float *out, size_t numPixels) {
+    const __m256i base = _mm256_set1_epi32(LUT_BASE);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i last = _mm256_set1_epi32((int)LUT_SIZE - 2);
+    const __m256i fracMask = _mm256_set1_epi32((1 << LUT_SHIFT) - 1);
+    const __m256 fracScale = _mm256_set1_ps(LUT_FRAC_SCALE);
+    const __m256 lo = _mm256_set1_ps(std::ldexp(1.0f, ToneMapper::LUT_MIN_EXPONENT));
+    const __m256 one = _mm256_set1_ps(1.f);
+
+    size_t i = 0;
+    for (; i + 2 <= numPixels; i += 2) {
+      __m256 x = _mm256_loadu_ps(in + i * 4);
+      __m256i bits = _mm256_castps_si256(x);
+
+      // Out of range indexes are clamped here and replaced below.
+      __m256i idx = _mm256_sub_epi32(_mm256_srli_epi32(bits, LUT_SHIFT), base);
+      idx = _mm256_min_epi32(_mm256_max_epi32(idx, zero), last);
+
+      __m256 a = _mm256_i32gather_ps(lut, idx, 4);
+      __m256 b = _mm256_i32gather_ps(lut + 1, idx, 4);
+      __m256 frac = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(bits, fracMask)), fracScale);
+      __m256 y = _mm256_fmadd_ps(frac, _mm256_sub_ps(b, a), a);
+
+      y = _mm256_blendv_ps(y, one, _mm256_cmp_ps(x, one, _CMP_GE_OQ));
+      y = _mm256_and_ps(y, _mm256_cmp_ps(x, lo, _CMP_GE_OQ));
+      y = _mm256_blend_ps(y, one, 0x88);
+      _mm256_storeu_ps(out + i * 4, y);
+    }
+
+    if (i < numPixels)
+      map_scalar(lut, in + i * 4, out + i * 4, numPixels - i);
+  }
+#endif
+
+  // Kernels for tone mapping, fastest the CPU supports.
+  struct ToneMapKernels {
+    MapKernel map;
+    ByteKernel bytes;
+
+    ToneMapKernels() {
+      map = map_scalar;
+      bytes = bytes_scalar;
+
+#ifdef LUMIVERSE_TONEMAPPER_SSE
+      bytes = bytes_sse;
+#endif
+
+#ifdef LUMIVERSE_TONEMAPPER_AVX2
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        map = map_avx2;
+#endif
+    }
+  };
+
+  static const ToneMapKernels tonemap_kernels;
+
 	////////////////////////////
 	// Default Implementation //
 	////////////////////////////
@@ -28,6 +160,8 @@ namespace Lumiverse {
 
 		input_buffer = NULL;
 		hdr_output_buffer = NULL;
+
+		update_lut();
 	}
 
 	ToneMapper::~ToneMapper() {}
@@ -36,7 +170,13 @@ namespace Lumiverse {
 
 	float ToneMapper::get_gamma() { return gamma; }
 
-	void ToneMapper::set_gamma(float gamma) { this->gamma = gamma; }
+	void ToneMapper::set_gamma(float gamma) {
+		if (gamma == this->gamma)
+			return;
+
+		this->gamma = gamma;
+		update_lut();
+	}
 
 	float ToneMapper::get_level() { return level; }
 
@@ -71,28 +211,7 @@ namespace Lumiverse {
 			return;
 		}
 
-		float g = 1.0f / gamma;
-		// float e = sqrt(pow(2, level));
-		float e = 1.f;
-
-		std::memset(hdr_output_buffer, 0, w * h * 4 * sizeof(float));
-		for (size_t i = 0; i < w * h; ++i) {
-			int actual_index = 4 * i;
-			Pixel4 curr_pixel = input_buffer[i];
-			float max_f = 1.0;
-			//if (hdr_output_buffer[actual_index] >= max_f) max_f = hdr_output_buffer[actual_index];
-			//if (hdr_output_buffer[actual_index + 1] >= max_f) max_f = hdr_output_buffer[actual_index + 1];
-			//if (hdr_output_buffer[actual_index + 2] >= max_f) max_f = hdr_output_buffer[actual_index  + 2];
-
-			//hdr_output_buffer[actual_index] /= max_f;
-			//hdr_output_buffer[actual_index + 1] /= max_f;
-			//hdr_output_buffer[actual_index + 2] /= max_f;
-
-			hdr_output_buffer[actual_index] = clamp(pow(curr_pixel.r * e, g), 0, 1);
-			hdr_output_buffer[actual_index + 1] = clamp(pow(curr_pixel.g * e, g), 0, 1);
-			hdr_output_buffer[actual_index + 2] = clamp(pow(curr_pixel.b * e, g), 0, 1);
-			hdr_output_buffer[actual_index + 3] = 1.f;
-		}
+		map_pixels(input_buffer, hdr_output_buffer, nullptr, w * h);
 	}
 
   void ToneMapper::apply_hdr_inplace(Pixel4 * in, float * out, size_t w, size_t h)
@@ -106,27 +225,23 @@ namespace Lumiverse {
       return;
     }
 
-    float g = 1.0f / gamma;
-    // float e = sqrt(pow(2, level));
-    float e = 1.f;
-
-    std::memset(out, 0, w * h * 4 * sizeof(float));
-    for (size_t i = 0; i < w * h; ++i) {
-      int actual_index = 4 * i;
-      Pixel4 curr_pixel = in[i];
-      float max_f = 1.0;
-      //if (hdr_output_buffer[actual_index] >= max_f) max_f = hdr_output_buffer[actual_index];
-      //if (hdr_output_buffer[actual_index + 1] >= max_f) max_f = hdr_output_buffer[actual_index + 1];
-      //if (hdr_output_buffer[actual_index + 2] >= max_f) max_f = hdr_output_buffer[actual_index  + 2];
-
-      //hdr_output_buffer[actual_index] /= max_f;
-      //hdr_output_buffer[actual_index + 1] /= max_f;
-      //hdr_output_buffer[actual_index + 2] /= max_f;
-
-      out[actual_index] = clamp(pow(curr_pixel.r * e, g), 0, 1);
-      out[actual_index + 1] = clamp(pow(curr_pixel.g * e, g), 0, 1);
-      out[actual_index + 2] = clamp(pow(curr_pixel.b * e, g), 0, 1);
-      out[actual_index + 3] = 1.f;
+    map_pixels(in, out, nullptr, w * h);
+  }
+
+  void ToneMapper::map_pixels(const Pixel4 *in, float *out, unsigned char *bytes, size_t n) const
+  {
+    // Without a float output, bytes are converted from a buffer that stays in L1.
+    const size_t chunk = 64;
+    float row[4 * chunk];
+
+    for (size_t i = 0; i < n; i += chunk) {
+      size_t count = std::min(chunk, n - i);
+      float *dst = (out != nullptr) ? out + 4 * i : row;
+
+      tonemap_kernels.map(lut.data(), as_floats(in + i), dst, count);
+
+      if (bytes != nullptr)
+        tonemap_kernels.bytes(dst, bytes + 4 * i, count);
     }
   }
 
@@ -152,7 +267,7 @@ namespace Lumiverse {
 	}
 
 	void ToneMapper::reset() {
-		gamma = 2.2f;
+		set_gamma(2.2f);
 		level = 1.0f;
 	}
 
@@ -160,6 +275,18 @@ namespace Lumiverse {
 		w = width;
 		h = height;
 	}
+
+  void ToneMapper::update_lut() {
+    float g = 1.0f / gamma;
+    lut.resize(LUT_SIZE);
+
+    for (size_t i = 0; i < LUT_SIZE; i++) {
+      uint32_t bits = (uint32_t)(i + LUT_BASE) << LUT_SHIFT;
+      float x;
+      std::memcpy(&x, &bits, sizeof(float));
+      lut[i] = clamp(pow(x, g), 0, 1);
+    }
+  }
 }; // namespace Lumiverse
 
 #endif // USE_ARNOLD_CACHING
@@ -351,6 +351,16 @@ namespace Lumiverse {
     */
     unordered_map<string, double> getColorParams() { return m_deviceChannels; }
 
+    /*!
+    \brief Returns the value of a channel without the weight applied. 0 if there's no such channel.
+
+    Unlike operator[], this doesn't add the channel or invalidate the cached XYZ value.
+    */
+    double getRawColorChannel(const string& name) {
+      auto it = m_deviceChannels.find(name);
+      return (it == m_deviceChannels.end()) ? 0 : it->second;
+    }
+
     /*! \brief Gets the weight. */
     double getWeight() { return m_weight; }
 
@@ -51,6 +51,8 @@ using namespace Lumiverse::ShowControl;
 %include "types/LumiverseTypeUtils.h"
 %include "DMX/KiNetInterface.h"
 %include "DMX/DMXDevicePatch.h"
+%include "DMX/DMXCapture.h"
+%include "DMX/DMXCapturePlayer.h"
 %include "DMX/ArtNetInterface.h"
 %include "Device.h"
 %include "Patch.h"
@@ -70,6 +70,7 @@ void Cue::operator=(const Cue& other) {
   _upfade = other._upfade;
   _downfade = other._downfade;
   _delay = other._delay;
+  clearCurrentState();
 }
 
 void Cue::update(Rig* rig) {
@@ -146,31 +147,276 @@ JSONNode Cue::toJSON() {
   return cue;
 }
 
-void Cue::setCurrentState(map<string, map<string, LumiverseType*> >& state, shared_ptr<Timeline> active, size_t time) {
-  // Update keyframe times based on up or downfade
-  for (const auto& d : state) {
-    for (const auto& p : d.second) {
-      string kid = getTimelineKey(d.first, p.first);
+function<void()> Cue::prepareCurrentState(map<string, map<string, LumiverseType*> >& state, shared_ptr<Timeline> active, size_t time) {
+  shared_ptr<Transition> next(new Transition());
+  next->layout = getTransitionLayout(state);
+
+  const TransitionLayout& layout = *next->layout;
+  next->params.resize(layout.params.size());
 
-      // Get end keyframe
-      auto lastKeyframe = _timelineData[kid].rbegin();
+  size_t delay = (size_t)(_delay * 1000);
+  size_t length = 0;
+
+  for (size_t i = 0; i < layout.params.size(); i++) {
+    TransitionParam& tp = next->params[i];
+    LumiverseType* param = layout.params[i];
+    const string& identifier = layout.identifiers[i];
+    const map<size_t, Keyframe>* keyframes = layout.keyframes[i];
+
+    // Nothing to fade for this parameter.
+    if (keyframes == nullptr || keyframes->size() == 0) {
+      tp.kind = TransitionParam::KEYFRAMES;
+      continue;
+    }
 
-      // detect if up or down fade
-      size_t fadeTime = 1000 * ((LumiverseTypeUtils::cmp(p.second, lastKeyframe->second.val.get()) == -1) ? _upfade : _downfade);
+    // Get end keyframe
+    auto lastKeyframe = keyframes->rbegin();
+
+    // detect if up or down fade
+    size_t fadeTime = 1000 * ((LumiverseTypeUtils::cmp(param, lastKeyframe->second.val.get()) == -1) ? _upfade : _downfade);
+    size_t end = fadeTime + _delay * 1000;
+
+    auto firstKeyframe = keyframes->begin();
+    if (keyframes->size() != 2 || firstKeyframe->first != 0 || !firstKeyframe->second.useCurrentState) {
+      // Unusual layout, retime a copy of the keyframes.
+      tp.kind = TransitionParam::RETIMED;
+      for (const auto& kf : *keyframes)
+        tp.keyframes[kf.first] = unresolved(kf.second);
 
-      // adjust keyframes
       // move last keyframe to proper position.
-      moveKeyframe(kid, lastKeyframe->first, fadeTime + _delay * 1000);
+      Keyframe last = tp.keyframes.rbegin()->second;
+      tp.keyframes.erase(prev(tp.keyframes.end()));
+      last.t = end;
+      tp.keyframes[end] = last;
 
       if (_delay > 0) {
         // Add new keyframe for delay
-        setKeyframe(kid, (size_t) (_delay * 1000), p.second, true);
+        tp.keyframes[delay] = Keyframe(delay, nullptr, true);
       }
 
-      // Update as normal.
-      updateKeyframeState(d.first, p.first, p.second, active, time);
+      for (auto& kf : tp.keyframes) {
+        if (kf.second.useCurrentState)
+          setKeyframeState(kf.second, identifier, param, active, time);
+      }
+
+      length = max(length, tp.keyframes.rbegin()->first);
+      continue;
+    }
+
+    tp.kind = TransitionParam::FADE;
+    tp.target = unresolved(lastKeyframe->second);
+    tp.delay = delay;
+    tp.end = end;
+    length = max(length, end);
+
+    // Start from the current state, or keep following the active timeline if it's
+    // currently pulling this parameter from another timeline.
+    Keyframe activeKeyframe;
+    if (active != nullptr)
+      activeKeyframe = active->getPreviousKeyframe(identifier, time);
+
+    tp.start.t = 0;
+    tp.start.useCurrentState = true;
+
+    if (activeKeyframe.timelineID != "") {
+      tp.start.timelineID = activeKeyframe.timelineID;
+      tp.start.timelineOffset = active->getLoopTime(time) - activeKeyframe.t + activeKeyframe.timelineOffset;
+    }
+    else {
+      tp.start.timelineOffset = 0;
+      tp.start.val = shared_ptr<LumiverseType>(LumiverseTypeUtils::copy(param));
+    }
+  }
+
+  // Keyframes the state doesn't cover still count towards the length.
+  if (_timelineData.size() > layout.index.size()) {
+    for (const auto& kf : _timelineData) {
+      if (kf.second.size() > 0 && layout.index.count(kf.first) == 0)
+        length = max(length, kf.second.rbegin()->first);
+    }
+  }
+
+  if (_events.size() > 0)
+    length = max(length, _events.rbegin()->first);
+
+  next->length = length;
+
+  return [this, next]() {
+    atomic_store(&_transition, next);
+    _lengthIsUpdated = false;
+    _loopLengthIsUpdated = false;
+  };
+}
+
+void Cue::clearCurrentState() {
+  atomic_store(&_transition, shared_ptr<Transition>());
+  _lengthIsUpdated = false;
+  _loopLengthIsUpdated = false;
+}
+
+shared_ptr<const Cue::TransitionLayout> Cue::getTransitionLayout(map<string, map<string, LumiverseType*> >& state) {
+  lock_guard<mutex> lock(_layoutLock);
+
+  bool rebuild = _layout == nullptr || _layout->state != &state || _layout->dataSize != _timelineData.size() ||
+    _layout->keyframeMapVersion != _keyframeMapVersion;
+
+  // Same layer, make sure the state hasn't changed shape since last time.
+  if (!rebuild) {
+    size_t i = 0;
+    for (const auto& d : state) {
+      for (const auto& p : d.second) {
+        if (i >= _layout->params.size() || _layout->params[i] != p.second) {
+          rebuild = true;
+          break;
+        }
+        i++;
+      }
+
+      if (rebuild)
+        break;
+    }
+
+    rebuild = rebuild || i != _layout->params.size();
+  }
+
+  if (!rebuild)
+    return _layout;
+
+  shared_ptr<TransitionLayout> layout(new TransitionLayout());
+
+  for (const auto& d : state) {
+    for (const auto& p : d.second) {
+      string identifier = getTimelineKey(d.first, p.first);
+      auto it = _timelineData.find(identifier);
+
+      layout->index[identifier] = layout->params.size();
+      layout->params.push_back(p.second);
+      layout->identifiers.push_back(identifier);
+      layout->keyframes.push_back((it != _timelineData.end()) ? &it->second : nullptr);
+    }
+  }
+
+  layout->state = &state;
+  layout->dataSize = _timelineData.size();
+  layout->keyframeMapVersion = _keyframeMapVersion;
+
+  _layout = layout;
+  return _layout;
+}
+
+void Cue::resolveTransition(Transition& transition, TimelineContext& ctx) {
+  auto& tls = ctx.getTimelines();
+
+  for (auto& tp : transition.params) {
+    if (tp.kind == TransitionParam::KEYFRAMES)
+      continue;
+
+    vector<Keyframe*> kfs;
+    if (tp.kind == TransitionParam::FADE) {
+      kfs.push_back(&tp.start);
+      kfs.push_back(&tp.target);
+    }
+    else {
+      for (auto& kf : tp.keyframes)
+        kfs.push_back(&kf.second);
+    }
+
+    for (Keyframe* kf : kfs) {
+      if (kf->timelineID == "")
+        continue;
+
+      // A cue can't pull values from itself.
+      auto it = tls.find(kf->timelineID);
+      kf->timeline = (it != tls.end() && it->second.get() != this) ? it->second : nullptr;
     }
   }
+
+  transition.generation = ctx.getGeneration();
+}
+
+Keyframe Cue::unresolved(const Keyframe& kf) {
+  Keyframe copy(kf.t);
+  copy.val = kf.val;
+  copy.useCurrentState = kf.useCurrentState;
+  copy.timelineID = kf.timelineID;
+  copy.timelineOffset = kf.timelineOffset;
+  return copy;
+}
+
+shared_ptr<LumiverseType> Cue::getTransitionValue(const Keyframe& kf, const string& identifier, string id, string paramName,
+  LumiverseType* currentVal, TimelineTicks time, TimelineContext& ctx)
+{
+  if (kf.timelineID == "")
+    return kf.val;
+
+  return getNestedValue(kf, identifier, id, paramName, currentVal, time, ctx);
+}
+
+shared_ptr<LumiverseType> Cue::getValueAtTicks(string id, string paramName, LumiverseType* currentVal, TimelineTicks time, TimelineContext& ctx) {
+  // Only this thread changes the transition, so it doesn't need an atomic load.
+  Transition* transition = _transition.get();
+  if (transition == nullptr)
+    return Timeline::getValueAtTicks(id, paramName, currentVal, time, ctx);
+
+  string identifier = getTimelineKey(id, paramName);
+  auto it = transition->layout->index.find(identifier);
+
+  if (it == transition->layout->index.end() || transition->params[it->second].kind == TransitionParam::KEYFRAMES)
+    return Timeline::getValueAtTicks(id, paramName, currentVal, time, ctx);
+
+  if (_resolvedGeneration != ctx.getGeneration())
+    resolveReferences(ctx);
+  if (transition->generation != ctx.getGeneration())
+    resolveTransition(*transition, ctx);
+
+  const TransitionParam& tp = transition->params[it->second];
+  time = getLoopTicks(time, transition->length);
+
+  if (tp.kind == TransitionParam::RETIMED)
+    return getKeyframeValue(tp.keyframes, identifier, id, paramName, currentVal, time, ctx);
+
+  if (time >= tp.end * TicksPerMs)
+    return getTransitionValue(tp.target, identifier, id, paramName, currentVal, time, ctx);
+
+  shared_ptr<LumiverseType> x = getTransitionValue(tp.start, identifier, id, paramName, currentVal, time, ctx);
+  if (x == nullptr || time < tp.delay * TicksPerMs)
+    return x;
+
+  shared_ptr<LumiverseType> y = getTransitionValue(tp.target, identifier, id, paramName, currentVal, time, ctx);
+  if (y == nullptr)
+    return nullptr;
+
+  float a = (float)((double)(time - tp.delay * TicksPerMs) / (double)((tp.end - tp.delay) * TicksPerMs));
+  return LumiverseTypeUtils::lerp(x.get(), y.get(), a);
+}
+
+Keyframe Cue::getPreviousKeyframe(string identifier, size_t time) {
+  // Layers call this while preparing the next cue, so the transition may be swapped at any time.
+  shared_ptr<Transition> transition = atomic_load(&_transition);
+
+  if (transition != nullptr) {
+    auto it = transition->layout->index.find(identifier);
+
+    if (it != transition->layout->index.end()) {
+      const TransitionParam& tp = transition->params[it->second];
+
+      if (tp.kind == TransitionParam::FADE)
+        return unresolved((getLoopTime(time) < tp.end) ? tp.start : tp.target);
+
+      if (tp.kind == TransitionParam::RETIMED)
+        return unresolved(*findPreviousKeyframe(tp.keyframes, getLoopTime(time)));
+    }
+  }
+
+  return Timeline::getPreviousKeyframe(identifier, time);
+}
+
+size_t Cue::getLoopLength() {
+  shared_ptr<Transition> transition = atomic_load(&_transition);
+  if (transition == nullptr)
+    return Timeline::getLoopLength();
+
+  return transition->length;
 }
 
 shared_ptr<LumiverseType> Cue::getLastCueValue(string id, string paramName)
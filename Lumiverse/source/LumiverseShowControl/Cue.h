@@ -5,6 +5,8 @@
 
 #include <LumiverseCore.h>
 #include <memory>
+#include <unordered_map>
+#include <mutex>
 #include "Timeline.h"
 
 using namespace std;
@@ -33,7 +35,7 @@ public:
   /*!
   \brief Makes a blank cue.
   */
-  Cue() : _upfade(3.0f), _downfade(3.0f) { }
+  Cue() : _upfade(3.0f), _downfade(3.0f), _delay(0) { }
 
   /*!
   \brief Constructs a cue from a rig. Default time is 3.
@@ -157,9 +159,36 @@ public:
   float getTransitionTime() { return max(_upfade, _downfade) + _delay; }
 
   /*!
-  Adjusts timing of cues depending on if they are an upfade or a downfade
+  \brief Works out the transition from the given state to this cue.
+
+  Picks the upfade or downfade for each parameter and records the starting values in a new
+  transition table, so the cue and a transition it's currently running are never modified.
+  Parameters with the usual two keyframes (current state at 0 and the cue value) are a single
+  pass over the state. Parameters with other keyframe layouts get a retimed copy of their
+  keyframes. The per-parameter layout of the table is shared between runs from the same layer.
+
+  The returned function switches the cue over to the new transition. Changes to the cue's
+  keyframes take effect the next time the cue is run.
+  */
+  function<void()> prepareCurrentState(map<string, map<string, LumiverseType*> >& state, shared_ptr<Timeline> active, size_t time) override;
+
+  /*! \brief Ends the current transition. The cue is evaluated from its keyframes until it's run again. */
+  void clearCurrentState() override;
+
+  /*!
+  \brief Returns the value of a parameter during the cue's transition.
+  */
+  shared_ptr<LumiverseType> getValueAtTicks(string id, string paramName, LumiverseType* currentVal, TimelineTicks time, TimelineContext& ctx) override;
+
+  /*!
+  \brief Gets the keyframe closest to happen at or before the given time, taking the transition into account.
   */
-  void setCurrentState(map<string, map<string, LumiverseType*> >& state, shared_ptr<Timeline> active, size_t time) override;
+  Keyframe getPreviousKeyframe(string identifier, size_t time) override;
+
+  /*!
+  \brief Length of the cue. Once the cue has been run, this is the length of the transition.
+  */
+  size_t getLoopLength() override;
 
   /*!
   \brief Gets the static value of the last keyframe in the cue if it exists.
@@ -176,6 +205,111 @@ private:
   // Delay before doing any fades, default timing.
   float _delay;
 
+  /*!
+  \brief Transition data for one layer parameter, filled in by prepareCurrentState().
+  */
+  struct TransitionParam {
+    /*!
+    \brief How the parameter is evaluated.
+
+    FADE parameters fade from start to target using the times below. RETIMED parameters
+    didn't have the standard cue layout and use a retimed copy of their keyframes. KEYFRAMES
+    parameters have no keyframes to transition and use the cue's keyframes.
+    */
+    enum Kind { FADE, RETIMED, KEYFRAMES } kind;
+
+    /*! \brief Value at the start of the transition. May reference the previously active timeline. */
+    Keyframe start;
+
+    /*! \brief Final keyframe of the cue. */
+    Keyframe target;
+
+    /*! \brief Fade start and end times in ms. */
+    size_t delay;
+    size_t end;
+
+    /*! \brief Keyframes for RETIMED parameters. */
+    map<size_t, Keyframe> keyframes;
+  };
+
+  /*!
+  \brief Layer parameters a transition is built for, in the same order as the layer state.
+
+  Shared by every transition built from the same layer while the shape of the layer state and
+  the cue's keyframe maps stay the same. Never modified once built.
+  */
+  struct TransitionLayout {
+    /*! \brief Layer state value, timeline key and keyframes (nullptr if none) of each parameter. */
+    vector<LumiverseType*> params;
+    vector<string> identifiers;
+    vector<map<size_t, Keyframe>*> keyframes;
+
+    /*! \brief Timeline key -> index in the vectors above. */
+    unordered_map<string, size_t> index;
+
+    /*! \brief Layer state the layout was built for. */
+    const void* state;
+
+    /*! \brief Size of _timelineData and _keyframeMapVersion when the layout was built. */
+    size_t dataSize;
+    size_t keyframeMapVersion;
+  };
+
+  /*!
+  \brief Transition for one run of the cue.
+
+  Only the nested timeline references are changed after the transition is built, by the
+  thread evaluating the cue.
+  */
+  struct Transition {
+    Transition() : generation(0), length(0) { }
+
+    shared_ptr<const TransitionLayout> layout;
+
+    /*! \brief One entry per parameter in the layout. */
+    vector<TransitionParam> params;
+
+    /*! \brief TimelineContext generation the start and target references were resolved for. */
+    size_t generation;
+
+    /*! \brief Length of the transition in ms. */
+    size_t length;
+  };
+
+  /*!
+  \brief Transition the cue is running. nullptr if the cue hasn't been run.
+
+  Only changed by the thread evaluating the cue. Other threads read it with atomic_load().
+  */
+  shared_ptr<Transition> _transition;
+
+  /*! \brief Most recently built layout, reused by prepareCurrentState(). Guarded by _layoutLock. */
+  shared_ptr<const TransitionLayout> _layout;
+  mutex _layoutLock;
+
+  /*!
+  \brief Returns a layout for the given state, reusing the previous one if it still matches.
+  */
+  shared_ptr<const TransitionLayout> getTransitionLayout(map<string, map<string, LumiverseType*> >& state);
+
+  /*!
+  \brief Resolves the nested timeline references in a transition.
+  */
+  void resolveTransition(Transition& transition, TimelineContext& ctx);
+
+  /*!
+  \brief Copies a keyframe without its resolved timeline reference.
+
+  The reference is only touched by the thread evaluating the cue.
+  */
+  static Keyframe unresolved(const Keyframe& kf);
+
+  /*!
+  \brief Gets the value of a transition keyframe, which is either a static value or a timeline reference.
+  */
+  shared_ptr<LumiverseType> getTransitionValue(const Keyframe& kf, const string& identifier, string id, string paramName,
+    LumiverseType* currentVal, TimelineTicks time, TimelineContext& ctx);
+
   // Reserved for future use.
   // m_follow - cue follow time (time to wait before automatically taking the next cue)
 };
@@ -1,13 +1,37 @@
 #include "CueList.h"
 
+#include <algorithm>
+#include <thread>
+
 namespace Lumiverse {
 namespace ShowControl {
 
-CueList::CueList(string name, Playback* pb) : _name(name), _pb(pb)
+// Splits [0, count) into contiguous blocks and runs them on separate threads.
+static void parallelFor(size_t count, function<void(size_t, size_t)> f) {
+  // Not worth starting threads for small amounts of work.
+  size_t threads = min<size_t>(max(thread::hardware_concurrency(), 1u), count / 64 + 1);
+
+  if (threads <= 1) {
+    f(0, count);
+    return;
+  }
+
+  vector<thread> workers;
+  size_t block = (count + threads - 1) / threads;
+  for (size_t start = 0; start < count; start += block) {
+    workers.push_back(thread(f, start, min(start + block, count)));
+  }
+
+  for (auto& w : workers) {
+    w.join();
+  }
+}
+
+CueList::CueList(string name, Playback* pb) : _name(name), _pb(pb), _trackingValid(false), _timelineGeneration(0)
 {
 }
 
-CueList::CueList(JSONNode node, Playback* pb): _pb(pb) {
+CueList::CueList(JSONNode node, Playback* pb): _pb(pb), _trackingValid(false), _timelineGeneration(0) {
   auto cues = node.find("cues");
   if (cues != node.end()) {
     // Load cues
@@ -48,6 +72,7 @@ bool CueList::storeCue(float num, string cueID, bool overwrite) {
 
   if (overwrite == true || _cues.count(num) == 0) {
     _cues[num] = cueID;
+    _trackingValid = false;
     stringstream ss;
     ss << "Recorded cue " << num;
     Logger::log(INFO, ss.str());
@@ -66,6 +91,7 @@ void CueList::deleteCue(float num, bool totalDelete) {
       _pb->deleteTimeline(_cues[num]);
     }
     _cues.erase(num);
+    _trackingValid = false;
 
     stringstream ss;
     ss << "Cue " << num << " deleted from cue list";
@@ -73,9 +99,198 @@ void CueList::deleteCue(float num, bool totalDelete) {
   }
 }
 
-//void CueList::update(float num, Rig* rig, bool track) {
-  // Should update a series of cues in the cue list according to tracking rules.
-//}
+bool CueList::update(float num, string id, string param, LumiverseType* val, bool track) {
+  if (_cues.count(num) == 0) {
+    stringstream ss;
+    ss << "Cue " << num << " does not exist in cue list " << _name;
+    Logger::log(ERR, ss.str());
+    return false;
+  }
+
+  buildTracking();
+
+  size_t index = lower_bound(_cueOrder.begin(), _cueOrder.end(), num,
+    [](const pair<float, shared_ptr<Timeline> >& c, float n) { return c.first < n; }) - _cueOrder.begin();
+  if (index >= _cueOrder.size() || _cueOrder[index].first != num) {
+    stringstream ss;
+    ss << "Cue " << num << " in cue list " << _name << " has no timeline in the playback";
+    Logger::log(ERR, ss.str());
+    return false;
+  }
+
+  string key = _cueOrder[index].second->getTimelineKey(id, param);
+
+  // The run of cues that share this cue's value ends at the next change point.
+  size_t end = index + 1;
+  if (track) {
+    const vector<size_t>& changes = _changes[key];
+    auto next = upper_bound(changes.begin(), changes.end(), index);
+    end = (next == changes.end()) ? _cueOrder.size() : *next;
+  }
+
+  for (size_t i = index; i < end; i++) {
+    // Cues without a value for the parameter already pick up the tracked value.
+    if (i != index && getTrackedValue(i, key) == nullptr)
+      continue;
+
+    Cue* cue = dynamic_cast<Cue*>(_cueOrder[i].second.get());
+    if (cue != nullptr)
+      cue->update(id, param, val);
+  }
+
+  // Only the edited cue and the first cue with a value after the run can change state.
+  refreshChanges(key, index);
+  for (size_t i = end; i < _cueOrder.size(); i++) {
+    if (getTrackedValue(i, key) != nullptr) {
+      refreshChanges(key, i);
+      break;
+    }
+  }
+
+  return true;
+}
+
+bool CueList::update(float num, Rig* rig, bool track) {
+  shared_ptr<Timeline> cue = _pb->getTimeline(getCueName(num));
+  if (cue == nullptr) {
+    stringstream ss;
+    ss << "Cue " << num << " does not exist in cue list " << _name;
+    Logger::log(ERR, ss.str());
+    return false;
+  }
+
+  struct Param {
+    string id;
+    string name;
+    LumiverseType* val;
+  };
+
+  vector<Param> params;
+  for (Device* d : rig->getDeviceRaw()) {
+    for (const auto& p : d->getRawParameters()) {
+      Param param = { d->getId(), p.first, p.second };
+      params.push_back(param);
+    }
+  }
+
+  // Comparing is read only, so it can be split up. Updating the cue can't.
+  vector<char> changed(params.size(), 0);
+  const auto& data = cue->getKeyframeData();
+  parallelFor(params.size(), [&](size_t start, size_t end) {
+    for (size_t i = start; i < end; i++) {
+      auto kf = data.find(cue->getTimelineKey(params[i].id, params[i].name));
+      LumiverseType* current = (kf == data.end() || kf->second.empty()) ? nullptr : kf->second.rbegin()->second.val.get();
+      changed[i] = (current == nullptr || !LumiverseTypeUtils::equals(current, params[i].val));
+    }
+  });
+
+  for (size_t i = 0; i < params.size(); i++) {
+    if (changed[i])
+      update(num, params[i].id, params[i].name, params[i].val, track);
+  }
+
+  return true;
+}
+
+vector<float> CueList::getTrackingChanges(string id, string param) {
+  vector<float> nums;
+
+  buildTracking();
+  if (_cueOrder.empty())
+    return nums;
+
+  auto changes = _changes.find(_cueOrder[0].second->getTimelineKey(id, param));
+  if (changes == _changes.end())
+    return nums;
+
+  for (size_t i : changes->second) {
+    nums.push_back(_cueOrder[i].first);
+  }
+
+  return nums;
+}
+
+void CueList::buildTracking() {
+  if (_trackingValid && _timelineGeneration == _pb->getTimelineGeneration())
+    return;
+
+  _timelineGeneration = _pb->getTimelineGeneration();
+  _cueOrder.clear();
+  _changes.clear();
+
+  for (const auto& c : _cues) {
+    auto tl = _pb->getTimeline(c.second);
+    if (tl != nullptr)
+      _cueOrder.push_back(make_pair(c.first, tl));
+  }
+
+  vector<string> keys;
+  {
+    set<string> allKeys;
+    for (const auto& c : _cueOrder) {
+      for (const auto& kvp : c.second->getKeyframeData()) {
+        allKeys.insert(kvp.first);
+      }
+    }
+    keys.assign(allKeys.begin(), allKeys.end());
+  }
+
+  // Parameters are independent, so each thread walks the cue list for its own block of them.
+  vector<vector<size_t> > changes(keys.size());
+  parallelFor(keys.size(), [&](size_t start, size_t end) {
+    for (size_t k = start; k < end; k++) {
+      LumiverseType* prev = nullptr;
+
+      for (size_t i = 0; i < _cueOrder.size(); i++) {
+        LumiverseType* val = getTrackedValue(i, keys[k]);
+        if (val == nullptr)
+          continue;
+
+        if (prev == nullptr || !LumiverseTypeUtils::equals(val, prev))
+          changes[k].push_back(i);
+
+        prev = val;
+      }
+    }
+  });
+
+  for (size_t k = 0; k < keys.size(); k++) {
+    _changes[keys[k]] = move(changes[k]);
+  }
+
+  _trackingValid = true;
+}
+
+LumiverseType* CueList::getTrackedValue(size_t index, const string& key) {
+  const auto& data = _cueOrder[index].second->getKeyframeData();
+  auto kf = data.find(key);
+
+  if (kf == data.end() || kf->second.empty())
+    return nullptr;
+
+  return kf->second.rbegin()->second.val.get();
+}
+
+void CueList::refreshChanges(const string& key, size_t index) {
+  LumiverseType* val = getTrackedValue(index, key);
+
+  // Compare against the nearest earlier cue that has a value.
+  LumiverseType* prev = nullptr;
+  for (size_t i = index; i > 0 && prev == nullptr; i--) {
+    prev = getTrackedValue(i - 1, key);
+  }
+
+  bool change = val != nullptr && (prev == nullptr || !LumiverseTypeUtils::equals(val, prev));
+
+  vector<size_t>& changes = _changes[key];
+  auto it = lower_bound(changes.begin(), changes.end(), index);
+  bool present = (it != changes.end() && *it == index);
+
+  if (change && !present)
+    changes.insert(it, index);
+  else if (!change && present)
+    changes.erase(it);
+}
 
 float CueList::getFirstCueNum() {
   if (_cues.size() == 0) {
@@ -40,10 +40,44 @@ public:
   // Delets a cue. Does not delete the Cue object from the playback controls by default
   void deleteCue(float num, bool totalDelete = false);
 
-  // Updates a cue and tracks changes.
-  // Set track to true if tracking desired.
-  // This function is a bit more complicated at the moment
-  //void update(float num, Rig* rig, bool track = false);
+  /*!
+  \brief Changes a parameter in a cue and optionally tracks the change.
+
+  With tracking, the new value also replaces the old one in the following cues that the old
+  value tracked into, up to the next cue where the parameter changed. Only the cues in that
+  run are touched.
+  \param num Cue number
+  \param id Device id
+  \param param Parameter name
+  \param val New value. Copied into the cues.
+  \param track Set to true to track the change through later cues.
+  \return false if the cue isn't in the list.
+  */
+  bool update(float num, string id, string param, LumiverseType* val, bool track = false);
+
+  /*!
+  \brief Records the parameters in the rig that differ from a cue.
+
+  Each changed parameter is updated as in update(float, string, string, LumiverseType*, bool).
+  The rig is compared to the cue on multiple threads.
+  \return false if the cue isn't in the list.
+  */
+  bool update(float num, Rig* rig, bool track = false);
+
+  /*!
+  \brief Rebuilds the tracking index on the next tracked update.
+
+  Call this after editing a cue directly instead of through update(). Storing and deleting
+  cues, and adding or deleting timelines in the Playback, does this automatically.
+  */
+  void invalidateTracking() { _trackingValid = false; }
+
+  /*!
+  \brief Returns the numbers of the cues where a parameter changes value.
+
+  The first cue with a value for the parameter is always included.
+  */
+  vector<float> getTrackingChanges(string id, string param);
 
   // Gets the list of cue numbers
   const map<float, string>& getCueList() { return _cues; }
@@ -116,6 +150,36 @@ private:
 
   /*! \brief Pointer to Playback object that contains the actual cue data. */
   Playback* _pb;
+
+  /*! \brief Builds the tracking index if it's out of date. */
+  void buildTracking();
+
+  /*! \brief Value of a parameter in the cue at an index in _cueOrder. nullptr if there isn't one. */
+  LumiverseType* getTrackedValue(size_t index, const string& key);
+
+  /*!
+  \brief Updates whether the cue at an index is a change point for a parameter.
+
+  A cue is a change point if its value differs from the previous cue's.
+  */
+  void refreshChanges(const string& key, size_t index);
+
+  /*! \brief Cues in list order, resolved once when the index is built. */
+  vector<pair<float, shared_ptr<Timeline> > > _cueOrder;
+
+  /*!
+  \brief Tracking index. Timeline key -> sorted indices into _cueOrder where the value changes.
+
+  The cues between two change points all have the same value, so a tracked edit only has to
+  touch one run.
+  */
+  unordered_map<string, vector<size_t> > _changes;
+
+  /*! \brief False if cues were added or removed since the index was built. */
+  bool _trackingValid;
+
+  /*! \brief Playback timeline generation _cueOrder was resolved for. */
+  size_t _timelineGeneration;
 };
 
 }
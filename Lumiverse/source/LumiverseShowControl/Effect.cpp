@@ -0,0 +1,351 @@
+#include "Effect.h"
+
+namespace Lumiverse {
+namespace ShowControl {
+
+  // Waveform helpers. These are written without branches or library calls (other than floor)
+  // so the loops in Effect::evaluate() can be vectorized by the compiler.
+
+  /*! \brief Fractional part of x, in [0, 1). */
+  static inline float cycleFrac(float x) {
+    return x - floor(x);
+  }
+
+  /*!
+  \brief sin(2 pi x) for x in cycles.
+
+  Reduces to [-1/4, 1/4] cycles using the symmetry of sine, then uses a degree 9 polynomial.
+  Error is under 4e-6.
+  */
+  static inline float sinCycles(float x) {
+    float y = x - floor(x + 0.5f);
+    float h = (y > 0.25f) ? 0.5f - y : ((y < -0.25f) ? -0.5f - y : y);
+    float a = h * 6.28318531f;
+    float a2 = a * a;
+    return a * (1.0f + a2 * (-1.66666667e-1f + a2 * (8.33333333e-3f + a2 * (-1.98412698e-4f + a2 * 2.75573192e-6f))));
+  }
+
+  /*! \brief Hashes a cycle number and device slot to a value in [-1, 1). */
+  static inline float randomLevel(unsigned int cycle, unsigned int slot, unsigned int seed) {
+    unsigned int h = (cycle * 0x9E3779B1u) ^ ((slot + seed) * 0x85EBCA77u);
+    h ^= h >> 15;
+    h *= 0x2C1B3C6Du;
+    h ^= h >> 12;
+    h *= 0x297A2D39u;
+    h ^= h >> 15;
+    return (h >> 8) * (2.0f / 16777216.0f) - 1.0f;
+  }
+
+  Effect::Effect(Waveform wave, float period, float magnitude, float phase, float offset, Mode mode) :
+    Timeline(), _period(period), _magnitude(magnitude), _phase(phase), _offset(offset), _mode(mode),
+    _wave(wave), _duty(0.5f), _steps(4), _seed(0), _limited(false), _evaluatedTime(0), _evaluated(false)
+  {
+  }
+
+  Effect::Effect(JSONNode node) :
+    Timeline(), _period(1), _magnitude(0.5f), _phase(0), _offset(0.5f), _mode(ABS),
+    _wave(SINE), _duty(0.5f), _steps(4), _seed(0), _limited(false), _evaluatedTime(0), _evaluated(false)
+  {
+    auto it = node.begin();
+    while (it != node.end()) {
+      string name = it->name();
+
+      if (name == "period")
+        _period = it->as_float();
+      else if (name == "magnitude")
+        _magnitude = it->as_float();
+      else if (name == "phase")
+        _phase = it->as_float();
+      else if (name == "offset")
+        _offset = it->as_float();
+      else if (name == "mode")
+        _mode = (Mode)it->as_int();
+      else if (name == "waveform")
+        _wave = (Waveform)it->as_int();
+      else if (name == "duty")
+        _duty = it->as_float();
+      else if (name == "steps")
+        setSteps(it->as_int());
+      else if (name == "seed")
+        _seed = it->as_int();
+      else if (name == "loops")
+        _loops = it->as_int();
+      else if (name == "devices") {
+        for (auto d = it->begin(); d != it->end(); d++) {
+          setDevicePhase(d->name(), d->as_float());
+        }
+      }
+      else if (name == "params") {
+        for (auto p = it->begin(); p != it->end(); p++) {
+          _params.push_back(p->as_string());
+        }
+      }
+
+      it++;
+    }
+  }
+
+  Effect::~Effect() {
+    // nothing at the moment.
+  }
+
+  void Effect::setDevices(DeviceSet devices, Spread spread, float amount, string key) {
+    clearDevices();
+    _limited = true;
+
+    // Position of each device along the spread, normalized to [0, 1] afterwards.
+    vector<pair<string, float> > positions;
+    float index = 0;
+    for (Device* d : devices.getDeviceList()) {
+      float pos = 0;
+      if (spread == ORDER) {
+        pos = index;
+      }
+      else if (spread == CHANNEL) {
+        pos = (float)d->getChannel();
+      }
+      else if (spread == METADATA) {
+        string val;
+        if (d->getMetadata(key, val)) {
+          pos = (float)atof(val.c_str());
+        }
+      }
+
+      positions.push_back(make_pair(d->getId(), pos));
+      index++;
+    }
+
+    float low = 0, high = 0;
+    for (size_t i = 0; i < positions.size(); i++) {
+      if (i == 0 || positions[i].second < low) low = positions[i].second;
+      if (i == 0 || positions[i].second > high) high = positions[i].second;
+    }
+
+    float range = high - low;
+    for (const auto& p : positions) {
+      setDevicePhase(p.first, (range > 0) ? amount * (p.second - low) / range : 0);
+    }
+  }
+
+  void Effect::setDevicePhase(string id, float phase) {
+    _limited = true;
+
+    auto it = _slots.find(id);
+    if (it != _slots.end()) {
+      _devicePhase[it->second] = phase;
+    }
+    else {
+      _slots[id] = (int)_ids.size();
+      _ids.push_back(id);
+      _devicePhase.push_back(phase);
+      _outputs.resize(_ids.size());
+    }
+
+    invalidate();
+  }
+
+  void Effect::clearDevices() {
+    _limited = false;
+    _slots.clear();
+    _ids.clear();
+    _devicePhase.clear();
+    _outputs.clear();
+    invalidate();
+  }
+
+  void Effect::setPeriod(float period) {
+    _period = period;
+    _lengthIsUpdated = false;
+    invalidate();
+  }
+
+  float Effect::wave(float x) {
+    switch (_wave) {
+    case SINE:
+      return sinCycles(x);
+    case SQUARE:
+      return (cycleFrac(x) < _duty) ? 1.0f : -1.0f;
+    case SAW:
+      return 2 * cycleFrac(x) - 1;
+    case RANDOM:
+      return randomLevel((unsigned int)(int)floor(x), 0, _seed);
+    case STEP:
+      return floor(cycleFrac(x) * _steps) * (2.0f / (_steps - 1)) - 1;
+    default:
+      return 0;
+    }
+  }
+
+  void Effect::evaluate(double t, size_t from) {
+    size_t n = _devicePhase.size();
+    _values.resize(n);
+
+    // Whole cycles are split off in double precision so long running effects stay accurate.
+    const double cycles = t / _period + _phase;
+    const double whole = floor(cycles);
+    const unsigned int cycle = (unsigned int)(long long)whole;
+    const float base = (float)(cycles - whole);
+    const float* phase = _devicePhase.data();
+    float* out = _values.data();
+
+    // One loop per waveform so each loop body is straight-line code.
+    switch (_wave) {
+    case SINE:
+      for (size_t i = from; i < n; i++)
+        out[i] = sinCycles(base + phase[i]);
+      break;
+    case SQUARE:
+      for (size_t i = from; i < n; i++)
+        out[i] = (cycleFrac(base + phase[i]) < _duty) ? 1.0f : -1.0f;
+      break;
+    case SAW:
+      for (size_t i = from; i < n; i++)
+        out[i] = 2 * cycleFrac(base + phase[i]) - 1;
+      break;
+    case RANDOM:
+      for (size_t i = from; i < n; i++)
+        out[i] = randomLevel(cycle + (unsigned int)(int)floor(base + phase[i]), (unsigned int)i, _seed);
+      break;
+    case STEP: {
+      const float steps = (float)_steps;
+      const float scale = 2.0f / (steps - 1);
+      for (size_t i = from; i < n; i++)
+        out[i] = floor(cycleFrac(base + phase[i]) * steps) * scale - 1;
+      break;
+    }
+    default:
+      for (size_t i = from; i < n; i++)
+        out[i] = 0;
+    }
+
+    for (size_t i = from; i < n; i++)
+      out[i] = _magnitude * out[i] + _offset;
+
+    _evaluatedTime = t;
+    _evaluated = true;
+  }
+
+  int Effect::getSlot(const string& id) {
+    auto it = _slots.find(id);
+    if (it != _slots.end())
+      return it->second;
+
+    if (_limited)
+      return -1;
+
+    // Unlimited effects pick up devices as they're asked for, with no phase offset.
+    _slots[id] = (int)_ids.size();
+    _ids.push_back(id);
+    _devicePhase.push_back(0);
+    _outputs.resize(_ids.size());
+
+    // Only the new slot needs computing.
+    if (_evaluated)
+      evaluate(_evaluatedTime, _ids.size() - 1);
+
+    return _slots[id];
+  }
+
+  bool Effect::hasParameter(const string& param) {
+    if (_params.empty())
+      return true;
+
+    for (const auto& p : _params) {
+      if (p == param)
+        return true;
+    }
+
+    return false;
+  }
+
+  shared_ptr<LumiverseType> Effect::getValueAtTicks(string id, string paramName, LumiverseType* currentVal, TimelineTicks time, TimelineContext& /* ctx */) {
+    if (!hasParameter(paramName))
+      return nullptr;
+
+    string type = currentVal->getTypeName();
+    if (type != "float" && type != "orientation" && type != "enum")
+      return nullptr;
+
+    int slot = getSlot(id);
+    if (slot < 0)
+      return nullptr;
+
+    // Clamp to end time if we're done with our loops. Infinite effects have the max length.
+    size_t length = getLength();
+    if (length != (size_t)-1 && time > (TimelineTicks)length * TicksPerMs) {
+      time = (TimelineTicks)length * TicksPerMs;
+    }
+    double t = (double)time / 1000000.0;
+
+    if (!_evaluated || t != _evaluatedTime) {
+      evaluate(t, 0);
+    }
+
+    float wave = _values[slot];
+
+    // Reuse the previous value unless someone else (e.g. a nested timeline cache) still holds it.
+    shared_ptr<LumiverseType>& out = _outputs[slot][paramName];
+    if (out == nullptr || out.use_count() > 1 || out->getTypeName() != type) {
+      out = shared_ptr<LumiverseType>(LumiverseTypeUtils::copy(currentVal));
+    }
+    else {
+      LumiverseTypeUtils::copyByVal(currentVal, out.get());
+    }
+
+    if (type == "float") {
+      LumiverseFloat* newVal = (LumiverseFloat*)out.get();
+      newVal->setValAsPercent((_mode == REL) ? newVal->asPercent() + wave : wave);
+    }
+    else if (type == "orientation") {
+      LumiverseOrientation* newVal = (LumiverseOrientation*)out.get();
+      newVal->setValAsPercent((_mode == REL) ? newVal->asPercent() + wave : wave);
+    }
+    else {
+      LumiverseEnum* newVal = (LumiverseEnum*)out.get();
+      newVal->setValAsPercent((_mode == REL) ? newVal->asPercent() + wave : wave);
+    }
+
+    return out;
+  }
+
+  size_t Effect::getLoopLength() {
+    return _period * 1000;
+  }
+
+  JSONNode Effect::toJSON() {
+    JSONNode effect;
+    effect.push_back(JSONNode("type", getTimelineTypeName()));
+    effect.push_back(JSONNode("period", _period));
+    effect.push_back(JSONNode("magnitude", _magnitude));
+    effect.push_back(JSONNode("phase", _phase));
+    effect.push_back(JSONNode("offset", _offset));
+    effect.push_back(JSONNode("mode", _mode));
+    effect.push_back(JSONNode("waveform", _wave));
+    effect.push_back(JSONNode("duty", _duty));
+    effect.push_back(JSONNode("steps", _steps));
+    effect.push_back(JSONNode("seed", _seed));
+    effect.push_back(JSONNode("loops", _loops));
+
+    if (_limited) {
+      JSONNode devices;
+      devices.set_name("devices");
+      for (size_t i = 0; i < _ids.size(); i++) {
+        devices.push_back(JSONNode(_ids[i], _devicePhase[i]));
+      }
+      effect.push_back(devices);
+    }
+
+    if (!_params.empty()) {
+      JSONNode params(JSON_ARRAY);
+      params.set_name("params");
+      for (const auto& p : _params) {
+        params.push_back(JSONNode("", p));
+      }
+      effect.push_back(params);
+    }
+
+    return effect;
+  }
+
+}
+}
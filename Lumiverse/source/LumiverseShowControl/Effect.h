@@ -0,0 +1,235 @@
+#ifndef _EFFECT_H_
+#define _EFFECT_H_
+
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+
+#include "Timeline.h"
+
+namespace Lumiverse {
+namespace ShowControl {
+
+  /*!
+  \brief Procedural effect Timeline.
+
+  Effects generate a periodic waveform instead of interpolating keyframes. The function for the
+  effect is f(t) = _magnitude * wave(t / _period + _phase + devicePhase) + _offset, where wave() has
+  range [-1, 1]. As with keyframed Timelines, values are set proportionally on floats,
+  orientations and enums, so a magnitude of 0.5 on a [0,100] parameter is 50. Colors are not
+  supported and getValueAtTime() returns nullptr for them.
+
+  An effect can be limited to a set of devices, in which case each device gets its own phase offset
+  spread across the set (a fan). Without a device set, the effect applies to every device with no
+  spread.
+
+  Values for every device are computed together once per Timeline time in a tight loop over
+  contiguous arrays. Individual getValueAtTicks() calls just look up the result and write it into a
+  reused output value.
+  */
+  class Effect : public Timeline
+  {
+  public:
+    /*! \brief Waveform shapes. All waveforms start at the beginning of a cycle when the phase is 0. */
+    enum Waveform {
+      SINE,   /*!< sin(2 pi x) */
+      SQUARE, /*!< 1 for the first _duty of each cycle, -1 for the rest */
+      SAW,    /*!< Ramps from -1 to 1 over each cycle */
+      RANDOM, /*!< A new random level each cycle, different for each device */
+      STEP    /*!< Steps evenly from -1 to 1 in _steps levels over each cycle */
+    };
+
+    /*!
+    \brief Encodes the behavior for this effect.
+
+    ABS = Absolute. Value from the effect will fully override the current value for the device.
+    REL = Relative. Value from the effect will be added to the the current value for the device.
+    */
+    enum Mode {
+      ABS,
+      REL
+    };
+
+    /*! \brief How per-device phase offsets are spread across the device set. */
+    enum Spread {
+      NONE,     /*!< Every device has the same phase. */
+      ORDER,    /*!< Evenly by position in channel order. */
+      CHANNEL,  /*!< Proportional to channel number. */
+      METADATA  /*!< Proportional to a numeric metadata value, e.g. a position along a truss. */
+    };
+
+    /*!
+    \brief Creates a new Effect.
+
+    \param wave Waveform shape.
+    \param period Period of the effect, in seconds
+    \param magnitude Magnitude of the waveform. Note that the total height is doubled
+    \param phase Phase of the waveform, in cycles. Adjusts the starting point on the curve.
+    \param offset Vertical offset of the waveform.
+    \param mode Effect mode.
+    */
+    Effect(Waveform wave = SINE, float period = 1, float magnitude = 0.5, float phase = 0, float offset = 0.5, Mode mode = ABS);
+
+    /*!
+    \brief Loads an Effect from a JSONNode.
+
+    If there are missing values in the JSONNode, the default values will be filled in.
+    */
+    Effect(JSONNode node);
+
+    virtual ~Effect();
+
+    /*!
+    \brief Limits the effect to a set of devices and fans the phase across them.
+
+    Phase offsets are computed once here. The set isn't tracked afterwards.
+    \param devices Devices the effect applies to.
+    \param spread How to distribute phase offsets.
+    \param amount Total phase difference between the first and last device, in cycles.
+    \param key Metadata key to read positions from when spread is METADATA. Devices without a
+    numeric value get position 0.
+    */
+    void setDevices(DeviceSet devices, Spread spread = ORDER, float amount = 1, string key = "");
+
+    /*!
+    \brief Sets the phase offset of a single device, in cycles.
+
+    Adds the device to the effect if it's not already there. Once any device has been added the
+    effect only applies to the devices it knows about.
+    */
+    void setDevicePhase(string id, float phase);
+
+    /*! \brief Removes the device limit, the effect applies to everything again. */
+    void clearDevices();
+
+    /*!
+    \brief Limits the effect to the given parameter names. An empty list means all parameters.
+    */
+    void setParameters(vector<string> params) { _params = params; }
+
+    void setWaveform(Waveform wave) { _wave = wave; invalidate(); }
+    Waveform getWaveform() { return _wave; }
+
+    /*! \brief Sets the period in seconds. */
+    void setPeriod(float period);
+    float getPeriod() { return _period; }
+
+    void setMagnitude(float magnitude) { _magnitude = magnitude; invalidate(); }
+    void setPhase(float phase) { _phase = phase; invalidate(); }
+    void setOffset(float offset) { _offset = offset; invalidate(); }
+    void setMode(Mode mode) { _mode = mode; }
+
+    /*! \brief Portion of each cycle a SQUARE wave is high, [0, 1]. */
+    void setDuty(float duty) { _duty = duty; invalidate(); }
+
+    /*! \brief Number of levels in a STEP wave. At least 2. */
+    void setSteps(unsigned int steps) { _steps = (steps < 2) ? 2 : steps; invalidate(); }
+
+    /*! \brief Seed for RANDOM waves. */
+    void setSeed(unsigned int seed) { _seed = seed; invalidate(); }
+
+    /*!
+    \brief Returns the value of the requested parameter according to the effect parameters.
+
+    Returns nullptr for devices and parameters the effect doesn't cover and for unsupported types.
+    */
+    virtual shared_ptr<LumiverseType> getValueAtTicks(string id, string paramName, LumiverseType* currentVal, TimelineTicks time, TimelineContext& ctx) override;
+
+    /*!
+    \brief Relative effects depend on the current value, so they can't be memoized.
+    */
+    virtual bool isCacheable() override { return _mode != REL; }
+
+    /*!
+    \brief Returns the amount of time it takes to cycle through the effect once in milliseconds.
+    */
+    virtual size_t getLoopLength() override;
+
+    /*!
+    \brief Returns the name of this type of timeline.
+    */
+    virtual string getTimelineTypeName() override { return "effect"; }
+
+    /*!
+    \brief Converts this timeline to a JSON node.
+    */
+    virtual JSONNode toJSON() override;
+
+    /*!
+    \brief Evaluates the raw waveform, in [-1, 1], at x cycles. Device phase and randomness are ignored.
+    */
+    float wave(float x);
+
+  protected:
+    /*! \brief Period of the effect */
+    float _period;
+
+    /*! \brief Magnitude of the effect */
+    float _magnitude;
+
+    /*! \brief Phase of the effect */
+    float _phase;
+
+    /*! \brief Vertical offset of the effect */
+    float _offset;
+
+    /*! \brief Effect mode. */
+    Mode _mode;
+
+    Waveform _wave;
+    float _duty;
+    unsigned int _steps;
+    unsigned int _seed;
+
+  private:
+    /*!
+    \brief Computes the value of the device slots at the given Timeline time.
+
+    \param t Time in seconds, already clamped to the length of the effect.
+    \param from First slot to compute. Slots before it are left as they are.
+    */
+    void evaluate(double t, size_t from);
+
+    /*! \brief Forces the next lookup to recompute the device values. */
+    void invalidate() { _evaluated = false; }
+
+    /*! \brief Returns the slot for a device, or -1 if the effect doesn't apply to it. */
+    int getSlot(const string& id);
+
+    /*! \brief Returns true if the parameter is covered by the effect. */
+    bool hasParameter(const string& param);
+
+    /*! \brief True when the effect is limited to the devices in _slots. */
+    bool _limited;
+
+    /*! \brief Device id -> slot in the arrays below. */
+    unordered_map<string, int> _slots;
+
+    /*! \brief Slot -> device id, for saving. */
+    vector<string> _ids;
+
+    /*! \brief Slot -> phase offset in cycles. */
+    vector<float> _devicePhase;
+
+    /*! \brief Slot -> effect value at _evaluatedTime, after magnitude and offset. */
+    vector<float> _values;
+
+    /*!
+    \brief Slot -> parameter -> value returned by the last lookup.
+
+    Reused when the caller has let go of it, which avoids allocating a new value per parameter per update.
+    */
+    vector<unordered_map<string, shared_ptr<LumiverseType> > > _outputs;
+
+    /*! \brief Parameters covered by the effect. Empty for all. */
+    vector<string> _params;
+
+    double _evaluatedTime;
+    bool _evaluated;
+  };
+
+}
+}
+
+#endif
@@ -0,0 +1,85 @@
+#include "EventScheduler.h"
+#include "Playback.h"
+
+namespace Lumiverse {
+namespace ShowControl {
+
+  EventScheduler::EventScheduler(Playback* pb) : m_pb(pb), m_nextSerial(1), m_nextOrder(0) {
+  }
+
+  size_t EventScheduler::schedule(string layer, shared_ptr<Timeline> tl, TimePoint start, size_t from, bool inclusive) {
+    Entry e;
+    e.layer = layer;
+    e.serial = m_nextSerial++;
+    e.timeline = tl;
+    e.start = start;
+
+    scheduleNextEvent(e, from, inclusive);
+
+    // Infinite loops never end on their own.
+    if (tl->getLoops() != -1) {
+      // Timelines are done once the time is past the end.
+      e.type = TIMELINE_END;
+      e.time = tl->getLength() + 1;
+      e.due = start + chrono::milliseconds(e.time);
+      push(e);
+    }
+
+    return e.serial;
+  }
+
+  void EventScheduler::run(TimePoint now) {
+    vector<Entry> pending;
+
+    while (!m_queue.empty() && m_queue.top().due <= now) {
+      Entry e = m_queue.top();
+      m_queue.pop();
+
+      if (!isCurrent(e))
+        continue;
+
+      m_dueTime = e.due;
+
+      if (e.type == TIMELINE_EVENT) {
+        e.timeline->executeEventsAt(e.time);
+        scheduleNextEvent(e, e.time, false);
+      }
+      else if (!m_pb->getLayer(e.layer)->endTimeline(now)) {
+        // Nested timelines can run past the end of their parent. Check again next update.
+        pending.push_back(e);
+      }
+    }
+
+    for (auto& e : pending) {
+      e.due = now + chrono::milliseconds(1);
+      push(e);
+    }
+  }
+
+  void EventScheduler::clear() {
+    m_queue = priority_queue<Entry, vector<Entry>, Later>();
+  }
+
+  void EventScheduler::scheduleNextEvent(const Entry& e, size_t time, bool inclusive) {
+    size_t next;
+    if (!e.timeline->getNextEventTime(time, inclusive, next))
+      return;
+
+    Entry n = e;
+    n.type = TIMELINE_EVENT;
+    n.time = next;
+    n.due = e.start + chrono::milliseconds(next);
+    push(n);
+  }
+
+  void EventScheduler::push(Entry e) {
+    e.order = m_nextOrder++;
+    m_queue.push(e);
+  }
+
+  bool EventScheduler::isCurrent(const Entry& e) {
+    shared_ptr<Layer> layer = m_pb->getLayer(e.layer);
+    return layer != nullptr && layer->getEventSerial() == e.serial;
+  }
+}
+}
@@ -0,0 +1,133 @@
+#ifndef _EVENTSCHEDULER_H_
+#define _EVENTSCHEDULER_H_
+
+#pragma once
+
+#include <memory>
+#include <chrono>
+#include <vector>
+#include <queue>
+
+#include "Timeline.h"
+
+namespace Lumiverse {
+namespace ShowControl {
+  class Playback;
+
+  /*!
+  \brief Time ordered queue of upcoming Timeline Events for every Layer in a Playback.
+
+  Each playing Layer has at most one pending Event entry and one end entry in the queue.
+  The Event entry holds the next time its Timeline has Events (including wrap-around into
+  the next loop), so each update only touches the Events that are actually due instead of
+  searching every Timeline. The end entry is due when the Timeline's length has passed, and
+  checks the Timeline's isDone() from then on.
+
+  Entries are tied to a Layer by name and a serial number handed out by schedule(). When a
+  Layer pauses, stops or starts a different Timeline it drops its serial, and any entries
+  still in the queue for it are discarded when they come up.
+  */
+  class EventScheduler
+  {
+  public:
+    typedef chrono::time_point<chrono::high_resolution_clock> TimePoint;
+
+    EventScheduler(Playback* pb);
+
+    /*!
+    \brief Queues the Events and end of a Timeline playing on a Layer.
+
+    \param layer Name of the Layer playing the Timeline
+    \param tl Timeline being played
+    \param start Time the Timeline started, i.e. Timeline time 0.
+    \param from Timeline time (ms) to schedule from.
+    \param inclusive If true, Events at exactly from are scheduled too.
+    \return Serial number for the Layer to check entries against.
+    */
+    size_t schedule(string layer, shared_ptr<Timeline> tl, TimePoint start, size_t from, bool inclusive);
+
+    /*!
+    \brief Executes everything due at or before the given time, in time order.
+
+    \param now Current update time.
+    */
+    void run(TimePoint now);
+
+    /*!
+    \brief Removes everything from the queue.
+    */
+    void clear();
+
+    /*!
+    \brief Time the entry currently being processed was due.
+
+    Updates only happen once per loop, so this is usually slightly earlier than the update time.
+    Events can use it to find out exactly when they were supposed to happen.
+    */
+    TimePoint getDueTime() { return m_dueTime; }
+
+    /*!
+    \brief Number of entries in the queue, including stale ones.
+    */
+    size_t size() { return m_queue.size(); }
+
+  private:
+    enum EntryType { TIMELINE_EVENT, TIMELINE_END };
+
+    struct Entry {
+      /*! \brief Absolute time the entry is due. */
+      TimePoint due;
+
+      /*! \brief End entries go after Events due at the same time. */
+      EntryType type;
+
+      /*! \brief Insertion order, keeps entries due at the same time in FIFO order. */
+      size_t order;
+
+      /*! \brief Layer name and serial the entry was scheduled for. */
+      string layer;
+      size_t serial;
+
+      shared_ptr<Timeline> timeline;
+
+      /*! \brief Timeline start time. */
+      TimePoint start;
+
+      /*! \brief Timeline time (ms) of the entry, counting from the start of the first loop. */
+      size_t time;
+    };
+
+    /*! \brief Orders the heap so the earliest entry is on top. */
+    struct Later {
+      bool operator()(const Entry& a, const Entry& b) const {
+        if (a.due != b.due) return a.due > b.due;
+        if (a.type != b.type) return a.type > b.type;
+        return a.order > b.order;
+      }
+    };
+
+    /*! \brief Queues the next Event after time for the entry's Timeline, if there is one. */
+    void scheduleNextEvent(const Entry& e, size_t time, bool inclusive);
+
+    void push(Entry e);
+
+    /*! \brief Returns true if the Layer the entry was scheduled for is still playing it. */
+    bool isCurrent(const Entry& e);
+
+    priority_queue<Entry, vector<Entry>, Later> m_queue;
+
+    /*! \brief Playback containing the Layers. */
+    Playback* m_pb;
+
+    /*! \brief Next serial to hand out. Starts at 1, 0 means nothing scheduled. */
+    size_t m_nextSerial;
+
+    /*! \brief Next insertion order number. */
+    size_t m_nextOrder;
+
+    TimePoint m_dueTime;
+  };
+}
+}
+
+#endif
@@ -8,6 +8,8 @@
 namespace Lumiverse {
 namespace ShowControl {
 
+class Timeline;
+
 /*!
 \brief A Keyframe stores the value of a parameter at the specified time.
 
@@ -44,6 +46,15 @@ struct Keyframe {
   */
   size_t timelineOffset;
 
+  /*!
+  \brief Timeline referenced by timelineID.
+
+  Filled in by Timeline::resolveReferences(). Empty if the reference hasn't been resolved,
+  the Timeline doesn't exist, or the reference would create a cycle. Held weakly so a Timeline
+  deleted from the Playback is never evaluated through a stale reference.
+  */
+  weak_ptr<Timeline> timeline;
+
   // Planned interpolation mode selection here. Additional parameters probably needed
   // once this thing gets activated
   // enum interpMode
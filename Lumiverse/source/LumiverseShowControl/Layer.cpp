@@ -19,7 +19,7 @@ namespace ShowControl {
   Layer::Layer(DeviceSet set, Playback * pb, string name, int priority, BlendMode mode) :
     m_name(name), m_priority(priority), m_pb(pb), m_mode(mode)
   {
-    auto devices = set.getDevices();
+    auto devices = set.getDeviceList();
     for (const auto& d : devices) {
       for (const auto& p : d->getRawParameters()) {
         m_layerState[d->getId()][p.first] = LumiverseTypeUtils::copy(p.second);
@@ -32,6 +32,9 @@ namespace ShowControl {
     m_playing = false;
     m_playbackData = nullptr;
     m_queuedPlayback = nullptr;
+    m_eventSerial = 0;
+    m_prepShutdown = false;
+    m_captureTime = 0;
   }
 
   Layer::Layer(Playback * pb, string name, int priority, BlendMode mode) :
@@ -44,6 +47,9 @@ namespace ShowControl {
     m_playing = false;
     m_playbackData = nullptr;
     m_queuedPlayback = nullptr;
+    m_eventSerial = 0;
+    m_prepShutdown = false;
+    m_captureTime = 0;
   }
 
   Layer::Layer(Playback* pb, JSONNode node) : m_pb(pb) {
@@ -90,10 +96,13 @@ namespace ShowControl {
     m_playing = false;
     m_playbackData = nullptr;
     m_queuedPlayback = nullptr;
+    m_eventSerial = 0;
+    m_prepShutdown = false;
+    m_captureTime = 0;
   }
 
   void Layer::init(Rig* rig) {
-    const set<Device*> devices = rig->getAllDevices().getDevices();
+    auto devices = rig->getAllDevices().getDeviceList();
     for (auto d : devices) {
       for (auto p : d->getRawParameters()) {
         // Copy and reset to defaults
@@ -108,15 +117,36 @@ namespace ShowControl {
     m_playing = false;
     m_playbackData = nullptr;
     m_queuedPlayback = nullptr;
+    m_eventSerial = 0;
+    m_prepShutdown = false;
+    m_captureTime = 0;
   }
 
   Layer::~Layer() {
+    {
+      lock_guard<mutex> lock(m_prepMutex);
+      m_prepShutdown = true;
+    }
+    m_prepCv.notify_all();
+
+    if (m_prepThread.joinable())
+      m_prepThread.join();
+
+    delete m_queuedPlayback.exchange(nullptr);
+    delete m_playbackData;
+
     // Delete the devices
     for (auto kvp : m_layerState) {
       for (auto pkvp : kvp.second) {
         delete m_layerState[kvp.first][pkvp.first];
       }
     }
+
+    for (auto& d : m_capture) {
+      for (auto& p : d.second) {
+        delete p.second;
+      }
+    }
   }
 
   void Layer::setOpacity(float val) {
@@ -130,7 +160,7 @@ namespace ShowControl {
       return false;
     }
 
-    auto devices = d.getDevices();
+    auto devices = d.getDeviceList();
     for (const auto& dv : devices) {
       for (const auto& p : dv->getRawParameters()) {
         m_layerState[dv->getId()][p.first] = LumiverseTypeUtils::copy(p.second);
@@ -165,7 +195,7 @@ namespace ShowControl {
       return false;
     }
 
-    auto devices = d.getDevices();
+    auto devices = d.getDeviceList();
     for (const auto& dv : devices) {
       for (const auto& p : params) {
         // Delete old param value if exists
@@ -222,7 +252,7 @@ namespace ShowControl {
       return false;
     }
 
-    auto devices = d.getDevices();
+    auto devices = d.getDeviceList();
     for (const auto& dv : devices) {
       auto params = m_layerState[dv->getId()];
       for (const auto& kvp : params) {
@@ -242,7 +272,7 @@ namespace ShowControl {
       return false;
     }
 
-    auto devices = d.getDevices();
+    auto devices = d.getDeviceList();
     for (const auto& dv : devices) {
       for (const auto& p : params) {
         deleteParameter(dv->getId(), p);
@@ -274,40 +304,116 @@ namespace ShowControl {
       return;
     }
 
-    // An assumption is made that each timeline isn't being played back multiple times at once
-    // grab relevant data from current playback object
-    string tlID = "";
-    size_t time = 0;
+    m_lastPlayedTimeline = id;
 
-    // Locking to make sure playback data doesn't get deleted from under our noses.
-    m_queue.lock();
-    
-    if (m_playbackData != nullptr) {
-      tlID = m_playbackData->timelineID;
-      time = chrono::duration_cast<chrono::milliseconds>(m_playbackData->elapsed - m_playbackData->start).count();
+    // Nothing is updating the layers, so there's nothing to keep responsive.
+    if (!m_pb->isRunning()) {
+      prepare(id);
+      return;
     }
 
-    m_pb->getTimeline(id)->setCurrentState(m_layerState, m_pb->getTimeline(tlID), time);
+    {
+      lock_guard<mutex> lock(m_prepMutex);
+      m_prepRequest = id;
 
-    m_queue.unlock();
+      if (!m_prepThread.joinable())
+        m_prepThread = thread(&Layer::prepareLoop, this);
+    }
+    m_prepCv.notify_all();
+  }
 
-    m_lastPlayedTimeline = id;
+  void Layer::prepareLoop() {
+    unique_lock<mutex> lock(m_prepMutex);
+
+    while (true) {
+      m_prepCv.wait(lock, [this] { return m_prepShutdown || !m_prepRequest.empty(); });
+
+      if (m_prepShutdown)
+        return;
+
+      string id = m_prepRequest;
+      m_prepRequest.clear();
+
+      lock.unlock();
+      prepare(id);
+      lock.lock();
+    }
+  }
+
+  void Layer::prepare(string id) {
+    // play() can run this directly while the preparation thread is still busy.
+    lock_guard<mutex> prepareLock(m_prepareMutex);
+
+    // The layer state belongs to the update loop, which skips this layer for an update
+    // instead of waiting if it runs into the capture.
+    {
+      lock_guard<mutex> stateLock(m_stateMutex);
+      captureState();
+    }
+
+    // An assumption is made that each timeline isn't being played back multiple times at once
+    shared_ptr<Timeline> tl = m_pb->getTimeline(id);
+    if (tl == nullptr) {
+      Logger::log(ERR, "Timeline with id " + id + " was deleted before it could be played.");
+      return;
+    }
 
-    PlaybackData* pbd = new PlaybackData();;
+    PlaybackData* pbd = new PlaybackData();
     pbd->timelineID = id;
     pbd->complete = false;
     pbd->start = chrono::high_resolution_clock::now();
     pbd->elapsed = pbd->start;
-    pbd->length = m_pb->getTimeline(id)->getLength();
+    pbd->length = 0;
 
-    // Delete anything in the up next slot if we got something there
-    if (m_queuedPlayback != nullptr) {
-      delete m_queuedPlayback;
+    // The Timeline may still be playing, so it's only switched over once update() takes the playback.
+    pbd->begin = tl->prepareCurrentState(m_capture, m_pb->getTimeline(m_captureTimeline), m_captureTime);
+
+    // Replace anything in the up next slot that update() hasn't picked up yet.
+    delete m_queuedPlayback.exchange(pbd);
+  }
+
+  void Layer::captureState() {
+    m_captureTimeline = "";
+    m_captureTime = 0;
+
+    if (m_playbackData != nullptr) {
+      m_captureTimeline = m_playbackData->timelineID;
+      m_captureTime = chrono::duration_cast<chrono::milliseconds>(m_playbackData->elapsed - m_playbackData->start).count();
     }
 
-    m_queue.lock();
-    m_queuedPlayback = pbd;
-    m_queue.unlock();
+    for (const auto& d : m_layerState) {
+      auto& device = m_capture[d.first];
+
+      // Parameters can only be removed while nothing is playing, start over if the shape changed.
+      if (device.size() > d.second.size()) {
+        for (auto& p : device)
+          delete p.second;
+        device.clear();
+      }
+
+      for (const auto& p : d.second) {
+        LumiverseType*& copy = device[p.first];
+
+        if (copy == nullptr || copy->getTypeName() != p.second->getTypeName()) {
+          delete copy;
+          copy = LumiverseTypeUtils::copy(p.second);
+        }
+        else {
+          LumiverseTypeUtils::copyByVal(p.second, copy);
+        }
+      }
+    }
+
+    for (auto it = m_capture.begin(); it != m_capture.end();) {
+      if (m_layerState.count(it->first) == 0) {
+        for (auto& p : it->second)
+          delete p.second;
+        it = m_capture.erase(it);
+      }
+      else {
+        it++;
+      }
+    }
   }
 
   void Layer::pause() {
@@ -331,31 +437,49 @@ namespace ShowControl {
   }
 
   void Layer::update(chrono::time_point<chrono::high_resolution_clock> updateStart) {
+    // The preparation thread is copying the layer state. Catch up on the next update instead of waiting.
+    unique_lock<mutex> stateLock(m_stateMutex, try_to_lock);
+    if (!stateLock.owns_lock())
+      return;
+
     auto loopTime = updateStart - m_previousLoopStart;
 
-    // Grab waiting playback objects from the queue
-    m_queue.lock();
-    if (m_queuedPlayback != nullptr) {
-      m_playbackData = m_queuedPlayback;
-      m_queuedPlayback = nullptr;
+    // Grab the next playback object if the preparation thread finished one.
+    PlaybackData* queued = m_queuedPlayback.exchange(nullptr);
+    if (queued != nullptr) {
+      endPlayback();
+      m_playbackData = queued;
+
+      // Switch the Timeline over to the run prepared for it.
+      shared_ptr<Timeline> tl = m_pb->getTimeline(m_playbackData->timelineID);
+      if (tl != nullptr) {
+        m_playbackData->begin();
+        m_playbackData->length = tl->getLength();
+      }
+      m_playbackData->begin = nullptr;
+
+      // Timelines start on the update that picks them up, so time 0 lands on an output frame.
+      m_playbackData->start = updateStart;
+      m_playbackData->elapsed = updateStart;
 
       m_pause = false;
       m_stop = false;
       m_playing = true;
+      m_eventSerial = 0;
     }
-    m_queue.unlock();
 
     if (m_stop) {
-      if (m_playbackData != nullptr) {
-        delete m_playbackData;
-        m_playbackData = nullptr;
-      }
+      endPlayback();
+      m_eventSerial = 0;
     }
     else if (m_pause) {
       // Need to update the start time by the diff of previous and current loop.
       if (m_playbackData != nullptr) {
         m_playbackData->start += loopTime;
       }
+
+      // Event times depend on the start time, so they get rescheduled on resume.
+      m_eventSerial = 0;
     }
     else {
       // Update playback data and set layer state if there is anything currently active
@@ -368,12 +492,12 @@ namespace ShowControl {
         // - Set the value in the layer state to the returned value.
         // - End playback if the timeline says it's done.
         shared_ptr<Timeline> tl = m_pb->getTimeline(m_playbackData->timelineID);
-        size_t t = chrono::duration_cast<chrono::milliseconds>(updateStart - m_playbackData->start).count();
+        TimelineTicks t = chrono::duration_cast<chrono::microseconds>(updateStart - m_playbackData->start).count();
         size_t tp = chrono::duration_cast<chrono::milliseconds>(m_previousLoopStart - m_playbackData->start).count();
 
         for (const auto& device : m_layerState) {
           for (auto& param : m_layerState[device.first]) {
-            shared_ptr<LumiverseType> val = tl->getValueAtTime(device.first, param.first, param.second, t, m_pb->getTimelines());
+            shared_ptr<LumiverseType> val = tl->getValueAtTicks(device.first, param.first, param.second, t, m_pb->getTimelineContext());
 
             // A value of nullptr indicates that the Timeline doesn't have any data for the specified device/paramter pair.
             if (val == nullptr) {
@@ -384,26 +508,57 @@ namespace ShowControl {
           }
         }
 
-        tl->executeEvents(tp, t);
-
-        // this is not optimal. at the moment the locking is necessary due to c++ stl container
-        // access issues in some of the timeline methods (iterators getting reset, etc.)
-        m_queue.lock();
-        if (tl->isDone(t, m_pb->getTimelines())) {
-          tl->executeEndEvents();
-          delete m_playbackData;
-          m_playbackData = nullptr;
-          m_stop = true;
-          m_pause = false;
-          m_playing = false;
+        // Events and the end of the timeline are handled by the Playback's scheduler.
+        // Anything after the previous update (or from the start on the first update) is queued.
+        if (m_eventSerial == 0) {
+          bool first = m_previousLoopStart <= m_playbackData->start;
+          m_eventSerial = m_pb->getScheduler().schedule(m_name, tl, m_playbackData->start, first ? 0 : tp, first);
         }
-        m_queue.unlock();
       }
     }
 
     m_previousLoopStart = updateStart;
   }
 
+  bool Layer::endTimeline(chrono::time_point<chrono::high_resolution_clock> now) {
+    // Try again on the next update if the state is being copied.
+    unique_lock<mutex> stateLock(m_stateMutex, try_to_lock);
+    if (!stateLock.owns_lock())
+      return false;
+
+    if (m_playbackData == nullptr)
+      return true;
+
+    shared_ptr<Timeline> tl = m_pb->getTimeline(m_playbackData->timelineID);
+    size_t t = chrono::duration_cast<chrono::milliseconds>(now - m_playbackData->start).count();
+
+    if (tl != nullptr && !tl->isDone(t, m_pb->getTimelines()))
+      return false;
+
+    if (tl != nullptr)
+      tl->executeEndEvents();
+
+    endPlayback();
+    m_stop = true;
+    m_pause = false;
+    m_playing = false;
+    m_eventSerial = 0;
+
+    return true;
+  }
+
+  void Layer::endPlayback() {
+    if (m_playbackData == nullptr)
+      return;
+
+    shared_ptr<Timeline> tl = m_pb->getTimeline(m_playbackData->timelineID);
+    if (tl != nullptr)
+      tl->clearCurrentState();
+
+    delete m_playbackData;
+    m_playbackData = nullptr;
+  }
+
   void Layer::blend(map<string, Device*> currentState) {
     // We assume here that what you're passing in contains all the devices in the rig
     // and will not create new devices if they don't exist in the current state.
@@ -12,6 +12,10 @@
 #include <memory>
 #include <chrono>
 #include <unordered_map>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 namespace Lumiverse {
 namespace ShowControl {
@@ -26,6 +30,9 @@ namespace ShowControl {
     bool complete;
     chrono::time_point<chrono::high_resolution_clock> elapsed;
     size_t length;
+
+    /*! \brief Starts the run prepared for the Timeline. Called by the update that takes the playback. */
+    function<void()> begin;
   };
 
   /*!
@@ -89,6 +96,12 @@ namespace ShowControl {
 
     Layers can play multiple timelines back at once, however there won't be much in the way of intelligent
     blending. System should do a latest takes precedence merge for multiple timelines.
+
+    Starting a Timeline (capturing the current state and preparing the Timeline's run from it)
+    happens on the Layer's preparation thread, so this returns right away. The Timeline starts
+    on the first update after it's ready. If play() is called again before that, only the most
+    recent Timeline is started. When the Playback isn't running (e.g. it's stepped manually)
+    the Timeline is prepared before play() returns, so it always starts on the next update.
     */
     void play(string id);
 
@@ -211,6 +224,23 @@ namespace ShowControl {
     */
     void update(chrono::time_point<chrono::high_resolution_clock> updateStart);
 
+    /*!
+    \brief Ends the current Timeline if it's done.
+
+    Called by the Playback's EventScheduler once the Timeline's length has passed. Executes the
+    Timeline's end Events and stops playback.
+    \param now Current update time.
+    \return false if the Timeline is still running.
+    */
+    bool endTimeline(chrono::time_point<chrono::high_resolution_clock> now);
+
+    /*!
+    \brief Serial number of the EventScheduler entries for the current playback.
+
+    0 if nothing is scheduled.
+    */
+    size_t getEventSerial() { return m_eventSerial; }
+
     /*!
     \brief Blends this layer with the given state.
 
@@ -303,18 +333,18 @@ namespace ShowControl {
     float m_opacity;
 
     /*! \brief Indicates if playback is paused on this layer. */
-    bool m_pause;
+    atomic<bool> m_pause;
 
     /*! \brief Indicates that the Layer is stopping playback.
     
     This allows the update function to finish a full update and then clear the playback queue.
     */
-    bool m_stop;
+    atomic<bool> m_stop;
 
     /*!
     \brief Indicates if the layer is currently playing back a timeline
     */
-    bool m_playing;
+    atomic<bool> m_playing;
 
     /*!
     \brief Stores the previous loop start time in milliseconds.
@@ -352,10 +382,73 @@ namespace ShowControl {
     */
     PlaybackData* m_playbackData;
     
-    /*! \brief Next timeline to run. */
-    PlaybackData* m_queuedPlayback;
+    /*!
+    \brief Next timeline to run.
+
+    Filled in by the preparation thread and taken by update() with an atomic exchange.
+    */
+    atomic<PlaybackData*> m_queuedPlayback;
+
+    /*!
+    \brief Serial number from the EventScheduler for the current playback's Events.
+
+    Reset to 0 whenever scheduled Events become invalid (pause, stop, new Timeline).
+    */
+    size_t m_eventSerial;
+
+    /*!
+    \brief Starts Timelines requested by play().
+
+    Copies the layer state, prepares the Timeline's run from it with prepareCurrentState()
+    and publishes the new PlaybackData to m_queuedPlayback.
+    */
+    void prepareLoop();
+
+    /*! \brief Starts a single Timeline. Runs on the preparation thread. */
+    void prepare(string id);
+
+    /*!
+    \brief Copies the layer state and the current playback position for the preparation thread.
+
+    Called with m_stateMutex held.
+    */
+    void captureState();
+
+    /*!
+    \brief Stops evaluating the current Timeline and lets it drop the state from its run.
+
+    Called from update() and endTimeline().
+    */
+    void endPlayback();
+
+    /*! \brief Preparation thread. Started by the first call to play(). */
+    thread m_prepThread;
+
+    /*! \brief Guards m_prepRequest and m_prepShutdown. Never taken by update(). */
+    mutex m_prepMutex;
+    condition_variable m_prepCv;
+
+    /*! \brief Most recent Timeline passed to play() that hasn't been started yet. */
+    string m_prepRequest;
+    bool m_prepShutdown;
+
+    /*! \brief Serializes prepare(), which runs on the preparation thread or in play(). */
+    mutex m_prepareMutex;
+
+    /*!
+    \brief Guards the layer state and m_playbackData while captureState() copies them.
+
+    update() and endTimeline() only try to take it, and put off their work until the next
+    update if the preparation thread has it.
+    */
+    mutex m_stateMutex;
+
+    /*! \brief Copy of the layer state handed to prepareCurrentState(). Reused between captures. */
+    map<string, map<string, LumiverseType*> > m_capture;
 
-    mutex m_queue;
+    /*! \brief Timeline and time (ms) that were playing when the state was captured. */
+    string m_captureTimeline;
+    size_t m_captureTime;
   };
 
 #ifdef USE_C11_MAPS
@@ -4,7 +4,10 @@
 #include "Layer.h"
 #include "Programmer.h"
 #include "Playback.h"
+#include "EventScheduler.h"
 #include "Snapshot.h"
+#include "Effect.h"
 #include "SineWave.h"
 #include "Cue.h"
-#include "CueList.h"
\ No newline at end of file
+#include "CueList.h"
+#include "OfflineRenderer.h"
\ No newline at end of file
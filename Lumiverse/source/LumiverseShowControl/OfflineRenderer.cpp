@@ -0,0 +1,108 @@
+#include "OfflineRenderer.h"
+
+namespace Lumiverse {
+namespace ShowControl {
+
+  OfflineRenderer::OfflineRenderer(Playback* pb, unsigned int rate) : m_pb(pb), m_rate(rate),
+    m_frames(0), m_bytes(0), m_maxFrameTime(0), m_avgFrameTime(0), m_overBudget(0)
+  {
+    if (m_rate == 0)
+      m_rate = 1;
+  }
+
+  void OfflineRenderer::addAction(size_t time, function<void()> action) {
+    m_actions.insert(make_pair(time, action));
+  }
+
+  bool OfflineRenderer::render(string filename, size_t duration) {
+    m_frames = 0;
+    m_bytes = 0;
+    m_maxFrameTime = 0;
+    m_avgFrameTime = 0;
+    m_overBudget = 0;
+
+    if (m_pb->isRunning()) {
+      Logger::log(ERR, "Can't render a Playback while its update loop is running.");
+      return false;
+    }
+
+    Rig* rig = m_pb->getRig();
+
+    // Find every universe that will have output.
+    vector<DMXPatch*> patches;
+    vector<DMXCaptureSource> sources;
+    for (const auto& p : rig->getPatches()) {
+      if (p.second->getType() != "DMXPatch")
+        continue;
+
+      DMXPatch* patch = (DMXPatch*)p.second;
+      patch->allocatePatchedUniverses();
+      patches.push_back(patch);
+
+      for (unsigned int u = 0; u < patch->getUniverses().size(); u++) {
+        DMXCaptureSource src;
+        src.patch = p.first;
+        src.universe = u;
+        sources.push_back(src);
+      }
+    }
+
+    DMXCaptureWriter writer;
+    if (!writer.open(filename, m_rate, sources))
+      return false;
+
+    vector<unsigned char> buffer(writer.getFrameSize());
+    size_t frames = (duration * m_rate + 999) / 1000;
+    auto nextAction = m_actions.begin();
+    double budget = 1000.0 / m_rate;
+    double total = 0;
+
+    // The virtual clock starts now so times stay comparable to Timeline start times.
+    auto epoch = chrono::high_resolution_clock::now();
+
+    for (size_t i = 0; i < frames; i++) {
+      auto frameStart = chrono::high_resolution_clock::now();
+
+      long long ns = (long long)i * 1000000000LL / m_rate;
+      size_t showTime = (size_t)(ns / 1000000);
+      auto frameTime = epoch + chrono::duration_cast<chrono::high_resolution_clock::duration>(chrono::nanoseconds(ns));
+
+      while (nextAction != m_actions.end() && nextAction->first <= showTime) {
+        nextAction->second();
+        nextAction++;
+      }
+
+      m_pb->update(frameTime);
+
+      unsigned char* out = buffer.data();
+      for (DMXPatch* patch : patches) {
+        patch->updateUniverses(rig->getDeviceRaw());
+        for (const auto& uni : patch->getUniverses()) {
+          memcpy(out, uni.data(), uni.size());
+          out += uni.size();
+        }
+      }
+
+      if (!writer.writeFrame(buffer.data())) {
+        writer.close();
+        return false;
+      }
+
+      double elapsed = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - frameStart).count();
+      total += elapsed;
+      if (elapsed > m_maxFrameTime)
+        m_maxFrameTime = elapsed;
+      if (elapsed > budget)
+        m_overBudget++;
+    }
+
+    m_frames = (size_t)writer.getFrameCount();
+    m_avgFrameTime = (m_frames > 0) ? total / m_frames : 0;
+
+    bool ok = writer.close();
+    m_bytes = (size_t)writer.getBytesWritten();
+
+    return ok;
+  }
+}
+}
@@ -0,0 +1,99 @@
+#ifndef _OFFLINERENDERER_H_
+#define _OFFLINERENDERER_H_
+
+#pragma once
+
+#include <functional>
+#include <map>
+
+#include "LumiverseCore.h"
+#include "DMX/DMXCapture.h"
+#include "Playback.h"
+
+namespace Lumiverse {
+namespace ShowControl {
+
+  /*!
+  \brief Renders a Playback to a DMX capture file as fast as possible.
+
+  The Playback is stepped on a virtual clock at a fixed frame rate instead of following the
+  wall clock, so a show renders the same way every time no matter how fast the machine is.
+  After each frame the output of every DMXPatch in the Rig is recorded. Patches don't need
+  interfaces for this and nothing is sent to the ones they have.
+
+  Things that would normally be triggered live (starting cues, moving faders) are scheduled
+  with addAction() and run at the start of the first frame at or after their time.
+
+  Neither the Playback nor the Rig update loop should be running during a render.
+  \sa DMXCaptureWriter
+  */
+  class OfflineRenderer
+  {
+  public:
+    /*!
+    \brief Creates a renderer for the given Playback.
+    \param pb Playback to render. The Rig is the one attached to the Playback.
+    \param rate Frames per second to render at.
+    */
+    OfflineRenderer(Playback* pb, unsigned int rate = 40);
+
+    /*!
+    \brief Schedules a function to run during the render.
+    \param time Show time in ms.
+    \param action Function to run. Typically plays something on a Layer.
+    */
+    void addAction(size_t time, function<void()> action);
+
+    /*! \brief Removes all scheduled actions. */
+    void clearActions() { m_actions.clear(); }
+
+    /*!
+    \brief Renders the show from time 0 to the given time.
+
+    Actions are kept, so calling this again with the Playback in the same starting state
+    produces an identical file.
+    \param filename Capture file to write.
+    \param duration Length of the render in ms.
+    \return false if the Playback is running or the file couldn't be written.
+    */
+    bool render(string filename, size_t duration);
+
+    unsigned int getRate() { return m_rate; }
+
+    /*! \brief Frames written by the last render. */
+    size_t getFrameCount() { return m_frames; }
+
+    /*! \brief Size of the file written by the last render, in bytes. */
+    size_t getBytesWritten() { return m_bytes; }
+
+    /*! \brief Longest wall clock time taken by a frame in the last render, in ms. */
+    double getMaxFrameTime() { return m_maxFrameTime; }
+
+    /*! \brief Average wall clock time taken by a frame in the last render, in ms. */
+    double getAverageFrameTime() { return m_avgFrameTime; }
+
+    /*!
+    \brief Number of frames in the last render that took longer than one frame period.
+
+    A show with frames over budget won't keep up when played live at this rate.
+    */
+    size_t getFramesOverBudget() { return m_overBudget; }
+
+  private:
+    Playback* m_pb;
+
+    unsigned int m_rate;
+
+    /*! \brief Show time (ms) -> actions, run in the order they were added. */
+    multimap<size_t, function<void()> > m_actions;
+
+    size_t m_frames;
+    size_t m_bytes;
+    double m_maxFrameTime;
+    double m_avgFrameTime;
+    size_t m_overBudget;
+  };
+}
+}
+
+#endif
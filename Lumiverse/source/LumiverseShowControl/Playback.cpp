@@ -1,14 +1,21 @@
 #include "Playback.h"
 #include "SineWave.h"
+#include "Effect.h"
 
 namespace Lumiverse {
 namespace ShowControl {
 
-  Playback::Playback(Rig* rig, float gm) : m_rig(rig), m_grandmaster(gm) {
+  Playback::Playback(Rig* rig, float gm) : m_timelineContext(m_timelines), m_grandmaster(gm), m_scheduler(this), m_rig(rig) {
     // setRefreshRate(refreshRate);
     m_running = false;
-
-    auto devices = m_rig->getAllDevices().getDevices();
+    m_timelinesChanged = false;
+    m_timelineGeneration = 0;
+    m_requestedRate = 0;
+    m_rateChanged = false;
+    m_fixedRate = 0;
+    m_frame = -1;
+
+    auto devices = m_rig->getAllDevices().getDeviceList();
     for (Device* d : devices) {
       // Copy and reset to defaults
       m_state[d->getId()] = new Device(*d);
@@ -19,12 +26,20 @@ namespace ShowControl {
 
     // Make a single programmer for this playback object
     m_prog = unique_ptr<Programmer>(new Programmer(m_rig));
+
+    initScaling();
   }
 
-  Playback::Playback(Rig* rig, string filename) : m_rig(rig) {
+  Playback::Playback(Rig* rig, string filename) : m_timelineContext(m_timelines), m_scheduler(this), m_rig(rig) {
     m_running = false;
-
-    auto devices = m_rig->getAllDevices().getDevices();
+    m_timelinesChanged = false;
+    m_timelineGeneration = 0;
+    m_requestedRate = 0;
+    m_rateChanged = false;
+    m_fixedRate = 0;
+    m_frame = -1;
+
+    auto devices = m_rig->getAllDevices().getDeviceList();
     for (Device* d : devices) {
       // Copy and reset to defaults
       m_state[d->getId()] = new Device(*d);
@@ -35,6 +50,7 @@ namespace ShowControl {
 
     // Make a single programmer for this playback object
     m_prog = unique_ptr<Programmer>(new Programmer(m_rig));
+    initScaling();
 
     // Load up cue and layer data.
     load(filename);
@@ -66,73 +82,114 @@ namespace ShowControl {
   //  m_loopTime = 1.0f / (float)m_refreshRate;
   //}
 
+  void Playback::setFixedTimestep(unsigned int rate) {
+    // The update thread owns the frame clock, it restarts the clock with the new rate.
+    m_requestedRate = rate;
+    m_rateChanged = true;
+  }
+
+  chrono::time_point<chrono::high_resolution_clock> Playback::nextFrameTime() {
+    auto now = chrono::high_resolution_clock::now();
+
+    if (m_rateChanged.exchange(false)) {
+      m_fixedRate = m_requestedRate;
+      m_frame = -1;
+    }
+
+    if (m_fixedRate == 0)
+      return now;
+
+    auto steadyNow = chrono::steady_clock::now();
+    if (m_frame < 0) {
+      m_clockStart = steadyNow;
+      m_frameEpoch = now;
+      m_frame = 0;
+      return now;
+    }
+
+    // Most recent frame boundary. Updates that come in early repeat the previous frame
+    // instead of going back in time.
+    long long frame = chrono::duration_cast<chrono::nanoseconds>(steadyNow - m_clockStart).count() * m_fixedRate / 1000000000LL;
+    m_frame = (frame > m_frame) ? frame : m_frame;
+
+    return m_frameEpoch + chrono::duration_cast<chrono::high_resolution_clock::duration>(
+      chrono::nanoseconds(m_frame * 1000000000LL / m_fixedRate));
+  }
+
   void Playback::update() {
     if (m_running) {
-      // Gets start time
-      auto start = chrono::high_resolution_clock::now();
+      update(nextFrameTime());
+    }
+  }
 
-      // Update layers
-      for (auto& kvp : m_layers) {
-        kvp.second->update(start);
-      }
+  void Playback::update(chrono::time_point<chrono::high_resolution_clock> start) {
+    m_frameTime = start;
 
-      // Flatten layers
-      // Reset state to defaults to start.
-      for (auto& kvp : m_state) {
-        kvp.second->reset();
-      }
+    // Nested timeline values are only valid for one update.
+    if (m_timelinesChanged) {
+      m_timelinesChanged = false;
+      m_timelineContext.invalidate();
+    }
+    m_timelineContext.reset();
 
-      // Sort active layers
-      set<shared_ptr<Layer>, function<bool(shared_ptr<Layer>, shared_ptr<Layer>)> >
-        sortedLayers([](shared_ptr<Layer> lhs, shared_ptr<Layer> rhs) { return (*lhs) < (*rhs); });
+    // Update layers
+    for (auto& kvp : m_layers) {
+      kvp.second->update(start);
+    }
 
-      for (auto& kvp : m_layers) {
-        if (kvp.second->isActive()) {
-          // sorting is handled automatically by set<> according to the stl spec
-          sortedLayers.insert(kvp.second);
-        }
-      }
+    // Run timeline events that are due
+    m_scheduler.run(start);
 
-      // Blend active layers
-      // Blending is done from the bottom up, with the state being passed to each
-      // layer in order.
-      for (auto& l : sortedLayers) {
-        l->blend(m_state);
-      }
+    // Flatten layers
+    // Reset state to defaults to start.
+    for (auto& kvp : m_state) {
+      kvp.second->reset();
+    }
 
-      // Blend the programmer layer
-      // This layer sits on top of everything else and anything captured by it
-      // will take precedence over everything.
-      m_prog->blend(m_state);
+    // Sort active layers
+    set<shared_ptr<Layer>, function<bool(shared_ptr<Layer>, shared_ptr<Layer>)> >
+      sortedLayers([](shared_ptr<Layer> lhs, shared_ptr<Layer> rhs) { return (*lhs) < (*rhs); });
 
-      // If we have a GM value less than 1, do some scaling
-      if (m_grandmaster < 1) {
-        for (const auto& d : m_state) {
-          for (auto p : d.second->getRawParameters()) {
-            LumiverseTypeUtils::scaleParam(p.second, m_grandmaster);
-          }
-        }
+    for (auto& kvp : m_layers) {
+      if (kvp.second->isActive()) {
+        // sorting is handled automatically by set<> according to the stl spec
+        sortedLayers.insert(kvp.second);
       }
+    }
 
-      // Write state to rig.
-      m_rig->setAllDevices(m_state);
+    // Blend active layers
+    // Blending is done from the bottom up, with the state being passed to each
+    // layer in order.
+    for (auto& l : sortedLayers) {
+      l->blend(m_state);
+    }
 
-      // For now I'm locking this to the update loop in rig
-      // We'll see how it goes
+    // Blend the programmer layer
+    // This layer sits on top of everything else and anything captured by it
+    // will take precedence over everything.
+    m_prog->blend(m_state);
 
-      // Sleep a bit depending on how long the update took.
-      // auto end = chrono::high_resolution_clock::now();
-      //auto elapsed = end - start;
-      //float elapsedSec = chrono::duration_cast<chrono::milliseconds>(elapsed).count() / 1000.0f;
+    // Apply grandmaster and submasters
+    applyScaling();
 
-      //if (elapsedSec < m_loopTime) {
-      //  unsigned int ms = (unsigned int)(1000 * (m_loopTime - elapsedSec));
-      //  this_thread::sleep_for(chrono::milliseconds(ms));
-      //}
-      //else {
-      //  Logger::log(WARN, "Playback Update loop running slowly");
-      //}
-    }
+    // Write state to rig.
+    m_rig->setAllDevices(m_state);
+
+    // For now I'm locking this to the update loop in rig
+    // We'll see how it goes
+
+    // Sleep a bit depending on how long the update took.
+    // auto end = chrono::high_resolution_clock::now();
+    //auto elapsed = end - start;
+    //float elapsedSec = chrono::duration_cast<chrono::milliseconds>(elapsed).count() / 1000.0f;
+
+    //if (elapsedSec < m_loopTime) {
+    //  unsigned int ms = (unsigned int)(1000 * (m_loopTime - elapsedSec));
+    //  this_thread::sleep_for(chrono::milliseconds(ms));
+    //}
+    //else {
+    //  Logger::log(WARN, "Playback Update loop running slowly");
+    //}
   }
 
   bool Playback::addLayer(shared_ptr<Layer> layer) {
@@ -163,6 +220,8 @@ namespace ShowControl {
   bool Playback::addTimeline(string id, shared_ptr<Timeline> tl) {
     if (m_timelines.count(id) == 0) {
       m_timelines[id] = tl;
+      m_timelinesChanged = true;
+      m_timelineGeneration++;
       return true;
     }
 
@@ -171,6 +230,8 @@ namespace ShowControl {
 
   void Playback::deleteTimeline(string id) {
     m_timelines.erase(id);
+    m_timelinesChanged = true;
+    m_timelineGeneration++;
   }
 
   shared_ptr<Timeline> Playback::getTimeline(string id) {
@@ -229,6 +290,7 @@ namespace ShowControl {
 
     // Easy stuff first
     pb.push_back(JSONNode("grandmaster", m_grandmaster));
+    pb.push_back(JSONNode("fixedTimestep", getFixedTimestep()));
 
     // Cue Lists.
     JSONNode clists;
@@ -277,6 +339,20 @@ namespace ShowControl {
     }
     pb.push_back(dynGroups);
 
+    // Submasters
+    JSONNode subs;
+    subs.set_name("submasters");
+
+    for (auto& kvp : m_submasters) {
+      JSONNode sub;
+      sub.set_name(kvp.first);
+      sub.push_back(JSONNode("group", kvp.second.group));
+      sub.push_back(JSONNode("dynamic", kvp.second.dynamic));
+      sub.push_back(JSONNode("level", kvp.second.level));
+      subs.push_back(sub);
+    }
+    pb.push_back(subs);
+
     pb.push_back(m_prog->toJSON());
 
     root.push_back(pb);
@@ -336,6 +412,8 @@ namespace ShowControl {
   bool Playback::loadJSON(JSONNode node) {
     m_layers.clear();
     m_timelines.clear();
+    m_timelinesChanged = true;
+    m_timelineGeneration++;
 
     auto data = node.find("playback");
     if (data == node.end()) {
@@ -367,6 +445,10 @@ namespace ShowControl {
     else {
       m_grandmaster = gm->as_float();
     }
+
+    // Older playbacks don't have a fixed timestep.
+    auto fixedTimestep = data->find("fixedTimestep");
+    setFixedTimestep((fixedTimestep == data->end()) ? 0 : fixedTimestep->as_int());
     
     auto timelines = data->find("timelines");
     if (timelines == data->end()) {
@@ -384,6 +466,9 @@ namespace ShowControl {
           else if (t == "sinewave") {
             m_timelines[it->name()] = shared_ptr<Timeline>(new SineWave(*it));
           }
+          else if (t == "effect") {
+            m_timelines[it->name()] = shared_ptr<Timeline>(new Effect(*it));
+          }
           else if (t == "cue") {
             m_timelines[it->name()] = shared_ptr<Timeline>(new Cue(*it));
           }
@@ -448,6 +533,31 @@ namespace ShowControl {
       }
     }
 
+    m_submasters.clear();
+    auto subs = data->find("submasters");
+    if (subs == data->end()) {
+      Logger::log(INFO, "No submasters found for Playback.");
+    }
+    else {
+      auto it = subs->begin();
+      while (it != subs->end()) {
+        auto group = it->find("group");
+        auto dynamic = it->find("dynamic");
+        auto level = it->find("level");
+
+        if (group == it->end()) {
+          Logger::log(WARN, "Submaster " + it->name() + " has no group. Skipping...");
+        }
+        else {
+          addSubmaster(it->name(), group->as_string(),
+            (dynamic == it->end()) ? false : dynamic->as_bool(),
+            (level == it->end()) ? 1.0f : level->as_float());
+        }
+
+        it++;
+      }
+    }
+
     auto prog = data->find("programmer");
     if (prog == data->end()) {
       Logger::log(WARN, "No programmer data found");
@@ -522,6 +632,143 @@ namespace ShowControl {
     m_grandmaster = (val > 1) ? 1 : ((val < 0) ? 0 : val);
   }
 
+  bool Playback::addSubmaster(string name, string group, bool dynamic, float level) {
+    if (m_submasters.count(name) > 0) {
+      Logger::log(ERR, "Submaster with name " + name + " already exists");
+      return false;
+    }
+
+    Submaster sub;
+    sub.group = group;
+    sub.dynamic = dynamic;
+    sub.level = (level > 1) ? 1 : ((level < 0) ? 0 : level);
+    m_submasters[name] = sub;
+    return true;
+  }
+
+  bool Playback::deleteSubmaster(string name) {
+    return m_submasters.erase(name) > 0;
+  }
+
+  bool Playback::setSubmaster(string name, float val) {
+    if (m_submasters.count(name) == 0) {
+      Logger::log(WARN, "Submaster " + name + " not found.");
+      return false;
+    }
+
+    m_submasters[name].level = (val > 1) ? 1 : ((val < 0) ? 0 : val);
+    return true;
+  }
+
+  float Playback::getSubmaster(string name) {
+    if (m_submasters.count(name) == 0) {
+      return 1;
+    }
+
+    return m_submasters[name].level;
+  }
+
+  bool Playback::submasterExists(string name) {
+    return m_submasters.count(name) > 0;
+  }
+
+  void Playback::initScaling() {
+    m_stateIndex.clear();
+    m_intensityParams.clear();
+    m_intensityDevice.clear();
+    m_colorParams.clear();
+    m_colorDevice.clear();
+
+    size_t i = 0;
+    for (const auto& d : m_state) {
+      m_stateIndex[d.first] = i;
+
+      for (const auto& p : d.second->getRawParameters()) {
+        string type = p.second->getTypeName();
+
+        if (type == "float" && p.first == "intensity") {
+          m_intensityParams.push_back((LumiverseFloat*)p.second);
+          m_intensityDevice.push_back(i);
+        }
+        else if (type == "color") {
+          m_colorParams.push_back((LumiverseColor*)p.second);
+          m_colorDevice.push_back(i);
+        }
+      }
+
+      i++;
+    }
+
+    m_deviceScale.resize(m_state.size());
+    m_scaleVals.resize(max(m_intensityParams.size(), m_colorParams.size()));
+    m_scaleFactors.resize(m_scaleVals.size());
+  }
+
+  void Playback::applyScaling() {
+    bool active = m_grandmaster < 1;
+    for (const auto& kvp : m_submasters) {
+      active = active || kvp.second.level < 1;
+    }
+
+    // Everything at full, nothing to do.
+    if (!active)
+      return;
+
+    fill(m_deviceScale.begin(), m_deviceScale.end(), m_grandmaster);
+
+    auto scaleGroup = [this](const DeviceList& devices, float level) {
+      for (Device* d : devices) {
+        auto idx = m_stateIndex.find(d->getId());
+        if (idx != m_stateIndex.end()) {
+          m_deviceScale[idx->second] *= level;
+        }
+      }
+    };
+
+    for (const auto& kvp : m_submasters) {
+      const Submaster& sub = kvp.second;
+      if (sub.level >= 1)
+        continue;
+
+      if (sub.dynamic && m_dynGroups.count(sub.group) > 0) {
+        scaleGroup(m_dynGroups[sub.group].getDeviceList(), sub.level);
+      }
+      else if (!sub.dynamic && m_groups.count(sub.group) > 0) {
+        scaleGroup(m_groups[sub.group].getDeviceList(), sub.level);
+      }
+    }
+
+    float* vals = m_scaleVals.data();
+    float* factors = m_scaleFactors.data();
+
+    // Intensities. Gather into contiguous buffers so the multiply itself
+    // can be vectorized by the compiler, then write the results back.
+    size_t n = m_intensityParams.size();
+    for (size_t i = 0; i < n; i++) {
+      vals[i] = m_intensityParams[i]->getVal();
+      factors[i] = m_deviceScale[m_intensityDevice[i]];
+    }
+    for (size_t i = 0; i < n; i++) {
+      vals[i] *= factors[i];
+    }
+    for (size_t i = 0; i < n; i++) {
+      m_intensityParams[i]->setVal(vals[i]);
+    }
+
+    // Colors are scaled through their weight, which is applied to every channel on output.
+    n = m_colorParams.size();
+    for (size_t i = 0; i < n; i++) {
+      vals[i] = (float)m_colorParams[i]->getWeight();
+      factors[i] = m_deviceScale[m_colorDevice[i]];
+    }
+    for (size_t i = 0; i < n; i++) {
+      vals[i] *= factors[i];
+    }
+    for (size_t i = 0; i < n; i++) {
+      m_colorParams[i]->setWeight(vals[i]);
+    }
+  }
+
   bool Playback::addCueList(shared_ptr<CueList> cueList) {
     if (m_cueLists.count(cueList->getName()) == 0) {
       m_cueLists[cueList->getName()] = cueList;
@@ -5,17 +5,39 @@
 
 #include <memory>
 #include <chrono>
+#include <unordered_map>
+#include <atomic>
 
 #include <LumiverseCore.h>
 #include "Timeline.h"
 #include "Layer.h"
 #include "Programmer.h"
+#include "EventScheduler.h"
 
 
 namespace Lumiverse {
 namespace ShowControl{
   class Layer;
   class CueList;
+
+  /*!
+  \brief A Submaster scales the output of a group stored in the Playback.
+
+  Submasters are bound to a group by name. If the group is a dynamic group,
+  the submaster will follow the devices currently selected by that group's query.
+  Submasters are applied along with the grandmaster after all layers and the
+  programmer have been blended.
+  */
+  struct Submaster {
+    /*! \brief Name of the group controlled by this submaster. */
+    string group;
+
+    /*! \brief If true, group refers to a dynamic group. */
+    bool dynamic;
+
+    /*! \brief Level of the submaster, between 0 and 1. */
+    float level;
+  };
   
   /*!
   \brief A playback object manages layers, timelines, and coordinates their actions and updates.
@@ -70,6 +92,26 @@ namespace ShowControl{
     */
     bool isRunning() { return m_running; }
 
+    /*!
+    \brief Locks playback to a fixed timestep.
+
+    By default each update evaluates Timelines at the time the update started. With a fixed
+    timestep, updates are evaluated at exact multiples of 1/rate seconds, counted on a monotonic
+    clock from the first update. Jitter in the update loop then doesn't show up in fades.
+    Set this to the output rate of the rig. Safe to call while the rig is running, the new rate
+    takes effect on the next update.
+    \param rate Frames per second. 0 turns fixed timestep off.
+    */
+    void setFixedTimestep(unsigned int rate);
+
+    /*! \brief Returns the fixed timestep rate, or 0 if it's off. */
+    unsigned int getFixedTimestep() { return m_requestedRate; }
+
+    /*!
+    \brief Returns the time the current (or most recent) update was evaluated at.
+    */
+    chrono::time_point<chrono::high_resolution_clock> getFrameTime() { return m_frameTime; }
+
     /*!
     * \brief Sets the playback update rate
     * \param rate Update loop rate in cycles/second
@@ -78,9 +120,20 @@ namespace ShowControl{
 
     /*!
     \brief Updates the layers contained by the Playback object and updates the Rig.
+
+    Does nothing unless the update loop is running.
     */
     void update();
 
+    /*!
+    \brief Updates the layers and the Rig as of the given time.
+
+    Runs whether or not the update loop is running, so the Playback can be stepped on a virtual
+    clock. Times should never go backwards.
+    \sa OfflineRenderer
+    */
+    void update(chrono::time_point<chrono::high_resolution_clock> frameTime);
+
     /*!
     \brief Adds a layer to the playback
 
@@ -128,9 +181,39 @@ namespace ShowControl{
 
     /*!
     \brief Returns the map of all Timelines contained in the Playback
+
+    Use addTimeline() and deleteTimeline() to change the set of Timelines, so nested
+    timeline references are resolved again on the next update.
     */
     map<string, shared_ptr<Timeline> >& getTimelines();
 
+    /*!
+    \brief Returns a counter that changes whenever a Timeline is added to or removed from the Playback.
+
+    Lets objects that hold on to Timelines, like CueList, know when to look them up again.
+    */
+    size_t getTimelineGeneration() { return m_timelineGeneration; }
+
+    /*!
+    \brief Returns the scheduler that runs Timeline Events for the Layers in this Playback.
+    */
+    EventScheduler& getScheduler() { return m_scheduler; }
+
+    /*!
+    \brief Returns the context Layers use to evaluate Timelines.
+
+    Nested Timeline values are memoized in the context for the duration of one update.
+    */
+    TimelineContext& getTimelineContext() { return m_timelineContext; }
+
+    /*!
+    \brief Gets the exact time the Event currently executing was scheduled for.
+
+    Events run during update(), so they can fire up to one update late. Event callbacks
+    can use this to compensate. Only meaningful while an Event is executing.
+    */
+    chrono::time_point<chrono::high_resolution_clock> getEventTime() { return m_scheduler.getDueTime(); }
+
     /*!
     \brief Binds the update function for this playback to the Rig's update function.
     \param pid ID to assign to the function. Defaults to 1. Must be positive.
@@ -270,6 +353,48 @@ namespace ShowControl{
     */
     float getGrandmaster() { return m_grandmaster; }
 
+    /*!
+    \brief Adds a submaster bound to a stored group.
+
+    The group does not need to exist when the submaster is created. Submasters
+    bound to a group that doesn't exist have no effect.
+    \param name Name of the submaster
+    \param group Name of the group (or dynamic group) to control
+    \param dynamic Set to true if group is a dynamic group
+    \param level Initial level of the submaster. Clamped to [0,1].
+    \return True on success, false if a submaster with the given name already exists.
+    */
+    bool addSubmaster(string name, string group, bool dynamic = false, float level = 1.0f);
+
+    /*!
+    \brief Deletes a submaster
+    \return True on success, false if a submaster with the given name does not exist.
+    */
+    bool deleteSubmaster(string name);
+
+    /*!
+    \brief Sets the level of a submaster.
+    \param val Value between 0 and 1. Values outside this range will be clamped.
+    \return True on success, false if the submaster does not exist.
+    */
+    bool setSubmaster(string name, float val);
+
+    /*!
+    \brief Gets the level of a submaster.
+    \return Level of the submaster. Returns 1 if the submaster does not exist.
+    */
+    float getSubmaster(string name);
+
+    /*!
+    \brief Checks if a submaster with the given name exists.
+    */
+    bool submasterExists(string name);
+
+    /*!
+    \brief Get the map of submasters in the Playback.
+    */
+    const map<string, Submaster>& getSubmasters() { return m_submasters; }
+
     /*!
     \brief Adds a cue list to the Playback
     If a list already exists with the same name, this function will return false.
@@ -330,14 +455,27 @@ namespace ShowControl{
     /*! \brief Map of */
     map<string, shared_ptr<Timeline> > m_timelines;
 
+    /*!
+    \brief Evaluation context for m_timelines, shared by all layers.
+
+    Invalidated when timelines are added or removed, reset every update.
+    */
+    TimelineContext m_timelineContext;
+
+    /*! \brief Set when m_timelines may have changed. The context is invalidated on the next update. */
+    bool m_timelinesChanged;
+
+    /*! \brief Incremented when Timelines are added or removed. \sa getTimelineGeneration() */
+    size_t m_timelineGeneration;
+
     /*! \brief Map of CueList ids to CueList objects*/
     map<string, shared_ptr<CueList> > m_cueLists;
 
     // Does the updating of the rig while running.
     // unique_ptr<thread> m_updateLoop;
 
-    /*! \brief True when the update loop is running */
-    bool m_running;
+    /*! \brief True when the update loop is running. Read by the Layers' preparation threads. */
+    atomic<bool> m_running;
 
     /*! \brief ID of the attached function in the rig update loop */
     int m_funcId;
@@ -345,12 +483,83 @@ namespace ShowControl{
     /*! \brief Controls the overall level of parameters in the rig. */
     float m_grandmaster;
 
+    /*! \brief Queue of upcoming Timeline Events across all layers. */
+    EventScheduler m_scheduler;
+
+    /*! \brief Stores named submasters created by the user. */
+    map<string, Submaster> m_submasters;
+
+    /*! \brief Index of each device in m_state, used by the scaling stage. */
+    unordered_map<string, size_t> m_stateIndex;
+
+    /*!
+    \brief Intensity parameters in m_state, stored contiguously for scaling.
+
+    Built once from m_state, since the devices in the state never change after construction.
+    */
+    vector<LumiverseFloat*> m_intensityParams;
+
+    /*! \brief Index into m_deviceScale for each entry in m_intensityParams. */
+    vector<size_t> m_intensityDevice;
+
+    /*! \brief Color parameters in m_state. Scaling is done through the color weight. */
+    vector<LumiverseColor*> m_colorParams;
+
+    /*! \brief Index into m_deviceScale for each entry in m_colorParams. */
+    vector<size_t> m_colorDevice;
+
+    /*! \brief Per-device scale factor, computed from the grandmaster and submasters each update. */
+    vector<float> m_deviceScale;
+
+    /*! \brief Scratch buffers for the scaling stage. */
+    vector<float> m_scaleVals;
+    vector<float> m_scaleFactors;
+
+    /*! \brief Gathers the intensity and color parameters from m_state for the scaling stage. */
+    void initScaling();
+
+    /*!
+    \brief Applies the grandmaster and submasters to the current state.
+
+    Does nothing if the grandmaster and all submasters are at full.
+    */
+    void applyScaling();
+
     // Refresh rate used by the update loop.
     // unsigned int m_refreshRate;
 
     // Loop time in seconds
     // float m_loopTime;
 
+    /*!
+    \brief Returns the time to evaluate the next update at.
+
+    The current time, or the most recent frame boundary if using a fixed timestep.
+    */
+    chrono::time_point<chrono::high_resolution_clock> nextFrameTime();
+
+    /*! \brief Rate passed to setFixedTimestep(). Picked up by nextFrameTime() when m_rateChanged is set. */
+    atomic<unsigned int> m_requestedRate;
+    atomic<bool> m_rateChanged;
+
+    /*! \brief Fixed timestep rate in frames per second. 0 if off. Only used by the update thread. */
+    unsigned int m_fixedRate;
+
+    /*! \brief Number of the most recent fixed timestep frame. -1 before the first frame. */
+    long long m_frame;
+
+    /*!
+    \brief Start of the fixed timestep frame clock.
+
+    Frame numbers come from the monotonic clock. Frame times are reported relative to the
+    high resolution clock time at the same moment, since that's what Layers use.
+    */
+    chrono::time_point<chrono::steady_clock> m_clockStart;
+    chrono::time_point<chrono::high_resolution_clock> m_frameEpoch;
+
+    /*! \brief Time of the most recent update. */
+    chrono::time_point<chrono::high_resolution_clock> m_frameTime;
+
     /*! \brief Pointer to the rig that this playback runs on */
     Rig* m_rig;
 
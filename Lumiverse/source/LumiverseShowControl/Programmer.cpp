@@ -4,17 +4,18 @@
 namespace Lumiverse {
 namespace ShowControl {
 
-Programmer::Programmer(Rig* rig) : m_rig(rig) {
+Programmer::Programmer(Rig* rig) : m_rig(rig), m_editDepth(0), m_version(new CaptureVersion()), m_readers(0) {
   const set<Device*>& devices = m_rig->getDeviceRaw();
 
   for (Device* d : devices) {
     m_devices[d->getId()] = new Device(d);
+    watch(m_devices[d->getId()]);
   }
 
   captured = DeviceSet(m_rig);
 }
 
-Programmer::Programmer(Rig* rig, JSONNode data) : m_rig(rig) {
+Programmer::Programmer(Rig* rig, JSONNode data) : m_rig(rig), m_editDepth(0), m_version(new CaptureVersion()), m_readers(0) {
   loadJSON(data);
 }
 
@@ -23,13 +24,35 @@ Programmer::~Programmer()
   for (auto& kvp : m_devices) {
     delete kvp.second;
   }
+
+  delete m_version.load();
+  for (auto v : m_retired) {
+    delete v;
+  }
+}
+
+Programmer::CapturedDevice::~CapturedDevice() {
+  for (auto& p : params) {
+    delete p.second;
+  }
+}
+
+Programmer::Edit::Edit(Programmer* prog) : m_prog(prog), m_lock(prog->m_editMutex) {
+  m_prog->m_editDepth++;
+}
+
+Programmer::Edit::~Edit() {
+  if (--m_prog->m_editDepth == 0)
+    m_prog->publish();
 }
 
 void Programmer::setParam(DeviceSet selection, string param, LumiverseType* val) {
-  // add selection to captured
+  Edit edit(this);
+
+  // add selection to captured. This also marks the devices as changed.
   addCaptured(selection);
 
-  for (Device* d : selection.getDevices()) {
+  for (Device* d : selection.getDeviceList()) {
     if (m_devices.count(d->getId()) > 0 && m_devices[d->getId()]->paramExists(param)) {
       // copy data from val into the Programmer's device
       LumiverseTypeUtils::copyByVal(val, m_devices[d->getId()]->getParam(param));
@@ -42,10 +65,12 @@ void Programmer::setParam(string selection, string param, LumiverseType* val) {
 }
 
 void Programmer::setParam(DeviceSet selection, string param, float val) {
+  Edit edit(this);
+
   // add selection to captured
-  addCaptured(selection);;
+  addCaptured(selection);
 
-  for (Device* d : selection.getDevices()) {
+  for (Device* d : selection.getDeviceList()) {
     if (m_devices.count(d->getId()) > 0) {
       m_devices[d->getId()]->setParam(param, val);
     }
@@ -53,10 +78,12 @@ void Programmer::setParam(DeviceSet selection, string param, float val) {
 }
 
 void Programmer::setParam(DeviceSet selection, string param, string val, float val2) {
+  Edit edit(this);
+
   // add selection to captured
   addCaptured(selection);
 
-  for (Device* d : selection.getDevices()) {
+  for (Device* d : selection.getDeviceList()) {
     if (m_devices.count(d->getId()) > 0) {
       m_devices[d->getId()]->setParam(param, val, val2);
     }
@@ -64,10 +91,12 @@ void Programmer::setParam(DeviceSet selection, string param, string val, float v
 }
 
 void Programmer::setParam(DeviceSet selection, string param, string channel, double val) {
+  Edit edit(this);
+
   // add selection to captured
   addCaptured(selection);
 
-  for (Device* d : selection.getDevices()) {
+  for (Device* d : selection.getDeviceList()) {
     if (m_devices.count(d->getId()) > 0) {
       m_devices[d->getId()]->setParam(param, channel, val);
     }
@@ -75,10 +104,12 @@ void Programmer::setParam(DeviceSet selection, string param, string channel, dou
 }
 
 void Programmer::setParam(DeviceSet selection, string param, double x, double y, double weight) {
+  Edit edit(this);
+
   // add selection to captured
   addCaptured(selection);
 
-  for (Device* d : selection.getDevices()) {
+  for (Device* d : selection.getDeviceList()) {
     if (m_devices.count(d->getId()) > 0) {
       m_devices[d->getId()]->setParam(param, x, y, weight);
     }
@@ -88,10 +119,12 @@ void Programmer::setParam(DeviceSet selection, string param, double x, double y,
 void Programmer::setParam(DeviceSet selection, string param, string val, float val2,
   LumiverseEnum::Mode mode, LumiverseEnum::InterpolationMode interpMode)
 {
+  Edit edit(this);
+
   // add selection to captured
   addCaptured(selection);
 
-  for (Device* d : selection.getDevices()) {
+  for (Device* d : selection.getDeviceList()) {
     if (m_devices.count(d->getId()) > 0) {
       m_devices[d->getId()]->setParam(param, val, val2, mode, interpMode);
     }
@@ -99,10 +132,12 @@ void Programmer::setParam(DeviceSet selection, string param, string val, float v
 }
 
 void Programmer::setColorRGB(DeviceSet selection, string param, double r, double g, double b, double weight, RGBColorSpace cs) {
+  Edit edit(this);
+
   // add selection to captured
   addCaptured(selection);
 
-  for (Device* d : selection.getDevices()) {
+  for (Device* d : selection.getDeviceList()) {
     if (m_devices.count(d->getId()) > 0) {
       m_devices[d->getId()]->setColorRGB(param, r, g, b, weight, cs);
     }
@@ -110,10 +145,12 @@ void Programmer::setColorRGB(DeviceSet selection, string param, double r, double
 }
 
 void Programmer::setColorRGBRaw(DeviceSet selection, string param, double r, double g, double b, double weight) {
+  Edit edit(this);
+
   // add selection to captured
   addCaptured(selection);
 
-  for (Device* d : selection.getDevices()) {
+  for (Device* d : selection.getDeviceList()) {
     if (m_devices.count(d->getId()) > 0) {
       m_devices[d->getId()]->setColorRGBRaw(param, r, g, b, weight);
     }
@@ -155,6 +192,7 @@ Device* Programmer::operator[](string id) {
 }
 
 Device* Programmer::getDevice(string id) {
+  Edit edit(this);
   addCaptured(id);
   return m_devices.count(id) > 0 ? m_devices[id] : nullptr;
 }
@@ -164,22 +202,26 @@ const Device* Programmer::readDevice(string id) {
 }
 
 void Programmer::captureDevices(DeviceSet d) {
+  Edit edit(this);
   addCaptured(d);
 }
 
 void Programmer::clearCaptured() {
-  m_progMutex.lock();
+  Edit edit(this);
   captured = DeviceSet(m_rig);
-  m_progMutex.unlock();
 }
 
 void Programmer::reset() {
+  // Device callbacks mark every device as changed.
+  Edit edit(this);
+
   for (const auto& kvp : m_devices) {
     kvp.second->reset();
   }
 }
 
 void Programmer::clearAndReset() {
+  Edit edit(this);
   clearCaptured();
   reset();
 }
@@ -187,30 +229,46 @@ void Programmer::clearAndReset() {
 map<string, Device*> Programmer::getCapturedDevices() {
   map<string, Device*> devices;
 
-  m_progMutex.lock();
-  for (Device* d : captured.getDevices()) {
+  lock_guard<recursive_mutex> lock(m_editMutex);
+  for (Device* d : captured.getDeviceList()) {
     devices[d->getId()] = d;
   }
-  m_progMutex.unlock();
 
   return devices;
 }
 
 bool Programmer::isCaptured(string id) {
+  lock_guard<recursive_mutex> lock(m_editMutex);
   return captured.contains(id);
 }
 
-void Programmer::blend(map<string, Device*> state) {
-  m_progMutex.lock();
+void Programmer::blend(const map<string, Device*>& state) {
+  // Register as a reader before looking at the version so it can't be deleted underneath us.
+  m_readers++;
+  const CaptureVersion* version = m_version.load();
 
   // Take each captured device, and write the parameters in.
-  for (Device* d : captured.getDevices()) {
-    for (auto& p : d->getRawParameters()) {
-      LumiverseTypeUtils::copyByVal(m_devices[d->getId()]->getParam(p.first), state[d->getId()]->getParam(p.first));
+  for (const auto& d : version->devices) {
+    auto target = state.find(d->id);
+    if (target == state.end())
+      continue;
+
+    for (const auto& p : d->params) {
+      LumiverseType* param = target->second->getParam(p.first);
+      if (param != nullptr)
+        LumiverseTypeUtils::copyByVal(p.second, param);
     }
   }
 
-  m_progMutex.unlock();
+  m_readers--;
+}
+
+void Programmer::commit() {
+  Edit edit(this);
+
+  for (const auto& kvp : m_devices) {
+    m_changed.insert(kvp.first);
+  }
 }
 
 //Cue Programmer::getCue(float upfade, float downfade, float delay) {
@@ -225,7 +283,7 @@ void Programmer::writeToTimeline(shared_ptr<Timeline> tl, size_t time, bool ucs)
 }
 
 void Programmer::writeToTimeline(DeviceSet d, shared_ptr<Timeline> tl, size_t time, bool ucs) {
-  auto devices = d.getDevices();
+  auto devices = d.getDeviceList();
   for (const auto& d : devices) {
     tl->setKeyframe(m_devices[d->getId()], time, ucs);
   }
@@ -233,7 +291,9 @@ void Programmer::writeToTimeline(DeviceSet d, shared_ptr<Timeline> tl, size_t ti
 
 
 void Programmer::captureFromRig(DeviceSet devices) {
-  for (Device* d : devices.getDevices()) {
+  Edit edit(this);
+
+  for (Device* d : devices.getDeviceList()) {
     for (auto& p : d->getRawParameters()) {
       LumiverseTypeUtils::copyByVal(m_rig->getDevice(d->getId())->getParam(p.first), m_devices[d->getId()]->getParam(p.first));
     }
@@ -243,6 +303,7 @@ void Programmer::captureFromRig(DeviceSet devices) {
 }
 
 void Programmer::captureFromRig(string id) {
+  Edit edit(this);
   Device* d = m_rig->getDevice(id);
 
   if (d == nullptr)
@@ -274,6 +335,8 @@ JSONNode Programmer::toJSON() {
 }
 
 bool Programmer::loadJSON(JSONNode data) {
+  Edit edit(this);
+
   auto devices = data.find("devices");
   if (devices == data.end()) {
     Logger::log(ERR, "No devices found in Programmer");
@@ -290,6 +353,8 @@ bool Programmer::loadJSON(JSONNode data) {
       delete m_devices[device->getId()];
 
     m_devices[device->getId()] = device;
+    watch(device);
+    markChanged(device->getId());
     it++;
   }
 
@@ -311,19 +376,74 @@ Cue* Programmer::getCue(float up, float down, float delay)
 }
 
 void Programmer::addCaptured(DeviceSet set) {
-  m_progMutex.lock();
+  Edit edit(this);
 
   captured = captured.add(set);
 
-  m_progMutex.unlock();
+  // Newly captured devices need copying. Callers are about to change the rest anyway.
+  for (Device* d : set.getDeviceList()) {
+    m_changed.insert(d->getId());
+  }
 }
 
 void Programmer::addCaptured(string id) {
-  m_progMutex.lock();
+  Edit edit(this);
 
   captured = captured.add(id);
+  m_changed.insert(id);
+}
+
+void Programmer::watch(Device* d) {
+  d->addParameterChangedCallback([this](Device* changed) { this->markChanged(changed->getId()); });
+}
+
+void Programmer::markChanged(const string& id) {
+  // Device callbacks come from whichever thread set the parameter, so this is an edit too.
+  Edit edit(this);
+  m_changed.insert(id);
+}
 
-  m_progMutex.unlock();
+void Programmer::publish() {
+  map<string, shared_ptr<const CapturedDevice> > values;
+  CaptureVersion* version = new CaptureVersion();
+
+  for (Device* d : captured.getDeviceList()) {
+    const string& id = d->getId();
+
+    auto existing = m_capturedValues.find(id);
+    if (existing != m_capturedValues.end() && m_changed.count(id) == 0) {
+      // Unchanged, share the copy with the previous version.
+      values[id] = existing->second;
+    }
+    else {
+      auto device = m_devices.find(id);
+      if (device == m_devices.end())
+        continue;
+
+      CapturedDevice* copy = new CapturedDevice();
+      copy->id = id;
+      for (auto& p : device->second->getRawParameters()) {
+        copy->params.push_back(make_pair(p.first, LumiverseTypeUtils::copy(p.second)));
+      }
+      values[id] = shared_ptr<const CapturedDevice>(copy);
+    }
+
+    version->devices.push_back(values[id]);
+  }
+
+  m_capturedValues.swap(values);
+  m_changed.clear();
+
+  m_retired.push_back(m_version.exchange(version));
+
+  // Anyone who starts a blend() from now on gets the new version. If nobody is in the middle
+  // of one, nobody can be holding an old version.
+  if (m_readers == 0) {
+    for (auto v : m_retired) {
+      delete v;
+    }
+    m_retired.clear();
+  }
 }
 
 }
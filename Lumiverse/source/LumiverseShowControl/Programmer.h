@@ -3,6 +3,9 @@
 
 #pragma once
 
+#include <atomic>
+#include <mutex>
+
 #include "Rig.h"
 #include "Timeline.h"
 #include "Cue.h"
@@ -20,6 +23,14 @@ Programmer objects do not contain Patches and cannot start an update loop.
 Note that this class never returns a DeviceSet, as those are attached to the Rig that
 generated it. Modifying the devices in a DeviceSet will modify the Rig, not a Programmer
 that might return them.
+
+Edits and blend() don't share a lock. Edits are serialized with each other, and at the end
+of each edit the values of the captured devices are published as a new immutable version.
+blend() reads whichever version is current without waiting, so operator edits never hold
+up an update. Only devices that changed are copied into a new version, the rest are shared
+with the previous one. Changes made with Device::setParam() on a device returned by
+getDevice() are published automatically. Changes made by writing to a parameter pointer
+directly are published by the next edit or by commit().
 */
 class Programmer
 {
@@ -151,8 +162,18 @@ public:
 
   Blend in this case means overwrite. Given a map of Devices by ID, this function will
   write the current state of the captured devices into the state map.
+
+  Reads the most recently published version and never blocks on edits.
+  */
+  void blend(const map<string, Device*>& state);
+
+  /*!
+  \brief Publishes changes made directly to device parameters.
+
+  Only needed after writing to a parameter pointer from getDevice(). Every other edit
+  publishes its own changes.
   */
-  void blend(map<string, Device*> state);
+  void commit();
 
   /*!
   \brief Gets the set of the Devices the Programmer has.
@@ -228,8 +249,67 @@ private:
   */
   Rig* m_rig;
 
-  /*! \brief Mutex for interacting with the programmer. */
-  mutex m_progMutex;
+  /*! \brief Copy of one captured device's parameter values. Never modified once published. */
+  struct CapturedDevice {
+    ~CapturedDevice();
+
+    string id;
+    vector<pair<string, LumiverseType*> > params;
+  };
+
+  /*! \brief Published state of the captured devices. Never modified once published. */
+  struct CaptureVersion {
+    vector<shared_ptr<const CapturedDevice> > devices;
+  };
+
+  /*!
+  \brief Holds the edit lock and publishes when the outermost edit finishes.
+
+  Edits call other edits (and trigger device callbacks), so this nests.
+  */
+  class Edit {
+  public:
+    Edit(Programmer* prog);
+    ~Edit();
+
+  private:
+    Programmer* m_prog;
+    lock_guard<recursive_mutex> m_lock;
+  };
+
+  /*! \brief Serializes edits. Never taken by blend(). */
+  recursive_mutex m_editMutex;
+
+  /*! \brief Number of nested Edits currently open. */
+  int m_editDepth;
+
+  /*! \brief Devices changed since the last publish. */
+  set<string> m_changed;
+
+  /*! \brief Latest copy of each captured device, shared with the published version. */
+  map<string, shared_ptr<const CapturedDevice> > m_capturedValues;
+
+  /*! \brief Version blend() reads. */
+  atomic<const CaptureVersion*> m_version;
+
+  /*! \brief Number of blend() calls in progress. */
+  atomic<int> m_readers;
+
+  /*! \brief Replaced versions that a blend() might still be reading. */
+  vector<const CaptureVersion*> m_retired;
+
+  /*! \brief Registers the callback that marks the device changed when its parameters are set. */
+  void watch(Device* d);
+
+  /*! \brief Marks a device as changed so it's copied on the next publish. */
+  void markChanged(const string& id);
+
+  /*!
+  \brief Builds a new version from the captured devices and makes it current.
+
+  Retired versions are deleted once no blend() is running.
+  */
+  void publish();
 
   /*! \brief Safely adds a set to the set of captured devices. */
   void addCaptured(DeviceSet set);
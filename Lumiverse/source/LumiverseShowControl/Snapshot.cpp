@@ -2,43 +2,299 @@
 
 namespace Lumiverse {
 namespace ShowControl {
-  
-  Snapshot::Snapshot()
+
+  SnapshotSchema::SnapshotSchema(Rig* rig) : m_rigInstance(rig->getInstanceId()), m_size(0)
+  {
+    m_deviceGeneration = rig->getDeviceGeneration();
+
+    for (Device* d : rig->getDeviceRaw()) {
+      DeviceEntry entry;
+      entry.id = d->getId();
+      entry.live = d;
+      entry.structureVersion = d->getParamStructureVersion();
+      entry.prototype = new Device(d);
+      m_devices.push_back(entry);
+
+      for (const auto& p : d->getRawParameters()) {
+        if (p.second == nullptr)
+          continue;
+
+        Slot slot;
+        slot.device = m_devices.size() - 1;
+        slot.param = p.first;
+        slot.offset = m_size;
+        slot.live = p.second;
+        slot.mode = ADDITIVE;
+
+        string type = p.second->getTypeName();
+        if (type == "float") {
+          slot.type = FLOAT_SLOT;
+          m_size += 1;
+        }
+        else if (type == "orientation") {
+          slot.type = ORIENTATION_SLOT;
+          m_size += 1;
+        }
+        else if (type == "enum") {
+          slot.type = ENUM_SLOT;
+          m_size += 4;
+        }
+        else if (type == "color") {
+          LumiverseColor* c = (LumiverseColor*)p.second;
+          slot.type = COLOR_SLOT;
+          slot.mode = c->getMode();
+          for (const auto& ch : c->getColorParams())
+            slot.channels.push_back(ch.first);
+          m_size += slot.channels.size() + 1;
+        }
+        else {
+          Logger::log(WARN, "Snapshots can't store parameter " + p.first + " of type " + type);
+          continue;
+        }
+
+        m_slots.push_back(slot);
+      }
+    }
+  }
+
+  SnapshotSchema::~SnapshotSchema() {
+    for (auto& d : m_devices) {
+      delete d.prototype;
+    }
+  }
+
+  bool SnapshotSchema::isCurrent(Rig* rig) {
+    if (rig->getInstanceId() != m_rigInstance || rig->getDeviceGeneration() != m_deviceGeneration)
+      return false;
+
+    for (const auto& d : m_devices) {
+      if (d.live->getParamStructureVersion() != d.structureVersion)
+        return false;
+    }
+
+    return true;
+  }
+
+  void SnapshotSchema::capture(double* values) {
+    for (const auto& slot : m_slots) {
+      read(slot, slot.live, values);
+    }
+  }
+
+  void SnapshotSchema::restore(const double* values) {
+    for (const auto& slot : m_slots) {
+      write(slot, slot.live, values);
+    }
+
+    for (const auto& d : m_devices) {
+      d.live->markChanged();
+    }
+  }
+
+  map<string, Device*> SnapshotSchema::createDevices(const double* values) {
+    map<string, Device*> devices;
+
+    for (const auto& d : m_devices) {
+      devices[d.id] = new Device(d.prototype);
+    }
+
+    for (const auto& slot : m_slots) {
+      LumiverseType* param = devices[m_devices[slot.device].id]->getParam(slot.param);
+      if (param != nullptr)
+        write(slot, param, values);
+    }
+
+    return devices;
+  }
+
+  size_t SnapshotSchema::getMemoryUsage() {
+    size_t bytes = sizeof(SnapshotSchema);
+    bytes += m_devices.capacity() * sizeof(DeviceEntry);
+    bytes += m_slots.capacity() * sizeof(Slot);
+
+    for (const auto& slot : m_slots) {
+      bytes += slot.param.capacity() + slot.channels.capacity() * sizeof(string);
+    }
+
+    // Rough size of each prototype device.
+    for (const auto& d : m_devices) {
+      bytes += sizeof(Device) + d.prototype->getRawParameters().size() * (sizeof(LumiverseColor) + 32);
+    }
+
+    return bytes;
+  }
+
+  void SnapshotSchema::read(const Slot& slot, LumiverseType* param, double* values) {
+    double* v = values + slot.offset;
+
+    switch (slot.type) {
+    case FLOAT_SLOT:
+      v[0] = ((LumiverseFloat*)param)->getVal();
+      break;
+    case ORIENTATION_SLOT:
+      v[0] = ((LumiverseOrientation*)param)->getVal();
+      break;
+    case ENUM_SLOT:
+    {
+      LumiverseEnum* e = (LumiverseEnum*)param;
+      v[0] = e->getValIndex();
+      v[1] = e->getTweak();
+      v[2] = e->getMode();
+      v[3] = e->getInterpMode();
+      break;
+    }
+    case COLOR_SLOT:
+    {
+      LumiverseColor* c = (LumiverseColor*)param;
+      for (size_t i = 0; i < slot.channels.size(); i++) {
+        v[i] = c->getRawColorChannel(slot.channels[i]);
+      }
+      v[slot.channels.size()] = c->getWeight();
+      break;
+    }
+    }
+  }
+
+  void SnapshotSchema::write(const Slot& slot, LumiverseType* param, const double* values) {
+    const double* v = values + slot.offset;
+
+    switch (slot.type) {
+    case FLOAT_SLOT:
+      ((LumiverseFloat*)param)->setVal((float)v[0]);
+      break;
+    case ORIENTATION_SLOT:
+    {
+      LumiverseOrientation* o = (LumiverseOrientation*)param;
+      o->setVal((float)v[0], o->getUnit());
+      break;
+    }
+    case ENUM_SLOT:
+    {
+      LumiverseEnum* e = (LumiverseEnum*)param;
+      const auto& names = e->getStartToVals();
+      auto name = names.find((int)v[0]);
+      if (name != names.end()) {
+        e->setVal(name->second, (float)v[1], (LumiverseEnum::Mode)(int)v[2],
+          (LumiverseEnum::InterpolationMode)(int)v[3]);
+      }
+      break;
+    }
+    case COLOR_SLOT:
+    {
+      LumiverseColor* c = (LumiverseColor*)param;
+
+      // Mode changes reset the channels, so only change it if it's different.
+      if (c->getMode() != slot.mode)
+        c->changeMode(slot.mode);
+
+      for (size_t i = 0; i < slot.channels.size(); i++) {
+        (*c)[slot.channels[i]] = v[i];
+      }
+      c->setWeight(v[slot.channels.size()]);
+      break;
+    }
+    }
+  }
+
+  Snapshot::Snapshot() : m_rigDataValid(false), m_saveTime(0), m_loadTime(0)
   {
     // do nothing, no data to fill
   }
 
-  Snapshot::Snapshot(Rig* rig) {
+  Snapshot::Snapshot(Rig* rig) : m_rigDataValid(false), m_saveTime(0), m_loadTime(0) {
     saveSnapshot(rig);
   }
 
-  Snapshot::Snapshot(Snapshot & other)
+  Snapshot::Snapshot(Rig* rig, shared_ptr<Snapshot> base) : m_rigDataValid(false),
+    m_saveTime(0), m_loadTime(0)
   {
-    for (const auto& kvp : other.m_rigData) {
-      m_rigData[kvp.first] = new Device(kvp.second);
-    }
+    saveSnapshot(rig, base);
+  }
 
+  Snapshot::Snapshot(Snapshot & other) : m_schema(other.m_schema), m_values(other.m_values),
+    m_runs(other.m_runs), m_base(other.m_base), m_rigDataValid(false),
+    m_saveTime(other.m_saveTime), m_loadTime(other.m_loadTime)
+  {
     _metadata = map<string, string>(other._metadata);
   }
 
   Snapshot::~Snapshot() {
-    for (const auto& kvp : m_rigData) {
-      // Delete all device data since we copied all of it
-      delete kvp.second;
-    }
+    clearRigData();
   }
 
   void Snapshot::saveSnapshot(Rig* rig) {
-    // clear old devices
-    for (auto d : m_rigData) {
-      delete d.second;
+    saveSnapshot(rig, nullptr);
+  }
+
+  void Snapshot::saveSnapshot(Rig* rig, shared_ptr<Snapshot> base) {
+    auto start = chrono::high_resolution_clock::now();
+
+    clearRigData();
+    m_runs.clear();
+    m_base = nullptr;
+
+    // Deltas need the base laid out the same way as the rig.
+    if (base != nullptr && (base->m_schema == nullptr || !base->m_schema->isCurrent(rig)))
+      base = nullptr;
+
+    if (base != nullptr)
+      m_schema = base->m_schema;
+    else if (m_schema == nullptr || !m_schema->isCurrent(rig))
+      m_schema = make_shared<SnapshotSchema>(rig);
+
+    if (base == nullptr) {
+      m_values.resize(m_schema->size());
+      m_schema->capture(m_values.data());
     }
-    m_rigData.clear();
+    else {
+      vector<double> current(m_schema->size());
+      vector<double> prev;
+      m_schema->capture(current.data());
+      base->getValues(prev);
+
+      m_values.clear();
+      size_t i = 0;
+      while (i < current.size()) {
+        if (current[i] == prev[i]) {
+          i++;
+          continue;
+        }
+
+        // Extend the run over gaps of a single value, which cost less than a new run.
+        size_t end = i + 1;
+        while (end < current.size() && (current[end] != prev[end] ||
+          (end + 1 < current.size() && current[end + 1] != prev[end + 1]))) {
+          end++;
+        }
 
-    DeviceSet allDevices = rig->getAllDevices();
-    const set<Device*>& devices = allDevices.getDevices();
-    for (auto d : devices) {
-      m_rigData[d->getId()] = new Device(d);
+        m_runs.push_back(make_pair((uint32_t)i, (uint32_t)(end - i)));
+        m_values.insert(m_values.end(), current.begin() + i, current.begin() + end);
+        i = end;
+      }
+
+      m_base = base;
+    }
+
+    m_saveTime = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+  }
+
+  void Snapshot::getValues(vector<double>& values) {
+    if (m_schema == nullptr) {
+      values.clear();
+      return;
+    }
+
+    if (m_base == nullptr) {
+      values = m_values;
+      return;
+    }
+
+    m_base->getValues(values);
+
+    const double* src = m_values.data();
+    for (const auto& run : m_runs) {
+      memcpy(values.data() + run.first, src, run.second * sizeof(double));
+      src += run.second;
     }
   }
 
@@ -47,20 +303,67 @@ namespace ShowControl {
   }
 
   void Snapshot::loadRig(Rig* targetRig) {
-    targetRig->setAllDevices(m_rigData);
+    if (m_schema == nullptr)
+      return;
+
+    auto start = chrono::high_resolution_clock::now();
+
+    if (m_schema->isCurrent(targetRig)) {
+      if (m_base == nullptr) {
+        m_schema->restore(m_values.data());
+      }
+      else {
+        vector<double> values;
+        getValues(values);
+        m_schema->restore(values.data());
+      }
+
+      targetRig->markParametersChanged();
+    }
+    else {
+      // Different rig or layout, match devices by id.
+      targetRig->setAllDevices(getRigData());
+    }
+
+    m_loadTime = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+  }
+
+  map<string, Device*>& Snapshot::getRigData() {
+    if (!m_rigDataValid && m_schema != nullptr) {
+      vector<double> values;
+      getValues(values);
+      m_rigData = m_schema->createDevices(values.data());
+      m_rigDataValid = true;
+    }
+
+    return m_rigData;
   }
 
   set<Device*> Snapshot::getDevices()
   {
     set<Device*> devices;
 
-    for (const auto& kvp : m_rigData) {
+    for (const auto& kvp : getRigData()) {
       devices.insert(kvp.second);
     }
 
     return devices;
   }
 
+  size_t Snapshot::getMemoryUsage() {
+    return sizeof(Snapshot) + m_values.capacity() * sizeof(double) +
+      m_runs.capacity() * sizeof(pair<uint32_t, uint32_t>);
+  }
+
+  void Snapshot::clearRigData() {
+    for (const auto& kvp : m_rigData) {
+      // Delete all device data since we created all of it
+      delete kvp.second;
+    }
+    m_rigData.clear();
+    m_rigDataValid = false;
+  }
+
   PlaybackSnapshot::PlaybackSnapshot(Rig * rig, Playback * pb) :
     Snapshot(rig)
   {
@@ -68,21 +371,13 @@ namespace ShowControl {
       m_playbackData = pb->toJSON();
   }
 
-  PlaybackSnapshot::PlaybackSnapshot(PlaybackSnapshot & other)
+  PlaybackSnapshot::PlaybackSnapshot(PlaybackSnapshot & other) : Snapshot(other),
+    m_playbackData(other.m_playbackData)
   {
-    for (const auto& kvp : other.m_rigData) {
-      m_rigData[kvp.first] = new Device(kvp.second);
-    }
-
-    m_playbackData = other.m_playbackData;
   }
 
   PlaybackSnapshot::~PlaybackSnapshot()
   {
-    for (const auto& kvp : m_rigData) {
-      // Delete all device data since we copied all of it
-      delete kvp.second;
-    }
   }
 
   void PlaybackSnapshot::saveSnapshot(Rig * rig, Playback * pb)
@@ -115,4 +410,4 @@ namespace ShowControl {
       targetPb->start();
   }
 }
-}
\ No newline at end of file
+}
@@ -4,11 +4,117 @@
 
 #define pragma once
 
+#include <memory>
+#include <cstdint>
+#include <cstring>
+
 #include "LumiverseCore.h"
 #include "Playback.h"
 
 namespace Lumiverse {
 namespace ShowControl {
+  /*!
+  \brief Describes where each parameter of a Rig lives in a flat buffer of doubles.
+
+  A schema is built once per Rig layout and shared by every Snapshot taken of that layout.
+  Snapshots then only store the buffer. Floats and orientations take one value, enums take
+  four (start value, tweak, mode, interpolation mode) and colors take one value per channel
+  plus the weight.
+
+  The schema keeps pointers to the Rig's parameters, so saving and restoring is a single pass
+  over the buffer with no lookups. The schema also keeps a copy of each device (the prototype)
+  so snapshots can be turned back into Devices or loaded into other Rigs by name.
+  */
+  class SnapshotSchema
+  {
+  public:
+    /*!
+    \brief Builds the schema for the current layout of a Rig.
+    */
+    SnapshotSchema(Rig* rig);
+
+    /*! \brief Deletes the prototype devices. */
+    ~SnapshotSchema();
+
+    /*!
+    \brief Returns true if the schema still matches the layout of the given Rig.
+
+    The layout changes when devices are added or removed, or when parameters are added or
+    removed from a device. A different Rig never matches, even one at the same address.
+    */
+    bool isCurrent(Rig* rig);
+
+    /*! \brief Number of doubles in a buffer for this schema. */
+    size_t size() { return m_size; }
+
+    /*!
+    \brief Copies the current parameter values of the Rig into a buffer.
+    \param values Buffer of size() doubles.
+    */
+    void capture(double* values);
+
+    /*!
+    \brief Writes a buffer back to the parameters of the Rig.
+
+    Only valid while isCurrent() is true for the Rig. Marks each device changed, but doesn't
+    update the Rig's parameter generation.
+    \param values Buffer of size() doubles.
+    */
+    void restore(const double* values);
+
+    /*!
+    \brief Creates copies of the prototype devices set to the values in a buffer.
+
+    The caller owns the returned devices.
+    */
+    map<string, Device*> createDevices(const double* values);
+
+    /*! \brief Approximate number of bytes used by the schema and its prototypes. */
+    size_t getMemoryUsage();
+
+  private:
+    enum SlotType {
+      FLOAT_SLOT,
+      ORIENTATION_SLOT,
+      ENUM_SLOT,
+      COLOR_SLOT
+    };
+
+    /*! \brief A single parameter in the buffer. */
+    struct Slot {
+      SlotType type;
+      /*! \brief Index into m_devices. */
+      size_t device;
+      string param;
+      /*! \brief Index of the parameter's first value in the buffer. */
+      size_t offset;
+      /*! \brief Parameter in the source Rig. */
+      LumiverseType* live;
+      /*! \brief Color channels in buffer order. */
+      vector<string> channels;
+      ColorMode mode;
+    };
+
+    struct DeviceEntry {
+      string id;
+      Device* live;
+      size_t structureVersion;
+      Device* prototype;
+    };
+
+    /*! \brief Copies a parameter into the buffer. */
+    static void read(const Slot& slot, LumiverseType* param, double* values);
+
+    /*! \brief Copies buffer values into a parameter. */
+    static void write(const Slot& slot, LumiverseType* param, const double* values);
+
+    size_t m_rigInstance;
+    size_t m_deviceGeneration;
+    vector<DeviceEntry> m_devices;
+    vector<Slot> m_slots;
+    size_t m_size;
+  };
+
   /*!
   \brief A Snapshot stores the state of the Rig at a particular time.
 
@@ -17,12 +123,25 @@ namespace ShowControl {
 
   Snapshots do not store state information about the rig's update loop, patches, or attached
   functions. Snapshots operate purely on the state of the devices at a particular time.
+
+  Values are stored in a flat buffer laid out by a SnapshotSchema. Snapshots of a Rig whose
+  layout hasn't changed share the same schema, so saving and loading is a copy of the buffer.
+  A snapshot can also be saved as a delta of another snapshot, in which case only the values
+  that differ from the base are stored.
   */
   class Snapshot
   {
   public:
     Snapshot();
     Snapshot(Rig* rig);
+
+    /*!
+    \brief Saves a snapshot that only stores the differences from base.
+    \sa saveSnapshot(Rig*, shared_ptr<Snapshot>)
+    */
+    Snapshot(Rig* rig, shared_ptr<Snapshot> base);
+
+    /*! \brief Copies the snapshot. The schema and base are shared. */
     Snapshot(Snapshot& other);
     ~Snapshot();
 
@@ -33,6 +152,16 @@ namespace ShowControl {
     */
     void saveSnapshot(Rig* rig);
 
+    /*!
+    \brief Saves a snapshot that only stores values that differ from another snapshot.
+
+    The base is kept alive by this snapshot. If the base was taken with a different Rig layout,
+    a full snapshot is saved instead.
+    \param rig Source rig
+    \param base Snapshot to store differences from.
+    */
+    void saveSnapshot(Rig* rig, shared_ptr<Snapshot> base);
+
     /*!
     \brief Loads the stored snapshot values into the given Rig and Playback objects.
 
@@ -47,30 +176,82 @@ namespace ShowControl {
     /*!
     \brief Loads the stored rig state into the given Rig.
 
+    If the Rig has the same layout the snapshot was taken with, the values are copied
+    straight into its parameters. Otherwise devices are matched by id.
     \param targetRig Rig to load the snapshot into.
     */
     void loadRig(Rig* targetRig);
 
     /*!
     \brief Retrieves device data from the snapshot.
+
+    The devices are created from the stored values the first time this is called.
     */
-    map<string, Device*>& getRigData() { return m_rigData; }
+    map<string, Device*>& getRigData();
 
     /*!
     \brief Returns an unindexed set of the devices from the snapshot.
     */
     set<Device*> getDevices();
 
+    /*! \brief Returns the layout of the stored values. nullptr if nothing has been saved. */
+    shared_ptr<SnapshotSchema> getSchema() { return m_schema; }
+
+    /*!
+    \brief Gets the full value buffer, applying deltas to their bases.
+    \param values Resized to the schema size.
+    */
+    void getValues(vector<double>& values);
+
+    /*! \brief Returns true if the snapshot only stores differences from a base snapshot. */
+    bool isDelta() { return m_base != nullptr; }
+
+    /*!
+    \brief Number of bytes stored by this snapshot.
+
+    Doesn't include the shared schema, the base snapshot, or devices created by getRigData().
+    */
+    size_t getMemoryUsage();
+
+    /*! \brief Time the last save took in ms. */
+    double getSaveTime() { return m_saveTime; }
+
+    /*! \brief Time the last load took in ms. */
+    double getLoadTime() { return m_loadTime; }
+
     /*!
     \brief Arbitrary use metadata map for a snapshot object.
     */
     map<string, string> _metadata;
 
   protected:
+    /*! \brief Deletes devices created by getRigData(). */
+    void clearRigData();
+
+    shared_ptr<SnapshotSchema> m_schema;
+
+    /*!
+    \brief Stored values.
+
+    The whole buffer for full snapshots. For deltas, the values of each run in m_runs
+    one after the other.
+    */
+    vector<double> m_values;
+
+    /*! \brief (offset, length) of each run of values that differ from m_base. */
+    vector<pair<uint32_t, uint32_t> > m_runs;
+
+    /*! \brief Snapshot this one is a delta of. */
+    shared_ptr<Snapshot> m_base;
+
     /*!
-    \brief Stores the device data from the rig
+    \brief Devices created from the stored values by getRigData().
     */
     map<string, Device*> m_rigData;
+    bool m_rigDataValid;
+
+    double m_saveTime;
+    double m_loadTime;
   };
 
   class PlaybackSnapshot : public Snapshot
@@ -96,4 +277,4 @@ namespace ShowControl {
   };
 }
 }
-#endif
\ No newline at end of file
+#endif
@@ -1,15 +1,52 @@
 #include "Timeline.h"
 
+#include <atomic>
+
 namespace Lumiverse {
 namespace ShowControl {
 
+// Generations are unique across contexts so a Timeline never mistakes one context's
+// resolved references for another's. 0 is reserved for "unresolved".
+static atomic<size_t> nextGeneration(1);
+
+TimelineContext::TimelineContext(map<string, shared_ptr<Timeline> >& timelines) : m_timelines(timelines) {
+  m_generation = nextGeneration++;
+}
+
+void TimelineContext::invalidate() {
+  m_generation = nextGeneration++;
+  m_memo.clear();
+}
+
+bool TimelineContext::lookup(const Timeline* tl, const string& identifier, TimelineTicks time, shared_ptr<LumiverseType>& val) {
+  Key k = { tl, identifier, time };
+  auto it = m_memo.find(k);
+
+  if (it == m_memo.end())
+    return false;
+
+  val = it->second;
+  return true;
+}
+
+void TimelineContext::store(const Timeline* tl, const string& identifier, TimelineTicks time, const shared_ptr<LumiverseType>& val) {
+  Key k = { tl, identifier, time };
+  m_memo[k] = val;
+}
+
 Timeline::Timeline() {
   _loops = 1;
   _lengthIsUpdated = false;
   _loopLengthIsUpdated = false;
+  _resolvedGeneration = 0;
+  _keyframeMapVersion = 0;
+  _cacheable = true;
 }
 
 Timeline::Timeline(JSONNode data) {
+  _resolvedGeneration = 0;
+  _keyframeMapVersion = 0;
+  _cacheable = true;
   loadJSON(data);
 }
 
@@ -18,6 +55,9 @@ Timeline::Timeline(const Timeline& other) {
   _timelineData = other._timelineData;
   _events = other._events;
   _endEvents = other._endEvents;
+  _resolvedGeneration = 0;
+  _keyframeMapVersion = 0;
+  _cacheable = true;
 }
 
 Timeline::~Timeline() {
@@ -52,6 +92,8 @@ map<string, Keyframe> Timeline::getKeyframes(Device* d, size_t time) {
 map<string, map<size_t, Keyframe> >& Timeline::getAllKeyframes() {
   _lengthIsUpdated = false;
   _loopLengthIsUpdated = false;
+  _resolvedGeneration = 0;
+  _keyframeMapVersion++;
   return _timelineData;
 }
 
@@ -81,6 +123,7 @@ void Timeline::setKeyframe(string identifier, size_t time, string timelineID, si
   _timelineData[identifier][time] = Keyframe(time, timelineID, offset);
   _lengthIsUpdated = false;
   _loopLengthIsUpdated = false;
+  _resolvedGeneration = 0;
 }
 
 void Timeline::setKeyframe(Device* d, size_t time, string timelineID, size_t offset) {
@@ -221,84 +264,165 @@ map<string, shared_ptr<Event> >& Timeline::getAllEndEvents() {
 }
 
 shared_ptr<LumiverseType> Timeline::getValueAtTime(string  id, string paramName, LumiverseType* currentVal, size_t time, map<string, shared_ptr<Timeline> >& tls) {
+  if (_mapContext == nullptr || &_mapContext->getTimelines() != &tls) {
+    _mapContext = shared_ptr<TimelineContext>(new TimelineContext(tls));
+    _mapContextTimelines.clear();
+  }
+
+  // References only need to be resolved again if the map's contents changed.
+  bool changed = _mapContextTimelines.size() != tls.size();
+  auto prev = _mapContextTimelines.begin();
+  for (auto it = tls.begin(); !changed && it != tls.end(); it++, prev++) {
+    changed = prev->first != it->first || prev->second != it->second.get();
+  }
+
+  if (changed) {
+    _mapContextTimelines.clear();
+    for (const auto& kvp : tls) {
+      _mapContextTimelines.push_back(make_pair(kvp.first, kvp.second.get()));
+    }
+    _mapContext->invalidate();
+  }
+
+  _mapContext->reset();
+  return getValueAtTime(id, paramName, currentVal, time, *_mapContext);
+}
+
+shared_ptr<LumiverseType> Timeline::getValueAtTime(string id, string paramName, LumiverseType* currentVal, size_t time, TimelineContext& ctx) {
+  return getValueAtTicks(id, paramName, currentVal, time * TicksPerMs, ctx);
+}
+
+shared_ptr<LumiverseType> Timeline::getValueAtTicks(string id, string paramName, LumiverseType* currentVal, TimelineTicks time, TimelineContext& ctx) {
+  if (_resolvedGeneration != ctx.getGeneration())
+    resolveReferences(ctx);
+
   string identifier = getTimelineKey(id, paramName);
-  time = getLoopTime(time);
+  time = getLoopTicks(time);
 
-  try {
-    auto keyframes = _timelineData.at(identifier);
+  auto data = _timelineData.find(identifier);
 
-    // If the id has a keyframe map, but no keyframes, we do nothing and return null.
-    if (keyframes.size() == 0)
-      return nullptr;
+  // If the id has no keyframe map, or a map with no keyframes, we do nothing and return null.
+  if (data == _timelineData.end() || data->second.size() == 0)
+    return nullptr;
 
-    Keyframe first;
-    Keyframe next;
-    bool nextFound = false;
+  return getKeyframeValue(data->second, identifier, id, paramName, currentVal, time, ctx);
+}
 
-    for (auto keyframe = keyframes.begin(); keyframe != keyframes.end();) {
-      if (keyframe->first > time) {
-        next = keyframe->second;
+shared_ptr<LumiverseType> Timeline::getKeyframeValue(const map<size_t, Keyframe>& keyframes, const string& identifier, string id,
+  string paramName, LumiverseType* currentVal, TimelineTicks time, TimelineContext& ctx)
+{
+  // Keyframes are in ms. A keyframe is after the tick if it's after the ms the tick falls in.
+  auto keyframe = keyframes.upper_bound((size_t)(time / TicksPerMs));
 
-        // Special case if they keyframe we found is after the current time but there is no keyframe
-        // before the keyframe we found. Example: no keyframe at t = 0 but keyframe at t = 1200, with
-        // t currently equal to 50.
-        if (keyframe == keyframes.begin()) {
-          first = next;
-        }
-        else {
-          first = prev(keyframe)->second;
-        }
-        nextFound = true;
-        break;
-      }
+  if (keyframe == keyframes.end()) {
+    // We are at the end of the defined keyframes, so return the value of the most
+    // recent keyframe
+    const Keyframe& last = keyframes.rbegin()->second;
 
-      ++keyframe;
+    if (last.timelineID != "") {
+      return getNestedValue(last, identifier, id, paramName, currentVal, time, ctx);
     }
 
-    if (!nextFound) {
-      // We are at the end of the defined keyframes, so return the value of the most
-      // recent keyframe
-      auto last = keyframes.rbegin()->second;
+    return last.val;
+  }
+
+  const Keyframe& next = keyframe->second;
 
-      if (last.timelineID != "") {
-        if (tls.count(last.timelineID) > 0) {
-          return tls[last.timelineID]->getValueAtTime(id, paramName, currentVal, time - last.t + last.timelineOffset, tls);
-        }
-        else return nullptr;
-      }
+  // Special case if they keyframe we found is after the current time but there is no keyframe
+  // before the keyframe we found. Example: no keyframe at t = 0 but keyframe at t = 1200, with
+  // t currently equal to 50.
+  const Keyframe& first = (keyframe == keyframes.begin()) ? next : prev(keyframe)->second;
 
-      return last.val;
-    }
+  // Note that in the instance when we use the current state, that value is pre-filled
+  // at the time of timeline run initialization.
 
-    // Note that in the instance when we use the current state, that value is pre-filled
-    // at the time of timeline run initialization.
+  // Otherwise we have our keyframes and can now do some ops.
+  float a = (float)((double)(time - first.t * TicksPerMs) / (double)((next.t - first.t) * TicksPerMs));
 
-    // Otherwise we have our keyframes and can now do some ops.
-    float a = (float)(time - first.t) / (float)(next.t - first.t);
+  shared_ptr<LumiverseType> x = first.val;
+  shared_ptr<LumiverseType> y = next.val;
 
-    shared_ptr<LumiverseType> x = first.val;
-    shared_ptr<LumiverseType> y = next.val;
+  // Check if any keyframe references timelines
+  // If no such timeline exists in the playback, return nullptr (indicate to layer to skip value for this)
+  if (first.timelineID != "") {
+    x = getNestedValue(first, identifier, id, paramName, currentVal, time, ctx);
+    if (x == nullptr)
+      return nullptr;
+  }
+  if (next.timelineID != "") {
+    y = (&next == &first) ? x : getNestedValue(next, identifier, id, paramName, currentVal, time, ctx);
+    if (y == nullptr)
+      return nullptr;
+  }
 
-    // Check if any keyframe references timelines
-    // If no such timeline exists in the playback, return nullptr (indicate to layer to skip value for this)
-    if (first.timelineID != "") {
-      if (tls.count(first.timelineID) > 0) {
-        x = tls[first.timelineID]->getValueAtTime(id, paramName, currentVal, time - first.t + first.timelineOffset, tls);
+  return LumiverseTypeUtils::lerp(x.get(), y.get(), a);
+}
+
+shared_ptr<LumiverseType> Timeline::getNestedValue(const Keyframe& kf, const string& identifier, string id, string paramName,
+  LumiverseType* currentVal, TimelineTicks time, TimelineContext& ctx)
+{
+  shared_ptr<Timeline> child = kf.timeline.lock();
+  if (child == nullptr)
+    return nullptr;
+
+  // The nested Timeline starts at kf.t - kf.timelineOffset, which can be before 0. Before it starts it
+  // holds its first value.
+  long long start = ((long long)kf.t - (long long)kf.timelineOffset) * (long long)TicksPerMs;
+  TimelineTicks t = ((long long)time > start) ? (TimelineTicks)((long long)time - start) : 0;
+  shared_ptr<LumiverseType> val;
+
+  if (child->_cacheable && ctx.lookup(child.get(), identifier, t, val))
+    return val;
+
+  val = child->getValueAtTicks(id, paramName, currentVal, t, ctx);
+
+  if (child->_cacheable)
+    ctx.store(child.get(), identifier, t, val);
+
+  return val;
+}
+
+void Timeline::resolveReferences(TimelineContext& ctx) {
+  set<Timeline*> visiting;
+  set<Timeline*> done;
+  resolveReferences(ctx, visiting, done);
+}
+
+void Timeline::resolveReferences(TimelineContext& ctx, set<Timeline*>& visiting, set<Timeline*>& done) {
+  auto& tls = ctx.getTimelines();
+  visiting.insert(this);
+  _cacheable = isCacheable();
+
+  for (auto& id : _timelineData) {
+    for (auto& kvp : id.second) {
+      Keyframe& kf = kvp.second;
+      if (kf.timelineID == "")
+        continue;
+
+      auto it = tls.find(kf.timelineID);
+      shared_ptr<Timeline> child = (it != tls.end()) ? it->second : nullptr;
+
+      if (child != nullptr && visiting.count(child.get()) > 0) {
+        stringstream ss;
+        ss << "Keyframe " << id.first << " at " << kvp.first << " references timeline " << kf.timelineID
+           << ", which creates a cycle. Reference ignored.";
+        Logger::log(ERR, ss.str());
+        child = nullptr;
       }
-      else return nullptr;
-    }
-    if (next.timelineID != "") {
-      if (tls.count(next.timelineID) > 0) {
-        y = tls[next.timelineID]->getValueAtTime(id, paramName, currentVal, time - next.t + next.timelineOffset, tls);
+      else if (child != nullptr && done.count(child.get()) == 0) {
+        child->resolveReferences(ctx, visiting, done);
       }
-      else return nullptr;
-    }
 
-    return LumiverseTypeUtils::lerp(x.get(), y.get(), a);
-  }
-  catch (exception e) {
-    return nullptr;
+      if (child != nullptr && !child->_cacheable)
+        _cacheable = false;
+
+      kf.timeline = child;
+    }
   }
+
+  visiting.erase(this);
+  done.insert(this);
+  _resolvedGeneration = ctx.getGeneration();
 }
 
 void Timeline::executeEvents(size_t prevTime, size_t currentTime) {
@@ -323,6 +447,60 @@ void Timeline::executeEndEvents() {
   }
 }
 
+void Timeline::executeEventsAt(size_t time) {
+  size_t length = getLoopLength();
+  size_t loop = (length == 0) ? 0 : time / length;
+  size_t local = time - loop * length;
+
+  // Events at the very end of a loop happen at the same time as the start of the next one.
+  if (local == 0 && loop > 0 && isLoopPlayed(loop - 1)) {
+    auto r = _events.equal_range(length);
+    for (auto it = r.first; it != r.second; it++) {
+      it->second->execute();
+    }
+  }
+
+  if (isLoopPlayed(loop)) {
+    auto r = _events.equal_range(local);
+    for (auto it = r.first; it != r.second; it++) {
+      it->second->execute();
+    }
+  }
+}
+
+bool Timeline::getNextEventTime(size_t time, bool inclusive, size_t& next) {
+  if (_events.size() == 0)
+    return false;
+
+  size_t length = getLoopLength();
+  size_t loop = (length == 0) ? 0 : time / length;
+  size_t local = time - loop * length;
+
+  if (inclusive && local == 0 && loop > 0 && isLoopPlayed(loop - 1) && _events.count(length) > 0) {
+    next = time;
+    return true;
+  }
+
+  if (isLoopPlayed(loop)) {
+    auto it = inclusive ? _events.lower_bound(local) : _events.upper_bound(local);
+    if (it != _events.end()) {
+      next = loop * length + it->first;
+      return true;
+    }
+  }
+
+  // Wrap around to the first event of the next loop
+  if (length == 0 || !isLoopPlayed(loop + 1))
+    return false;
+
+  next = (loop + 1) * length + _events.begin()->first;
+  return true;
+}
+
+bool Timeline::isLoopPlayed(size_t loop) {
+  return _loops == -1 || loop == 0 || loop < (size_t)_loops;
+}
+
 int Timeline::getLoops() {
   return _loops;
 }
@@ -406,66 +584,86 @@ bool Timeline::isDone(size_t time, map<string, shared_ptr<Timeline> >& tls) {
 }
 
 void Timeline::setCurrentState(map<string, map<string, LumiverseType*> >& state, shared_ptr<Timeline> active, size_t time) {
+  prepareCurrentState(state, active, time)();
+}
+
+function<void()> Timeline::prepareCurrentState(map<string, map<string, LumiverseType*> >& state, shared_ptr<Timeline> active, size_t time) {
+  // Keyframes marked "Use Current State" and their new starting values.
+  shared_ptr<vector<pair<Keyframe*, Keyframe> > > updates(new vector<pair<Keyframe*, Keyframe> >());
+
   for (const auto& d : state) {
     for (const auto& p : d.second) {
-      updateKeyframeState(d.first, p.first, p.second, active, time);
+      string kid = getTimelineKey(d.first, p.first);
+      auto data = _timelineData.find(kid);
+      if (data == _timelineData.end())
+        continue;
+
+      for (auto& kf : data->second) {
+        if (!kf.second.useCurrentState)
+          continue;
+
+        Keyframe start(kf.second.t);
+        start.timelineID = kf.second.timelineID;
+        start.timelineOffset = kf.second.timelineOffset;
+        start.val = kf.second.val;
+        setKeyframeState(start, kid, p.second, active, time);
+        updates->push_back(make_pair(&kf.second, start));
+      }
     }
   }
+
+  return [this, updates]() {
+    for (auto& u : *updates) {
+      u.first->timelineID = u.second.timelineID;
+      u.first->timelineOffset = u.second.timelineOffset;
+      u.first->val = u.second.val;
+    }
+
+    // Keyframes may now reference different timelines.
+    _resolvedGeneration = 0;
+  };
 }
 
-void Timeline::updateKeyframeState(string id, string paramName, LumiverseType* param, shared_ptr<Timeline> tl, size_t time) {
-  string kid = getTimelineKey(id, paramName);
-  for (auto& kf : _timelineData[kid]) {
-    if (kf.second.useCurrentState) {
-      // check for active subtimelines
-      if (tl != nullptr) {
-        Keyframe activeKeyframe = tl->getPreviousKeyframe(getTimelineKey(id, paramName), time);
-        if (activeKeyframe.timelineID != "") {
-          kf.second.timelineID = activeKeyframe.timelineID;
-          kf.second.timelineOffset = tl->getLoopTime(time) - activeKeyframe.t + activeKeyframe.timelineOffset + kf.second.t;
-        }
-        else {
-          kf.second.val = shared_ptr<LumiverseType>(LumiverseTypeUtils::copy(param));
-        }
-      }
-      else {
-        kf.second.val = shared_ptr<LumiverseType>(LumiverseTypeUtils::copy(param));
-      }
+void Timeline::setKeyframeState(Keyframe& kf, const string& identifier, LumiverseType* param, shared_ptr<Timeline> tl, size_t time) {
+  // check for active subtimelines
+  if (tl != nullptr) {
+    Keyframe activeKeyframe = tl->getPreviousKeyframe(identifier, time);
+    if (activeKeyframe.timelineID != "") {
+      kf.timelineID = activeKeyframe.timelineID;
+      kf.timelineOffset = tl->getLoopTime(time) - activeKeyframe.t + activeKeyframe.timelineOffset + kf.t;
+      return;
     }
   }
+
+  kf.val = shared_ptr<LumiverseType>(LumiverseTypeUtils::copy(param));
 }
 
 Keyframe Timeline::getPreviousKeyframe(string identifier, size_t time) {
-  // at the moment this function is horribly slow.
-  // TODO: update keyframe datastructure to access elements faster.
-
-  // get the keyframes if they exist, otherwise return null immediately.
-  time = getLoopTime(time);
-
-  auto keyframes = _timelineData[identifier];
-  Keyframe first;
-  Keyframe next;
-  bool nextFound = false;
-
-  for (auto keyframe = keyframes.begin(); keyframe != keyframes.end();) {
-    if (keyframe->first > time) {
-      next = keyframe->second;
-      first = prev(keyframe)->second;
-      nextFound = true;
-      break;
-    }
+  auto data = _timelineData.find(identifier);
+  if (data == _timelineData.end())
+    return Keyframe();
 
-    ++keyframe;
-  }
+  const Keyframe* kf = findPreviousKeyframe(data->second, getLoopTime(time));
+  return (kf != nullptr) ? *kf : Keyframe();
+}
+
+const Keyframe* Timeline::findPreviousKeyframe(const map<size_t, Keyframe>& keyframes, size_t time) {
+  if (keyframes.size() == 0)
+    return nullptr;
+
+  auto next = keyframes.upper_bound(time);
 
-  if (!nextFound) {
+  if (next == keyframes.end()) {
     // We are at the end of the defined keyframes, so return the value of the most
     // recent keyframe
-    auto last = keyframes.rbegin()->second;
-    return last;
+    return &keyframes.rbegin()->second;
   }
 
-  return first;
+  // Nothing before the first keyframe, so the first keyframe is the closest.
+  if (next == keyframes.begin())
+    return &next->second;
+
+  return &prev(next)->second;
 }
 
 size_t Timeline::getLength() {
@@ -539,6 +737,24 @@ size_t Timeline::getLoopTime(size_t time) {
   return time;
 }
 
+TimelineTicks Timeline::getLoopTicks(TimelineTicks time) {
+  return getLoopTicks(time, getLoopLength());
+}
+
+TimelineTicks Timeline::getLoopTicks(TimelineTicks time, size_t length) {
+  TimelineTicks loopLength = (TimelineTicks)length * TicksPerMs;
+  if (loopLength == 0)
+    return 0;
+
+  TimelineTicks loopNum = time / loopLength;
+  if (_loops != -1 && loopNum >= (TimelineTicks)_loops) {
+    // if we've exceeded our number of loops, set to the end keyframe.
+    return time;
+  }
+
+  return time - loopNum * loopLength;
+}
+
 void Timeline::loadJSON(JSONNode node) {
   auto type = node.find("type");
   if (type == node.end()) {
@@ -9,6 +9,86 @@
 namespace Lumiverse {
 namespace ShowControl {
 
+class Timeline;
+
+/*!
+\brief Timeline evaluation time in microseconds.
+
+Keyframes, Events and lengths are stored in ms. Values are evaluated at tick resolution so
+fades don't step at high output rates.
+*/
+typedef unsigned long long TimelineTicks;
+
+/*! \brief Number of ticks in a millisecond. */
+static const TimelineTicks TicksPerMs = 1000;
+
+/*!
+\brief Shared state for evaluating Timelines that reference other Timelines.
+
+Nested Timeline references in Keyframes are resolved to pointers the first time a Timeline is
+evaluated with a context, and again only after the context is invalidated. Values pulled from
+nested Timelines are memoized by (Timeline, device, parameter, time) until reset() is called,
+so a sub-timeline shared by several keyframes or layers is only evaluated once per update.
+
+The Playback owns one context for all of its Layers and resets it every update.
+*/
+class TimelineContext {
+public:
+  /*!
+  \brief Creates a context for the given set of Timelines.
+  \param timelines Timelines that keyframes can reference by id.
+  */
+  TimelineContext(map<string, shared_ptr<Timeline> >& timelines);
+
+  /*! \brief Returns the Timelines that keyframes can reference. */
+  map<string, shared_ptr<Timeline> >& getTimelines() { return m_timelines; }
+
+  /*! \brief Clears memoized values. Call whenever the time or Timeline contents change. */
+  void reset() { m_memo.clear(); }
+
+  /*!
+  \brief Forces Timelines to resolve their references again.
+
+  Call when Timelines are added to or removed from the map.
+  */
+  void invalidate();
+
+  /*! \brief Identifies the current set of resolved references. */
+  size_t getGeneration() { return m_generation; }
+
+  /*!
+  \brief Looks up a memoized value.
+  \return true if the value was found.
+  */
+  bool lookup(const Timeline* tl, const string& identifier, TimelineTicks time, shared_ptr<LumiverseType>& val);
+
+  /*! \brief Memoizes a value. */
+  void store(const Timeline* tl, const string& identifier, TimelineTicks time, const shared_ptr<LumiverseType>& val);
+
+private:
+  struct Key {
+    const Timeline* tl;
+    string identifier;
+    TimelineTicks time;
+
+    bool operator==(const Key& other) const {
+      return tl == other.tl && time == other.time && identifier == other.identifier;
+    }
+  };
+
+  struct KeyHash {
+    size_t operator()(const Key& k) const {
+      return hash<string>()(k.identifier) ^ (hash<const void*>()(k.tl) * 31) ^ (hash<TimelineTicks>()(k.time) * 131);
+    }
+  };
+
+  map<string, shared_ptr<Timeline> >& m_timelines;
+
+  unordered_map<Key, shared_ptr<LumiverseType>, KeyHash> m_memo;
+
+  size_t m_generation;
+};
+
 /*!
 \brief A Timeline is a list of device parameter values at arbitrary times
 
@@ -25,10 +105,11 @@ at the specified times. Events are executed on every loop, or at the very end of
 are complete).
 
 Subclasses of timelines are allowed, and encouraged for certain applications. Note that you do not have
-to override all functions, but probably should at least override getValueAtTime(). Subclasses
+to override all functions, but probably should at least override getValueAtTicks(). Subclasses
 have access to all the keyframe functions and data structures, but do not have to use them.
 
-Times are specified in ms.
+Times are specified in ms. Values can also be evaluated at microsecond resolution with
+getValueAtTicks(), which is what Layers use during playback.
 \sa Event
 */
 class Timeline {
@@ -86,6 +167,14 @@ public:
   */
   map<string, map<size_t, Keyframe> >& getAllKeyframes();
 
+  /*!
+  \brief Gets the keyframes for the entire timeline. Read-only.
+
+  Unlike getAllKeyframes(), this doesn't invalidate the timeline's cached lengths and
+  resolved references, so it can be called from several threads at once.
+  */
+  const map<string, map<size_t, Keyframe> >& getKeyframeData() const { return _timelineData; }
+
   /*!
   \brief Sets the value for the specified keyframe.
 
@@ -222,9 +311,52 @@ public:
   \param paramName Parameter name
   \param time Time in milliseconds to get the value.
   \return A LumiverseType value for the specified time in the timeline.
+
+  Keeps a context for the map between calls, so references are only resolved again
+  after Timelines in the map are added, removed or replaced.
   */
   virtual shared_ptr<LumiverseType> getValueAtTime(string id, string paramName, LumiverseType* currentVal, size_t time, map<string, shared_ptr<Timeline> >& tls);
 
+  /*!
+  \brief Returns the value of the specified parameter for the specified device at the specified time.
+
+  Same as getValueAtTicks() with the time converted to ticks.
+  \param id Device ID
+  \param paramName Parameter name
+  \param time Time in milliseconds to get the value.
+  \param ctx Evaluation context
+  \return A LumiverseType value for the specified time in the timeline.
+  */
+  shared_ptr<LumiverseType> getValueAtTime(string id, string paramName, LumiverseType* currentVal, size_t time, TimelineContext& ctx);
+
+  /*!
+  \brief Returns the value of the specified parameter for the specified device at the specified tick.
+
+  Nested Timeline references are resolved and memoized through the context. Subclasses
+  should override this function, the getValueAtTime() overloads call it.
+  \param id Device ID
+  \param paramName Parameter name
+  \param time Time in microseconds to get the value.
+  \param ctx Evaluation context
+  \return A LumiverseType value for the specified time in the timeline.
+  */
+  virtual shared_ptr<LumiverseType> getValueAtTicks(string id, string paramName, LumiverseType* currentVal, TimelineTicks time, TimelineContext& ctx);
+
+  /*!
+  \brief Resolves nested Timeline references in the keyframes to pointers.
+
+  Referenced Timelines are resolved too. A reference that would make a Timeline depend on itself
+  is logged and ignored.
+  */
+  void resolveReferences(TimelineContext& ctx);
+
+  /*!
+  \brief Indicates if values from this Timeline only depend on the device, parameter and time.
+
+  Values from Timelines that also depend on the value passed in to getValueAtTime() aren't memoized.
+  */
+  virtual bool isCacheable() { return true; }
+
   /*!
   \brief Executes the events between the specified times
 
@@ -243,6 +375,27 @@ public:
   */
   virtual void executeEndEvents();
 
+  /*!
+  \brief Executes the events that happen at exactly the specified time.
+
+  Unlike executeEvents(), the time counts from the start of the first loop, so looped
+  Timelines can be told apart from loop to loop.
+  \param time Time in ms since the Timeline started.
+  */
+  virtual void executeEventsAt(size_t time);
+
+  /*!
+  \brief Finds the next time an Event will happen.
+
+  Loops are taken into account, so the result may be in a later loop than the given time.
+  Used by the Playback's EventScheduler to queue only the next Event of each Timeline.
+  \param time Time in ms since the Timeline started.
+  \param inclusive If true, Events at exactly the given time count.
+  \param next Set to the time of the next Event.
+  \return false if there are no more Events.
+  */
+  virtual bool getNextEventTime(size_t time, bool inclusive, size_t& next);
+
   /*!
   \brief Returns the looping setting for this timeline.
 
@@ -292,9 +445,29 @@ public:
   \brief Takes a state from the layer and updates the keyframes marked with 
   "Use Current State"
 
+  Same as running the function returned by prepareCurrentState() right away.
   \param state Layer state
   */
-  virtual void setCurrentState(map<string, map<string, LumiverseType*> >& state, shared_ptr<Timeline> active, size_t time);
+  void setCurrentState(map<string, map<string, LumiverseType*> >& state, shared_ptr<Timeline> active, size_t time);
+
+  /*!
+  \brief Works out how the Timeline starts from the given layer state without modifying the Timeline.
+
+  The returned function applies the result, and must be run on the thread that evaluates the
+  Timeline. Layers prepare Timelines on their preparation thread and apply the result on the
+  update that starts the Timeline, so a Timeline can be prepared again while it's playing.
+  \param state Layer state
+  \param active Timeline that was playing on the layer when the state was taken. May be nullptr.
+  \param time Time in ms into the active Timeline.
+  */
+  virtual function<void()> prepareCurrentState(map<string, map<string, LumiverseType*> >& state, shared_ptr<Timeline> active, size_t time);
+
+  /*!
+  \brief Drops anything kept from the last call to setCurrentState().
+
+  Called by Layers when they stop playing the Timeline.
+  */
+  virtual void clearCurrentState() { }
 
   /*!
   \brief Gets the keyframe closest to happen at or before the given time.
@@ -302,13 +475,23 @@ public:
   \param identifier Keyframe identifier
   \param time Time to get the closest keyframe.
   */
-  Keyframe getPreviousKeyframe(string identifier, size_t time);
+  virtual Keyframe getPreviousKeyframe(string identifier, size_t time);
 
   /*!
   \brief Returns the time adjusted for the number of loops the timeline can perfrom.
   */
   virtual size_t getLoopTime(size_t time);
 
+  /*!
+  \brief Returns the tick adjusted for the number of loops the timeline can perform.
+  */
+  TimelineTicks getLoopTicks(TimelineTicks time);
+
+  /*!
+  \brief Returns the tick adjusted for the number of loops, given the loop length in ms.
+  */
+  TimelineTicks getLoopTicks(TimelineTicks time, size_t length);
+
   /*!
   \brief Used for identifying different kinds of timelines.
   */
@@ -347,6 +530,33 @@ protected:
   */
   bool _loopLengthIsUpdated;
 
+  /*!
+  \brief TimelineContext generation the keyframe references were resolved for. 0 if unresolved.
+  */
+  size_t _resolvedGeneration;
+
+  /*!
+  \brief Incremented whenever keyframe maps in _timelineData may have been removed.
+
+  Lets subclasses keep pointers to the per-identifier keyframe maps.
+  */
+  size_t _keyframeMapVersion;
+
+  /*!
+  \brief True if this Timeline and everything it references is cacheable.
+
+  Set by resolveReferences().
+  */
+  bool _cacheable;
+
+  /*!
+  \brief Context used by the getValueAtTime() overload that takes a Timeline map.
+
+  _mapContextTimelines is the contents of the map when the context was last validated.
+  */
+  shared_ptr<TimelineContext> _mapContext;
+  vector<pair<string, Timeline*> > _mapContextTimelines;
+
   // right so the map should at some point be changed to a specialized data structure that meets
   // the following properties:
   // -given a time, can find the first and next keyframes (if they exist) as quickly as possible
@@ -372,14 +582,51 @@ protected:
   map<string, shared_ptr<Event> > _endEvents;
 
   /*!
-  \brief Updates the Keyframes marked as "Use Current State" in the Timeline's data 
+  \brief Fills in a keyframe marked as "Use Current State" from the layer state.
+
+  If the active Timeline is pulling the parameter from a nested Timeline, the keyframe keeps
+  following that Timeline instead.
+  \param kf Keyframe to fill in
+  \param identifier Timeline key for the parameter
+  \param param Layer state value
+  \param tl Active Timeline, may be nullptr.
+  \param time Time in ms into the active Timeline.
+  */
+  void setKeyframeState(Keyframe& kf, const string& identifier, LumiverseType* param, shared_ptr<Timeline> tl, size_t time);
+
+  /*!
+  \brief Gets the value of a parameter from a set of keyframes.
+  \param time Loop adjusted time in ticks.
   */
-  void updateKeyframeState(string id, string paramName, LumiverseType* param, shared_ptr<Timeline> tl, size_t time);
+  shared_ptr<LumiverseType> getKeyframeValue(const map<size_t, Keyframe>& keyframes, const string& identifier, string id,
+    string paramName, LumiverseType* currentVal, TimelineTicks time, TimelineContext& ctx);
+
+  /*!
+  \brief Finds the keyframe at or before the given loop adjusted time, or the first keyframe if there isn't one.
+  \return nullptr if there are no keyframes.
+  */
+  static const Keyframe* findPreviousKeyframe(const map<size_t, Keyframe>& keyframes, size_t time);
 
   /*!
   \brief Initializes the timeline with the given JSONNode's data.
   */
   void loadJSON(JSONNode node);
+
+  /*!
+  \brief Returns true if the given loop (counting from 0) is played.
+  */
+  bool isLoopPlayed(size_t loop);
+
+  /*!
+  \brief Resolves references depth first. visiting holds the Timelines on the current path.
+  */
+  void resolveReferences(TimelineContext& ctx, set<Timeline*>& visiting, set<Timeline*>& done);
+
+  /*!
+  \brief Gets the value of a nested Timeline keyframe, using the context's memo if possible.
+  */
+  shared_ptr<LumiverseType> getNestedValue(const Keyframe& kf, const string& identifier, string id, string paramName,
+    LumiverseType* currentVal, TimelineTicks time, TimelineContext& ctx);
 };
 
 }
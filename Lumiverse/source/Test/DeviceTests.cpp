@@ -11,6 +11,7 @@ int DeviceTests::runTests() {
   (runTest([=]{ return this->deviceMetadataManipulation(); }, "deviceMetadataManipulation", 6)) ? numPassed++ : numPassed;
   (runTest([=]{ return this->devicePropertyInfo(); }, "devicePropertyInfo", 7)) ? numPassed++ : numPassed;
   (runTest([=]{ return this->deviceCallbacks(); }, "deviceCallbacks", 8)) ? numPassed++ : numPassed;
+  (runTest([=]{ return this->deviceRevisions(); }, "deviceRevisions", 9)) ? numPassed++ : numPassed;
 
   return numPassed;
 }
@@ -360,4 +361,66 @@ bool DeviceTests::deviceCallbacks() {
   }
 
   return ret;
-}
\ No newline at end of file
+}
+
+bool DeviceTests::deviceRevisions() {
+  Device d("test", 1, "ETC Source 4 26deg");
+  d.setParam("intensity", (LumiverseType*)(new LumiverseFloat(0, 0, 1, 0)));
+
+  Device copy(d);
+  if (copy.getInstanceId() == d.getInstanceId()) {
+    cout << "[ERROR] deviceRevisions: Copy has the same instance id\n";
+    return false;
+  }
+
+  size_t rev = d.getRevision();
+  if (d.getRevision() != rev) {
+    cout << "[ERROR] deviceRevisions: Revision changed without an edit\n";
+    return false;
+  }
+
+  d.setParam("intensity", 0.5f);
+  if (d.getRevision() == rev) {
+    cout << "[ERROR] deviceRevisions: Revision didn't change on setParam\n";
+    return false;
+  }
+
+  rev = d.getRevision();
+  d.setMetadata("area", "1");
+  if (d.getRevision() == rev) {
+    cout << "[ERROR] deviceRevisions: Revision didn't change on setMetadata\n";
+    return false;
+  }
+
+  rev = d.getRevision();
+  LumiverseFloat val(0.75f, 0, 1, 0);
+  d.copyParamByValue("intensity", &val);
+  if (d.getRevision() == rev) {
+    cout << "[ERROR] deviceRevisions: Revision didn't change on copyParamByValue\n";
+    return false;
+  }
+
+  rev = d.getRevision();
+  d.copyParamByValue("intensity", &val);
+  if (d.getRevision() != rev) {
+    cout << "[ERROR] deviceRevisions: Revision changed when copyParamByValue copied the same value\n";
+    return false;
+  }
+
+  rev = d.getRevision();
+  d.addFocusPalette(FocusPalette("fp", 0.5f, 0.5f, "", "", "fp.exr"));
+  if (d.getRevision() == rev) {
+    cout << "[ERROR] deviceRevisions: Revision didn't change when a focus palette was added\n";
+    return false;
+  }
+
+  rev = d.getRevision();
+  d.getFloat("intensity")->setVal(0.25f);
+  d.markChanged();
+  if (d.getRevision() == rev) {
+    cout << "[ERROR] deviceRevisions: Revision didn't change on markChanged\n";
+    return false;
+  }
+
+  return true;
+}
@@ -21,7 +21,7 @@ private:
   bool runTest(std::function<bool()> t, string testName, int testNum);
 
   // Update when new tests are written.
-  static const int m_numTests = 8;
+  static const int m_numTests = 9;
 
   // Test functions
   bool deviceCreation();
@@ -32,4 +32,5 @@ private:
   bool deviceMetadataManipulation();
   bool devicePropertyInfo();
   bool deviceCallbacks();
+  bool deviceRevisions();
 };
\ No newline at end of file
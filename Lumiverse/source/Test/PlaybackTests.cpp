@@ -17,6 +17,18 @@ int PlaybackTests::runTests() {
   (runTest([=]{ return this->layerToggle(); }, "layerToggle", 7)) ? numPassed++ : numPassed;
   (runTest([=]{ return this->snapshot(); }, "snapshot", 8)) ? numPassed++ : numPassed;
   (runTest([=]{ return this->groups(); }, "groups", 9)) ? numPassed++ : numPassed;
+  (runTest([=]{ return this->submasters(); }, "submasters", 10)) ? numPassed++ : numPassed;
+  (runTest([=]{ return this->timelineEvents(); }, "timelineEvents", 11)) ? numPassed++ : numPassed;
+  (runTest([=]{ return this->nestedTimelines(); }, "nestedTimelines", 12)) ? numPassed++ : numPassed;
+  (runTest([=]{ return this->cueTransition(); }, "cueTransition", 13)) ? numPassed++ : numPassed;
+  (runTest([=]{ return this->goStress(); }, "goStress", 14)) ? numPassed++ : numPassed;
+  (runTest([=]{ return this->effects(); }, "effects", 15)) ? numPassed++ : numPassed;
+  (runTest([=]{ return this->fixedTimestep(); }, "fixedTimestep", 16)) ? numPassed++ : numPassed;
+  (runTest([=]{ return this->offlineRender(); }, "offlineRender", 17)) ? numPassed++ : numPassed;
+  (runTest([=]{ return this->capturePlayback(); }, "capturePlayback", 18)) ? numPassed++ : numPassed;
+  (runTest([=]{ return this->programmerEdits(); }, "programmerEdits", 19)) ? numPassed++ : numPassed;
+  (runTest([=]{ return this->snapshotBuffers(); }, "snapshotBuffers", 20)) ? numPassed++ : numPassed;
+  (runTest([=]{ return this->cueTracking(); }, "cueTracking", 21)) ? numPassed++ : numPassed;
 
   return numPassed;
 }
@@ -273,4 +285,766 @@ bool PlaybackTests::groups() {
     return false;
   }
   return true;
-}
\ No newline at end of file
+}
+
+bool PlaybackTests::submasters() {
+  m_pb->getProgrammer()->clearAndReset();
+  m_pb->getProgrammer()->setParam("s41", "intensity", 1.0f);
+  m_pb->storeGroup("sub group", m_testRig->select("s41"), true);
+
+  if (!m_pb->addSubmaster("sub 1", "sub group", false, 0.5f)) {
+    cout << "Failed to add submaster to playback\n";
+    return false;
+  }
+
+  if (m_pb->addSubmaster("sub 1", "sub group")) {
+    cout << "Failed to detect existing submaster in playback\n";
+    return false;
+  }
+
+  this_thread::sleep_for(chrono::milliseconds(100));
+  float val;
+  m_testRig->getDevice("s41")->getParam("intensity", val);
+
+  if (abs(val - 0.5f) > 0.00001) {
+    cout << "Submaster failed to scale intensity. Expected: 0.5. Received: " << val << "\n";
+    return false;
+  }
+
+  m_pb->setGrandmaster(0.5f);
+  this_thread::sleep_for(chrono::milliseconds(100));
+  m_testRig->getDevice("s41")->getParam("intensity", val);
+
+  if (abs(val - 0.25f) > 0.00001) {
+    cout << "Grandmaster and submaster failed to scale intensity. Expected: 0.25. Received: " << val << "\n";
+    return false;
+  }
+
+  m_pb->setGrandmaster(1);
+  if (!m_pb->deleteSubmaster("sub 1") || m_pb->submasterExists("sub 1")) {
+    cout << "Failed to delete submaster\n";
+    return false;
+  }
+
+  m_pb->deleteGroup("sub group");
+  m_pb->getProgrammer()->clearAndReset();
+
+  return true;
+}
+
+bool PlaybackTests::timelineEvents() {
+  shared_ptr<Timeline> tl(new Timeline());
+
+  // Counters are shared with the events so they outlive any update still in flight.
+  shared_ptr<atomic<int> > events(new atomic<int>(0));
+  shared_ptr<atomic<int> > endEvents(new atomic<int>(0));
+  shared_ptr<atomic<int> > eventsAtEnd(new atomic<int>(-1));
+
+  // Three loops of 100ms with an event at the start, middle and end of each loop.
+  tl->setLoops(3);
+  for (size_t t = 0; t <= 100; t += 50) {
+    tl->addEvent(t, shared_ptr<Event>(new Event([events]() { (*events)++; })));
+  }
+  tl->addEndEvent("end", shared_ptr<Event>(new Event([events, endEvents, eventsAtEnd]() {
+    (*endEvents)++;
+    *eventsAtEnd = events->load();
+  })));
+  m_pb->addTimeline("Event Timeline", tl);
+
+  shared_ptr<Layer> layer(new Layer(m_pb, "Event Layer", 0));
+  m_pb->addLayer(layer);
+  layer->play("Event Timeline");
+
+  this_thread::sleep_for(chrono::milliseconds(500));
+
+  int numEvents = *events;
+  int numEndEvents = *endEvents;
+  int numAtEnd = *eventsAtEnd;
+
+  layer->stop();
+  m_pb->deleteLayer("Event Layer");
+  m_pb->deleteTimeline("Event Timeline");
+
+  if (numEvents != 9) {
+    cout << "Timeline events executed wrong number of times. Expected: 9. Received: " << numEvents << "\n";
+    return false;
+  }
+
+  if (numEndEvents != 1 || numAtEnd != 9) {
+    cout << "Timeline end events not executed once after all other events\n";
+    return false;
+  }
+
+  return true;
+}
+
+bool PlaybackTests::nestedTimelines() {
+  map<string, shared_ptr<Timeline> > tls;
+  TimelineContext ctx(tls);
+  LumiverseFloat zero(0.0f), one(1.0f);
+
+  shared_ptr<Timeline> inner(new Timeline());
+  inner->setKeyframe("s41:intensity", 0, &zero);
+  inner->setKeyframe("s41:intensity", 1000, &one);
+
+  shared_ptr<Timeline> outer(new Timeline());
+  outer->setKeyframe("s41:intensity", 0, "inner", 0);
+  outer->setKeyframe("s41:intensity", 2000, &one);
+
+  tls["inner"] = inner;
+  tls["outer"] = outer;
+
+  // Inner timeline is at 0.5, a quarter of the way to 1.
+  for (int i = 0; i < 2; i++) {
+    auto val = outer->getValueAtTime("s41", "intensity", &zero, 500, ctx);
+    if (val == nullptr || abs(((LumiverseFloat*)val.get())->getVal() - 0.625f) > 0.00001) {
+      cout << "Nested timeline value error. Expected: 0.625.\n";
+      return false;
+    }
+  }
+
+  // The map overload keeps its context between calls, replacing a Timeline has to be picked up.
+  float expected[] = { 0.625f, 1.0f };
+  for (int i = 0; i < 2; i++) {
+    auto val = outer->getValueAtTime("s41", "intensity", &zero, 500, tls);
+    if (val == nullptr || abs(((LumiverseFloat*)val.get())->getVal() - expected[i]) > 0.00001) {
+      cout << "Nested timeline value error using the timeline map. Expected: " << expected[i] << ".\n";
+      return false;
+    }
+
+    shared_ptr<Timeline> constant(new Timeline());
+    constant->setKeyframe("s41:intensity", 0, &one);
+    tls["inner"] = constant;
+  }
+
+  tls["inner"] = inner;
+  ctx.invalidate();
+
+  // Timelines that reference each other shouldn't recurse forever.
+  shared_ptr<Timeline> a(new Timeline());
+  shared_ptr<Timeline> b(new Timeline());
+  a->setKeyframe("s41:intensity", 0, "b", 0);
+  b->setKeyframe("s41:intensity", 0, "a", 0);
+  tls["a"] = a;
+  tls["b"] = b;
+  ctx.invalidate();
+
+  if (a->getValueAtTime("s41", "intensity", &zero, 100, ctx) != nullptr) {
+    cout << "Timeline reference cycle returned a value.\n";
+    return false;
+  }
+
+  return true;
+}
+
+bool PlaybackTests::cueTransition() {
+  map<string, shared_ptr<Timeline> > tls;
+  TimelineContext ctx(tls);
+  LumiverseFloat zero(0.0f), one(1.0f);
+
+  // 1s delay then a 2s upfade
+  Cue cue;
+  cue.setTime(2, 4, 1);
+  cue.update("s41", "intensity", &one);
+
+  map<string, map<string, LumiverseType*> > state;
+  state["s41"]["intensity"] = &zero;
+
+  // Running the cue twice reuses the transition table.
+  for (int i = 0; i < 2; i++) {
+    cue.setCurrentState(state, nullptr, 0);
+
+    float expected[] = { 0, 0.5f, 1 };
+    size_t times[] = { 500, 2000, 3500 };
+
+    for (int t = 0; t < 3; t++) {
+      auto val = cue.getValueAtTime("s41", "intensity", &zero, times[t], ctx);
+      if (val == nullptr || abs(((LumiverseFloat*)val.get())->getVal() - expected[t]) > 0.00001) {
+        cout << "Cue transition value error at " << times[t] << "ms. Expected: " << expected[t] << "\n";
+        return false;
+      }
+    }
+
+    if (cue.getLength() != 3000) {
+      cout << "Cue transition length error. Expected: 3000. Received: " << cue.getLength() << "\n";
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool PlaybackTests::goStress() {
+  unsigned int rate = m_testRig->getRefreshRate();
+  m_testRig->setRefreshRate(200);
+
+  atomic<int> ticks(0);
+  m_testRig->addFunction(14, [&]() { ticks++; });
+
+  shared_ptr<Layer> layer(new Layer(m_testRig, m_pb, "Stress Layer", 5));
+  m_pb->addLayer(layer);
+
+  float levels[] = { 0.2f, 0.4f, 0.6f };
+  for (int i = 0; i < 3; i++) {
+    LumiverseFloat val(levels[i]);
+    shared_ptr<Cue> cue(new Cue());
+    cue->setTime(0.05f, 0.05f, 0);
+    cue->update("s41", "intensity", &val);
+    m_pb->addTimeline("Stress " + to_string(i), cue);
+  }
+
+  // GO as fast as possible for a second while the rig updates.
+  auto start = chrono::high_resolution_clock::now();
+  int gos = 0;
+  while (chrono::high_resolution_clock::now() - start < chrono::seconds(1)) {
+    layer->play("Stress " + to_string(gos % 2));
+    gos++;
+  }
+  int stormTicks = ticks;
+
+  layer->play("Stress 2");
+  this_thread::sleep_for(chrono::milliseconds(300));
+
+  float final = ((LumiverseFloat*)layer->getLayerState()["s41"]["intensity"])->getVal();
+
+  m_testRig->removeFunction(14);
+  m_pb->deleteLayer("Stress Layer");
+  for (int i = 0; i < 3; i++) {
+    m_pb->deleteTimeline("Stress " + to_string(i));
+  }
+  m_testRig->setRefreshRate(rate);
+
+  // The update loop shouldn't stall while cues are being started.
+  if (stormTicks < 100) {
+    cout << "Rig only updated " << stormTicks << " times during " << gos << " GOs\n";
+    return false;
+  }
+
+  if (abs(final - 0.6f) > 0.00001) {
+    cout << "Layer didn't end on the last cue. Expected: 0.6. Received: " << final << "\n";
+    return false;
+  }
+
+  return true;
+}
+
+bool PlaybackTests::effects() {
+  map<string, shared_ptr<Timeline> > tls;
+  TimelineContext ctx(tls);
+  LumiverseFloat current(0.0f);
+
+  // SineWave is a SINE effect with the phase in seconds, check it against the exact function.
+  SineWave sine(2, 0.5f, 0.1f, 0.5f);
+  sine.setLoops(-1);
+  SineWave sineLoaded(sine.toJSON());
+  sineLoaded.setLoops(-1);
+  for (size_t t = 0; t < 4000; t += 130) {
+    float expected = 0.5f * sin(M_PI * 2 * ((t / 1000.0f) + 0.1f) / 2) + 0.5f;
+    for (SineWave* s : { &sine, &sineLoaded }) {
+      auto val = s->getValueAtTime("s41", "intensity", &current, t, ctx);
+      if (val == nullptr || abs(((LumiverseFloat*)val.get())->getVal() - expected) > 0.0001) {
+        cout << "SineWave value error at " << t << "ms. Expected: " << expected << "\n";
+        return false;
+      }
+    }
+  }
+
+  // Saw fanned across three devices by channel order: phases 0, 0.5 and 1 cycles.
+  Effect saw(Effect::SAW, 1, 0.5f, 0, 0.5f);
+  saw.setLoops(-1);
+  saw.setDevices(m_testRig->select("#1-3"), Effect::ORDER, 1);
+  saw.setParameters({ "intensity" });
+
+  float expected[] = { 0.25f, 0.75f, 0.25f };
+  string first;
+  int i = 0;
+  for (auto d : m_testRig->select("#1-3").getDeviceList()) {
+    first = (i == 0) ? d->getId() : first;
+    auto val = saw.getValueAtTime(d->getId(), "intensity", &current, 250, ctx);
+    if (val == nullptr || abs(((LumiverseFloat*)val.get())->getVal() - expected[i]) > 0.0001) {
+      cout << "Effect fan value error for " << d->getId() << ". Expected: " << expected[i] << "\n";
+      return false;
+    }
+    i++;
+  }
+
+  // Devices and parameters outside the effect are left alone.
+  if (saw.getValueAtTime("notADevice", "intensity", &current, 250, ctx) != nullptr ||
+    saw.getValueAtTime(first, "pan", &current, 250, ctx) != nullptr) {
+    cout << "Effect returned a value for a device or parameter it doesn't cover\n";
+    return false;
+  }
+
+  // Square and step waves.
+  Effect square(Effect::SQUARE, 1, 0.5f, 0, 0.5f);
+  square.setDuty(0.25f);
+  Effect step(Effect::STEP, 1, 0.5f, 0, 0.5f);
+  step.setSteps(3);
+  size_t times[] = { 100, 300, 500, 900 };
+  float squareVals[] = { 1, 0, 0, 0 };
+  float stepVals[] = { 0, 0, 0.5f, 1 };
+  for (int t = 0; t < 4; t++) {
+    auto sq = square.getValueAtTime("s41", "intensity", &current, times[t], ctx);
+    auto st = step.getValueAtTime("s41", "intensity", &current, times[t], ctx);
+    if (abs(((LumiverseFloat*)sq.get())->getVal() - squareVals[t]) > 0.0001 ||
+      abs(((LumiverseFloat*)st.get())->getVal() - stepVals[t]) > 0.0001) {
+      cout << "Square or step value error at " << times[t] << "ms\n";
+      return false;
+    }
+  }
+
+  // Phases and settings survive a save and load.
+  Effect loaded(saw.toJSON());
+  loaded.setLoops(-1);
+  auto a = saw.getValueAtTime(first, "intensity", &current, 620, ctx);
+  auto b = loaded.getValueAtTime(first, "intensity", &current, 620, ctx);
+  if (abs(((LumiverseFloat*)a.get())->getVal() - ((LumiverseFloat*)b.get())->getVal()) > 0.0001 ||
+    loaded.getValueAtTime("notADevice", "intensity", &current, 620, ctx) != nullptr) {
+    cout << "Effect JSON round trip error\n";
+    return false;
+  }
+
+  return true;
+}
+
+bool PlaybackTests::fixedTimestep() {
+  map<string, shared_ptr<Timeline> > tls;
+  TimelineContext ctx(tls);
+  LumiverseFloat zero(0.0f), one(1.0f);
+
+  // Fades are evaluated between milliseconds.
+  Timeline fade;
+  fade.setKeyframe("s41:intensity", 0, &zero);
+  fade.setKeyframe("s41:intensity", 2, &one);
+
+  auto val = fade.getValueAtTicks("s41", "intensity", &zero, 1250, ctx);
+  if (val == nullptr || abs(((LumiverseFloat*)val.get())->getVal() - 0.625f) > 0.00001) {
+    cout << "Timeline tick value error. Expected: 0.625.\n";
+    return false;
+  }
+
+  // Updates land on 5ms frame boundaries.
+  vector<chrono::time_point<chrono::high_resolution_clock> > frames;
+  m_pb->setFixedTimestep(200);
+  m_testRig->addFunction(16, [&]() { frames.push_back(m_pb->getFrameTime()); });
+  this_thread::sleep_for(chrono::milliseconds(200));
+  m_testRig->removeFunction(16);
+  m_pb->setFixedTimestep(0);
+
+  if (frames.size() < 3) {
+    cout << "Not enough updates to check frame times\n";
+    return false;
+  }
+
+  // The first update after turning it on starts the frame clock.
+  for (size_t i = 2; i < frames.size(); i++) {
+    long long us = chrono::duration_cast<chrono::microseconds>(frames[i] - frames[1]).count();
+    if (us < 0 || us % 5000 != 0) {
+      cout << "Update " << i << " was " << us << "us after the first frame, not on a frame boundary\n";
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool PlaybackTests::offlineRender() {
+  // Renders a one second fade starting at 250ms on a fresh rig that isn't running.
+  auto renderShow = [](string filename, size_t& frames, size_t& bytes, int& level) {
+    Rig* rig = new Rig("../../source/Test/testRig.json");
+    Playback* pb = new Playback(rig);
+
+    shared_ptr<Layer> layer(new Layer(rig, pb, "Render Layer", 1));
+    layer->activate();
+    pb->addLayer(layer);
+
+    LumiverseFloat zero(0.0f), one(1.0f);
+    shared_ptr<Timeline> fade(new Timeline());
+    fade->setKeyframe("s41:intensity", 0, &zero);
+    fade->setKeyframe("s41:intensity", 1000, &one);
+    pb->addTimeline("Fade", fade);
+
+    OfflineRenderer renderer(pb, 40);
+    renderer.addAction(250, [=]() { layer->play("Fade"); });
+    bool ok = renderer.render(filename, 1500);
+
+    frames = renderer.getFrameCount();
+    bytes = renderer.getBytesWritten();
+    level = rig->getPatchAsDMXPatch("DMX1")->getUniverses()[0][0];
+
+    delete pb;
+    delete rig;
+    return ok;
+  };
+
+  size_t framesA, framesB, bytesA, bytesB;
+  int levelA, levelB;
+  if (!renderShow("offlineRenderA.lvdmx", framesA, bytesA, levelA) ||
+    !renderShow("offlineRenderB.lvdmx", framesB, bytesB, levelB)) {
+    cout << "Failed to render show\n";
+    return false;
+  }
+
+  ifstream a("offlineRenderA.lvdmx", ios::binary), b("offlineRenderB.lvdmx", ios::binary);
+  string dataA((istreambuf_iterator<char>(a)), istreambuf_iterator<char>());
+  string dataB((istreambuf_iterator<char>(b)), istreambuf_iterator<char>());
+  a.close();
+  b.close();
+  remove("offlineRenderA.lvdmx");
+  remove("offlineRenderB.lvdmx");
+
+  if (framesA != 60 || dataA.size() != bytesA) {
+    cout << "Render wrote " << framesA << " frames and " << dataA.size() << " bytes. Expected 60 frames and " << bytesA << " bytes.\n";
+    return false;
+  }
+
+  if (dataA != dataB) {
+    cout << "Rendering the same show twice gave different output\n";
+    return false;
+  }
+
+  DMXCaptureHeader header;
+  memcpy(&header, dataA.data(), sizeof(header));
+  if (string(header.magic, 8) != "LVDMXCAP" || header.frameCount != 60 || header.rate != 40 || header.numUniverses != 2) {
+    cout << "Capture header error\n";
+    return false;
+  }
+
+  // The test rig patches two universes. A single fading channel should compress to a fraction of the raw frames.
+  if (bytesA * 4 > 60 * 2 * 512) {
+    cout << "Capture wasn't compressed. " << bytesA << " bytes for 60 frames.\n";
+    return false;
+  }
+
+  if (levelA != 255) {
+    cout << "Fade didn't finish in the render. Expected: 255. Received: " << levelA << "\n";
+    return false;
+  }
+
+  return true;
+}
+
+bool PlaybackTests::capturePlayback() {
+  // Record a one second fade starting at 250ms.
+  Rig* rig = new Rig("../../source/Test/testRig.json");
+  Playback* pb = new Playback(rig);
+  shared_ptr<Layer> layer(new Layer(rig, pb, "Render Layer", 1));
+  layer->activate();
+  pb->addLayer(layer);
+
+  LumiverseFloat zero(0.0f), one(1.0f);
+  shared_ptr<Timeline> fade(new Timeline());
+  fade->setKeyframe("s41:intensity", 0, &zero);
+  fade->setKeyframe("s41:intensity", 1000, &one);
+  pb->addTimeline("Fade", fade);
+
+  OfflineRenderer renderer(pb, 40);
+  renderer.addAction(250, [=]() { layer->play("Fade"); });
+  bool ok = renderer.render("capturePlayback.lvdmx", 1500);
+  delete pb;
+
+  DMXCaptureReader reader;
+  if (!ok || !reader.open("capturePlayback.lvdmx") || reader.getFrameCount() != 60 || reader.getRate() != 40) {
+    cout << "Failed to read back the rendered capture\n";
+    delete rig;
+    remove("capturePlayback.lvdmx");
+    return false;
+  }
+
+  // Frame 30 is 750ms, halfway through the fade.
+  vector<vector<unsigned char> > frames;
+  for (uint64_t i = 0; i < reader.getFrameCount(); i++) {
+    const unsigned char* f = reader.getFrame(i);
+    frames.push_back(vector<unsigned char>(f, f + reader.getFrameSize()));
+  }
+
+  if (frames[10][0] != 0 || abs(frames[30][0] - 127) > 1 || frames[59][0] != 255) {
+    cout << "Capture values error. Received: " << (int)frames[10][0] << ", " << (int)frames[30][0] << ", " << (int)frames[59][0] << "\n";
+    delete rig;
+    remove("capturePlayback.lvdmx");
+    return false;
+  }
+
+  // Seeking has to give the same frames as reading in order.
+  uint64_t seeks[] = { 45, 3, 59, 0, 31, 30, 12 };
+  for (uint64_t s : seeks) {
+    if (memcmp(reader.getFrame(s), frames[s].data(), reader.getFrameSize()) != 0) {
+      cout << "Seeking to frame " << s << " gave a different frame\n";
+      delete rig;
+      remove("capturePlayback.lvdmx");
+      return false;
+    }
+  }
+  reader.close();
+
+  // Play the capture out of the patch, then cut to live values.
+  DMXPatch* patch = rig->getPatchAsDMXPatch("DMX1");
+  rig->getDevice("s41")->setParam("intensity", 0.25f);
+
+  DMXCapturePlayer player;
+  player.open("capturePlayback.lvdmx");
+  player.attach(patch, "DMX1");
+  player.seek(1000);
+  player.play(false);
+  patch->update(rig->getDeviceRaw());
+  int captured = patch->getUniverses()[0][0];
+
+  player.fadeToLive(0);
+  patch->update(rig->getDeviceRaw());
+  int live = patch->getUniverses()[0][0];
+
+  // Looping wraps back to the start.
+  player.fadeToCapture(0);
+  player.stop();
+  player.seek(1500);
+  player.play(true);
+  patch->update(rig->getDeviceRaw());
+  int looped = patch->getUniverses()[0][0];
+
+  player.close();
+  delete rig;
+  remove("capturePlayback.lvdmx");
+
+  if (captured != frames[40][0] || abs(live - 63) > 1 || looped != 0) {
+    cout << "Capture player output error. Captured: " << captured << " Live: " << live << " Looped: " << looped << "\n";
+    return false;
+  }
+
+  return true;
+}
+
+bool PlaybackTests::programmerEdits() {
+  Programmer prog(m_testRig);
+
+  // Separate state to blend into so the running Playback isn't affected.
+  map<string, Device*> state;
+  for (Device* d : m_testRig->getDeviceRaw()) {
+    state[d->getId()] = new Device(d);
+    state[d->getId()]->reset();
+  }
+
+  auto intensity = [&](string id) { return ((LumiverseFloat*)state[id]->getParam("intensity"))->getVal(); };
+  auto cleanup = [&]() {
+    for (auto& kvp : state)
+      delete kvp.second;
+  };
+
+  // Edit from another thread while blending as fast as possible.
+  atomic<bool> editing(true);
+  thread editor([&]() {
+    for (int i = 0; i < 2000; i++) {
+      prog.setParam("#1-10", "intensity", (i % 2 == 0) ? 0.25f : 0.75f);
+    }
+    prog.setParam("#1-10", "intensity", 0.5f);
+    editing = false;
+  });
+
+  bool consistent = true;
+  int blends = 0;
+  while (editing) {
+    prog.blend(state);
+    float v = intensity("s41");
+    if (v != 0 && v != 0.25f && v != 0.75f && v != 0.5f)
+      consistent = false;
+    blends++;
+  }
+  editor.join();
+
+  prog.blend(state);
+  if (!consistent || intensity("s41") != 0.5f) {
+    cout << "Programmer blend saw an inconsistent value after " << blends << " blends. Final value: " << intensity("s41") << "\n";
+    cleanup();
+    return false;
+  }
+
+  // Edits through a device from the programmer are published too.
+  prog.getDevice("par1")->setParam("intensity", 0.3f);
+  prog.blend(state);
+  if (abs(intensity("par1") - 0.3f) > 0.00001) {
+    cout << "Programmer device edit wasn't published. Received: " << intensity("par1") << "\n";
+    cleanup();
+    return false;
+  }
+
+  // Cleared devices aren't blended any more.
+  prog.clearCaptured();
+  state["s41"]->reset();
+  prog.blend(state);
+  if (intensity("s41") != 0) {
+    cout << "Programmer blended a device after clearing captured devices\n";
+    cleanup();
+    return false;
+  }
+
+  cleanup();
+  return true;
+}
+
+bool PlaybackTests::snapshotBuffers() {
+  Rig* rig = new Rig("../../source/Test/testRig.json");
+  Rig* other = new Rig("../../source/Test/testRig.json");
+
+  map<string, int> keys;
+  keys["open"] = 0;
+  keys["gobo1"] = 128;
+
+  // Extra parameter types so every kind of slot is covered.
+  for (Rig* r : { rig, other }) {
+    r->getDevice("s42")->setParam("gobo", new LumiverseEnum(keys, LumiverseEnum::CENTER, 255, "open"));
+    r->getDevice("s42")->setParam("color", new LumiverseColor(BASIC_RGB));
+  }
+
+  Device* s41 = rig->getDevice("s41");
+  Device* s42 = rig->getDevice("s42");
+
+  s41->setParam("intensity", 0.5f);
+  s42->setParam("gobo", "gobo1", 0.25f);
+  s42->getParam<LumiverseColor>("color")->setRGBRaw(0.1, 0.2, 0.3);
+
+  auto full = make_shared<Snapshot>(rig);
+
+  s41->setParam("intensity", 0.75f);
+  Snapshot delta(rig, full);
+
+  bool ok = true;
+  if (!delta.isDelta() || delta.getSchema() != full->getSchema() ||
+    delta.getMemoryUsage() >= full->getMemoryUsage()) {
+    cout << "Delta snapshot wasn't smaller than the full snapshot.\n";
+    ok = false;
+  }
+
+  // Scramble everything, then restore.
+  s41->setParam("intensity", 0.0f);
+  s42->setParam("gobo", "open", 0.5f);
+  s42->getParam<LumiverseColor>("color")->setRGBRaw(1, 1, 1);
+
+  full->loadRig(rig);
+  float val;
+  s41->getParam("intensity", val);
+  LumiverseColor* color = s42->getParam<LumiverseColor>("color");
+  if (val != 0.5f || s42->getParam<LumiverseEnum>("gobo")->getVal() != "gobo1" ||
+    s42->getParam<LumiverseEnum>("gobo")->getTweak() != 0.25f || (*color)["Blue"] != 0.3) {
+    cout << "Full snapshot didn't restore the rig.\n";
+    ok = false;
+  }
+
+  delta.loadRig(rig);
+  s41->getParam("intensity", val);
+  if (val != 0.75f || (*color)["Green"] != 0.2) {
+    cout << "Delta snapshot didn't restore the rig.\n";
+    ok = false;
+  }
+
+  Device* copy = delta.getRigData()["s41"];
+  if (copy == nullptr || copy->getParam<LumiverseFloat>("intensity")->getVal() != 0.75f) {
+    cout << "Snapshot devices don't match the stored values.\n";
+    ok = false;
+  }
+
+  // Different rig, loaded by device id.
+  delta.loadRig(other);
+  other->getDevice("s41")->getParam("intensity", val);
+  if (val != 0.75f || other->getDevice("s42")->getParam<LumiverseEnum>("gobo")->getVal() != "gobo1") {
+    cout << "Snapshot didn't load into a different rig.\n";
+    ok = false;
+  }
+
+  // Layout changes make a new schema.
+  rig->getDevice("s41")->setParam("snapshotTest", new LumiverseFloat(0.5f));
+  Snapshot changed(rig, full);
+  if (changed.isDelta() || changed.getSchema() == full->getSchema()) {
+    cout << "Snapshot reused a stale schema.\n";
+    ok = false;
+  }
+
+  delete rig;
+  delete other;
+  return ok;
+}
+
+bool PlaybackTests::cueTracking() {
+  CueList list("Tracking", m_pb);
+  float levels[] = { 0.5f, 0.5f, 0.5f, 0.8f, 0.8f, 0.8f };
+
+  for (int i = 0; i < 6; i++) {
+    LumiverseFloat val(levels[i]);
+    shared_ptr<Cue> cue(new Cue());
+    cue->update("s41", "intensity", &val);
+    m_pb->addTimeline("Tracking " + to_string(i), cue);
+    list.storeCue((float)(i + 1), "Tracking " + to_string(i));
+  }
+
+  auto level = [&](float num) {
+    auto val = list.getCue(num)->getLastCueValue("s41", "intensity");
+    return (val == nullptr) ? -1 : ((LumiverseFloat*)val.get())->getVal();
+  };
+  auto changes = [&]() {
+    stringstream ss;
+    for (float c : list.getTrackingChanges("s41", "intensity"))
+      ss << c << " ";
+    return ss.str();
+  };
+  auto cleanup = [&]() {
+    for (int i = 0; i < 6; i++)
+      m_pb->deleteTimeline("Tracking " + to_string(i));
+  };
+
+  if (changes() != "1 4 ") {
+    cout << "Tracking index error. Expected: 1 4. Received: " << changes() << "\n";
+    cleanup();
+    return false;
+  }
+
+  // Tracks through cue 3 and stops at cue 4, where the value changed.
+  LumiverseFloat low(0.3f);
+  list.update(2, "s41", "intensity", &low, true);
+  if (level(1) != 0.5f || level(3) != 0.3f || level(4) != 0.8f || changes() != "1 2 4 ") {
+    cout << "Tracked update error. Changes: " << changes() << "\n";
+    cleanup();
+    return false;
+  }
+
+  // Runs merge once they have the same value.
+  list.update(4, "s41", "intensity", &low, true);
+  if (level(6) != 0.3f || changes() != "1 2 ") {
+    cout << "Tracked update didn't merge runs. Changes: " << changes() << "\n";
+    cleanup();
+    return false;
+  }
+
+  LumiverseFloat high(1.0f);
+  list.update(5, "s41", "intensity", &high, false);
+  if (level(5) != 1.0f || level(6) != 0.3f || changes() != "1 2 5 6 ") {
+    cout << "Untracked update error. Changes: " << changes() << "\n";
+    cleanup();
+    return false;
+  }
+
+  // Record from a rig. Only cue 1 has this value, so it doesn't track into cue 2.
+  Rig rig("../../source/Test/testRig.json");
+  rig.getDevice("s41")->setParam("intensity", 0.9f);
+  list.update(1, &rig, true);
+  if (level(1) != 0.9f || level(2) != 0.3f || list.getCue(1)->getLastCueValue("s42", "intensity") == nullptr ||
+    changes() != "1 2 5 6 ") {
+    cout << "Rig update error. Changes: " << changes() << "\n";
+    cleanup();
+    return false;
+  }
+
+  // Timelines replaced or deleted in the playback are looked up again.
+  shared_ptr<Cue> replaced(new Cue());
+  m_pb->deleteTimeline("Tracking 4");
+  m_pb->addTimeline("Tracking 4", replaced);
+  m_pb->deleteTimeline("Tracking 5");
+  list.update(5, "s41", "intensity", &high, false);
+  auto replacedVal = replaced->getLastCueValue("s41", "intensity");
+  if (replacedVal == nullptr || ((LumiverseFloat*)replacedVal.get())->getVal() != 1.0f ||
+    list.update(6, "s41", "intensity", &high, true)) {
+    cout << "Tracked update used a stale timeline\n";
+    cleanup();
+    return false;
+  }
+
+  cleanup();
+  return true;
+}
@@ -24,7 +24,7 @@ private:
   bool runTest(std::function<bool()> t, string testName, int testNum);
 
   // Update when new tests are written.
-  static const int m_numTests = 9;
+  static const int m_numTests = 21;
 
   // Initialized in PlaybackStart()
   Rig* m_testRig;
@@ -43,4 +43,16 @@ private:
   bool layerToggle();
   bool snapshot();
   bool groups();
+  bool submasters();
+  bool timelineEvents();
+  bool nestedTimelines();
+  bool cueTransition();
+  bool goStress();
+  bool effects();
+  bool fixedTimestep();
+  bool offlineRender();
+  bool capturePlayback();
+  bool programmerEdits();
+  bool snapshotBuffers();
+  bool cueTracking();
 };
\ No newline at end of file
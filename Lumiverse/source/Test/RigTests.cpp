@@ -131,6 +131,32 @@ bool RigTests::deviceSetAdd() {
     ret = false;
   }
 
+  // getDevices() is cached, so it has to pick up devices added afterwards.
+  Device outside1("outside1", 200, "test");
+  Device outside2("outside2", 201, "test");
+  DeviceSet outside(test);
+  size_t before = outside.getDevices().size();
+  outside = outside.add(&outside1).add(&outside2).add(&outside1);
+
+  if (outside.getDevices().size() != before + 2 || outside.getDevices().count(&outside2) == 0 ||
+    test.getDevices().size() != before) {
+    cout << "DeviceSet getDevices didn't match the set after adding devices.\n";
+    ret = false;
+  }
+
+  // Sets made before the rig changes should keep their devices.
+  Device* newDevice = new Device("setTest", 100, "test");
+  m_testRig->addDevice(newDevice);
+  test = test.add(100);
+  expected = expected.add("setTest");
+
+  if (!test.hasSameDevices(expected) || test.size() != 3) {
+    cout << "DeviceSet lost devices after rig change.\n";
+    ret = false;
+  }
+
+  m_testRig->deleteDevice("setTest");
+
   // Most of the other complex add functions are called from the queries,
   // so we'll test them over in that section.
 
@@ -359,6 +385,14 @@ bool RigTests::queryMixed() {
     ret = false;
   }
 
+  // Or sections
+  expected.clear();
+  expected = expected.select("s41,s42");
+  if (!m_testRig->select("#1|#3").hasSameDevices(expected)) {
+    cout << "Failed to select devices with | query\n";
+    ret = false;
+  }
+
   return ret;
 }
 
@@ -428,5 +462,20 @@ bool RigTests::dynamicQuery() {
     cout << "Info: " << dynam.info() << "\n";
     ret = false;
   }
+
+  // Metadata changes should be picked up by metadata queries
+  DynamicDeviceSet area(m_testRig, "$area=2");
+  size_t areaSize = area.size();
+
+  m_testRig->getDevice("s41")->setMetadata("area", "3");
+
+  if (area.size() != areaSize - 1 || area.contains("s41")) {
+    cout << "Dynamic DeviceSet did not update after a metadata change\n";
+    cout << "Info: " << area.info() << "\n";
+    ret = false;
+  }
+
+  m_testRig->getDevice("s41")->setMetadata("area", "2");
+
   return ret;
 }
\ No newline at end of file